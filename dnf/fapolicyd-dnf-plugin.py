@@ -11,10 +11,13 @@ class Fapolicyd(dnf.Plugin):
     pipe = "/run/fapolicyd/fapolicyd.fifo"
     file = None
 
+    # Commands of the update pipe, see src/library/database.h
+    reload_trustdb = "1"
+
     def __init__(self, base, cli):
         pass
 
-    def transaction(self):
+    def send(self, *commands):
 
         if not os.path.exists(self.pipe):
             sys.stderr.write("Pipe does not exist (" + self.pipe + ")\n")
@@ -32,5 +35,12 @@ class Fapolicyd(dnf.Plugin):
             sys.stderr.write("fapolicy-plugin does not have write permission: " + self.pipe + "\n")
             return
 
-        self.file.write("1\n")
+        for command in commands:
+            self.file.write(command + "\n")
         self.file.close()
+
+    def transaction(self):
+
+        # The rpm plugin has already reported each file as it was
+        # installed, and the daemon applied them as they came in.
+        self.send(self.reload_trustdb)
@@ -44,6 +44,8 @@
 #include <ftw.h>
 #include <mntent.h>
 #include <libgen.h>	// basename
+#include <pthread.h>
+#include <time.h>
 #include "policy.h"
 #include "database.h"
 #include "file-cli.h"
@@ -57,8 +59,11 @@
 #include "fd-fgets.h"
 #include "paths.h"
 #include "filter.h"
+#include "rule-test.h"
+#include "scan-cursor.h"
 
 bool verbose = false;
+static bool resume_scan = false;
 
 static const char *usage =
 "Fapolicyd CLI Tool\n\n"
@@ -69,6 +74,7 @@ static const char *usage =
 "--check-watch_fs      Check watch_fs against currently mounted file systems\n"
 "--check-ignore_mounts [path] Scan ignored mounts for executable content\n"
 "--verbose             Enable verbose output for select commands\n"
+"--resume              Continue an interrupted --check-ignore_mounts scan\n"
 "-d, --delete-db       Delete the trust database\n"
 "-D, --dump-db         Dump the trust database contents\n"
 "-f, --file cmd path   Manage the file trust database\n"
@@ -82,6 +88,8 @@ static const char *usage =
 "--filter             Use FILTER_FILE for --file add or update\n"
 "--trust-file file     Use after --file to specify trust file\n"
 "-u, --update          Notifies fapolicyd to perform update of database\n"
+"--test-rules events [rules [rules]] Evaluate events against the rules, or\n"
+"                      compare the decisions of two rule files\n"
 ;
 
 static struct option long_opts[] =
@@ -93,6 +101,7 @@ static struct option long_opts[] =
 	{"check-trustdb",0, NULL,  3 },
 	{"check-status",0, NULL,  4 },
 	{"check-path",  0, NULL,  5 },
+	{"test-rules",  1, NULL,  9 },
 	{"delete-db",	0, NULL, 'd'},
 	{"dump-db",	0, NULL, 'D'},
 	{"file",	1, NULL, 'f'},
@@ -119,13 +128,53 @@ static void reset_config(void)
 
 typedef enum _reload_code { DB, RULES} reload_code;
 
+// The ignore_mounts scan classifies files on up to this many threads
+#define SCAN_MAX_THREADS	8
+#define SCAN_ITEMS_PER_THREAD	64
+// Files reported between two saves of the resume cursor
+#define SCAN_CHECKPOINT		4096
+// nftw() result when a resumed walk no longer matches the cursor
+#define SCAN_RESTART		2
+
+struct scan_item {
+	char *path;
+	struct file_info info;
+	int done;
+	int suspicious;
+	int open_errno;		// set when the file could not be opened
+	int no_mime;		// set when it could not be classified
+	char mime[128];
+};
+
 struct mount_scan_state {
 	const avl_tree_t *languages;
 	unsigned long *count;
 	int had_error;
+	// files queued for the workers, reported in walk order
+	struct scan_item *items;
+	unsigned int depth;
+	unsigned int head;	// next item to report
+	unsigned int next;	// next item for a worker
+	unsigned int tail;	// next free item
+	int finished;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	atomic_ulong prefiltered;
+	// progress through the current mount
+	const char *mount;
+	unsigned long walked;	// regular files seen by nftw()
+	unsigned long files;	// regular files reported
+	unsigned long saved;	// files reported when the cursor was saved
+	unsigned long skip;	// files reported by an interrupted run
+	char last[PATH_MAX];	// last file reported
+	char skip_last[PATH_MAX];
+	int cursor_used;	// the cursor file was read or written
+	int cursor_failed;
 };
 
 static struct mount_scan_state scan_state;
+static struct scan_cursor scan_cursor;
 
 static char *get_line(FILE *f, unsigned *lineno)
 {
@@ -161,7 +210,7 @@ static int do_dump_db(void)
 	int rc;
 	MDB_env *env;
 	MDB_txn *txn;
-	MDB_dbi dbi;
+	MDB_dbi dbi, dirs;
 	MDB_stat status;
 	MDB_cursor *cursor;
 	MDB_val key, val;
@@ -172,7 +221,7 @@ static int do_dump_db(void)
 							mdb_strerror(rc));
 		return 1;
 	}
-	mdb_env_set_maxdbs(env, 2);
+	mdb_env_set_maxdbs(env, 3);
 	rc = mdb_env_open(env, DB_DIR, MDB_RDONLY|MDB_NOLOCK, 0660);
 	if (rc) {
 		fprintf(stderr, "mdb_env_open failed, error %d %s\n", rc,
@@ -180,31 +229,39 @@ static int do_dump_db(void)
 		rc = 1;
 		goto env_close;
 	}
-	rc = mdb_env_stat(env, &status);
+	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
 	if (rc) {
-		fprintf(stderr, "mdb_env_stat failed, error %d %s\n", rc,
+		fprintf(stderr, "mdb_txn_begin failed, error %d %s\n", rc,
 							mdb_strerror(rc));
 		rc = 1;
 		goto env_close;
 	}
-	if (status.ms_entries == 0) {
+	rc = mdb_dbi_open(txn, DB_NAME, MDB_DUPSORT, &dbi);
+	if (rc == MDB_NOTFOUND) {
 		printf("Trust database is empty\n");
-		goto env_close; // Note: rc is 0 to get here
+		rc = 0;
+		goto txn_abort;
 	}
-	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+	if (rc == 0)
+		rc = mdb_dbi_open(txn, DIRS_DB_NAME, 0, &dirs);
 	if (rc) {
-		fprintf(stderr, "mdb_txn_begin failed, error %d %s\n", rc,
+		fprintf(stderr, "mdb_open failed, error %d %s\n", rc,
 							mdb_strerror(rc));
 		rc = 1;
-		goto env_close;
+		goto txn_abort;
 	}
-	rc = mdb_dbi_open(txn, DB_NAME, MDB_DUPSORT, &dbi);
+	// The environment also lists the other tables, so count the index
+	rc = mdb_stat(txn, dbi, &status);
 	if (rc) {
-		fprintf(stderr, "mdb_open failed, error %d %s\n", rc,
+		fprintf(stderr, "mdb_stat failed, error %d %s\n", rc,
 							mdb_strerror(rc));
 		rc = 1;
 		goto txn_abort;
 	}
+	if (status.ms_entries == 0) {
+		printf("Trust database is empty\n");
+		goto txn_abort; // Note: rc is 0 to get here
+	}
 	rc = mdb_cursor_open(txn, dbi, &cursor);
 	if (rc) {
 		fprintf(stderr, "mdb_cursor_open failed, error %d %s\n", rc,
@@ -220,17 +277,15 @@ static int do_dump_db(void)
 		goto txn_abort;
 	}
 	do {
-		char *path = NULL, *data = NULL, sha[FILE_DIGEST_STRING_MAX];
+		char path[PATH_MAX], *data = NULL, sha[FILE_DIGEST_STRING_MAX];
 		unsigned int tsource;
 		off_t size;
 		const char *source;
 
-		path = malloc(key.mv_size + 1);
-		if (!path)
+		// Keys hold a directory id and the file name
+		if (trust_db_key_path(txn, dirs, &key, path, sizeof(path)))
 			goto next_record;
 
-		memcpy(path, key.mv_data, key.mv_size);
-		path[key.mv_size] = 0;
 		data = malloc(val.mv_size + 1);
 
 		if (!data)
@@ -247,7 +302,6 @@ static int do_dump_db(void)
 
 next_record:
 		free(data);
-		free(path);
 		// Try to get the duplicate. If it doesn't exist, get the next one
 		rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT_DUP);
 		if (rc == MDB_NOTFOUND)
@@ -987,62 +1041,425 @@ static int load_ignore_mounts_config(const char *override)
 }
 
 /*
- * inspect_mount_file - nftw callback that records suspicious files.
+ * Leading bytes of data formats that cannot hold %languages content. A
+ * file starting with one of them gets the MIME type libmagic would give
+ * it without being passed to libmagic, which has to try every text and
+ * script test on it first. The extension is not trusted on its own since
+ * renaming a script would be enough to hide it.
+ */
+static const struct scan_signature {
+	const char *magic;
+	unsigned int len;
+	const char *mime;
+} scan_signatures[] = {
+	{ "\x89PNG\r\n\x1a\n", 8, "image/png" },
+	{ "\xff\xd8\xff", 3, "image/jpeg" },
+	{ "GIF87a", 6, "image/gif" },
+	{ "GIF89a", 6, "image/gif" },
+	{ "\x1f\x8b", 2, "application/gzip" },
+	{ "\xfd" "7zXZ\0", 6, "application/x-xz" },
+	{ "\x28\xb5\x2f\xfd", 4, "application/zstd" },
+	{ "%PDF-", 5, "application/pdf" },
+	{ "SQLite format 3\0", 16, "application/vnd.sqlite3" },
+};
+
+/*
+ * prefilter_mime - classify a file from its size and leading bytes.
+ * @fd: open descriptor of a regular file.
+ * @info: metadata of the file.
+ * @buf: receives the MIME type.
+ * @blen: size of @buf.
+ * Returns @buf when the type is certain and NULL when the file needs the
+ * full classification.
+ */
+static char *prefilter_mime(int fd, const struct file_info *info, char *buf,
+			    size_t blen)
+{
+	unsigned char head[16];
+	ssize_t len;
+
+	if (info->size == 0) {
+		snprintf(buf, blen, "inode/x-empty");
+		return buf;
+	}
+
+	len = pread(fd, head, sizeof(head), 0);
+	if (len <= 0)
+		return NULL;
+
+	for (unsigned int i = 0; i < sizeof(scan_signatures) /
+				      sizeof(scan_signatures[0]); i++) {
+		const struct scan_signature *sig = &scan_signatures[i];
+
+		if ((size_t)len >= sig->len &&
+		    memcmp(head, sig->magic, sig->len) == 0) {
+			snprintf(buf, blen, "%s", sig->mime);
+			return buf;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * classify_scan_item - determine the MIME type of a queued file and
+ * whether it belongs to %languages. Runs on a scan worker.
+ * @item: file to classify.
+ */
+static void classify_scan_item(struct scan_item *item)
+{
+	int fd;
+	char *mime;
+
+	fd = open(item->path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		item->open_errno = errno;
+		return;
+	}
+
+	mime = prefilter_mime(fd, &item->info, item->mime, sizeof(item->mime));
+	if (mime)
+		scan_state.prefiltered++;
+	else
+		mime = get_file_type_from_fd(fd, &item->info, item->path,
+					     sizeof(item->mime), item->mime);
+	close(fd);
+	if (mime == NULL) {
+		item->no_mime = 1;
+		return;
+	}
+
+	/* Look up the MIME in the %languages tree. */
+	struct language_entry key = {
+		.mime = item->mime,
+	};
+
+	if (avl_search(scan_state.languages, &key.avl))
+		item->suspicious = 1;
+}
+
+/*
+ * scan_worker - classify queued files until the scan is finished.
+ * @arg: unused.
+ * Returns NULL.
+ */
+static void *scan_worker(void *arg __attribute__ ((unused)))
+{
+	struct mount_scan_state *st = &scan_state;
+
+	// libmagic cookies cannot be shared between threads
+	int no_magic = file_thread_init();
+
+	pthread_mutex_lock(&st->lock);
+	while (1) {
+		while (st->next == st->tail && !st->finished)
+			pthread_cond_wait(&st->work, &st->lock);
+		if (st->next == st->tail)
+			break;
+
+		struct scan_item *item = &st->items[st->next++ % st->depth];
+		pthread_mutex_unlock(&st->lock);
+
+		if (no_magic)
+			item->no_mime = 1;
+		else
+			classify_scan_item(item);
+
+		pthread_mutex_lock(&st->lock);
+		item->done = 1;
+		pthread_cond_broadcast(&st->done);
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	file_thread_close();
+	return NULL;
+}
+
+/*
+ * save_scan_cursor - record the mounts scanned to the end and how far the
+ * scan of the current mount got so that --resume can continue from there.
+ * @position: 0 when the current mount is done, 1 to save the position.
+ */
+static void save_scan_cursor(int position)
+{
+	if (scan_state.files == 0)
+		position = 0;
+	if (scan_state.cursor_failed || (!position && scan_cursor.ndone == 0))
+		return;
+
+	if (scan_cursor_save(&scan_cursor, position ? scan_state.mount : NULL,
+			     scan_state.files, *scan_state.count,
+			     scan_state.last)) {
+		fprintf(stderr, "Cannot save scan progress to %s (%s)\n",
+			SCAN_CURSOR_FILE, strerror(errno));
+		scan_state.cursor_failed = 1;
+		return;
+	}
+	scan_state.saved = scan_state.files;
+	scan_state.cursor_used = 1;
+}
+
+/*
+ * finish_scan_cursor - record that the current mount was scanned to the
+ * end so that --resume does not scan it again.
+ * @count: suspicious files found in it.
+ */
+static void finish_scan_cursor(unsigned long count)
+{
+	if (scan_state.cursor_failed)
+		return;
+
+	if (scan_cursor_finish(&scan_cursor, scan_state.mount, count)) {
+		fprintf(stderr, "Out of memory saving scan progress\n");
+		scan_state.cursor_failed = 1;
+		return;
+	}
+
+	// Drop the position in this mount from the saved cursor
+	if (scan_state.cursor_used)
+		save_scan_cursor(0);
+}
+
+/*
+ * resume_scan_cursor - pick up where an interrupted scan of the current
+ * mount stopped, if that is where it stopped.
+ * @count: receives the suspicious files it had found.
+ */
+static void resume_scan_cursor(unsigned long *count)
+{
+	if (!scan_cursor_resumes(&scan_cursor, scan_state.mount))
+		return;
+
+	snprintf(scan_state.skip_last, sizeof(scan_state.skip_last), "%s",
+		 scan_cursor.last);
+	strcpy(scan_state.last, scan_state.skip_last);
+	scan_state.skip = scan_cursor.files;
+	scan_state.files = scan_cursor.files;
+	scan_state.saved = scan_cursor.files;
+	*count = scan_cursor.found;
+	printf("Resuming scan of %s after %lu file(s)\n", scan_state.mount,
+	       scan_cursor.files);
+}
+
+/*
+ * report_scan_item - report the oldest queued file once it is classified
+ * and advance the resume cursor past it.
+ */
+static void report_scan_item(void)
+{
+	struct scan_item *item = &scan_state.items[scan_state.head %
+						   scan_state.depth];
+
+	pthread_mutex_lock(&scan_state.lock);
+	while (!item->done)
+		pthread_cond_wait(&scan_state.done, &scan_state.lock);
+	pthread_mutex_unlock(&scan_state.lock);
+
+	if (item->open_errno) {
+		fprintf(stderr, "Unable to open %s (%s)\n", item->path,
+			strerror(item->open_errno));
+		scan_state.had_error = 1;
+	} else if (item->no_mime) {
+		fprintf(stderr, "Unable to determine mime for %s\n",
+			item->path);
+		scan_state.had_error = 1;
+	} else if (item->suspicious) {
+		if (verbose)
+			printf("%s: %s\n", item->path, item->mime);
+		(*scan_state.count)++;
+	}
+
+	snprintf(scan_state.last, sizeof(scan_state.last), "%s", item->path);
+	scan_state.files++;
+	if (scan_state.files - scan_state.saved >= SCAN_CHECKPOINT)
+		save_scan_cursor(1);
+
+	free(item->path);
+	memset(item, 0, sizeof(*item));
+	scan_state.head++;
+}
+
+/*
+ * inspect_mount_file - nftw callback that queues files for classification.
  * @fpath: path of the file being inspected.
  * @sb: stat buffer describing the file.
  * @typeflag_unused: unused nftw type flag.
  * @ftwbuf_unused: unused nftw traversal metadata.
- * Returns FTW_CONTINUE so the walk keeps running.
+ * Returns FTW_CONTINUE so the walk keeps running, FTW_STOP when the scan
+ * is interrupted and SCAN_RESTART when a resumed walk has diverged.
  */
 static int inspect_mount_file(const char *fpath, const struct stat *sb,
 	int typeflag_unused __attribute__ ((unused)),
 	struct FTW *ftwbuf_unused __attribute__ ((unused)))
 {
-	int fd;
-	struct file_info info;
-	char buf[128];
-	char *mime;
+	struct scan_item *item;
+
+	if (stop)
+		return FTW_STOP;
 
 	/* Only evaluate regular files discovered during the walk. */
 	if (S_ISREG(sb->st_mode) == 0)
 		return FTW_CONTINUE;
 
-	/* Open the file and collect metadata for libmagic. */
-	fd = open(fpath, O_RDONLY|O_CLOEXEC);
-	if (fd < 0) {
-		fprintf(stderr, "Unable to open %s (%s)\n", fpath, strerror(errno));
-		scan_state.had_error = 1;
+	/* Skip what an interrupted run covered, if the tree still matches. */
+	if (scan_state.walked++ < scan_state.skip) {
+		if (scan_state.walked == scan_state.skip &&
+		    strcmp(fpath, scan_state.skip_last))
+			return SCAN_RESTART;
 		return FTW_CONTINUE;
 	}
 
-	memset(&info, 0, sizeof(info));
-	info.device = sb->st_dev;
-	info.inode = sb->st_ino;
-	info.mode = sb->st_mode;
-	info.size = sb->st_size;
-	info.time = sb->st_mtim;
+	// Make room by reporting the oldest queued file
+	if (scan_state.tail - scan_state.head == scan_state.depth)
+		report_scan_item();
 
-	mime = get_file_type_from_fd(fd, &info, fpath, sizeof(buf), buf);
-	close(fd);
-	if (mime == NULL) {
-		fprintf(stderr, "Unable to determine mime for %s\n", fpath);
+	item = &scan_state.items[scan_state.tail % scan_state.depth];
+	item->path = strdup(fpath);
+	if (item->path == NULL) {
+		fprintf(stderr, "Out of memory scanning %s\n", fpath);
 		scan_state.had_error = 1;
-		return FTW_CONTINUE;
+		return FTW_STOP;
 	}
+	item->info.device = sb->st_dev;
+	item->info.inode = sb->st_ino;
+	item->info.mode = sb->st_mode;
+	item->info.size = sb->st_size;
+	item->info.time = sb->st_mtim;
 
-	/* Look up the MIME in the %languages tree and report matches. */
-	struct language_entry key = {
-		.mime = buf,
-	};
+	pthread_mutex_lock(&scan_state.lock);
+	scan_state.tail++;
+	pthread_cond_signal(&scan_state.work);
+	pthread_mutex_unlock(&scan_state.lock);
 
-	if (avl_search(scan_state.languages, &key.avl)) {
-		if (verbose)
-			printf("%s: %s\n", fpath, buf);
-		if (scan_state.count)
-			(*scan_state.count)++;
+	return FTW_CONTINUE;
+}
+
+/*
+ * walk_mount - scan one mount, resuming from the cursor when asked.
+ * @rpath: resolved mount point.
+ * @count: suspicious file counter of the mount.
+ * Returns the result of nftw().
+ */
+static int walk_mount(const char *rpath, unsigned long *count)
+{
+	int rc;
+
+	scan_state.mount = rpath;
+	resume_scan_cursor(count);
+
+	rc = nftw(rpath, inspect_mount_file, 1024, FTW_PHYS);
+
+	// Report the rest in order, even on error, so workers go idle
+	while (scan_state.head != scan_state.tail)
+		report_scan_item();
+
+	if (rc == 0 && scan_state.walked < scan_state.skip)
+		rc = SCAN_RESTART;
+	if (rc == SCAN_RESTART) {
+		fprintf(stderr, "%s changed since the interrupted scan, "
+			"scanning all of it\n", rpath);
+		*count = 0;
+		scan_state.walked = scan_state.files = scan_state.saved = 0;
+		scan_state.skip = 0;
+		rc = nftw(rpath, inspect_mount_file, 1024, FTW_PHYS);
+		while (scan_state.head != scan_state.tail)
+			report_scan_item();
 	}
 
-	return FTW_CONTINUE;
+	return rc;
+}
+
+/*
+ * reset_mount_progress - forget the progress of the previous mount.
+ */
+static void reset_mount_progress(void)
+{
+	scan_state.mount = NULL;
+	scan_state.walked = scan_state.files = scan_state.saved = 0;
+	scan_state.skip = 0;
+	scan_state.last[0] = 0;
+	scan_state.skip_last[0] = 0;
+	scan_state.prefiltered = 0;
+}
+
+static void stop_scan(int sig __attribute__ ((unused)))
+{
+	stop = 1;
+}
+
+static unsigned int scan_threads;
+static pthread_t scan_workers[SCAN_MAX_THREADS];
+
+/*
+ * start_scan_workers - start one classification thread per CPU.
+ * Returns 0 on success and 1 on failure.
+ */
+static int start_scan_workers(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int want = cpus < 1 ? 1 : cpus > SCAN_MAX_THREADS ?
+				SCAN_MAX_THREADS : (unsigned int)cpus;
+
+	pthread_mutex_init(&scan_state.lock, NULL);
+	pthread_cond_init(&scan_state.work, NULL);
+	pthread_cond_init(&scan_state.done, NULL);
+	scan_state.finished = 0;
+	scan_state.head = scan_state.next = scan_state.tail = 0;
+	scan_state.depth = want * SCAN_ITEMS_PER_THREAD;
+	scan_state.items = calloc(scan_state.depth, sizeof(struct scan_item));
+	if (scan_state.items == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	for (; scan_threads < want; scan_threads++)
+		if (pthread_create(&scan_workers[scan_threads], NULL,
+				   scan_worker, NULL))
+			break;
+	if (scan_threads == 0) {
+		fprintf(stderr, "Cannot start scan threads\n");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * stop_scan_workers - wait for the classification threads to exit.
+ */
+static void stop_scan_workers(void)
+{
+	if (scan_state.items == NULL)
+		return;
+
+	pthread_mutex_lock(&scan_state.lock);
+	scan_state.finished = 1;
+	pthread_cond_broadcast(&scan_state.work);
+	pthread_mutex_unlock(&scan_state.lock);
+	for (unsigned int i = 0; i < scan_threads; i++)
+		pthread_join(scan_workers[i], NULL);
+	scan_threads = 0;
+
+	free(scan_state.items);
+	scan_state.items = NULL;
+	pthread_cond_destroy(&scan_state.work);
+	pthread_cond_destroy(&scan_state.done);
+	pthread_mutex_destroy(&scan_state.lock);
+}
+
+/*
+ * scan_interrupts - have SIGINT and SIGTERM stop the walk so the resume
+ * cursor is saved, or restore the default handling.
+ * @on: 1 to catch the signals, 0 to restore them.
+ */
+static void scan_interrupts(int on)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = on ? stop_scan : SIG_DFL;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 }
 
 /*
@@ -1058,9 +1475,11 @@ static int scan_mount_entry(const char *mount, unsigned long *suspicious_total,
 {
 	char resolved[PATH_MAX];
 	char *rpath;
+	const struct scan_cursor_mount *done;
 	unsigned long mount_count = 0;
 	struct stat sb;
-	int rc = 0;
+	struct timespec start, end;
+	int rc = 0, walk_rc;
 	int scanned = 0;
 
 	rpath = realpath(mount, resolved);
@@ -1099,16 +1518,37 @@ static int scan_mount_entry(const char *mount, unsigned long *suspicious_total,
 	if (mount_rc != 1)
 		return 1;
 
+	// The interrupted run being resumed got to its end
+	done = scan_cursor_finished(&scan_cursor, rpath);
+	if (done) {
+		printf("Summary for %s: %lu suspicious file(s) (scanned before "
+		       "the interruption)\n", rpath, done->found);
+		*suspicious_total += done->found;
+		return 0;
+	}
+
 	scan_state.count = &mount_count;
 	scan_state.had_error = 0;
-	if (nftw(rpath, inspect_mount_file, 1024, FTW_PHYS)) {
+	reset_mount_progress();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	walk_rc = walk_mount(rpath, &mount_count);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (walk_rc == FTW_STOP && stop) {
+		save_scan_cursor(1);
+		fprintf(stderr, "Scan of %s interrupted after %lu file(s)%s\n",
+			rpath, scan_state.files, scan_state.cursor_failed ? "" :
+			", run again with --resume to continue");
+		rc = 1;
+	} else if (walk_rc) {
 		fprintf(stderr, "Unable to scan %s (%s)\n", rpath,
 			strerror(errno));
 		printf("Summary for %s: 0 suspicious file(s) (scan skipped)\n",
 		       rpath);
 		rc = 1;
-	} else
+	} else {
 		scanned = 1;
+		finish_scan_cursor(mount_count);
+	}
 
 	if (scan_state.had_error)
 		rc = 1;
@@ -1119,7 +1559,19 @@ static int scan_mount_entry(const char *mount, unsigned long *suspicious_total,
 		*suspicious_total += mount_count;
 	}
 
+	if (verbose) {
+		double secs = (end.tv_sec - start.tv_sec) +
+			      (end.tv_nsec - start.tv_nsec) / 1e9;
+		unsigned long files = scan_state.files - scan_state.skip;
+
+		printf("Scanned %lu file(s) of %s in %.2fs, %.0f files/s "
+		       "(%lu classified by leading bytes, %u threads)\n",
+		       files, rpath, secs, secs > 0 ? files / secs : 0.0,
+		       (unsigned long)scan_state.prefiltered, scan_threads);
+	}
+
 	scan_state.count = NULL;
+	reset_mount_progress();
 
 	if (!scanned)
 		return 1;
@@ -1141,9 +1593,12 @@ static int check_ignore_mounts(const char *override)
 	unsigned long suspicious_total = 0;
 	int errors = 0;
 	int file_ready = 0;
+	int walked_all = 0;
 	const char *languages_path;
 
 	reset_config();
+	scan_cursor_init(&scan_cursor, SCAN_CURSOR_FILE);
+	scan_state.cursor_used = scan_state.cursor_failed = 0;
 	list_init(&mounts);
 	avl_init(&languages, compare_language_entry);
 
@@ -1176,22 +1631,43 @@ static int check_ignore_mounts(const char *override)
 		goto finish;
 	}
 
-	/* Initialize libmagic once so nftw() callbacks can reuse it. */
+	/* Initialize libmagic once, each scan thread then opens a cookie. */
 	file_init();
 	file_ready = 1;
 	scan_state.languages = &languages;
 
+	if (start_scan_workers()) {
+		errors = 1;
+		goto finish;
+	}
+	scan_interrupts(1);
+
+	// Only a resumed run skips what the saved cursor covers
+	if (resume_scan && scan_cursor_load(&scan_cursor) == 0)
+		scan_state.cursor_used = 1;
+
 	/* Walk each ignore_mounts entry and flag suspicious MIME matches. */
 	for (list_item_t *lptr = mounts.first; lptr; lptr = lptr->next) {
 		if (scan_mount_entry(lptr->index, &suspicious_total,
 				     override ? 1 : 0))
 			errors = 1;
+		// The cursor was saved in the mount that was interrupted
+		if (stop)
+			break;
 	}
+	walked_all = !stop;
 
 	if (errors == 0 && suspicious_total == 0)
 		rc = 0;
 
 finish:
+	stop_scan_workers();
+	scan_interrupts(0);
+	// Nothing is left to resume once every mount was walked
+	if (walked_all)
+		scan_cursor_remove(&scan_cursor);
+	else
+		scan_cursor_free(&scan_cursor);
 	if (file_ready)
 		file_close();
 	list_empty(&mounts);
@@ -1324,8 +1800,143 @@ static int is_link(const char *path)
 	return 0;
 }
 
-// Check that the file is in the trust db
-static int path_found = 0;
+/*
+ * --check-path walks PATH on the main thread and hands the files to
+ * workers in batches. Each worker looks its batches up in a read
+ * transaction of its own with the batch lookup, which visits them in
+ * sorted order so that consecutive lookups land on the same B-tree pages.
+ */
+#define AUDIT_BATCH		256
+#define AUDIT_BATCHES_PER_THREAD 4
+// Files a worker holds open for one lookup, a few per thread stay well
+// below the default open file limit
+#define AUDIT_OPEN_FILES	32
+
+struct audit_file {
+	char *path;
+	off_t size;
+};
+
+struct audit_batch {
+	unsigned int count;
+	struct audit_file files[AUDIT_BATCH];
+};
+
+static struct path_audit {
+	struct audit_batch **queue;
+	unsigned int depth;
+	unsigned int next;	// next batch for a worker
+	unsigned int tail;	// next free slot
+	int finished;
+	struct audit_batch *fill;	// batch being filled by the walk
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t room;
+	atomic_ulong files;
+	atomic_ulong untrusted;
+} audit;
+
+static int compare_audit_file(const void *a, const void *b)
+{
+	const struct audit_file *fa = a, *fb = b;
+
+	return strcmp(fa->path, fb->path);
+}
+
+// Check every file of a batch against the trust db, then free it
+static void audit_batch(trust_reader_t *reader, struct audit_batch *batch)
+{
+	struct trust_lookup lookups[AUDIT_OPEN_FILES];
+	struct file_info infos[AUDIT_OPEN_FILES];
+
+	// Sorted up front so the slices below follow each other in key
+	// order and the cursor keeps walking forward between them
+	qsort(batch->files, batch->count, sizeof(batch->files[0]),
+	      compare_audit_file);
+
+	for (unsigned int i = 0; i < batch->count; ) {
+		unsigned int n = 0;
+
+		for (; i < batch->count && n < AUDIT_OPEN_FILES; i++) {
+			struct audit_file *f = &batch->files[i];
+			int fd = open(f->path, O_RDONLY|O_CLOEXEC);
+
+			if (fd < 0)
+				continue;
+			memset(&infos[n], 0, sizeof(infos[n]));
+			infos[n].size = f->size;
+			lookups[n].path = f->path;
+			lookups[n].info = &infos[n];
+			lookups[n].fd = fd;
+			n++;
+		}
+		if (n == 0)
+			continue;
+
+		if (reader)
+			trust_reader_check_batch(reader, lookups, n);
+		else
+			check_trust_database_batch(lookups, n);
+
+		for (unsigned int j = 0; j < n; j++) {
+			if (lookups[j].trusted != 1) {
+				audit.untrusted++;
+				fprintf(stderr, "%s is not trusted\n",
+					lookups[j].path);
+			}
+			close(lookups[j].fd);
+		}
+		audit.files += n;
+	}
+
+	for (unsigned int i = 0; i < batch->count; i++)
+		free(batch->files[i].path);
+	free(batch);
+}
+
+static void *audit_worker(void *arg __attribute__ ((unused)))
+{
+	// Without a reader slot, fall back to the shared locked lookup
+	trust_reader_t *reader = trust_reader_open();
+
+	pthread_mutex_lock(&audit.lock);
+	while (1) {
+		while (audit.next == audit.tail && !audit.finished)
+			pthread_cond_wait(&audit.work, &audit.lock);
+		if (audit.next == audit.tail)
+			break;
+
+		struct audit_batch *batch = audit.queue[audit.next++ %
+							audit.depth];
+		pthread_cond_signal(&audit.room);
+		pthread_mutex_unlock(&audit.lock);
+
+		audit_batch(reader, batch);
+
+		pthread_mutex_lock(&audit.lock);
+	}
+	pthread_mutex_unlock(&audit.lock);
+
+	trust_reader_close(reader);
+	return NULL;
+}
+
+// Hand the batch being filled to the workers
+static void queue_audit_batch(void)
+{
+	if (audit.fill == NULL || audit.fill->count == 0)
+		return;
+
+	pthread_mutex_lock(&audit.lock);
+	while (audit.tail - audit.next == audit.depth)
+		pthread_cond_wait(&audit.room, &audit.lock);
+	audit.queue[audit.tail++ % audit.depth] = audit.fill;
+	pthread_cond_signal(&audit.work);
+	pthread_mutex_unlock(&audit.lock);
+	audit.fill = NULL;
+}
+
+// Queue the file to be checked against the trust db
 static int check_file(const char *fpath,
 		const struct stat *sb,
 		int typeflag_unused __attribute__ ((unused)),
@@ -1336,24 +1947,30 @@ static int check_file(const char *fpath,
 	if (S_ISREG(sb->st_mode) == 0)
 		return ret;
 
-	int fd = open(fpath, O_RDONLY|O_CLOEXEC);
-	if (fd >= 0) {
-		struct file_info info;
-		info.size = sb->st_size;
+	if (audit.fill == NULL) {
+		audit.fill = malloc(sizeof(*audit.fill));
+		if (audit.fill == NULL)
+			return FTW_STOP;
+		audit.fill->count = 0;
+	}
 
-		if (check_trust_database(fpath, &info, fd) != 1) {
-			path_found = 1;
-			fprintf(stderr, "%s is not trusted\n", fpath);
-		}
+	struct audit_file *f = &audit.fill->files[audit.fill->count];
+	f->path = strdup(fpath);
+	if (f->path == NULL)
+		return FTW_STOP;
+	f->size = sb->st_size;
+	if (++audit.fill->count == AUDIT_BATCH)
+		queue_audit_batch();
 
-		close(fd);
-	}
 	return ret;
 }
 
 static int check_path(void)
 {
 	char *ptr, *saved;
+	pthread_t workers[TRUST_READERS_MAX];
+	unsigned int threads = 0;
+	struct timespec start, end;
 	const char *env_path = getenv("PATH");
 	if (env_path == NULL) {
 		puts("PATH not found");
@@ -1368,22 +1985,76 @@ static int check_path(void)
 	}
 	set_message_mode(MSG_QUIET, DBG_NO);
 	init_database(&config);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int want = cpus < 1 ? 1 : cpus > TRUST_READERS_MAX ?
+				TRUST_READERS_MAX : (unsigned int)cpus;
+
+	memset(&audit, 0, sizeof(audit));
+	pthread_mutex_init(&audit.lock, NULL);
+	pthread_cond_init(&audit.work, NULL);
+	pthread_cond_init(&audit.room, NULL);
+	audit.depth = want * AUDIT_BATCHES_PER_THREAD;
+	audit.queue = calloc(audit.depth, sizeof(*audit.queue));
+	if (audit.queue)
+		for (; threads < want; threads++)
+			if (pthread_create(&workers[threads], NULL,
+					   audit_worker, NULL))
+				break;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	char *path = strdup(env_path);
 	ptr = strtok_r(path, ":", &saved);
-	while (ptr) {
+	while (ptr && threads) {
 		if (is_link(ptr))
 			goto next;
 
 		nftw(ptr, check_file, 1024, FTW_PHYS);
+		queue_audit_batch();
 next:
 		ptr = strtok_r(NULL, ":", &saved);
 	}
+
+	pthread_mutex_lock(&audit.lock);
+	audit.finished = 1;
+	pthread_cond_broadcast(&audit.work);
+	pthread_mutex_unlock(&audit.lock);
+	for (unsigned int i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// A walk stopped by an allocation failure leaves a partial batch
+	if (audit.fill) {
+		for (unsigned int i = 0; i < audit.fill->count; i++)
+			free(audit.fill->files[i].path);
+		free(audit.fill);
+	}
+	free(audit.queue);
+	pthread_cond_destroy(&audit.work);
+	pthread_cond_destroy(&audit.room);
+	pthread_mutex_destroy(&audit.lock);
+
 	stop = 1; // Need this to terminate update thread
 	free(path);
 	close_database();
 	reset_config();
 
-	if (path_found == 0)
+	if (threads == 0) {
+		fprintf(stderr, "Cannot start path check threads\n");
+		return 1;
+	}
+
+	if (verbose) {
+		double secs = (end.tv_sec - start.tv_sec) +
+			      (end.tv_nsec - start.tv_nsec) / 1e9;
+		unsigned long files = audit.files;
+
+		printf("Checked %lu file(s) in %.2fs, %.0f files/s "
+		       "(%u threads)\n", files, secs,
+		       secs > 0 ? files / secs : 0.0, threads);
+	}
+
+	if (audit.untrusted == 0)
 		puts("No problems found");
 
 	return 0;
@@ -1474,6 +2145,38 @@ err_out:
 	return 1;
 }
 
+/*
+ * do_test_rules - evaluate events offline against one or two rule files.
+ * @events: file of events, see rule_test().
+ * @rules: compiled rule file, NULL for the daemon's.
+ * @other: rule file to compare with, or NULL.
+ */
+static int do_test_rules(const char *events, const char *rules,
+			 const char *other)
+{
+	int rc;
+
+	set_message_mode(MSG_STDERR, DBG_NO);
+	reset_config();
+	if (load_daemon_config(&config)) {
+		reset_config();
+		return 1;
+	}
+	set_message_mode(MSG_QUIET, DBG_NO);
+	file_init();
+	init_database(&config);
+
+	// Rule parse errors are the user's to see
+	set_message_mode(MSG_STDERR, DBG_NO);
+	rc = rule_test(events, rules ? rules : RULES_FILE, other, verbose);
+
+	stop = 1; // Need this to terminate update thread
+	close_database();
+	file_close();
+	reset_config();
+	return rc;
+}
+
 #ifdef HAVE_LIBRPM
 static int do_test_filter(const char *path)
 {
@@ -1506,6 +2209,10 @@ int main(int argc, char * const argv[])
 			verbose = true;
 			continue;
 		}
+		if (strcmp(argv[i], "--resume") == 0) {
+			resume_scan = true;
+			continue;
+		}
 		args[arg_count++] = argv[i];
 	}
 	args[arg_count] = NULL;
@@ -1616,6 +2323,19 @@ int main(int argc, char * const argv[])
 		}
 		break;
 
+	case 9: { // --test-rules
+		const char *rules = NULL, *other = NULL;
+
+		if (optind < arg_count)
+			rules = args[optind++];
+		if (optind < arg_count)
+			other = args[optind++];
+		if (optind < arg_count)
+			goto args_err;
+		return do_test_rules(optarg, rules, other);
+		}
+		break;
+
 #ifdef HAVE_LIBRPM
 	case 6: { // --test-filter
 		if (arg_count > 3)
@@ -0,0 +1,774 @@
+/*
+ * rule-test.c - evaluate recorded events against rule files offline
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "attr-sets.h"
+#include "database.h"
+#include "event.h"
+#include "file.h"
+#include "message.h"
+#include "policy.h"
+#include "rules.h"
+#include "rule-test.h"
+
+/*
+ * Events are built the way new_event() and get_subj_attr() would build
+ * them, except that nothing is read from /proc: the process is long
+ * gone, or was never on this system. What the input line gives is used
+ * as is. The object and the trust of both sides come from the files on
+ * disk and the trust database. Everything else is filled in so that the
+ * lazy lookups never run: unknown ids are sets without members, so no
+ * uid or gid rule matches them. A process is taken to have started
+ * normally from a clean environment, since the exec sequence that
+ * pattern rules look at is not in the input.
+ */
+
+// Events a worker claims at a time
+#define TEST_CHUNK	64
+
+// Subject numbers the input line gave
+#define HAVE_UID	0x01
+#define HAVE_AUID	0x02
+#define HAVE_SESSIONID	0x04
+#define HAVE_PID	0x08
+#define HAVE_PPID	0x10
+
+struct test_event {
+	unsigned int line;
+	int type;		// FAN_OPEN_PERM or FAN_OPEN_EXEC_PERM
+	unsigned int have;
+	unsigned int uid, auid, sessionid;
+	pid_t pid, ppid;
+	char *exe;
+	char *path;
+	char *gids;		// comma separated, NULL when not given
+	char *comm;
+	char *exe_type;		// subject ftype as logged
+	char *ftype;		// object ftype as logged
+	int subj_trust;		// -1 when not logged
+	int obj_trust;
+	decision_t dec[2];
+	unsigned int rule[2];	// 1 based, 0 when no rule matched
+};
+
+static struct rule_run {
+	const llist *rules;
+	struct test_event *events;
+	unsigned long count;
+	int pass;
+	bool exe_type;		// rules look at the subject's ftype
+	atomic_ulong next;
+	atomic_ullong event_ns;
+	atomic_ullong rule_ns;
+} run;
+
+static void free_test_event(struct test_event *t)
+{
+	free(t->exe);
+	free(t->path);
+	free(t->gids);
+	free(t->comm);
+	free(t->exe_type);
+	free(t->ftype);
+}
+
+static int parse_access(const char *val, int *type)
+{
+	if (strcmp(val, "execute") == 0 || strcmp(val, "exec") == 0)
+		*type = FAN_OPEN_EXEC_PERM;
+	else if (strcmp(val, "open") == 0)
+		*type = FAN_OPEN_PERM;
+	else
+		return 1;
+	return 0;
+}
+
+static int parse_uint(const char *val, unsigned int *num)
+{
+	char *end;
+	unsigned long v;
+
+	errno = 0;
+	v = strtoul(val, &end, 10);
+	if (errno || *end || end == val || v > 0xFFFFFFFFUL)
+		return 1;
+	*num = v;
+	return 0;
+}
+
+// "exe uid gid path access" - returns 0 on success and 1 on error
+static int parse_tuple(char *line, struct test_event *t)
+{
+	char *fields[5], *saved = NULL;
+	unsigned int n = 0;
+
+	for (char *ptr = strtok_r(line, " \t", &saved); ptr;
+	     ptr = strtok_r(NULL, " \t", &saved)) {
+		if (n == 5)
+			return 1;
+		fields[n++] = ptr;
+	}
+	if (n != 5 || parse_uint(fields[1], &t->uid) ||
+	    parse_access(fields[4], &t->type))
+		return 1;
+
+	t->have |= HAVE_UID;
+	t->exe = strdup(fields[0]);
+	t->gids = strdup(fields[2]);
+	t->path = strdup(fields[3]);
+	return t->exe == NULL || t->gids == NULL || t->path == NULL;
+}
+
+// A logged decision - returns 0 on success and 1 on error
+static int parse_logged(char *line, struct test_event *t)
+{
+	char *saved = NULL;
+	int object = 0, have_perm = 0;
+
+	for (char *ptr = strtok_r(line, " \t", &saved); ptr;
+	     ptr = strtok_r(NULL, " \t", &saved)) {
+		char *val, **str = NULL;
+		unsigned int *num = NULL, flag = 0;
+
+		if (strcmp(ptr, ":") == 0) {
+			object = 1;
+			continue;
+		}
+		val = strchr(ptr, '=');
+		if (val == NULL)
+			continue;
+		*val++ = 0;
+
+		if (strcmp(ptr, "perm") == 0) {
+			if (parse_access(val, &t->type))
+				return 1;
+			have_perm = 1;
+		} else if (strcmp(ptr, "path") == 0 && object)
+			str = &t->path;
+		else if (strcmp(ptr, "ftype") == 0)
+			str = object ? &t->ftype : &t->exe_type;
+		else if (strcmp(ptr, "trust") == 0) {
+			if (strcmp(val, "0") && strcmp(val, "1"))
+				continue;	// 9 is logged when unknown
+			if (object)
+				t->obj_trust = *val == '1';
+			else
+				t->subj_trust = *val == '1';
+		} else if (object)
+			continue;
+		else if (strcmp(ptr, "exe") == 0)
+			str = &t->exe;
+		else if (strcmp(ptr, "comm") == 0)
+			str = &t->comm;
+		else if (strcmp(ptr, "gid") == 0)
+			str = &t->gids;
+		else if (strcmp(ptr, "uid") == 0) {
+			num = &t->uid;
+			flag = HAVE_UID;
+		} else if (strcmp(ptr, "auid") == 0) {
+			num = &t->auid;
+			flag = HAVE_AUID;
+		} else if (strcmp(ptr, "sessionid") == 0) {
+			num = &t->sessionid;
+			flag = HAVE_SESSIONID;
+		} else if (strcmp(ptr, "pid") == 0) {
+			num = (unsigned int *)&t->pid;
+			flag = HAVE_PID;
+		} else if (strcmp(ptr, "ppid") == 0) {
+			num = (unsigned int *)&t->ppid;
+			flag = HAVE_PPID;
+		}
+
+		if (str) {
+			free(*str);
+			*str = strdup(val);
+			if (*str == NULL)
+				return 1;
+		} else if (num) {
+			if (parse_uint(val, num))
+				return 1;
+			t->have |= flag;
+		}
+	}
+
+	return !have_perm || t->exe == NULL || t->path == NULL;
+}
+
+/*
+ * load_events - read the events to evaluate.
+ * @file: one event per line, blank lines and # comments are skipped.
+ * @count: receives the number of events.
+ * Returns the events, or NULL on failure which has been reported.
+ */
+static struct test_event *load_events(const char *file, unsigned long *count)
+{
+	struct test_event *events = NULL;
+	unsigned long n = 0, size = 0;
+	unsigned int lineno = 0;
+	char *line = NULL;
+	size_t len = 0;
+	int bad = 0;
+	FILE *f;
+
+	f = fopen(file, "rm");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot open %s (%s)\n", file, strerror(errno));
+		return NULL;
+	}
+
+	while (getline(&line, &len, f) != -1) {
+		char *ptr = line;
+		int rc;
+
+		lineno++;
+		line[strcspn(line, "\n")] = 0;
+		while (*ptr == ' ' || *ptr == '\t')
+			ptr++;
+		if (*ptr == 0 || *ptr == '#')
+			continue;
+
+		if (n == size) {
+			unsigned long nsize = size ? size * 2 : 1024;
+			struct test_event *tmp;
+
+			tmp = realloc(events, nsize * sizeof(*tmp));
+			if (tmp == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				bad = 1;
+				break;
+			}
+			events = tmp;
+			size = nsize;
+		}
+
+		struct test_event *t = &events[n];
+		memset(t, 0, sizeof(*t));
+		t->line = lineno;
+		t->subj_trust = -1;
+		t->obj_trust = -1;
+		if (strstr(ptr, "exe="))
+			rc = parse_logged(ptr, t);
+		else
+			rc = parse_tuple(ptr, t);
+		if (rc) {
+			fprintf(stderr, "%s:%u: cannot parse event\n", file,
+				lineno);
+			free_test_event(t);
+			bad = 1;
+			continue;
+		}
+		n++;
+	}
+	free(line);
+	fclose(f);
+
+	if (bad || n == 0) {
+		if (n == 0 && !bad)
+			fprintf(stderr, "No events in %s\n", file);
+		for (unsigned long i = 0; i < n; i++)
+			free_test_event(&events[i]);
+		free(events);
+		return NULL;
+	}
+
+	*count = n;
+	return events;
+}
+
+/*
+ * load_test_rules - load a compiled rule file into a list of its own.
+ * @file: rule file to load.
+ * @l: list that receives the rules.
+ * The attribute sets must have been initialized.
+ * Returns 0 on success and 1 on failure.
+ */
+static int load_test_rules(const char *file, llist *l)
+{
+	unsigned int lineno = 1;
+	char *line = NULL;
+	size_t len = 0;
+	int rc = 0;
+	FILE *f;
+
+	if (rules_create(l))
+		return 1;
+
+	f = fopen(file, "rm");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot open %s (%s)\n", file, strerror(errno));
+		return 1;
+	}
+
+	while (getline(&line, &len, f) != -1) {
+		line[strcspn(line, "\n")] = 0;
+		if (rules_append(l, line, lineno)) {
+			fprintf(stderr, "%s:%u: cannot parse rule\n", file,
+				lineno);
+			rc = 1;
+			break;
+		}
+		lineno++;
+	}
+	free(line);
+	fclose(f);
+
+	if (rc == 0 && l->cnt == 0) {
+		fprintf(stderr, "No rules in %s\n", file);
+		rc = 1;
+	}
+	if (rc == 0)
+		rules_regen_sets(l);
+
+	return rc;
+}
+
+// Returns true when a rule of the list looks at the subject's ftype
+static bool rules_use_exe_type(const llist *l)
+{
+	for (const lnode *r = l->head; r; r = r->next)
+		for (unsigned int i = 0; i < r->s_count; i++)
+			if (r->s[i].type == EXE_TYPE)
+				return true;
+	return false;
+}
+
+static attr_sets_entry_t *id_set(const char *ids, int have, unsigned int id)
+{
+	attr_sets_entry_t *set = init_standalone_set(UNSIGNED);
+	char *tmp, *ptr, *saved = NULL;
+
+	if (set == NULL)
+		return NULL;
+
+	if (have)
+		append_int_attr_set(set, id);
+	if (ids && (tmp = strdup(ids))) {
+		for (ptr = strtok_r(tmp, ",", &saved); ptr;
+		     ptr = strtok_r(NULL, ",", &saved)) {
+			unsigned int num;
+
+			if (parse_uint(ptr, &num) == 0)
+				append_int_attr_set(set, num);
+		}
+		free(tmp);
+	}
+	return set;
+}
+
+static void add_subj_num(s_array *s, subject_type_t type, unsigned int val)
+{
+	subject_attr_t subj = { .type = type };
+
+	if (type == PID || type == PPID)
+		subj.pid = val;
+	else
+		subj.uval = val;
+	subject_add(s, &subj);
+}
+
+static void add_subj_str(s_array *s, subject_type_t type, char *str)
+{
+	subject_attr_t subj = { .type = type, .str = str };
+
+	if (str == NULL || subject_add(s, &subj))
+		free(str);
+}
+
+static void add_subj_set(s_array *s, subject_type_t type,
+			 attr_sets_entry_t *set)
+{
+	subject_attr_t subj = { .type = type, .set = set };
+
+	if (set && subject_add(s, &subj)) {
+		destroy_attr_set(set);
+		free(set);
+	}
+}
+
+static void add_obj(o_array *o, object_type_t type, char *str, int val)
+{
+	object_attr_t obj = { .type = type, .o = str, .val = val };
+
+	if (object_add(o, &obj))
+		free(str);
+}
+
+// Classify the executable on disk, as get_type_from_pid() would
+static char *exe_file_type(const char *exe)
+{
+	char buf[128], *ptr = NULL;
+	int fd = open(exe, O_RDONLY|O_CLOEXEC|O_NONBLOCK|O_NOCTTY);
+
+	if (fd >= 0) {
+		struct file_info *info = stat_file_entry(fd);
+
+		if (info)
+			ptr = get_file_type_from_fd(fd, info, exe,
+						    sizeof(buf), buf);
+		free(info);
+		close(fd);
+	}
+	return strdup(ptr ? ptr : "?");
+}
+
+static int lookup_trust(trust_reader_t *reader, const char *path,
+			struct file_info *info, int fd)
+{
+	int rc;
+
+	if (reader)
+		rc = trust_reader_check(reader, path, info, fd);
+	else
+		rc = check_trust_database(path, info, fd);
+	return rc == 1;
+}
+
+/*
+ * build_event - give an event every attribute the rules may ask for.
+ * @t: event as read from the input.
+ * @reader: trust reader of the calling thread, or NULL.
+ * @subj_trust: trust of the executable, see prefetch_subj_trust().
+ * @e: event to fill in, released with subject_clear() and object_clear().
+ * Returns 0 on success and 1 on failure.
+ */
+static int build_event(const struct test_event *t, trust_reader_t *reader,
+		       int subj_trust, event_t *e)
+{
+	struct proc_info *pinfo = calloc(1, sizeof(*pinfo));
+	struct file_info *finfo = NULL;
+	unsigned int auid = (unsigned int)-1, sessionid = (unsigned int)-1;
+	struct stat sb;
+	int fd = -1;
+
+	if (pinfo == NULL)
+		return 1;
+	pinfo->pid = t->pid;
+	pinfo->state = STATE_NORMAL;
+	pinfo->env_state = ENVIRON_CLEAN;
+
+	subject_create(e->s);
+	e->s->info = pinfo;
+	if (t->have & HAVE_AUID)
+		auid = t->auid;
+	if (t->have & HAVE_SESSIONID)
+		sessionid = t->sessionid;
+	add_subj_num(e->s, PID, t->have & HAVE_PID ? t->pid : 0);
+	add_subj_num(e->s, PPID, t->have & HAVE_PPID ? t->ppid : -1);
+	add_subj_num(e->s, AUID, auid);
+	add_subj_num(e->s, SESSIONID, sessionid);
+	add_subj_set(e->s, UID, id_set(NULL, t->have & HAVE_UID, t->uid));
+	add_subj_set(e->s, GID, id_set(t->gids, 0, 0));
+	add_subj_str(e->s, EXE, strdup(t->exe));
+	if (t->comm)
+		add_subj_str(e->s, COMM, strdup(t->comm));
+	else {
+		// The kernel keeps the first 15 characters of the name
+		const char *base = strrchr(t->exe, '/');
+
+		add_subj_str(e->s, COMM, strndup(base ? base + 1 : t->exe, 15));
+	}
+	if (t->exe_type)
+		add_subj_str(e->s, EXE_TYPE, strdup(t->exe_type));
+	else
+		add_subj_str(e->s, EXE_TYPE, run.exe_type ?
+			     exe_file_type(t->exe) : strdup("?"));
+	add_subj_num(e->s, SUBJ_TRUST, subj_trust);
+
+	// Only regular files are opened, reading a device may have effects
+	if (stat(t->path, &sb) == 0 && S_ISREG(sb.st_mode))
+		fd = open(t->path, O_RDONLY|O_CLOEXEC|O_NONBLOCK|O_NOCTTY);
+	if (fd >= 0)
+		finfo = stat_file_entry(fd);
+	if (finfo == NULL)
+		finfo = calloc(1, sizeof(*finfo));
+	if (finfo && fd < 0 && stat(t->path, &sb) == 0) {
+		finfo->device = sb.st_dev;
+		finfo->inode = sb.st_ino;
+		finfo->mode = sb.st_mode;
+		finfo->size = sb.st_size;
+	}
+
+	object_create(e->o);
+	e->o->info = finfo;
+	add_obj(e->o, PATH, strdup(t->path), 0);
+	if (t->ftype)
+		add_obj(e->o, FTYPE, strdup(t->ftype), 0);
+	add_obj(e->o, OBJ_TRUST, NULL, t->obj_trust >= 0 ? t->obj_trust :
+		fd >= 0 && finfo ? lookup_trust(reader, t->path, finfo, fd) : 0);
+
+	e->pid = -1;
+	e->fd = fd;
+	e->type = t->type;
+	e->num = 0;
+
+	return finfo == NULL;
+}
+
+// The decision process_event() would make, without logging it
+static decision_t evaluate_event(const llist *l, event_t *e,
+				 unsigned int *num)
+{
+	for (lnode *r = l->head; r; r = r->next) {
+		decision_t d = rule_evaluate(r, e);
+
+		if (d != NO_OPINION) {
+			*num = r->num + 1;
+			return d;
+		}
+	}
+	*num = 0;
+	return ALLOW;
+}
+
+static unsigned long long ns_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+		now.tv_nsec - start->tv_nsec;
+}
+
+/*
+ * prefetch_subj_trust - look the executables of a chunk up in one batch.
+ * @reader: trust reader of the calling thread, or NULL.
+ * @events: first event of the chunk.
+ * @count: number of events, at most TEST_CHUNK.
+ * @trust: receives the trust of each event's executable.
+ *
+ * Subjects are only checked by path, so a whole chunk can be looked up
+ * before any of its files is opened.
+ */
+static void prefetch_subj_trust(trust_reader_t *reader,
+				const struct test_event *events,
+				unsigned int count, int *trust)
+{
+	struct trust_lookup lookups[TEST_CHUNK];
+	unsigned int slot[TEST_CHUNK], n = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		trust[i] = events[i].subj_trust;
+		if (trust[i] >= 0)
+			continue;
+		lookups[n].path = events[i].exe;
+		lookups[n].info = NULL;
+		lookups[n].fd = 0;
+		slot[n++] = i;
+	}
+	if (n == 0)
+		return;
+
+	if (reader)
+		trust_reader_check_batch(reader, lookups, n);
+	else
+		check_trust_database_batch(lookups, n);
+	for (unsigned int i = 0; i < n; i++)
+		trust[slot[i]] = lookups[i].trusted == 1;
+}
+
+static void *rule_worker(void *arg __attribute__ ((unused)))
+{
+	unsigned long long event_ns = 0, rule_ns = 0;
+	int subj_trust[TEST_CHUNK];
+	trust_reader_t *reader;
+	unsigned long i, first, end;
+
+	file_thread_init();
+	reader = trust_reader_open();
+
+	while ((i = atomic_fetch_add(&run.next, TEST_CHUNK)) < run.count) {
+		struct timespec batch;
+
+		end = i + TEST_CHUNK < run.count ? i + TEST_CHUNK : run.count;
+		first = i;
+		clock_gettime(CLOCK_MONOTONIC, &batch);
+		prefetch_subj_trust(reader, &run.events[first], end - first,
+				    subj_trust);
+		event_ns += ns_since(&batch);
+
+		for (; i < end; i++) {
+			struct test_event *t = &run.events[i];
+			struct timespec start, rules;
+			s_array s;
+			o_array o;
+			event_t e = { .s = &s, .o = &o };
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (build_event(t, reader, subj_trust[i - first], &e)) {
+				t->dec[run.pass] = NO_OPINION;
+			} else {
+				clock_gettime(CLOCK_MONOTONIC, &rules);
+				t->dec[run.pass] = evaluate_event(run.rules,
+						&e, &t->rule[run.pass]);
+				rule_ns += ns_since(&rules);
+			}
+			subject_clear(&s);
+			object_clear(&o);
+			if (e.fd >= 0)
+				close(e.fd);
+			event_ns += ns_since(&start);
+		}
+	}
+
+	run.event_ns += event_ns;
+	run.rule_ns += rule_ns;
+	trust_reader_close(reader);
+	file_thread_close();
+	return NULL;
+}
+
+/*
+ * evaluate_rules - evaluate every event against one rule file.
+ * @file: rule file.
+ * @events: events to evaluate.
+ * @count: number of events.
+ * @pass: 0 or 1, which decision of the events to fill in.
+ * Returns 0 on success and 1 on failure.
+ */
+static int evaluate_rules(const char *file, struct test_event *events,
+			  unsigned long count, int pass)
+{
+	pthread_t workers[TRUST_READERS_MAX];
+	unsigned int threads = 0;
+	unsigned long allowed = 0, denied = 0, failed = 0;
+	struct timespec start;
+	llist rules;
+	int rc = 1;
+
+	if (init_attr_sets())
+		return 1;
+	if (load_test_rules(file, &rules))
+		goto out;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int want = cpus < 1 ? 1 : cpus > TRUST_READERS_MAX ?
+				TRUST_READERS_MAX : (unsigned int)cpus;
+
+	memset(&run, 0, sizeof(run));
+	run.rules = &rules;
+	run.events = events;
+	run.count = count;
+	run.pass = pass;
+	run.exe_type = rules_use_exe_type(&rules);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (; threads < want; threads++)
+		if (pthread_create(&workers[threads], NULL, rule_worker, NULL))
+			break;
+	if (threads == 0) {
+		fprintf(stderr, "Cannot start rule test threads\n");
+		goto out;
+	}
+	for (unsigned int i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	double secs = ns_since(&start) / 1e9;
+
+	for (unsigned long i = 0; i < count; i++) {
+		decision_t d = events[i].dec[pass];
+
+		if (d == NO_OPINION)
+			failed++;
+		else if (d & FAN_DENY)
+			denied++;
+		else
+			allowed++;
+	}
+
+	printf("%s: %lu events, %lu allowed, %lu denied", file, count,
+	       allowed, denied);
+	if (failed)
+		printf(", %lu not evaluated", failed);
+	printf("\n%s: %.3fs on %u threads, %.0f events/s, %.2f us per event, "
+	       "%.2f us of it in rule_evaluate()\n", file, secs, threads,
+	       secs > 0 ? count / secs : 0.0,
+	       (double)run.event_ns / count / 1000,
+	       (double)run.rule_ns / count / 1000);
+	rc = failed ? 1 : 0;
+out:
+	rules_clear(&rules);
+	destroy_attr_sets();
+	return rc;
+}
+
+static void print_decision(const struct test_event *t, int pass)
+{
+	const char *name = dec_val_to_name(t->dec[pass]);
+
+	if (t->rule[pass])
+		printf("%s (rule %u)", name ? name : "?", t->rule[pass]);
+	else
+		printf("%s (no rule)", name ? name : "?");
+}
+
+int rule_test(const char *events_file, const char *rules, const char *other,
+	      bool verbose)
+{
+	struct test_event *events;
+	unsigned long count = 0, differ = 0;
+	int rc;
+
+	events = load_events(events_file, &count);
+	if (events == NULL)
+		return 1;
+
+	rc = evaluate_rules(rules, events, count, 0);
+	if (rc == 0 && other)
+		rc = evaluate_rules(other, events, count, 1);
+
+	for (unsigned long i = 0; rc == 0 && i < count; i++) {
+		struct test_event *t = &events[i];
+		int diff = other && t->dec[0] != t->dec[1];
+
+		if (!diff && !verbose)
+			continue;
+		differ += diff;
+		printf("%s:%u: %s %s %s: ", events_file, t->line,
+		       t->type & FAN_OPEN_EXEC_PERM ? "execute" : "open",
+		       t->exe, t->path);
+		print_decision(t, 0);
+		if (other) {
+			printf(" -> ");
+			print_decision(t, 1);
+		}
+		putchar('\n');
+	}
+	if (rc == 0 && other)
+		printf("%lu of %lu decisions differ\n", differ, count);
+
+	for (unsigned long i = 0; i < count; i++)
+		free_test_event(&events[i]);
+	free(events);
+
+	return rc || differ;
+}
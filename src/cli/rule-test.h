@@ -0,0 +1,48 @@
+/*
+ * rule-test.h - Header file for evaluating recorded events offline
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef RULE_TEST_H
+#define RULE_TEST_H
+
+#include <stdbool.h>
+
+/**
+ * Evaluate every event of a file against one rule file, or against two
+ * and report where their decisions differ.
+ *
+ * Each line of \p events is either "exe uid gid path access", where gid
+ * may be a comma separated list and access is open or execute, or a
+ * decision logged by the daemon, such as
+ * "rule=9 dec=allow perm=open auid=0 pid=1 exe=/usr/bin/cat : path=/etc/x"
+ * Attributes the line does not give are read from the files on disk and
+ * the trust database, which must have been initialized by the caller.
+ *
+ * @param events File with one event per line
+ * @param rules Compiled rule file to evaluate against
+ * @param other Second rule file to compare with, or NULL
+ * @param verbose Print every decision rather than only the differences
+ * @return 0 when all events were evaluated and no decision differs,
+ *     1 otherwise
+ */
+int rule_test(const char *events, const char *rules, const char *other,
+	      bool verbose);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * scan-cursor.c - resume an interrupted scan of the ignore_mounts entries
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scan-cursor.h"
+
+/*
+ * The file has the magic line, then one line per mount that was scanned
+ * to the end, "done <found> <mount>", and when a scan was interrupted,
+ * "at <files> <found> <mount>" followed by the last file it reported.
+ * Mounts come last on their line so they may hold spaces.
+ */
+#define SCAN_CURSOR_MAGIC	"fapolicyd-scan-cursor 2"
+
+void scan_cursor_init(struct scan_cursor *c, const char *file)
+{
+	memset(c, 0, sizeof(*c));
+	c->file = file;
+}
+
+static void clear_position(struct scan_cursor *c)
+{
+	free(c->mount);
+	free(c->last);
+	c->mount = c->last = NULL;
+	c->files = c->found = 0;
+}
+
+void scan_cursor_free(struct scan_cursor *c)
+{
+	for (unsigned int i = 0; i < c->ndone; i++)
+		free(c->done[i].path);
+	free(c->done);
+	c->done = NULL;
+	c->ndone = 0;
+	clear_position(c);
+}
+
+int scan_cursor_finish(struct scan_cursor *c, const char *mount,
+		       unsigned long found)
+{
+	struct scan_cursor_mount *done;
+	char *path = strdup(mount);
+
+	done = realloc(c->done, (c->ndone + 1) * sizeof(*done));
+	if (path == NULL || done == NULL) {
+		free(path);
+		return 1;
+	}
+	c->done = done;
+	c->done[c->ndone].path = path;
+	c->done[c->ndone].found = found;
+	c->ndone++;
+	if (scan_cursor_resumes(c, mount))
+		clear_position(c);
+	return 0;
+}
+
+const struct scan_cursor_mount *scan_cursor_finished(
+		const struct scan_cursor *c, const char *mount)
+{
+	for (unsigned int i = 0; i < c->ndone; i++)
+		if (strcmp(c->done[i].path, mount) == 0)
+			return &c->done[i];
+	return NULL;
+}
+
+int scan_cursor_resumes(const struct scan_cursor *c, const char *mount)
+{
+	return c->mount && strcmp(c->mount, mount) == 0;
+}
+
+// Read a line without its newline, returns its length or -1 at the end
+static ssize_t read_line(char **line, size_t *len, FILE *f)
+{
+	ssize_t n = getline(line, len, f);
+
+	if (n > 0 && (*line)[n - 1] == '\n')
+		(*line)[--n] = 0;
+	return n;
+}
+
+int scan_cursor_load(struct scan_cursor *c)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int rc = 1;
+	FILE *f;
+
+	f = fopen(c->file, "r");
+	if (f == NULL)
+		return 1;
+
+	if (read_line(&line, &len, f) < 0 ||
+	    strcmp(line, SCAN_CURSOR_MAGIC))
+		goto out;
+
+	while (read_line(&line, &len, f) >= 0) {
+		unsigned long files, found;
+		int pos = 0;
+
+		if (sscanf(line, "done %lu %n", &found, &pos) == 1 && pos &&
+		    line[pos]) {
+			if (scan_cursor_finish(c, line + pos, found))
+				goto out;
+		} else if (c->mount == NULL &&
+			   sscanf(line, "at %lu %lu %n", &files, &found,
+				  &pos) == 2 && pos && line[pos]) {
+			c->mount = strdup(line + pos);
+			if (c->mount == NULL ||
+			    read_line(&line, &len, f) <= 0)
+				goto out;
+			c->last = strdup(line);
+			if (c->last == NULL)
+				goto out;
+			c->files = files;
+			c->found = found;
+		} else
+			goto out;
+	}
+	rc = 0;
+out:
+	if (rc)
+		scan_cursor_free(c);
+	free(line);
+	fclose(f);
+	return rc;
+}
+
+int scan_cursor_save(struct scan_cursor *c, const char *mount,
+		     unsigned long files, unsigned long found,
+		     const char *last)
+{
+	size_t len = strlen(c->file);
+	char tmp[len + sizeof(".tmp")];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", c->file);
+	f = fopen(tmp, "w");
+	if (f == NULL)
+		return 1;
+	fprintf(f, "%s\n", SCAN_CURSOR_MAGIC);
+	for (unsigned int i = 0; i < c->ndone; i++)
+		fprintf(f, "done %lu %s\n", c->done[i].found,
+			c->done[i].path);
+	if (mount)
+		fprintf(f, "at %lu %lu %s\n%s\n", files, found, mount, last);
+	if (fclose(f) || rename(tmp, c->file)) {
+		int saved = errno;
+
+		unlink(tmp);
+		errno = saved;
+		return 1;
+	}
+	return 0;
+}
+
+void scan_cursor_remove(struct scan_cursor *c)
+{
+	unlink(c->file);
+	scan_cursor_free(c);
+}
@@ -0,0 +1,93 @@
+/*
+ * scan-cursor.h - Header file for resuming an interrupted mount scan
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef SCAN_CURSOR_H
+#define SCAN_CURSOR_H
+
+// A mount an earlier run scanned to the end
+struct scan_cursor_mount {
+	char *path;
+	unsigned long found;	// suspicious files it had
+};
+
+struct scan_cursor {
+	const char *file;
+	struct scan_cursor_mount *done;
+	unsigned int ndone;
+	// position in the mount that was being scanned, if any
+	char *mount;
+	unsigned long files;	// files reported in it
+	unsigned long found;	// suspicious files among them
+	char *last;		// last file reported
+};
+
+/**
+ * Start an empty cursor that is saved to \p file.
+ */
+void scan_cursor_init(struct scan_cursor *c, const char *file);
+
+/**
+ * Read the cursor an interrupted run saved.
+ * @return 0 when it was read, 1 when there is none or it cannot be used,
+ *     in which case the cursor stays empty
+ */
+int scan_cursor_load(struct scan_cursor *c);
+
+/**
+ * Save the finished mounts and, when \p mount is not NULL, how far its
+ * scan got.
+ * @return 0 on success, 1 on failure with errno set
+ */
+int scan_cursor_save(struct scan_cursor *c, const char *mount,
+		     unsigned long files, unsigned long found,
+		     const char *last);
+
+/**
+ * Record that \p mount was scanned to the end, dropping the position in
+ * it. The record is kept in memory until the next save.
+ * @return 0 on success, 1 when out of memory
+ */
+int scan_cursor_finish(struct scan_cursor *c, const char *mount,
+		       unsigned long found);
+
+/**
+ * Look up a mount scanned to the end.
+ * @return the record, or NULL when it still has to be scanned
+ */
+const struct scan_cursor_mount *scan_cursor_finished(
+		const struct scan_cursor *c, const char *mount);
+
+/**
+ * Tell whether the saved position is in \p mount.
+ */
+int scan_cursor_resumes(const struct scan_cursor *c, const char *mount);
+
+/**
+ * Remove the saved cursor and free the one in memory.
+ */
+void scan_cursor_remove(struct scan_cursor *c);
+
+/**
+ * Free the cursor in memory.
+ */
+void scan_cursor_free(struct scan_cursor *c);
+
+#endif
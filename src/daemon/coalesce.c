@@ -0,0 +1,130 @@
+/*
+ * coalesce.c - answer identical permission events with one decision
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#include "config.h"
+#include <sys/stat.h>
+#include "coalesce.h"
+#include "policy.h"
+
+/*
+ * Threads of one process often open the same file at the same instant,
+ * each open raising its own permission event. The decision thread takes
+ * whatever is already queued, up to COALESCE_BATCH events, and answers
+ * later events with the same pid, mask and file as one it just decided
+ * with that decision. Events of other processes in between do not
+ * matter, but the first other event of the same process ends the
+ * search. An exec makes it another program, and anything else has to be
+ * decided before what the process did after it is answered, so that its
+ * replies go out in the order it asked. Exec events are never shared.
+ * The subject is identified by its pid because the attributes rules
+ * look at are gathered lazily and cannot be compared between processes
+ * without doing the work coalescing saves.
+ * Decisions that are audited or logged are not shared so that every
+ * access still leaves its own record. Events the reader already answered
+ * are never shared either, each carries its own subject snapshot.
+ */
+
+// Fill in the file identity of a slot, returns 1 if it is known
+static int slot_stat(struct batch_slot *b)
+{
+	struct stat sb;
+
+	if (b->state == SLOT_NEW) {
+		if (fstat(b->m.fd, &sb) == 0) {
+			b->dev = sb.st_dev;
+			b->ino = sb.st_ino;
+			b->state = SLOT_STAT;
+		} else
+			b->state = SLOT_NOSTAT;
+	}
+	return b->state == SLOT_STAT;
+}
+
+static inline int may_match(const struct batch_slot *a,
+			    const struct batch_slot *b)
+{
+	return a->m.mask == b->m.mask && !(b->m.mask & FAN_OPEN_EXEC_PERM) &&
+		!((a->m.reserved | b->m.reserved) & EVENT_REPLIED);
+}
+
+/*
+ * next_same_pid - find the next pending event of the same process.
+ * @batch: events in queue order.
+ * @n: number of events in @batch.
+ * @i: event whose process is looked for.
+ * @j: first index to look at.
+ * Returns the index of that event or @n if there is none.
+ */
+static unsigned int next_same_pid(const struct batch_slot *batch,
+				  unsigned int n, unsigned int i,
+				  unsigned int j)
+{
+	for (; j < n; j++)
+		if (batch[j].state != SLOT_DONE &&
+		    batch[j].m.pid == batch[i].m.pid)
+			break;
+	return j;
+}
+
+/*
+ * coalesce_decide - decide a batch of events in order.
+ * @batch: events taken from the queue, in queue order, all SLOT_NEW.
+ * @n: number of events in @batch.
+ * @decide: evaluates and answers one event. It returns the response sent
+ *	when it may be reused for an identical event, or -1.
+ * @answer: sends a reused response for an event.
+ * Returns how many events were answered with a reused response.
+ */
+unsigned int coalesce_decide(struct batch_slot *batch, unsigned int n,
+	int (*decide)(const struct fanotify_event_metadata *m),
+	void (*answer)(const struct fanotify_event_metadata *m, int reply))
+{
+	unsigned int i, j, shared = 0;
+
+	for (i = 0; i < n; i++) {
+		int known = 0, reply;
+
+		if (batch[i].state == SLOT_DONE)
+			continue;
+
+		// The reply closes the fd, so look at the file first
+		j = next_same_pid(batch, n, i, i + 1);
+		if (j < n && may_match(&batch[i], &batch[j]))
+			known = slot_stat(&batch[i]);
+
+		reply = decide(&batch[i].m);
+		batch[i].state = SLOT_DONE;
+		if (reply < 0 || !known)
+			continue;
+
+		for (; j < n; j = next_same_pid(batch, n, i, j + 1)) {
+			if (!may_match(&batch[i], &batch[j]) ||
+			    !slot_stat(&batch[j]) ||
+			    batch[j].dev != batch[i].dev ||
+			    batch[j].ino != batch[i].ino)
+				break;
+			answer(&batch[j].m, reply);
+			batch[j].state = SLOT_DONE;
+			shared++;
+		}
+	}
+	return shared;
+}
@@ -0,0 +1,42 @@
+/*
+ * coalesce.h - Header file for coalesce.c
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef COALESCE_HEADER
+#define COALESCE_HEADER
+
+#include <sys/types.h>
+#include <sys/fanotify.h>
+
+// Most events the decision thread takes from the queue at once
+#define COALESCE_BATCH 32
+
+struct batch_slot {
+	struct fanotify_event_metadata m;
+	dev_t dev;
+	ino_t ino;
+	enum { SLOT_NEW, SLOT_STAT, SLOT_NOSTAT, SLOT_DONE } state;
+};
+
+unsigned int coalesce_decide(struct batch_slot *batch, unsigned int n,
+	int (*decide)(const struct fanotify_event_metadata *m),
+	void (*answer)(const struct fanotify_event_metadata *m, int reply));
+
+#endif
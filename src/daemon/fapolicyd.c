@@ -43,6 +43,7 @@
 #include <stdatomic.h>
 #include <limits.h>        /* PATH_MAX */
 #include <locale.h>
+#include <time.h>
 #include <pthread.h>
 #ifndef HAVE_GETTID
 #include <sys/syscall.h>
@@ -53,7 +54,6 @@
 #include "notify.h"
 #include "policy.h"
 #include "event.h"
-#include "escape.h"
 #include "fd-fgets.h"
 #include "file.h"
 #include "database.h"
@@ -61,6 +61,7 @@
 #include "daemon-config.h"
 #include "conf.h"
 #include "queue.h"
+#include "realtime.h"
 #include "gcc-attributes.h"
 #include "avl.h"
 #include "paths.h"
@@ -72,6 +73,10 @@
 // Global program variables
 unsigned int debug_mode = 0;
 const char* mounts = MOUNTS_FILE;
+// Mount table scanned for watched mounts, mountinfo unless overridden
+static const char *mount_table = MOUNTINFO_FILE;
+// fanotify mount event descriptor, -1 when rescanning the mount table
+static int mount_events = -1;
 
 // Signal handler notifications
 atomic_bool stop = false, hup = false, run_stats = false;
@@ -378,6 +383,8 @@ static int reload_configuration(void)
 	}
 
 	config.permissive = new_config.permissive;
+	config.permissive_defer = new_config.permissive_defer;
+	config.coalesce_events = new_config.coalesce_events;
 
 	if (setpriority(PRIO_PROCESS, 0, -(int)new_config.nice_val) == -1)
 		msg(LOG_WARNING, "Couldn't adjust priority (%s)",
@@ -426,12 +433,18 @@ static int reload_configuration(void)
 
 	/*
 	 * Remaining daemon_config fields require restart-time changes:
-	 * q_size, subj_cache_size, and obj_cache_size are consumed when the
-	 * event queue and caches are created. uid/gid, allow_filesystem_mark,
+	 * q_size, q_exec_weight, the backpressure watermarks,
+	 * subj_cache_size, and obj_cache_size are consumed when the event
+	 * queue and caches are created. uid/gid, allow_filesystem_mark,
 	 * watch_fs, and ignore_mounts are applied while fanotify marks are
 	 * installed. db_max_size fixes the LMDB map when the database opens,
-	 * and report_interval is bound to the decision thread's timer. None
-	 * of these components support resizing in-place yet, so their
+	 * digest_index decides whether the digest index is built with it,
+	 * and report_interval is bound to the decision thread's timer. The
+	 * reader_thread, reader_cpu, reader_spin, and watchdog settings are
+	 * fixed once the fanotify reader and watchdog threads start, as are
+	 * decision_priority, decision_cpu, and lock_memory once the decision
+	 * thread runs, and huge_pages once the queue and caches are mapped.
+	 * None of these components support resizing in-place yet, so their
 	 * configuration stays static.
 	 */
 
@@ -613,15 +626,18 @@ static int check_mount_entry(const char *point, const char *type)
 
 static void handle_mounts(int fd)
 {
-	char buf[PATH_MAX * 2], device[1025], point[4097];
-	char type[32], mntops[128];
-	int fs_req, fs_passno;
+	char buf[PATH_MAX * 2], point[4097];
+	char type[32];
+	unsigned int lines = 0, added = 0, deleted = 0;
+	struct timespec start, end;
+	int id;
 
 	if (m == NULL) {
 		m = malloc(sizeof(mlist));
 		mlist_create(m);
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	// Rewind the descriptor
 	lseek(fd, 0, SEEK_SET);
 	fd_fgets_state_t *st = fd_fgets_init();
@@ -633,29 +649,143 @@ static void handle_mounts(int fd)
 		int rc = fd_fgets_r(st, buf, sizeof(buf), fd);
 		// Get a line
 		if (rc > 0) {
+			lines++;
 			// Parse it
-			sscanf(buf, "%1024s %4096s %31s %127s %d %d\n",
-			    device, point, type, mntops, &fs_req, &fs_passno);
-			unescape_shell(device, strlen(device));
-			unescape_shell(point, strlen(point));
+			if (!parse_mount_line(buf, point, sizeof(point),
+					      type, sizeof(type), &id))
+				continue;
 			// Is this one that we care about?
 			if (check_mount_entry(point, type)) {
-				// Can we find it in the old list?
-				if (mlist_find(m, point)) {
-					// Mark no change
-					m->cur->status = MNT_NO_CHANGE;
-				} else
-					mlist_append(m, point);
+				// Keep it, or add it if it is new
+				if (mlist_seen(m, point, id))
+					msg(LOG_ERR, "Cannot track mount %s",
+					    point);
 			}
 		} else if (rc < 0) // Some kind of error - stop
 			break;
 	} while (!fd_fgets_eof_r(st));
 
 	fd_fgets_destroy(st);
+	// Remounted points get marked again
+	mlist_resolve(m, &added, &deleted);
 	// update marks
 	fanotify_update(m);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	msg(LOG_DEBUG,
+	    "Mount rescan: %u entries, %u watched, %u added, %u removed "
+	    "in %.3fms", lines, m->count, added, deleted,
+	    (end.tv_sec - start.tv_sec) * 1000.0 +
+	    (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+#ifdef USE_MOUNT_EVENTS
+static unsigned int mounts_attached, mounts_detached;
+
+static void report_rescan(const char *how, unsigned int entries,
+			  unsigned int added, unsigned int deleted,
+			  const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	msg(LOG_DEBUG,
+	    "Mount rescan (%s): %u entries, %u watched, %u added, %u removed "
+	    "in %.3fms", how, entries, m->count, added, deleted,
+	    (end.tv_sec - start->tv_sec) * 1000.0 +
+	    (end.tv_nsec - start->tv_nsec) / 1e6);
 }
 
+/*
+ * scan_mounts_by_id - rebuild the watched mount list with listmount.
+ *
+ * The list is keyed by the unique mount IDs that mount events report.
+ * Returns 0 on success and 1 if the mounts cannot be listed.
+ */
+static int scan_mounts_by_id(void)
+{
+	char point[PATH_MAX], type[32];
+	unsigned int added = 0, deleted = 0;
+	struct timespec start;
+	uint64_t *ids;
+	long count, i;
+
+	if (m == NULL) {
+		m = malloc(sizeof(mlist));
+		mlist_create(m);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	count = list_mounts(&ids);
+	if (count < 0) {
+		msg(LOG_DEBUG, "listmount failed (%s)", strerror(errno));
+		return 1;
+	}
+
+	mlist_mark_all_deleted(m);
+	for (i = 0; i < count; i++) {
+		// Mounts can go away while we look
+		if (mount_by_id(ids[i], point, sizeof(point),
+				type, sizeof(type)) != 1)
+			continue;
+		if (check_mount_entry(point, type) &&
+		    mlist_seen(m, point, (long long)ids[i]))
+			msg(LOG_ERR, "Cannot track mount %s", point);
+	}
+	free(ids);
+
+	mlist_resolve(m, &added, &deleted);
+	fanotify_update(m);
+	report_rescan("listmount", count, added, deleted, &start);
+	return 0;
+}
+
+/*
+ * mount_event - update the watched mount list for one mount event.
+ * @mask: FAN_MNT_ATTACH and/or FAN_MNT_DETACH.
+ * @id: unique ID of the mount.
+ */
+static void mount_event(uint64_t mask, uint64_t id)
+{
+	char point[PATH_MAX], type[32];
+
+	// A move reports both, the old place goes first
+	if (mask & FAN_MNT_DETACH)
+		mounts_detached += mlist_detach(m, (long long)id);
+
+	if ((mask & FAN_MNT_ATTACH) &&
+	    mount_by_id(id, point, sizeof(point), type, sizeof(type)) == 1 &&
+	    check_mount_entry(point, type)) {
+		if (mlist_attach(m, point, (long long)id))
+			msg(LOG_ERR, "Cannot track mount %s", point);
+		else
+			mounts_attached++;
+	}
+}
+
+/*
+ * handle_mount_events - mark only the mounts that changed.
+ * @fd: descriptor from init_mount_events.
+ *
+ * Falls back to a full listmount scan if the kernel dropped events.
+ */
+static void handle_mount_events(int fd)
+{
+	int rc;
+
+	mounts_attached = mounts_detached = 0;
+	rc = read_mount_events(fd, mount_event);
+	if (rc == 1) {
+		msg(LOG_WARNING, "Mount events were lost, rescanning mounts");
+		if (scan_mounts_by_id() == 0)
+			return;
+	}
+	fanotify_update(m);
+	msg(LOG_DEBUG, "Mount events: %u attached, %u detached",
+	    mounts_attached, mounts_detached);
+}
+#endif
+
 /*
  * handle_mounts_thread_main - run mount processing outside event loop.
  * @arg: pointer to a heap-allocated file descriptor integer.
@@ -855,7 +985,8 @@ err_out: // At this point, we have a pid file, let's just assume it's alive
 
 int main(int argc, const char *argv[])
 {
-	struct pollfd pfd[2];
+	struct pollfd pfd[3];
+	int fan_fd;
 	struct sigaction sa;
 	struct rlimit limit;
 
@@ -934,6 +1065,7 @@ int main(int argc, const char *argv[])
 			}
 			msg(LOG_INFO, "Overriding mounts file: %s", tmp);
 			mounts = tmp;
+			mount_table = tmp;
 		} else if (strcmp(argv[i], "--debug") == 0 || strcmp(argv[i], "--debug-deny") == 0) {
 			// nop; debug flags already set
 		} else {
@@ -1035,6 +1167,10 @@ int main(int argc, const char *argv[])
 		capng_updatev(CAPNG_ADD, CAPNG_EFFECTIVE|CAPNG_PERMITTED,
 			CAP_DAC_OVERRIDE, CAP_SYS_ADMIN, CAP_SYS_PTRACE,
 			CAP_SYS_NICE, CAP_SYS_RESOURCE, CAP_AUDIT_WRITE, -1);
+		if (config.lock_memory)
+			capng_update(CAPNG_ADD,
+				     CAPNG_EFFECTIVE|CAPNG_PERMITTED,
+				     CAP_IPC_LOCK);
 		if (capng_change_id(config.uid, config.gid,
 							CAPNG_DROP_SUPP_GRP)) {
 			msg(LOG_ERR, "Cannot change to uid %d", config.uid);
@@ -1046,7 +1182,8 @@ int main(int argc, const char *argv[])
 	// Install seccomp filter to prevent escalation
 	install_syscall_filter();
 
-	// Setup lru caches
+	// Setup lru caches, their arrays and the queue use this backing
+	rt_set_huge_pages(config.huge_pages);
 	init_event_system(&config);
 
 	// Init the database
@@ -1064,11 +1201,29 @@ int main(int argc, const char *argv[])
 	file_init();
 
 	// Initialize the file watch system
-	pfd[0].fd = open(mounts, O_RDONLY);
-	pfd[0].events = POLLPRI;
-	handle_mounts(pfd[0].fd);
-	pfd[1].fd = init_fanotify(&config, m);
+#ifdef USE_MOUNT_EVENTS
+	// A --mounts override is a static file, it has to be scanned
+	if (strcmp(mount_table, MOUNTINFO_FILE) == 0 &&
+	    (mount_events = init_mount_events()) >= 0 &&
+	    scan_mounts_by_id()) {
+		close(mount_events);
+		mount_events = -1;
+	}
+#endif
+	if (mount_events >= 0) {
+		msg(LOG_DEBUG, "Using mount events to track mounts");
+		pfd[0].fd = mount_events;
+		pfd[0].events = POLLIN;
+	} else {
+		pfd[0].fd = open(mount_table, O_RDONLY);
+		pfd[0].events = POLLPRI;
+		handle_mounts(pfd[0].fd);
+	}
+	fan_fd = init_fanotify(&config, m);
+	pfd[1].fd = fan_fd;
 	pfd[1].events = POLLIN;
+	pfd[2].fd = fanotify_resume_fd();
+	pfd[2].events = POLLIN;
 
 	msg(LOG_INFO, "Starting to listen for events");
 	while (!stop) {
@@ -1078,7 +1233,9 @@ int main(int argc, const char *argv[])
 			msg(LOG_DEBUG, "Got SIGHUP");
 			maybe_start_reconfigure_thread();
 		}
-		rc = poll(pfd, 2, -1);
+		// Under backpressure the kernel holds events until we resume
+		pfd[1].fd = fanotify_throttled() ? -1 : fan_fd;
+		rc = poll(pfd, 3, -1);
 
 #ifdef DEBUG
 		msg(LOG_DEBUG, "Main poll interrupted");
@@ -1095,6 +1252,8 @@ int main(int argc, const char *argv[])
 				exit(1);
 			}
 		} else if (rc > 0) {
+			if (pfd[2].revents & POLLIN)
+				handle_resume();
 			if (pfd[1].revents & POLLIN) {
 				handle_events();
 			}
@@ -1102,6 +1261,10 @@ int main(int argc, const char *argv[])
 				msg(LOG_DEBUG, "Mount change detected");
 				maybe_start_mounts_thread(pfd[0].fd);
 			}
+#ifdef USE_MOUNT_EVENTS
+			if (pfd[0].revents & POLLIN)
+				handle_mount_events(pfd[0].fd);
+#endif
 
 			// This will always need to be here as long as we
 			// link against librpm. Turns out that librpm masks
@@ -1,5 +1,5 @@
 /*
- * mounts.c - Minimal linked list set of mount points
+ * mounts.c - Hash indexed list set of mount points
  * Copyright (c) 2019 Red Hat Inc.
  * All Rights Reserved.
  *
@@ -31,54 +31,259 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include "mounts.h"
+#include "escape.h"
+#ifdef USE_MOUNT_EVENTS
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mount.h>
+#endif
+
+#define MIN_BUCKETS 64
 
 void mlist_create(mlist *m)
 {
         m->head = NULL;
         m->cur = NULL;
+	m->tail = NULL;
+	m->buckets = NULL;
+	m->nbuckets = 0;
+	m->count = 0;
+	m->id_buckets = NULL;
+	m->nid_buckets = 0;
+	m->id_count = 0;
 }
 
-static void mlist_last(mlist *m)
+// FNV-1a, mount points share long prefixes so every byte counts
+static unsigned int hash_path(const char *p)
 {
-	register mnode* window;
+	unsigned int h = 2166136261u;
 
-	if (m->head == NULL)
+	while (*p) {
+		h ^= (unsigned char)*p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Keep the load factor at or below 1. Returns 0 on success and 1 on error
+static int mlist_grow(mlist *m)
+{
+	unsigned int n = m->nbuckets ? m->nbuckets * 2 : MIN_BUCKETS;
+	mnode **b = calloc(n, sizeof(mnode *));
+	mnode *cur;
+
+	if (b == NULL)
+		return 1;
+
+	for (cur = m->head; cur; cur = cur->next) {
+		unsigned int i = hash_path(cur->path) & (n - 1);
+
+		cur->hnext = b[i];
+		b[i] = cur;
+	}
+	free(m->buckets);
+	m->buckets = b;
+	m->nbuckets = n;
+	return 0;
+}
+
+static mnode *mlist_lookup(const mlist *m, const char *p)
+{
+	mnode *n;
+
+	if (m->nbuckets == 0)
+		return NULL;
+
+	n = m->buckets[hash_path(p) & (m->nbuckets - 1)];
+	while (n) {
+		if (strcmp(p, n->path) == 0)
+			return n;
+		n = n->hnext;
+	}
+	return NULL;
+}
+
+/*
+ * Mounts can be stacked on one point, so each node keeps the IDs of all
+ * of them and a second index finds the node of an ID. Mount events only
+ * carry the ID. IDs of -1, from tables that have none, are kept on the
+ * stack but not indexed.
+ */
+static unsigned int hash_id(long long id)
+{
+	return (unsigned int)(((unsigned long long)id *
+			       0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+// Keep the load factor at or below 1. Returns 0 on success and 1 on error
+static int id_grow(mlist *m)
+{
+	unsigned int n = m->nid_buckets ? m->nid_buckets * 2 : MIN_BUCKETS;
+	midx **b = calloc(n, sizeof(midx *));
+
+	if (b == NULL)
+		return 1;
+
+	for (unsigned int i = 0; i < m->nid_buckets; i++) {
+		midx *e = m->id_buckets[i], *next;
+
+		for (; e; e = next) {
+			unsigned int j = hash_id(e->id) & (n - 1);
+
+			next = e->next;
+			e->next = b[j];
+			b[j] = e;
+		}
+	}
+	free(m->id_buckets);
+	m->id_buckets = b;
+	m->nid_buckets = n;
+	return 0;
+}
+
+static mnode *id_lookup(const mlist *m, long long id)
+{
+	midx *e;
+
+	if (m->nid_buckets == 0)
+		return NULL;
+
+	for (e = m->id_buckets[hash_id(id) & (m->nid_buckets - 1)]; e;
+	     e = e->next)
+		if (e->id == id)
+			return e->node;
+	return NULL;
+}
+
+static void id_unindex(mlist *m, long long id)
+{
+	midx **e;
+
+	if (id < 0 || m->nid_buckets == 0)
 		return;
 
-	window = m->head;
-	while (window->next)
-		window = window->next;
+	for (e = &m->id_buckets[hash_id(id) & (m->nid_buckets - 1)]; *e;
+	     e = &(*e)->next) {
+		if ((*e)->id == id) {
+			midx *gone = *e;
 
-	m->cur = window;
+			*e = gone->next;
+			free(gone);
+			m->id_count--;
+			return;
+		}
+	}
 }
 
-// Returns 0 on success and 1 on error
-int mlist_append(mlist *m, const char *p)
+// Put a mount on top of the node's stack. Returns 0 on success
+static int push_id(mlist *m, mnode *n, long long id)
 {
-        mnode* newnode;
+	if (n->nids == n->ids_size) {
+		unsigned int size = n->ids_size ? n->ids_size * 2 : 2;
+		long long *ids = realloc(n->ids, size * sizeof(long long));
 
-	if (p) {
-		newnode = malloc(sizeof(mnode));
-		if (newnode == NULL)
+		if (ids == NULL)
 			return 1;
-		newnode->path = strdup(p);
-		newnode->status = MNT_ADD;
-	} else
-		return 1;
+		n->ids = ids;
+		n->ids_size = size;
+	}
+
+	if (id >= 0) {
+		midx *e;
+		unsigned int i;
+
+		if (m->id_count >= m->nid_buckets && id_grow(m))
+			return 1;
+		e = malloc(sizeof(midx));
+		if (e == NULL)
+			return 1;
+		i = hash_id(id) & (m->nid_buckets - 1);
+		e->id = id;
+		e->node = n;
+		e->next = m->id_buckets[i];
+		m->id_buckets[i] = e;
+		m->id_count++;
+	}
+	n->ids[n->nids++] = id;
+	return 0;
+}
+
+// Take a mount off the node's stack, wherever it is
+static void drop_id(mlist *m, mnode *n, long long id)
+{
+	for (unsigned int i = 0; i < n->nids; i++) {
+		if (n->ids[i] == id) {
+			memmove(&n->ids[i], &n->ids[i + 1],
+				(n->nids - i - 1) * sizeof(long long));
+			n->nids--;
+			break;
+		}
+	}
+	id_unindex(m, id);
+}
+
+static void clear_ids(mlist *m, mnode *n)
+{
+	for (unsigned int i = 0; i < n->nids; i++)
+		id_unindex(m, n->ids[i]);
+	n->nids = 0;
+}
+
+static mnode *mlist_insert(mlist *m, const char *p, long long id)
+{
+        mnode* newnode;
+
+	if (p == NULL)
+		return NULL;
 
+	if (m->count >= m->nbuckets && mlist_grow(m))
+		return NULL;
+
+	newnode = malloc(sizeof(mnode));
+	if (newnode == NULL)
+		return NULL;
+	newnode->path = strdup(p);
+	if (newnode->path == NULL) {
+		free(newnode);
+		return NULL;
+	}
+	newnode->status = MNT_ADD;
+	newnode->mnt_id = id;
+	newnode->new_id = id;
+	newnode->ids = NULL;
+	newnode->nids = 0;
+	newnode->ids_size = 0;
+	newnode->seen = 1;
 	newnode->next = NULL;
-	mlist_last(m);
+	if (push_id(m, newnode, id)) {
+		free(newnode->ids);
+		free((void *)newnode->path);
+		free(newnode);
+		return NULL;
+	}
+
+	unsigned int i = hash_path(p) & (m->nbuckets - 1);
+	newnode->hnext = m->buckets[i];
+	m->buckets[i] = newnode;
 
 	// if we are at top, fix this up
 	if (m->head == NULL)
 		m->head = newnode;
 	else    // Otherwise add pointer to newnode
-		m->cur->next = newnode;
+		m->tail->next = newnode;
 
 	// make newnode current
+	m->tail = newnode;
 	m->cur = newnode;
+	m->count++;
 
-	return 0;
+	return newnode;
+}
+
+// Returns 0 on success and 1 on error
+int mlist_append(mlist *m, const char *p)
+{
+	return mlist_insert(m, p, -1) ? 0 : 1;
 }
 
 const char *mlist_first(mlist *m)
@@ -106,23 +311,161 @@ void mlist_mark_all_deleted(mlist *m)
 	register mnode *n = m->head;
 	while (n) {
 		n->status = MNT_DELETE;
+		n->seen = 0;
 		n = n->next;
 	}
 }
 
 int mlist_find(mlist *m, const char *p)
 {
-	register mnode *n = m->head;
-	while (n) {
-		if (strcmp(p, n->path) == 0) {
-			m->cur = n;
-			return 1;
-		}
-		n = n->next;
+	mnode *n = mlist_lookup(m, p);
+
+	if (n) {
+		m->cur = n;
+		return 1;
 	}
 	return 0;
 }
 
+/*
+ * mlist_seen - record a mount found by the current scan.
+ * @m: list that had mlist_mark_all_deleted called before the scan.
+ * @p: mount point.
+ * @id: mount ID, or -1 when the table has none.
+ *
+ * New mount points are appended as MNT_ADD. Known ones are kept, and the
+ * ID is remembered so mlist_resolve can tell if the mount at that point
+ * was replaced. When mounts are stacked on one point the last one listed
+ * is on top, so the last ID wins. The stack of IDs is rebuilt from what
+ * the scan finds.
+ * Returns 0 on success and 1 on error.
+ */
+int mlist_seen(mlist *m, const char *p, long long id)
+{
+	mnode *n = mlist_lookup(m, p);
+
+	if (n == NULL)
+		return mlist_insert(m, p, id) ? 0 : 1;
+
+	if (n->seen++ == 0)
+		clear_ids(m, n);
+	if (push_id(m, n, id))
+		return 1;
+	if (n->status == MNT_DELETE)
+		n->status = MNT_NO_CHANGE;
+	n->new_id = id;
+	m->cur = n;
+	return 0;
+}
+
+/*
+ * mlist_attach - record a mount reported by a mount event.
+ * @m: list of watched mounts.
+ * @p: mount point.
+ * @id: unique mount ID from the event.
+ *
+ * The point is flagged MNT_ADD whether or not it was known, a mount
+ * attached on top of a watched point needs its own mark. The mount goes
+ * on top of the point's stack.
+ * Returns 0 on success and 1 on error.
+ */
+int mlist_attach(mlist *m, const char *p, long long id)
+{
+	mnode *n = mlist_lookup(m, p);
+
+	if (n == NULL)
+		return mlist_insert(m, p, id) ? 0 : 1;
+
+	if (id_lookup(m, id) != n && push_id(m, n, id))
+		return 1;
+	n->status = MNT_ADD;
+	n->mnt_id = n->new_id = id;
+	m->cur = n;
+	return 0;
+}
+
+/*
+ * mlist_detach - take the mount with this ID off its point.
+ * @m: list of watched mounts.
+ * @id: unique mount ID from the event.
+ *
+ * The point is only flagged MNT_DELETE when no other mount is stacked
+ * on it, the marks of the ones below are still in place.
+ * Returns 1 if a watched mount went away and 0 otherwise.
+ */
+int mlist_detach(mlist *m, long long id)
+{
+	mnode *n = id_lookup(m, id);
+
+	if (n == NULL)
+		return 0;
+
+	drop_id(m, n, id);
+	if (n->nids == 0)
+		n->status = MNT_DELETE;
+	else
+		n->mnt_id = n->new_id = n->ids[n->nids - 1];
+	m->cur = n;
+	return 1;
+}
+
+/*
+ * mlist_resolve - finish a scan by comparing mount IDs.
+ * @m: list updated by mlist_seen.
+ * @added: incremented for each mount that needs a new mark.
+ * @deleted: incremented for each mount that went away.
+ *
+ * A mount point whose mount ID changed was unmounted and mounted again
+ * since the last scan, so its mark is gone and it is flagged MNT_ADD.
+ */
+void mlist_resolve(mlist *m, unsigned int *added, unsigned int *deleted)
+{
+	mnode *n;
+
+	for (n = m->head; n; n = n->next) {
+		if (n->status == MNT_NO_CHANGE && n->new_id != n->mnt_id)
+			n->status = MNT_ADD;
+		n->mnt_id = n->new_id;
+		if (n->status == MNT_ADD)
+			(*added)++;
+		else if (n->status == MNT_DELETE)
+			(*deleted)++;
+	}
+}
+
+/*
+ * mlist_remove - unlink and free a node.
+ * @m: list holding @n.
+ * @prev: node before @n or NULL when @n is the head.
+ * @n: node to remove.
+ * Returns the node that followed @n.
+ */
+mnode *mlist_remove(mlist *m, mnode *prev, mnode *n)
+{
+	mnode *next = n->next, **h;
+
+	h = &m->buckets[hash_path(n->path) & (m->nbuckets - 1)];
+	while (*h != n)
+		h = &(*h)->hnext;
+	*h = n->hnext;
+
+	if (prev)
+		prev->next = next;
+	else
+		m->head = next;
+	if (m->tail == n)
+		m->tail = prev;
+	if (m->cur == n)
+		m->cur = next;
+	m->count--;
+
+	clear_ids(m, n);
+	free(n->ids);
+	free((void *)n->path);
+	free((void *)n);
+	return next;
+}
+
 void mlist_clear(mlist *m)
 {
 	mnode* nextnode;
@@ -131,11 +474,163 @@ void mlist_clear(mlist *m)
 	current = m->head;
 	while (current) {
 		nextnode=current->next;
+		free(current->ids);
 		free((void *)current->path);
 		free((void *)current);
 		current=nextnode;
 	}
-	m->head = NULL;
-	m->cur = NULL;
+	free(m->buckets);
+	for (unsigned int i = 0; i < m->nid_buckets; i++) {
+		midx *e = m->id_buckets[i], *next;
+
+		for (; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	free(m->id_buckets);
+	mlist_create(m);
+}
+
+// Copy one space delimited field, returns the end of it or NULL
+static const char *copy_field(const char *p, char *out, size_t len)
+{
+	size_t n;
+
+	while (*p == ' ')
+		p++;
+	n = strcspn(p, " \n");
+	if (n == 0 || n >= len)
+		return NULL;
+	memcpy(out, p, n);
+	out[n] = '\0';
+	return p + n;
+}
+
+/*
+ * parse_mount_line - extract the mount point and type of a mount table line.
+ * @line: a line of /proc/self/mountinfo or of /proc/mounts.
+ * @point: receives the unescaped mount point.
+ * @point_len: size of @point.
+ * @type: receives the file system type.
+ * @type_len: size of @type.
+ * @id: receives the mount ID, or -1 for the /proc/mounts format.
+ *
+ * mountinfo lines are "<id> <parent> <maj:min> <root> <point> <opts>
+ * [optional fields] - <type> <source> <super opts>".
+ * Returns 1 when the line was parsed and 0 otherwise.
+ */
+int parse_mount_line(const char *line, char *point, size_t point_len,
+		     char *type, size_t type_len, int *id)
+{
+	char device[1025];
+	int mnt_id, parent, len = 0;
+
+	if (sscanf(line, "%d %d %*u:%*u %*s%n", &mnt_id, &parent, &len) == 2 &&
+	    len) {
+		const char *p = copy_field(line + len, point, point_len);
+		const char *sep;
+
+		if (p == NULL || (sep = strstr(p, " - ")) == NULL ||
+		    copy_field(sep + 3, type, type_len) == NULL)
+			return 0;
+		*id = mnt_id;
+	} else {
+		const char *p = copy_field(line, device, sizeof(device));
+
+		if (p == NULL || (p = copy_field(p, point, point_len)) == NULL
+		    || copy_field(p, type, type_len) == NULL)
+			return 0;
+		*id = -1;
+	}
+
+	unescape_shell(point, strlen(point));
+	return 1;
+}
+
+#ifdef USE_MOUNT_EVENTS
+/*
+ * mount_by_id - look up a mount point and type with statmount.
+ * @id: unique mount ID as reported by listmount and fanotify.
+ * @point: receives the mount point.
+ * @point_len: size of @point.
+ * @type: receives the file system type.
+ * @type_len: size of @type.
+ * Returns 1 when found, 0 when the mount is already gone, and -1 on error.
+ */
+int mount_by_id(uint64_t id, char *point, size_t point_len,
+		char *type, size_t type_len)
+{
+	union {
+		struct statmount sm;
+		char buf[PATH_MAX + 1024];
+	} u;
+	struct mnt_id_req req;
+	const char *str;
+
+	memset(&req, 0, sizeof(req));
+	req.size = MNT_ID_REQ_SIZE_VER0;
+	req.mnt_id = id;
+	req.param = STATMOUNT_MNT_POINT | STATMOUNT_FS_TYPE;
+
+	if (syscall(__NR_statmount, &req, &u.sm, sizeof(u), 0) < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	if ((u.sm.mask & (STATMOUNT_MNT_POINT | STATMOUNT_FS_TYPE)) !=
+	    (STATMOUNT_MNT_POINT | STATMOUNT_FS_TYPE))
+		return -1;
+
+	str = u.sm.str + u.sm.mnt_point;
+	if (strlen(str) >= point_len)
+		return -1;
+	strcpy(point, str);
+
+	str = u.sm.str + u.sm.fs_type;
+	if (strlen(str) >= type_len)
+		return -1;
+	strcpy(type, str);
+
+	return 1;
 }
 
+/*
+ * list_mounts - get the unique IDs of the mounts in our namespace.
+ * @ids: receives a malloc'd array that the caller frees.
+ * Returns the number of IDs or -1 on error.
+ */
+long list_mounts(uint64_t **ids)
+{
+	struct mnt_id_req req;
+	size_t size = 256;
+	long count = 0;
+
+	*ids = NULL;
+	memset(&req, 0, sizeof(req));
+	req.size = MNT_ID_REQ_SIZE_VER0;
+	req.mnt_id = LSMT_ROOT;
+
+	while (1) {
+		uint64_t *tmp = realloc(*ids, size * sizeof(uint64_t));
+		long rc;
+
+		if (tmp == NULL)
+			goto err;
+		*ids = tmp;
+
+		// param is the last ID returned, listmount continues after it
+		rc = syscall(__NR_listmount, &req, *ids + count,
+			     size - count, 0);
+		if (rc < 0)
+			goto err;
+		count += rc;
+		if ((size_t)count < size)
+			return count;
+		req.param = (*ids)[count - 1];
+		size *= 2;
+	}
+err:
+	free(*ids);
+	*ids = NULL;
+	return -1;
+}
+#endif
@@ -25,17 +25,50 @@
 #ifndef MOUNTS_HEADER
 #define MOUNTS_HEADER
 
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Mount notification needs fanotify mount events (Linux 6.14) and
+ * listmount/statmount (Linux 6.8). Without them the mount table is
+ * rescanned whenever it changes.
+ */
+#if defined HAVE_DECL_FAN_MNT_ATTACH && HAVE_DECL_FAN_MNT_ATTACH != 0 && \
+    defined HAVE_DECL_LSMT_ROOT && HAVE_DECL_LSMT_ROOT != 0
+#define USE_MOUNT_EVENTS 1
+#endif
+
 typedef enum { MNT_NO_CHANGE, MNT_ADD, MNT_DELETE } change_t;
 
 typedef struct _mnode{
 	const char *path;
 	change_t status;
+	long long mnt_id;     // ID of the mount on top, -1 if unknown
+	long long new_id;     // Top mount ID seen by the scan in progress
+	long long *ids;       // IDs of the mounts stacked here, bottom first
+	unsigned int nids;    // Number of stacked mounts
+	unsigned int ids_size;
+	unsigned int seen;    // Mounts the scan in progress found here
 	struct _mnode *next;  // Next node pointer
+	struct _mnode *hnext; // Next node in the same hash bucket
 } mnode;
 
+typedef struct _midx {
+	long long id;
+	mnode *node;
+	struct _midx *next;
+} midx;
+
 typedef struct {
 	mnode *head;          // List head
 	mnode *cur;           // Pointer to current node
+	mnode *tail;          // Last node
+	mnode **buckets;      // Hash index of the nodes by path
+	unsigned int nbuckets;
+	unsigned int count;   // Number of nodes
+	midx **id_buckets;    // Hash index of the nodes by mount ID
+	unsigned int nid_buckets;
+	unsigned int id_count;
 } mlist;
 
 void mlist_create(mlist *m);
@@ -44,6 +77,19 @@ const char *mlist_next(mlist *m);
 void mlist_mark_all_deleted(mlist *l);
 int mlist_find(mlist *m, const char *p);
 int mlist_append(mlist *m, const char *p);
+int mlist_seen(mlist *m, const char *p, long long id);
+int mlist_attach(mlist *m, const char *p, long long id);
+int mlist_detach(mlist *m, long long id);
+void mlist_resolve(mlist *m, unsigned int *added, unsigned int *deleted);
+mnode *mlist_remove(mlist *m, mnode *prev, mnode *n);
 void mlist_clear(mlist *m);
 
+int parse_mount_line(const char *line, char *point, size_t point_len,
+		     char *type, size_t type_len, int *id);
+#ifdef USE_MOUNT_EVENTS
+int mount_by_id(uint64_t id, char *point, size_t point_len,
+		char *type, size_t type_len);
+long list_mounts(uint64_t **ids);
+#endif
+
 #endif
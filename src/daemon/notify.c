@@ -32,6 +32,12 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/timerfd.h>
 #include <stdbool.h>
@@ -42,10 +48,20 @@
 #include "event.h"
 #include "message.h"
 #include "queue.h"
+#include "defer.h"
+#include "reply-cache.h"
 #include "mounts.h"
+#include "coalesce.h"
 #include "paths.h"
+#include "realtime.h"
 
+// Read buffer limits in events, it starts small and adapts to the load
 #define FANOTIFY_BUFFER_SIZE 8192
+#define FANOTIFY_BUFFER_MIN 256
+// Events handled per wakeup before going back to poll
+#define FANOTIFY_READ_BUDGET 16384
+// Quiet wakeups in a row before the read buffer shrinks
+#define FANOTIFY_SHRINK_WAKEUPS 64
 
 // External variables
 extern atomic_bool stop, run_stats;
@@ -55,20 +71,60 @@ extern conf_t config;
 static pid_t our_pid;
 static struct queue *q = NULL;
 static pthread_t decision_thread;
-static pthread_t deadmans_switch_thread;
-static atomic_bool alive = true;
+// Posted by the decision thread once the queue can take events
+static sem_t decision_ready;
+static pthread_t watchdog_thread;
+static pthread_t reader_thread;
+static int reader_wake_fd = -1;
+static int reader_cpu = -1;
+static unsigned int reader_spin;
+static atomic_ulong rd_spin_hits;
+// Backpressure state, bp_fd is -1 when disabled
+static int bp_fd = -1;
+static unsigned int bp_high, bp_low;
+static atomic_bool throttled;
+static uint64_t throttle_start;
+static atomic_ulong bp_throttles;
+static atomic_ullong bp_throttled_usec;
+// Watchdog state, inflight_since is 0 when no decision is running
+static unsigned int wd_degrade, wd_kill, wd_fallback;
+static atomic_bool degraded;
+static atomic_ullong inflight_since;
+static atomic_ullong wd_max_age, wd_max_stall;
+static atomic_ulong wd_degrades;
+static atomic_ulong wd_fallbacks;
+// Replies the reader reuses while degraded, NULL without a watchdog
+static struct reply_cache *replies;
+// Subjects of permissive events answered before evaluation
+static struct defer_pool *deferred;
+// Events answered with the decision of an identical one
+static atomic_ulong coalesced;
+// Real time settings of the decision thread
+static unsigned int decision_priority, lock_memory;
+static int decision_cpu = -1;
 static int fd = -1;
 static int rpt_timer_fd = -1;
 static uint64_t mask;
 static unsigned int mark_flag;
 static unsigned int rpt_interval;
+static struct fanotify_event_metadata *rbuf;
+static size_t rbuf_entries;
+static unsigned int rd_small_wakeups;
+// Written by the reader, read by the report
+static atomic_ulong rd_wakeups, rd_reads, rd_events, rd_budget_hits;
 
 // External functions
 void do_stat_report(FILE *f, int shutdown);
 
 // Local functions
+static int resize_read_buffer(size_t entries);
 static void *decision_thread_main(void *arg);
-static void *deadmans_switch_thread_main(void *arg);
+static void *watchdog_thread_main(void *arg);
+static void *reader_thread_main(void *arg);
+static unsigned int drain_events(void);
+static uint64_t now_usec(void);
+static uint64_t oldest_event_age(uint64_t now);
+static void maybe_resume_reading(void);
 
 /*
  * ignore_mounts_configured - determine whether ignore_mounts has entries.
@@ -89,13 +145,55 @@ static int ignore_mounts_configured(const char *list)
 	return 0;
 }
 
+/*
+ * init_backpressure - turn the watermark percentages into queue lengths
+ * and create the eventfd the decision thread uses to resume reading.
+ */
+static void init_backpressure(const conf_t *conf)
+{
+	unsigned int low = conf->q_low_watermark;
+
+	if (low >= conf->q_high_watermark) {
+		msg(LOG_WARNING,
+		    "q_low_watermark must be below q_high_watermark - using %u",
+		    conf->q_high_watermark / 2);
+		low = conf->q_high_watermark / 2;
+	}
+	bp_high = (unsigned long)conf->q_size * conf->q_high_watermark / 100;
+	if (bp_high == 0)
+		bp_high = 1;
+	bp_low = (unsigned long)conf->q_size * low / 100;
+	if (bp_low >= bp_high)
+		bp_low = bp_high - 1;
+
+	bp_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (bp_fd < 0) {
+		msg(LOG_ERR, "Failed creating backpressure eventfd (%s)",
+		    strerror(errno));
+		exit(1);
+	}
+	msg(LOG_DEBUG, "Queue backpressure between %u and %u events",
+	    bp_low, bp_high);
+}
+
+/*
+ * init_fanotify - open the fanotify fd, start the worker threads and mark
+ * the mount points.
+ * @conf: daemon configuration.
+ * @m: mount points to watch.
+ *
+ * When reader_thread is enabled, a dedicated thread owns reading the
+ * fanotify fd and -1 is returned so the caller's poll loop leaves it
+ * alone. Otherwise the fanotify fd is returned and the caller must call
+ * handle_events when it becomes readable.
+ */
 int init_fanotify(const conf_t *conf, mlist *m)
 {
 	const char *path;
 	int ignore_mounts_enabled;
 
 	// Get inter-thread queue ready
-	q = q_open(conf->q_size);
+	q = q_open(conf->q_size, conf->q_exec_weight);
 	if (q == NULL) {
 		msg(LOG_ERR, "Failed setting up queue (%s)",
 			strerror(errno));
@@ -103,6 +201,19 @@ int init_fanotify(const conf_t *conf, mlist *m)
 	}
 	our_pid = getpid();
 
+	// A deferred event holds its slot while queued or being decided
+	deferred = defer_open(conf->q_size + COALESCE_BATCH);
+	if (deferred == NULL) {
+		msg(LOG_ERR, "Failed setting up deferred evaluations (%s)",
+			strerror(errno));
+		exit(1);
+	}
+
+	if (resize_read_buffer(FANOTIFY_BUFFER_MIN)) {
+		msg(LOG_ERR, "Failed allocating fanotify read buffer");
+		exit(1);
+	}
+
 	fd = fanotify_init(FAN_CLOEXEC | FAN_CLASS_CONTENT |
 #ifdef USE_AUDIT
 				FAN_ENABLE_AUDIT |
@@ -129,8 +240,32 @@ int init_fanotify(const conf_t *conf, mlist *m)
 		exit(1);
 	}
 
+	if (conf->q_backpressure)
+		init_backpressure(conf);
+
+	wd_degrade = conf->watchdog_degrade;
+	wd_kill = conf->watchdog_kill;
+	wd_fallback = conf->watchdog_fallback;
+	if (wd_degrade) {
+		replies = reply_cache_open();
+		if (replies == NULL) {
+			msg(LOG_ERR, "Failed allocating the reply cache");
+			exit(1);
+		}
+	}
+
 	// Start decision thread so its ready when first event comes
 	rpt_interval = conf->report_interval;
+	decision_priority = conf->decision_priority;
+	decision_cpu = conf->decision_cpu;
+	lock_memory = conf->lock_memory;
+	if (sem_init(&decision_ready, 0, 0)) {
+		msg(LOG_ERR, "Failed to set up decision thread (%s)",
+			strerror(errno));
+		close(fd);
+		q_close(q);
+		exit(1);
+	}
 	int rc = pthread_create(&decision_thread, NULL,
 				decision_thread_main, NULL);
 	if (rc) {
@@ -141,10 +276,14 @@ int init_fanotify(const conf_t *conf, mlist *m)
 		exit(1);
 	}
 
-	rc = pthread_create(&deadmans_switch_thread, NULL,
-			    deadmans_switch_thread_main, NULL);
+	// No event can be queued before it placed the queue
+	while (sem_wait(&decision_ready) && errno == EINTR)
+		;
+	sem_destroy(&decision_ready);
+
+	rc = pthread_create(&watchdog_thread, NULL, watchdog_thread_main, NULL);
 	if (rc) {
-		msg(LOG_ERR, "Failed to create deadman's switch thread (%s)",
+		msg(LOG_ERR, "Failed to create watchdog thread (%s)",
 		    strerror(rc));
 		atomic_store(&stop, true);
 		q_shutdown(q);
@@ -203,6 +342,25 @@ retry_mark:
 		path = mlist_next(m);
 	}
 
+	if (conf->reader_thread) {
+		reader_cpu = conf->reader_cpu;
+		reader_spin = conf->reader_spin;
+		reader_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (reader_wake_fd < 0) {
+			msg(LOG_ERR, "Failed creating reader eventfd (%s)",
+			    strerror(errno));
+			exit(1);
+		}
+		rc = pthread_create(&reader_thread, NULL,
+				    reader_thread_main, NULL);
+		if (rc) {
+			msg(LOG_ERR, "Failed to create reader thread (%s)",
+			    strerror(rc));
+			exit(1);
+		}
+		return -1;
+	}
+
 	return fd;
 }
 
@@ -215,7 +373,7 @@ void fanotify_update(mlist *m)
 	if (m->head == NULL)
 		return;
 
-	mnode *cur = m->head, *prev = NULL, *temp;
+	mnode *cur = m->head, *prev = NULL;
 
 	while (cur) {
 		if (cur->status == MNT_ADD) {
@@ -229,22 +387,13 @@ void fanotify_update(mlist *m)
 				msg(LOG_DEBUG, "Added %s mount point",
 					cur->path);
 			}
+			cur->status = MNT_NO_CHANGE;
 		}
 
 		// Now remove the deleted mount point
 		if (cur->status == MNT_DELETE) {
 			msg(LOG_DEBUG, "Deleted %s mount point", cur->path);
-			temp = cur->next;
-
-			if (cur == m->head)
-				m->head = temp;
-			else
-				prev->next = temp;
-
-			free((void *)cur->path);
-			free((void *)cur);
-
-			cur = temp;
+			cur = mlist_remove(m, prev, cur);
 		} else {
 			prev = cur;
 			cur = cur->next;
@@ -253,6 +402,105 @@ void fanotify_update(mlist *m)
 	m->cur = m->head;  // Leave cur pointing to something valid
 }
 
+/*
+ * init_mount_events - get notified of mounts attached or detached in our
+ * mount namespace.
+ * Returns the notification descriptor, or -1 when the kernel cannot
+ * report mount events and the mount table has to be rescanned instead.
+ */
+int init_mount_events(void)
+{
+#ifdef USE_MOUNT_EVENTS
+	int mfd, ns;
+
+	mfd = fanotify_init(FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_MNT,
+			    O_RDONLY);
+	if (mfd < 0) {
+		msg(LOG_DEBUG, "Mount events are not available (%s)",
+		    strerror(errno));
+		return -1;
+	}
+
+	ns = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+	if (ns < 0 || fanotify_mark(mfd, FAN_MARK_ADD | FAN_MARK_MNTNS,
+			FAN_MNT_ATTACH | FAN_MNT_DETACH, ns, NULL) == -1) {
+		msg(LOG_DEBUG, "Cannot watch mount namespace (%s)",
+		    strerror(errno));
+		if (ns >= 0)
+			close(ns);
+		close(mfd);
+		return -1;
+	}
+	close(ns);
+
+	return mfd;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * read_mount_events - drain the mount notification descriptor.
+ * @mfd: descriptor from init_mount_events.
+ * @cb: called with the event mask and unique mount ID of each event.
+ * Returns 0 when all events were handed to @cb, 1 if the kernel queue
+ * overflowed and the mounts have to be rescanned, and -1 on error.
+ */
+int read_mount_events(int mfd, void (*cb)(uint64_t mask, uint64_t id))
+{
+#ifdef USE_MOUNT_EVENTS
+	char buf[FANOTIFY_BUFFER_SIZE]
+		__attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+	int rc = 0;
+
+	while (1) {
+		const struct fanotify_event_metadata *md;
+		ssize_t len = read(mfd, buf, sizeof(buf));
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return rc;
+			msg(LOG_ERR, "Error reading mount events (%s)",
+			    strerror(errno));
+			return -1;
+		}
+		if (len == 0)
+			return rc;
+
+		md = (const struct fanotify_event_metadata *)buf;
+		while (FAN_EVENT_OK(md, len)) {
+			const char *info = (const char *)md + md->metadata_len;
+			const char *end = (const char *)md + md->event_len;
+
+			if (md->mask & FAN_Q_OVERFLOW)
+				rc = 1;
+
+			// The mount ID comes in an info record
+			while (info + sizeof(struct fanotify_event_info_header)
+			       <= end) {
+				const struct fanotify_event_info_header *hdr =
+				  (const struct fanotify_event_info_header *)info;
+
+				if (hdr->len == 0 || info + hdr->len > end)
+					break;
+				if (hdr->info_type == FAN_EVENT_INFO_TYPE_MNT) {
+					const struct fanotify_event_info_mnt *mi =
+					  (const struct fanotify_event_info_mnt *)hdr;
+
+					cb(md->mask, mi->mnt_id);
+				}
+				info += hdr->len;
+			}
+			md = FAN_EVENT_NEXT(md, len);
+		}
+	}
+#else
+	return -1;
+#endif
+}
+
 void unmark_fanotify(mlist *m)
 {
 	const char *path = mlist_first(m);
@@ -271,15 +519,37 @@ void shutdown_fanotify(mlist *m)
 {
 	unmark_fanotify(m);
 
+	// Stop the reader before the decision side goes away
+	if (reader_wake_fd >= 0) {
+		uint64_t one = 1;
+
+		if (write(reader_wake_fd, &one, sizeof(one)) < 0)
+			msg(LOG_WARNING, "Failed waking reader thread (%s)",
+			    strerror(errno));
+		pthread_join(reader_thread, NULL);
+		close(reader_wake_fd);
+		reader_wake_fd = -1;
+	}
+
 	// End the thread
 	q_shutdown(q);
 	pthread_join(decision_thread, NULL);
-	pthread_join(deadmans_switch_thread, NULL);
+	pthread_join(watchdog_thread, NULL);
 
 	// Clean up
 	q_close(q);
+	defer_close(deferred);
+	deferred = NULL;
+	reply_cache_close(replies);
+	replies = NULL;
+	if (bp_fd >= 0) {
+		close(bp_fd);
+		bp_fd = -1;
+	}
 	close(rpt_timer_fd);
 	close(fd);
+	free(rbuf);
+	rbuf = NULL;
 
 	// Report results
 	msg(LOG_DEBUG, "Allowed accesses: %lu", getAllowed());
@@ -299,11 +569,77 @@ void decision_report(FILE *f)
 	// Report results
 	fprintf(f, "Allowed accesses: %lu\n", getAllowed());
 	fprintf(f, "Denied accesses: %lu\n", getDenied());
+
+	// Reader batching
+	unsigned long wakeups = atomic_load(&rd_wakeups);
+	unsigned long reads = atomic_load(&rd_reads);
+	fprintf(f, "Fanotify reads per wakeup: %.2f\n",
+		wakeups ? (double)reads / wakeups : 0.0);
+	fprintf(f, "Fanotify events per read: %.2f\n",
+		reads ? (double)atomic_load(&rd_events) / reads : 0.0);
+	fprintf(f, "Fanotify read budget exhausted: %lu\n",
+		atomic_load(&rd_budget_hits));
+	fprintf(f, "Fanotify read buffer: %zu events\n", rbuf_entries);
+	if (reader_wake_fd >= 0 && reader_spin)
+		fprintf(f, "Fanotify reader spin hits: %lu\n",
+			atomic_load(&rd_spin_hits));
+
+	if (config.permissive_defer)
+		defer_report(deferred, f);
+
+	fprintf(f, "Coalesced events: %lu\n", atomic_load(&coalesced));
+	fprintf(f, "Decision stage: %s\n", policy_stage_name(policy_stage()));
+	fprintf(f, "Watchdog oldest event age: %llu ms\n",
+		(unsigned long long)oldest_event_age(now_usec()) / 1000);
+	fprintf(f, "Watchdog max event age: %llu ms\n",
+		atomic_load(&wd_max_age) / 1000);
+	fprintf(f, "Watchdog max stall: %llu ms\n",
+		atomic_load(&wd_max_stall) / 1000);
+	fprintf(f, "Watchdog degraded: %lu\n", atomic_load(&wd_degrades));
+	if (replies)
+		reply_cache_report(replies, f);
+	fprintf(f, "Watchdog fallback replies: %lu\n",
+		atomic_load(&wd_fallbacks));
+
+	if (bp_fd >= 0) {
+		unsigned long long usec = atomic_load(&bp_throttled_usec);
+
+		fprintf(f, "Backpressure throttles: %lu\n",
+			atomic_load(&bp_throttles));
+		fprintf(f, "Backpressure time throttled: %llu ms\n",
+			usec / 1000);
+		fprintf(f, "Backpressure throttled now: %s\n",
+			atomic_load(&throttled) ? "yes" : "no");
+	}
 }
 
 
-static void *deadmans_switch_thread_main(void *arg)
+// Age in microseconds of the oldest event being decided or queued
+static uint64_t oldest_event_age(uint64_t now)
 {
+	uint64_t since = atomic_load(&inflight_since);
+	uint64_t queued = q_oldest_stamp(q) / 1000;
+
+	if (queued && (since == 0 || queued < since))
+		since = queued;
+	return since && now > since ? now - since : 0;
+}
+
+/*
+ * watchdog_thread_main - keep an eye on the decision thread.
+ *
+ * Once a second, look at how old the oldest pending event is and whether
+ * policy_progress() moved. A decision that takes long but keeps moving,
+ * like hashing a huge file, is left alone. When events are pending and
+ * nothing moved for wd_degrade seconds, the reader answers new events it
+ * has a recent reply for instead of piling them up behind the stuck one,
+ * see answer_degraded(). After wd_kill seconds the process is killed so
+ * the kernel releases every pending event.
+ */
+static void *watchdog_thread_main(void *arg)
+{
+	unsigned long progress, last = policy_progress();
+	uint64_t last_move = now_usec();
 	sigset_t sigs;
 
 	/* This is a worker thread. Don't handle external signals. */
@@ -315,20 +651,61 @@ static void *deadmans_switch_thread_main(void *arg)
 	sigaddset(&sigs, SIGQUIT);
 	pthread_sigmask(SIG_SETMASK, &sigs, NULL);
 
-	do {
-		// Are you alive decision thread? The idea of triggering
-		// on 5 is that if it's less than 5 it's still alive and
-		// processing, although maybe running behind sometimes.
-		// But if we are over 5, we are losing the battle.
-		if (!alive && !stop && q_queue_length(q) > 5) {
+	while (!stop) {
+		sleep(1);
+
+		uint64_t now = now_usec();
+		uint64_t age = oldest_event_age(now);
+
+		if (age > atomic_load(&wd_max_age))
+			atomic_store(&wd_max_age, age);
+
+		progress = policy_progress();
+		if (progress != last || age == 0) {
+			last = progress;
+			last_move = now;
+			if (atomic_exchange(&degraded, false))
+				msg(LOG_WARNING,
+			    "Decision thread is making progress, leaving degraded mode");
+			continue;
+		}
+
+		uint64_t stall = now - last_move;
+		if (stall > atomic_load(&wd_max_stall))
+			atomic_store(&wd_max_stall, stall);
+
+		if (wd_kill && stall >= wd_kill * 1000000ULL && !stop) {
 			msg(LOG_ERR,
-				"Deadman's switch activated...killing process");
+	"Watchdog: no decision progress for %llus in stage %s, oldest event %llums old...killing process",
+			    (unsigned long long)stall / 1000000,
+			    policy_stage_name(policy_stage()),
+			    (unsigned long long)age / 1000);
 			raise(SIGKILL);
 		}
-		// OK, prove it again.
-		alive = false;
-		sleep(3);
-	} while (!stop);
+
+		if (wd_degrade && stall >= wd_degrade * 1000000ULL &&
+		    !atomic_load(&degraded)) {
+			atomic_fetch_add(&wd_degrades, 1);
+			msg(LOG_ERR,
+	"Watchdog: no decision progress for %llus in stage %s, answering new events from cache, others %s",
+			    (unsigned long long)stall / 1000000,
+			    policy_stage_name(policy_stage()),
+			    config.permissive || wd_fallback == FAN_ALLOW ?
+			    "allowed" : wd_fallback == FAN_DENY ? "denied" :
+			    "queued");
+			atomic_store(&degraded, true);
+
+			// A throttled reader must pick up again to answer
+			if (bp_fd >= 0 && atomic_exchange(&throttled, false)) {
+				uint64_t one = 1;
+
+				if (write(bp_fd, &one, sizeof(one)) < 0)
+					msg(LOG_ERR,
+					    "Failed to resume reading events (%s)",
+					    strerror(errno));
+			}
+		}
+	}
 	return NULL;
 }
 
@@ -371,6 +748,62 @@ static void rpt_write(void)
 	}
 }
 
+// Evaluate one event of a batch and answer it
+static int decide_event(const struct fanotify_event_metadata *m)
+{
+	int reply;
+
+	if (m->reserved & EVENT_REPLIED) {
+		int slot = m->event_len;
+
+		reply = make_policy_decision(m, defer_snapshot(deferred, slot),
+					     fd, mask);
+		defer_done(deferred, slot);
+	} else if (replies) {
+		// Keep the reply for the reader in case we stall later. The
+		// reply closes the fd, so look at the file first.
+		unsigned int epoch = reply_cache_epoch();
+		struct stat sb;
+		int known = fstat(m->fd, &sb) == 0;
+
+		reply = make_policy_decision(m, NULL, fd, mask);
+		if (known && reply >= 0)
+			reply_cache_store(replies, m, m->event_len, epoch,
+					  sb.st_dev, sb.st_ino, reply);
+	} else
+		reply = make_policy_decision(m, NULL, fd, mask);
+	return reply;
+}
+
+static void answer_event(const struct fanotify_event_metadata *m, int reply)
+{
+	reply_event(fd, m, reply, NULL);
+	policy_count_reply(reply);
+}
+
+/*
+ * decide_batch - decide an event and, when coalescing, those queued
+ * behind it. See coalesce.c.
+ * @first: event just taken from the queue.
+ */
+static void decide_batch(const struct fanotify_event_metadata *first)
+{
+	static struct batch_slot batch[COALESCE_BATCH];
+	unsigned int n = 1;
+
+	batch[0].m = *first;
+	batch[0].state = SLOT_NEW;
+	if (config.coalesce_events)
+		while (n < COALESCE_BATCH &&
+		       q_try_dequeue(q, &batch[n].m) == 1)
+			batch[n++].state = SLOT_NEW;
+	if (bp_fd >= 0)
+		maybe_resume_reading();
+
+	atomic_fetch_add(&coalesced,
+			 coalesce_decide(batch, n, decide_event, answer_event));
+}
+
 static void *decision_thread_main(void *arg)
 {
 	sigset_t sigs;
@@ -384,6 +817,25 @@ static void *decision_thread_main(void *arg)
 	sigaddset(&sigs, SIGQUIT);
 	pthread_sigmask(SIG_SETMASK, &sigs, NULL);
 
+	if (decision_priority || decision_cpu >= 0)
+		rt_set_scheduling(decision_priority, decision_cpu);
+
+	// Fault the queue in from here, once pinned, so its pages are on
+	// this thread's NUMA node rather than the reader's. Only then are
+	// its slots free, init_fanotify() waits for that.
+	q_place(q);
+
+	// Keep the allocations of the decision path from faulting. The
+	// heap reserve tunes malloc for the whole process, so it is only
+	// worth it when the memory can be locked afterwards.
+	if (lock_memory && !RT_CAN_LOCK_MEMORY)
+		msg(LOG_WARNING,
+		    "lock_memory needs mlockall MCL_ONFAULT, not locking");
+	else if (lock_memory && rt_reserve_heap(RT_HEAP_RESERVE) == 0 &&
+		 rt_lock_memory() == 0)
+		msg(LOG_DEBUG, "Decision thread memory locked");
+	sem_post(&decision_ready);
+
 	// interval reporting state
 	int rpt_is_stale = 0;
 	struct timespec rpt_timeout;
@@ -460,50 +912,233 @@ static void *decision_thread_main(void *arg)
 			}
 		}
 
-		alive = true;
 		rpt_is_stale = 1;
-		make_policy_decision(&metadata, fd, mask);
+		atomic_store(&inflight_since, now_usec());
+		decide_batch(&metadata);
+		atomic_store(&inflight_since, 0);
 	}
 	msg(LOG_DEBUG, "Exiting decision thread");
 	return NULL;
 }
 
-void handle_events(void)
+/*
+ * Backpressure
+ *
+ * Once the queue reaches bp_high the reader stops reading the fanotify
+ * fd and sets throttled. The kernel keeps the permission events pending
+ * meanwhile. The decision thread clears throttled when the queue has
+ * drained to bp_low and kicks bp_fd so the reader picks up again.
+ * Whichever side flips throttled back to false owns the wakeup. Both
+ * sides store one variable and load the other, so a full fence sits
+ * between the two to avoid missing a resume when the queue drains just
+ * as the reader gives up.
+ */
+static void maybe_resume_reading(void)
 {
-	const struct fanotify_event_metadata *metadata;
-	struct fanotify_event_metadata buf[FANOTIFY_BUFFER_SIZE];
-	ssize_t len = -2;
+	if (!atomic_load(&throttled))
+		return;
+	atomic_thread_fence(memory_order_seq_cst);
+	if (q_queue_length(q) <= bp_low &&
+	    atomic_exchange(&throttled, false)) {
+		uint64_t one = 1;
 
-	while (len < 0) {
-		do {
-			len = read(fd, (void *) buf, sizeof(buf));
-		} while (len == -1 && errno == EINTR && stop == false);
-		if (len == -1 && errno != EAGAIN) {
-			// If we get this, we have no access to the file. We
-			// cannot formulate a reply either to deny it because
-			// we have nothing to work with.
-			msg(LOG_ERR,
-			    "Error receiving fanotify_event (%s)",
+		if (write(bp_fd, &one, sizeof(one)) < 0)
+			msg(LOG_ERR, "Failed to resume reading events (%s)",
 			    strerror(errno));
-			return;
-		}
-		if (stop)
-			return;
 	}
+}
+
+/*
+ * read_room - how many events the next read may return.
+ * Returns 0 after throttling the reader when the queue is at the high
+ * watermark, otherwise the room left below it.
+ */
+static size_t read_room(void)
+{
+	unsigned int len = q_queue_length(q);
+
+	if (atomic_load(&throttled))
+		return 0;
+	if (len < bp_high)
+		return bp_high - len;
+
+	throttle_start = now_usec();
+	atomic_fetch_add(&bp_throttles, 1);
+	atomic_store(&throttled, true);
+	atomic_thread_fence(memory_order_seq_cst);
+	// The queue may have drained before the decision thread saw the flag
+	if (q_queue_length(q) <= bp_low && atomic_exchange(&throttled, false))
+		return bp_high - q_queue_length(q);
+	return 0;
+}
+
+/*
+ * fanotify_throttled - tell the poll loop to leave the fanotify fd alone.
+ */
+bool fanotify_throttled(void)
+{
+	return atomic_load(&throttled);
+}
+
+/*
+ * fanotify_resume_fd - descriptor that becomes readable when reading
+ * events may resume, -1 when backpressure is disabled.
+ */
+int fanotify_resume_fd(void)
+{
+	return reader_wake_fd >= 0 ? -1 : bp_fd;
+}
+
+/*
+ * handle_resume - account for the time spent throttled and read the
+ * events the kernel held meanwhile.
+ */
+void handle_resume(void)
+{
+	uint64_t val;
+
+	if (read(bp_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		msg(LOG_ERR, "Failed reading backpressure eventfd (%s)",
+		    strerror(errno));
+	atomic_fetch_add(&bp_throttled_usec, now_usec() - throttle_start);
+	drain_events();
+}
+
+/*
+ * resize_read_buffer - change the fanotify read buffer size.
+ * @entries: new size in metadata entries.
+ * Returns 0 on success and 1 if the buffer could not be allocated, in
+ * which case the old one is kept.
+ */
+static int resize_read_buffer(size_t entries)
+{
+	struct fanotify_event_metadata *tmp;
+
+	tmp = realloc(rbuf, entries * sizeof(struct fanotify_event_metadata));
+	if (tmp == NULL)
+		return 1;
+	rbuf = tmp;
+	rbuf_entries = entries;
+	return 0;
+}
+
+static inline bool deferring(void)
+{
+	return config.permissive && config.permissive_defer;
+}
+
+/*
+ * defer_event - allow a permissive event now and evaluate it later.
+ * @metadata: event as read from fanotify.
+ *
+ * The subject is snapshotted while the process still waits for the
+ * answer, and the snapshot's slot goes along in the copy's event_len,
+ * which nothing reads once an event left the read buffer. The reply
+ * closes the event's descriptor, so the copy that goes to the decision
+ * thread carries a duplicate for hashing and marks itself as already
+ * answered. If the snapshot or the duplicate cannot be made or the queue
+ * is full, only the evaluation is lost.
+ */
+static void defer_event(const struct fanotify_event_metadata *metadata)
+{
+	struct fanotify_event_metadata copy = *metadata;
+	int slot = defer_capture(deferred, metadata->pid);
+
+	copy.fd = slot < 0 ? -1 : fcntl(metadata->fd, F_DUPFD_CLOEXEC, 0);
+	reply_event(fd, metadata, FAN_ALLOW, NULL);
+	if (slot < 0)
+		return;
+	if (copy.fd < 0) {
+		defer_cancel(deferred, slot);
+		return;
+	}
+
+	copy.reserved |= EVENT_REPLIED;
+	copy.event_len = slot;
+	if (q_enqueue(q, &copy)) {
+		close(copy.fd);
+		defer_cancel(deferred, slot);
+	}
+}
+
+/*
+ * answer_degraded - answer an event while the decision thread is stalled.
+ * @m: event just read.
+ * An identical event decided recently gets the same reply. Any other
+ * gets wd_fallback, or with WATCHDOG_WAIT goes in the queue like it would
+ * have without the watchdog. Without exec events, a process that execs
+ * cannot be told apart from what it was, so nothing is reused.
+ * Returns 1 when the event was answered and 0 when it is to be queued.
+ */
+static int answer_degraded(const struct fanotify_event_metadata *m)
+{
+	struct stat sb;
+	int reply = -1;
+
+	if (replies && (mask & FAN_OPEN_EXEC_PERM) && fstat(m->fd, &sb) == 0)
+		reply = reply_cache_lookup(replies, m, sb.st_dev, sb.st_ino);
+	if (reply < 0) {
+		if (wd_fallback == WATCHDOG_WAIT && !config.permissive)
+			return 0;
+		atomic_fetch_add_explicit(&wd_fallbacks, 1,
+					  memory_order_relaxed);
+		reply = config.permissive ? FAN_ALLOW : (int)wd_fallback;
+	} else
+		policy_count_reply(reply);
+	reply_event(fd, m, reply, NULL);
+	return 1;
+}
+
+/*
+ * enqueue_event - queue an event for the decision thread.
+ * @m: event just read.
+ * With a reply cache, the exec count of the process travels in event_len
+ * so the reply can be stored with it. See reply-cache.c.
+ * Returns 0 on success and -1 when the queue is full.
+ */
+static int enqueue_event(const struct fanotify_event_metadata *m)
+{
+	struct fanotify_event_metadata copy;
+
+	if (replies == NULL)
+		return q_enqueue(q, m);
+	copy = *m;
+	copy.event_len = reply_cache_stamp(replies, m->pid);
+	return q_enqueue(q, &copy);
+}
+
+/*
+ * process_events - reply to or enqueue the events of one read.
+ * @buf: events returned by read.
+ * @len: number of bytes read.
+ * Returns the number of events handled.
+ */
+static unsigned int process_events(const struct fanotify_event_metadata *buf,
+				   ssize_t len)
+{
+	const struct fanotify_event_metadata *metadata = buf;
+	unsigned int count = 0;
 
-	metadata = (const struct fanotify_event_metadata *)buf;
 	while (FAN_EVENT_OK(metadata, len)) {
 		if (metadata->vers != FANOTIFY_METADATA_VERSION) {
 			msg(LOG_ERR, "Mismatch of fanotify metadata version");
 			exit(1);
 		}
 
+		count++;
 		if (metadata->fd >= 0) {
 			if (metadata->mask & mask) {
 				if (metadata->pid == our_pid)
 					reply_event(fd, metadata, FAN_ALLOW,
 						    NULL);
-				else if (q_enqueue(q, metadata)) {
+				else if (deferring())
+					defer_event(metadata);
+				// Decision thread is stuck, answer what
+				// we can without queueing behind it
+				else if ((!atomic_load_explicit(&degraded,
+						memory_order_relaxed) ||
+					  !answer_degraded(metadata)) &&
+					 enqueue_event(metadata)) {
 					msg(LOG_ERR,
 				"Failed to enqueue event for PID %d: "
 				"queue is full, please consider tuning q_size "
@@ -514,6 +1149,13 @@ void handle_events(void)
 					reply_event(fd, metadata, decision,
 						    NULL);
 				}
+
+				// Replies stored before an exec no longer
+				// hold for the process
+				if (replies &&
+				    (metadata->mask & FAN_OPEN_EXEC_PERM))
+					reply_cache_exec(replies,
+							 metadata->pid);
 			} else {
 				// This should never happen. Reply with deny
 				// which releases the descriptor and kernel
@@ -523,5 +1165,189 @@ void handle_events(void)
 		}
 		metadata = FAN_EVENT_NEXT(metadata, len);
 	}
+
+	return count;
 }
 
+/*
+ * handle_events - read and dispatch fanotify events until the fd drains.
+ *
+ * Under load the kernel usually has more events queued by the time a
+ * batch is dispatched, so keep reading until EAGAIN rather than paying a
+ * poll round trip per batch. FANOTIFY_READ_BUDGET bounds one wakeup so
+ * mount changes and signals still get serviced. The buffer doubles when
+ * a read fills it and halves after a run of wakeups that used less than
+ * a quarter of it.
+ */
+void handle_events(void)
+{
+	drain_events();
+}
+
+/*
+ * drain_events - body of handle_events.
+ * Returns the number of events handled so the reader thread can tell
+ * whether spinning is paying off.
+ */
+static unsigned int drain_events(void)
+{
+	unsigned int handled = 0;
+	unsigned int budget = FANOTIFY_READ_BUDGET;
+	size_t bytes, peak = 0;
+	ssize_t len;
+
+	while (budget && !stop) {
+		size_t entries = rbuf_entries;
+
+		// Deferred events never wait, they just lose the evaluation.
+		// Neither do those read while degraded, unless misses wait.
+		if (bp_fd >= 0 && !deferring() &&
+		    !(atomic_load(&degraded) &&
+		      (wd_fallback != WATCHDOG_WAIT || config.permissive))) {
+			size_t room = read_room();
+
+			if (room == 0)
+				break;
+			if (room < entries)
+				entries = room;
+		}
+		bytes = entries * sizeof(struct fanotify_event_metadata);
+		len = read(fd, (void *) rbuf, bytes);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			// If we get this, we have no access to the file. We
+			// cannot formulate a reply either to deny it because
+			// we have nothing to work with.
+			msg(LOG_ERR,
+			    "Error receiving fanotify_event (%s)",
+			    strerror(errno));
+			break;
+		}
+
+		atomic_fetch_add_explicit(&rd_reads, 1, memory_order_relaxed);
+		if ((size_t)len > peak)
+			peak = len;
+
+		unsigned int count = process_events(rbuf, len);
+		atomic_fetch_add_explicit(&rd_events, count,
+					  memory_order_relaxed);
+		handled += count;
+		budget = count >= budget ? 0 : budget - count;
+
+		// A full buffer means the kernel had more to give us
+		if ((size_t)len == bytes && entries == rbuf_entries &&
+		    rbuf_entries < FANOTIFY_BUFFER_SIZE &&
+		    resize_read_buffer(rbuf_entries * 2) == 0)
+			rd_small_wakeups = 0;
+	}
+	// Empty spins of the reader thread are not wakeups
+	if (handled)
+		atomic_fetch_add_explicit(&rd_wakeups, 1, memory_order_relaxed);
+	if (budget == 0)
+		atomic_fetch_add_explicit(&rd_budget_hits, 1,
+					  memory_order_relaxed);
+
+	// Give memory back after the burst has passed
+	if (peak < rbuf_entries * sizeof(struct fanotify_event_metadata) / 4 &&
+	    rbuf_entries > FANOTIFY_BUFFER_MIN) {
+		if (++rd_small_wakeups >= FANOTIFY_SHRINK_WAKEUPS) {
+			rd_small_wakeups = 0;
+			resize_read_buffer(rbuf_entries / 2);
+		}
+	} else
+		rd_small_wakeups = 0;
+
+	return handled;
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * reader_thread_main - dedicated fanotify reader.
+ *
+ * Reads and enqueues events so that the main thread only deals with
+ * signals, mount changes and reconfiguration. The thread can be pinned
+ * to reader_cpu to keep its cache warm. With reader_spin set, it polls
+ * the non-blocking fd for that many microseconds after the last event
+ * before going to sleep in poll, which trades a CPU for the wakeup
+ * latency of bursts that arrive back to back.
+ */
+static void *reader_thread_main(void *arg)
+{
+	struct pollfd pfd[3];
+	sigset_t sigs;
+
+	/* This is a worker thread. Don't handle external signals. */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGQUIT);
+	pthread_sigmask(SIG_SETMASK, &sigs, NULL);
+
+	if (reader_cpu >= 0) {
+		cpu_set_t set;
+		int rc;
+
+		CPU_ZERO(&set);
+		CPU_SET(reader_cpu, &set);
+		rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (rc)
+			msg(LOG_WARNING, "Cannot pin reader thread to cpu %d (%s)",
+			    reader_cpu, strerror(rc));
+		else
+			msg(LOG_DEBUG, "Reader thread pinned to cpu %d",
+			    reader_cpu);
+	}
+
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = reader_wake_fd;
+	pfd[1].events = POLLIN;
+	pfd[2].fd = bp_fd;
+	pfd[2].events = POLLIN;
+
+	while (!stop) {
+		if (reader_spin) {
+			uint64_t deadline = now_usec() + reader_spin;
+
+			while (!stop && !fanotify_throttled() &&
+			       now_usec() < deadline) {
+				if (drain_events()) {
+					atomic_fetch_add_explicit(&rd_spin_hits, 1,
+						memory_order_relaxed);
+					deadline = now_usec() + reader_spin;
+				} else
+					sched_yield();
+			}
+		}
+
+		pfd[0].fd = fanotify_throttled() ? -1 : fd;
+		int rc = poll(pfd, 3, -1);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			msg(LOG_ERR, "Reader thread poll error (%s)",
+			    strerror(errno));
+			break;
+		}
+		if (pfd[1].revents & POLLIN)
+			break;
+		if (pfd[2].revents & POLLIN)
+			handle_resume();
+		if (pfd[0].revents & POLLIN)
+			drain_events();
+	}
+
+	return NULL;
+}
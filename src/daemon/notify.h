@@ -26,15 +26,21 @@
 #define NOTIFY_HEADER
 
 #include <stdio.h>
+#include <stdbool.h>
 #include "conf.h"
 #include "mounts.h"
 
 int init_fanotify(const conf_t *config, mlist *m);
 void fanotify_update(mlist *m);
+int init_mount_events(void);
+int read_mount_events(int mfd, void (*cb)(uint64_t mask, uint64_t id));
 void unmark_fanotify(mlist *m);
 void shutdown_fanotify(mlist *m);
 void decision_report(FILE *f);
 void handle_events(void);
+bool fanotify_throttled(void);
+int fanotify_resume_fd(void);
+void handle_resume(void);
 void nudge_queue(void);
 
 #endif
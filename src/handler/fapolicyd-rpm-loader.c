@@ -56,6 +56,7 @@ conf_t config;				// Library needs this
 int do_rpm_init_backend(void);
 int do_rpm_load_list(conf_t * conf, int memfd);
 int do_rpm_destroy_backend(void);
+void do_rpm_set_options(const char *root, const char *cache, int incremental);
 
 extern backend rpm_backend;
 
@@ -65,8 +66,15 @@ int sock_fd = 3; // same number dup2’ed by parent
 int main(int argc, char * const argv[])
 {
 
+	int incremental = 0;
+
 	set_message_mode(MSG_STDERR, DBG_YES);
 
+	// The daemon asks for a change set when its trust database holds
+	// the previous snapshot.
+	if (argc > 1 && strcmp(argv[1], "--incremental") == 0)
+		incremental = 1;
+
 	if (load_daemon_config(&config)) {
 		free_daemon_config(&config);
 		msg(LOG_ERR, "Exiting due to bad configuration");
@@ -79,20 +87,25 @@ int main(int argc, char * const argv[])
 		exit(1);
 	}
 
+	do_rpm_set_options(NULL, RPM_CACHE_FILE, incremental);
 	do_rpm_init_backend();
 	if (do_rpm_load_list(&config, memfd)) {
 		msg(LOG_ERR, "Failed to populate rpm backend snapshot");
 		exit(1);
 	}
 
-	msg(LOG_INFO, "Loaded files %ld", rpm_backend.entries);
+	if (rpm_backend.delta)
+		msg(LOG_INFO, "Changed files %ld", rpm_backend.entries);
+	else
+		msg(LOG_INFO, "Loaded files %ld", rpm_backend.entries);
 
 	fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
 	lseek(memfd, 0, SEEK_SET);            /* rewind – not strictly needed */
 
-	// send the FD
+	// send the FD, the payload tells whether it holds a change set
+	char kind = rpm_backend.delta ? 1 : 0;
 	struct msghdr  _msg = {0};
-	struct iovec   iov = { .iov_base = (char[1]){0}, .iov_len = 1 };
+	struct iovec   iov = { .iov_base = &kind, .iov_len = 1 };
 	union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(int))]; } cmsgbuf;
 
 	_msg.msg_iov = &iov;
@@ -135,6 +135,16 @@ int backend_init(const conf_t *conf)
 	if (backend_create(conf->trust))
 		return 1;
 
+	// Backends dropped from the trust list lose their records on the
+	// next rebuild, so they cannot send a change set when added back.
+	for (long i = 0; compiled[i] != NULL; i++) {
+		backend_entry *be = backend_get_first();
+		while (be && be->backend != compiled[i])
+			be = be->next;
+		if (be == NULL)
+			compiled[i]->synced = 0;
+	}
+
 	for (backend_entry *be = backend_get_first();
 			be != NULL;
 			be = be->next) {
@@ -164,6 +174,7 @@ void backend_close(void)
 			close(be->backend->memfd);
 			be->backend->memfd = -1;
 			be->backend->entries = -1;
+			be->backend->delta = 0;
 		}
 
 		// allow the backend to release any resources
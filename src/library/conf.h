@@ -27,12 +27,21 @@
 #include <pwd.h>
 
 typedef enum { IN_NONE, IN_SIZE, IN_IMA, IN_SHA256 } integrity_t;
+typedef enum { HP_NONE, HP_TRANSPARENT, HP_EXPLICIT } huge_pages_t;
+// watchdog_fallback that queues uncached events, otherwise FAN_ALLOW/DENY
+#define WATCHDOG_WAIT 0
 
 typedef struct conf
 {
 	unsigned int permissive;
+	unsigned int permissive_defer;
 	unsigned int nice_val;
 	unsigned int q_size;
+	unsigned int q_backpressure;
+	unsigned int q_high_watermark;
+	unsigned int q_low_watermark;
+	unsigned int q_exec_weight;
+	unsigned int coalesce_events;
 	uid_t uid;
 	gid_t gid;
 	unsigned int do_stat_report;
@@ -44,10 +53,21 @@ typedef struct conf
 	const char *ignore_mounts;
 	const char *trust;
 	integrity_t integrity;
+	unsigned int digest_index;
 	const char *syslog_format;
 	unsigned int rpm_sha256_only;
 	unsigned int allow_filesystem_mark;
     unsigned int report_interval;
+	unsigned int reader_thread;
+	int reader_cpu;
+	unsigned int reader_spin;
+	unsigned int watchdog_degrade;
+	unsigned int watchdog_kill;
+	unsigned int watchdog_fallback;
+	unsigned int decision_priority;
+	int decision_cpu;
+	unsigned int lock_memory;
+	huge_pages_t huge_pages;
 } conf_t;
 
 #endif
@@ -37,6 +37,8 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <grp.h>
+#include <sched.h>
+#include <sys/fanotify.h>
 #include "paths.h"
 
 /* Local prototypes */
@@ -64,10 +66,22 @@ static int nv_split(char *buf, struct nv_pair *nv);
 static const struct kw_pair *kw_lookup(const char *val);
 static int permissive_parser(const struct nv_pair *nv, int line,
 		conf_t *config);
+static int permissive_defer_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
 static int nice_val_parser(const struct nv_pair *nv, int line,
 		conf_t *config);
 static int q_size_parser(const struct nv_pair *nv, int line,
 		conf_t *config);
+static int q_backpressure_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int q_high_watermark_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int q_low_watermark_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int q_exec_weight_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int coalesce_events_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
 static int uid_parser(const struct nv_pair *nv, int line,
 		conf_t *config);
 static int gid_parser(const struct nv_pair *nv, int line,
@@ -90,6 +104,8 @@ static int trust_parser(const struct nv_pair *nv, int line,
 			   conf_t *config);
 static int integrity_parser(const struct nv_pair *nv, int line,
 		conf_t *config);
+static int digest_index_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
 static int syslog_format_parser(const struct nv_pair *nv, int line,
 		conf_t *config);
 static int rpm_sha256_only_parser(const struct nv_pair *nv, int line,
@@ -98,12 +114,38 @@ static int fs_mark_parser(const struct nv_pair *nv, int line,
 		conf_t *config);
 static int report_interval_parser(const struct nv_pair *nv, int line,
         conf_t *config);
+static int reader_thread_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int reader_cpu_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int reader_spin_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int watchdog_degrade_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int watchdog_kill_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int watchdog_fallback_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int decision_priority_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int decision_cpu_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int lock_memory_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
+static int huge_pages_parser(const struct nv_pair *nv, int line,
+		conf_t *config);
 
 static const struct kw_pair keywords[] =
 {
   {"permissive",	permissive_parser },
+  {"permissive_defer",	permissive_defer_parser },
   {"nice_val",		nice_val_parser },
   {"q_size",		q_size_parser },
+  {"q_backpressure",	q_backpressure_parser },
+  {"q_high_watermark",	q_high_watermark_parser },
+  {"q_low_watermark",	q_low_watermark_parser },
+  {"q_exec_weight",	q_exec_weight_parser },
+  {"coalesce_events",	coalesce_events_parser },
   {"uid",		uid_parser },
   {"gid",		gid_parser },
   {"detailed_report",	detailed_report_parser },
@@ -115,10 +157,21 @@ static const struct kw_pair keywords[] =
   {"ignore_mounts",	ignore_mounts_parser },
   {"trust",		trust_parser },
   {"integrity",		integrity_parser },
+  {"digest_index",	digest_index_parser },
   {"syslog_format",	syslog_format_parser },
   {"rpm_sha256_only", rpm_sha256_only_parser},
   {"allow_filesystem_mark",	fs_mark_parser },
   {"report_interval",	report_interval_parser },
+  {"reader_thread",	reader_thread_parser },
+  {"reader_cpu",	reader_cpu_parser },
+  {"reader_spin",	reader_spin_parser },
+  {"watchdog_degrade",	watchdog_degrade_parser },
+  {"watchdog_kill",	watchdog_kill_parser },
+  {"watchdog_fallback",	watchdog_fallback_parser },
+  {"decision_priority",	decision_priority_parser },
+  {"decision_cpu",	decision_cpu_parser },
+  {"lock_memory",	lock_memory_parser },
+  {"huge_pages",	huge_pages_parser },
   { NULL,		NULL }
 };
 
@@ -128,8 +181,14 @@ static const struct kw_pair keywords[] =
 static void clear_daemon_config(conf_t *config)
 {
 	config->permissive = 0;
+	config->permissive_defer = 0;
 	config->nice_val = 10;
 	config->q_size = 800;
+	config->q_backpressure = 0;
+	config->q_high_watermark = 90;
+	config->q_low_watermark = 50;
+	config->q_exec_weight = 0;
+	config->coalesce_events = 0;
 	config->uid = 0;
 	config->gid = 0;
 	config->do_stat_report = 1;
@@ -145,11 +204,22 @@ static void clear_daemon_config(conf_t *config)
 	config->trust = strdup("file");
 #endif
 	config->integrity = IN_NONE;
+	config->digest_index = 0;
 	config->syslog_format =
 		strdup("rule,dec,perm,auid,pid,exe,:,path,ftype");
 	config->rpm_sha256_only = 0;
 	config->allow_filesystem_mark = 0;
     config->report_interval = 0;
+	config->reader_thread = 0;
+	config->reader_cpu = -1;
+	config->reader_spin = 0;
+	config->watchdog_degrade = 5;
+	config->watchdog_kill = 30;
+	config->watchdog_fallback = WATCHDOG_WAIT;
+	config->decision_priority = 0;
+	config->decision_cpu = -1;
+	config->lock_memory = 0;
+	config->huge_pages = HP_NONE;
 }
 
 int load_daemon_config(conf_t *config)
@@ -403,6 +473,19 @@ static int permissive_parser(const struct nv_pair *nv, int line,
 	return rc;
 }
 
+static int permissive_defer_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	int rc = unsigned_int_parser(&(config->permissive_defer), nv->value,
+				     line);
+	if (rc == 0 && config->permissive_defer > 1) {
+		msg(LOG_WARNING,
+			"permissive_defer value reset to 0 - line %d", line);
+		config->permissive_defer = 0;
+	}
+	return rc;
+}
+
 static int nice_val_parser(const struct nv_pair *nv, int line,
 		conf_t *config)
 {
@@ -426,6 +509,70 @@ static int q_size_parser(const struct nv_pair *nv, int line,
 	return rc;
 }
 
+static int q_backpressure_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	int rc = unsigned_int_parser(&(config->q_backpressure), nv->value, line);
+	if (rc == 0 && config->q_backpressure > 1) {
+		msg(LOG_WARNING,
+			"q_backpressure value reset to 0 - line %d", line);
+		config->q_backpressure = 0;
+	}
+	return rc;
+}
+
+static int watermark_parser(unsigned int *val, const char *name,
+		const struct nv_pair *nv, int line)
+{
+	int rc = unsigned_int_parser(val, nv->value, line);
+	if (rc == 0 && (*val == 0 || *val > 100)) {
+		msg(LOG_ERR,
+			"%s must be a percentage from 1 to 100 - line %d",
+			name, line);
+		rc = 1;
+	}
+	return rc;
+}
+
+static int q_high_watermark_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	return watermark_parser(&(config->q_high_watermark),
+				"q_high_watermark", nv, line);
+}
+
+static int q_low_watermark_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	return watermark_parser(&(config->q_low_watermark),
+				"q_low_watermark", nv, line);
+}
+
+static int q_exec_weight_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	int rc = unsigned_int_parser(&(config->q_exec_weight), nv->value, line);
+	if (rc == 0 && config->q_exec_weight > 1000) {
+		msg(LOG_WARNING,
+			"q_exec_weight is capped at 1000 - line %d", line);
+		config->q_exec_weight = 1000;
+	}
+	return rc;
+}
+
+static int coalesce_events_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	int rc = unsigned_int_parser(&(config->coalesce_events), nv->value,
+				     line);
+	if (rc == 0 && config->coalesce_events > 1) {
+		msg(LOG_WARNING,
+			"coalesce_events value reset to 1 - line %d", line);
+		config->coalesce_events = 1;
+	}
+	return rc;
+}
+
 static int uid_parser(const struct nv_pair *nv, int line,
 		conf_t *config)
 {
@@ -568,6 +715,163 @@ static int report_interval_parser(const struct nv_pair *nv, int line,
 }
 
 
+static int reader_thread_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	int rc = unsigned_int_parser(&(config->reader_thread), nv->value, line);
+	if (rc == 0 && config->reader_thread > 1) {
+		msg(LOG_WARNING,
+			"reader_thread value reset to 0 - line %d", line);
+		config->reader_thread = 0;
+	}
+	return rc;
+}
+
+
+static int cpu_parser(int *val, const char *name, const struct nv_pair *nv,
+		int line)
+{
+	unsigned int cpu;
+
+	if (strcasecmp(nv->value, "none") == 0) {
+		*val = -1;
+		return 0;
+	}
+
+	int rc = unsigned_int_parser(&cpu, nv->value, line);
+	if (rc == 0 && cpu >= CPU_SETSIZE) {
+		msg(LOG_ERR, "%s %u is out of range - line %d",
+			name, cpu, line);
+		return 1;
+	}
+	if (rc == 0)
+		*val = cpu;
+	return rc;
+}
+
+
+static int reader_cpu_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	return cpu_parser(&(config->reader_cpu), "reader_cpu", nv, line);
+}
+
+
+static int reader_spin_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	int rc = unsigned_int_parser(&(config->reader_spin), nv->value, line);
+	if (rc == 0 && config->reader_spin > 1000000) {
+		msg(LOG_WARNING,
+			"reader_spin is capped at 1000000 usec - line %d", line);
+		config->reader_spin = 1000000;
+	}
+	return rc;
+}
+
+
+static int watchdog_degrade_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	return unsigned_int_parser(&(config->watchdog_degrade), nv->value,
+				   line);
+}
+
+
+static int watchdog_kill_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	return unsigned_int_parser(&(config->watchdog_kill), nv->value, line);
+}
+
+
+static int watchdog_fallback_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	if (strcasecmp(nv->value, "wait") == 0)
+		config->watchdog_fallback = WATCHDOG_WAIT;
+	else if (strcasecmp(nv->value, "allow") == 0)
+		config->watchdog_fallback = FAN_ALLOW;
+	else if (strcasecmp(nv->value, "deny") == 0)
+		config->watchdog_fallback = FAN_DENY;
+	else {
+		msg(LOG_ERR, "Option %s not found - line %d", nv->value, line);
+		return 1;
+	}
+	return 0;
+}
+
+
+static int decision_priority_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	int rc = unsigned_int_parser(&(config->decision_priority), nv->value,
+				     line);
+	if (rc == 0 && config->decision_priority > 99) {
+		msg(LOG_ERR,
+			"decision_priority must be from 0 to 99 - line %d",
+			line);
+		rc = 1;
+	}
+	return rc;
+}
+
+
+static int decision_cpu_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	return cpu_parser(&(config->decision_cpu), "decision_cpu", nv, line);
+}
+
+
+static int digest_index_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	int rc = unsigned_int_parser(&(config->digest_index), nv->value, line);
+	if (rc == 0 && config->digest_index > 1) {
+		msg(LOG_WARNING,
+			"digest_index value reset to 0 - line %d", line);
+		config->digest_index = 0;
+	}
+	return rc;
+}
+
+
+static int lock_memory_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	int rc = unsigned_int_parser(&(config->lock_memory), nv->value, line);
+	if (rc == 0 && config->lock_memory > 1) {
+		msg(LOG_WARNING,
+			"lock_memory value reset to 0 - line %d", line);
+		config->lock_memory = 0;
+	}
+	return rc;
+}
+
+
+static const struct nv_list huge_pages_modes[] =
+{
+  {"none",        HP_NONE        },
+  {"transparent", HP_TRANSPARENT },
+  {"explicit",    HP_EXPLICIT    },
+  { NULL,  0 }
+};
+
+static int huge_pages_parser(const struct nv_pair *nv, int line,
+		conf_t *config)
+{
+	for (int i=0; huge_pages_modes[i].name != NULL; i++) {
+		if (strcasecmp(nv->value, huge_pages_modes[i].name) == 0) {
+			config->huge_pages = huge_pages_modes[i].option;
+			return 0;
+		}
+	}
+	msg(LOG_ERR, "Option %s not found - line %d", nv->value, line);
+	return 1;
+}
+
+
 static int trust_parser(const struct nv_pair *nv, int line,
 			   conf_t *config)
 {
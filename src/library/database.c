@@ -32,11 +32,13 @@
 #include <poll.h>
 #include <pthread.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <openssl/sha.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -52,21 +54,34 @@
 #include "gcc-attributes.h"
 #include "paths.h"
 #include "policy.h"
+#include "reply-cache.h"
+#include "update-batch.h"
 
 // Local defines
 enum { READ_DATA, READ_TEST_KEY, READ_DATA_DUP };
-typedef enum { DB_NO_OP, ONE_FILE, RELOAD_DB, FLUSH_CACHE, RELOAD_RULES } db_ops_t;
+typedef enum { DB_NO_OP, ONE_FILE, RELOAD_DB, FLUSH_CACHE, RELOAD_RULES,
+	BEGIN_BATCH, COMMIT_BATCH } db_ops_t;
 #define BUFFER_SIZE 4096
 #define MEGABYTE    (1024*1024)
 #define MAX_DELIMS  3
+#define DIR_ID_LEN	4	// Size of the directory id leading each key
+#define TRUST_KEY_MAX	511	// Longest key, LMDB may allow less
 
 // Local variables
 static MDB_env *env;
 static MDB_dbi dbi;
 static int dbi_init = 0;
+static MDB_dbi reader_dbi;
+static int reader_dbi_open = 0;
+static MDB_dbi digest_dbi;
+static int digest_index = 0;
+static MDB_dbi dirs_dbi;
 static unsigned MDB_maxkeysize;
+static unsigned key_max;
 static const char *data_dir = DB_DIR;
 static const char *db = DB_NAME;
+static const char *digest_db = DIGEST_DB_NAME;
+static const char *dirs_db = DIRS_DB_NAME;
 static int lib_symlink=0, lib64_symlink=0, bin_symlink=0, sbin_symlink=0;
 static struct pollfd ffd[1] =  { {0, 0, 0} };
 static integrity_t integrity;
@@ -83,6 +98,9 @@ static pthread_t update_thread;
 static pthread_mutex_t update_lock;
 static pthread_mutex_t rule_lock;
 
+// FIFO records read but not yet written, see update-batch.c
+static struct update_batch batch;
+
 /*
  * lmdb_record - Parsed representation of a single LMDB value payload.
  * @tsource: Trust source identifier stored alongside the record.
@@ -102,7 +120,9 @@ struct lmdb_record {
 // Local functions
 static void *update_thread_main(void *arg);
 static int update_database(conf_t *config);
-static int write_db(const char *idx, const char *data) __wur;
+static int open_dirs_dbi(void);
+static int write_db(const char *idx, size_t idx_len, const char *data,
+		    size_t data_len) __wur;
 
 // External variables
 extern atomic_bool stop;
@@ -207,7 +227,8 @@ static int init_db(const conf_t *config)
 		return 1;
 	}
 
-	if (mdb_env_set_maxdbs(env, 2)) {
+	// The path index, its directories and the digest index
+	if (mdb_env_set_maxdbs(env, 3)) {
 		/* Clean up environment on failure */
 		mdb_env_close(env);
 		env = NULL;
@@ -221,7 +242,8 @@ static int init_db(const conf_t *config)
 		return 3;
 	}
 
-	if (mdb_env_set_maxreaders(env, 4)) {
+	// Room for trust readers on top of the daemon's own threads
+	if (mdb_env_set_maxreaders(env, 4 + TRUST_READERS_MAX)) {
 		/* Clean up environment on failure */
 		mdb_env_close(env);
 		env = NULL;
@@ -238,6 +260,13 @@ static int init_db(const conf_t *config)
 	}
 
 	MDB_maxkeysize = mdb_env_get_maxkeysize(env);
+	key_max = MDB_maxkeysize < TRUST_KEY_MAX ? MDB_maxkeysize :
+						   TRUST_KEY_MAX;
+	if (open_dirs_dbi()) {
+		mdb_env_close(env);
+		env = NULL;
+		return 6;
+	}
 	integrity = config->integrity;
 	msg(LOG_INFO, "fapolicyd integrity is %u", integrity);
 
@@ -274,6 +303,9 @@ static void close_db(int do_report)
 	// Now close down
 	mdb_close(env, dbi);
 	mdb_env_close(env);
+	dbi_init = 0;
+	reader_dbi_open = 0;
+	digest_index = 0;
 }
 
 static void check_db_size(void)
@@ -473,24 +505,436 @@ static char *path_to_hash(const char *path, const size_t path_len)
 }
 
 
+/*
+ * Keys of the path index are a directory id followed by the file name,
+ * so the directories that hundreds of thousands of paths repeat are
+ * stored once, in the directory dictionary:
+ *   "<dir>/"      -> id, the digest of the directory if it is too long
+ *   "\0" <id>     -> "<dir>/"
+ *   "\0"          -> last id handed out
+ * Ids are 4 bytes, big endian, so the keys of a directory are adjacent
+ * and in name order. Id 0 is reserved for paths whose key would be
+ * longer than the LMDB key limit, they are stored under the SHA512
+ * digest of the whole path instead. Deleting every record empties the
+ * dictionary but keeps the last id, so ids are never reused and an id
+ * read from an older transaction can only miss, never find the records
+ * of another directory.
+ */
+enum { KEY_READ, KEY_REMOVE, KEY_CREATE };
+
+// Bumped whenever the dictionary is emptied
+static atomic_uint dirs_generation;
+
+// Last directory this thread looked up for reading
+static __thread struct {
+	unsigned int generation;
+	uint32_t id;
+	size_t len;
+	char dir[PATH_MAX];
+} last_dir;
+
+static void put_dir_id(unsigned char *buf, uint32_t id)
+{
+	buf[0] = id >> 24;
+	buf[1] = id >> 16;
+	buf[2] = id >> 8;
+	buf[3] = id;
+}
+
+static uint32_t get_dir_id(const unsigned char *buf)
+{
+	return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+	       (uint32_t)buf[2] << 8 | buf[3];
+}
+
+/*
+ * The dictionary handle is opened in a committed transaction so that it
+ * stays valid for every later transaction, readers included.
+ */
+static int open_dirs_dbi(void)
+{
+	MDB_txn *txn;
+	int rc;
+
+	if ((rc = mdb_txn_begin(env, NULL, 0, &txn)))
+		goto err;
+	if ((rc = mdb_dbi_open(txn, dirs_db, MDB_CREATE, &dirs_dbi))) {
+		mdb_txn_abort(txn);
+		goto err;
+	}
+	if ((rc = mdb_txn_commit(txn)))
+		goto err;
+	return 0;
+err:
+	msg(LOG_ERR, "Cannot open the directory dictionary (%s)",
+	    mdb_strerror(rc));
+	return 1;
+}
+
+/*
+ * reset_dirs - Empty the directory dictionary, keeping the last id.
+ * @txn: Open write transaction.
+ * Returns 0 on success or the LMDB error.
+ */
+static int reset_dirs(MDB_txn *txn)
+{
+	unsigned char last[DIR_ID_LEN];
+	MDB_val ckey = { 1, (void *)"" }, cval;
+	int rc, have_last;
+
+	rc = mdb_get(txn, dirs_dbi, &ckey, &cval);
+	if (rc && rc != MDB_NOTFOUND)
+		return rc;
+	have_last = rc == 0 && cval.mv_size == DIR_ID_LEN;
+	if (have_last)
+		memcpy(last, cval.mv_data, DIR_ID_LEN);
+
+	if ((rc = mdb_drop(txn, dirs_dbi, 0)))
+		return rc;
+	if (have_last) {
+		cval.mv_data = last;
+		cval.mv_size = DIR_ID_LEN;
+		return mdb_put(txn, dirs_dbi, &ckey, &cval, 0);
+	}
+	return 0;
+}
+
+// Give the directory the next id, returns 0 on success
+static int new_dir_id(MDB_txn *txn, MDB_val *dkey, const char *dir,
+		      size_t len, uint32_t *id)
+{
+	unsigned char last[DIR_ID_LEN], rkey[1 + DIR_ID_LEN];
+	MDB_val ckey = { 1, (void *)"" }, cval, rval;
+	int rc;
+
+	rc = mdb_get(txn, dirs_dbi, &ckey, &cval);
+	if (rc == MDB_NOTFOUND)
+		*id = 1;
+	else if (rc)
+		return rc;
+	else if (cval.mv_size != DIR_ID_LEN)
+		return MDB_CORRUPTED;
+	else
+		*id = get_dir_id(cval.mv_data) + 1;
+
+	put_dir_id(last, *id);
+	cval.mv_data = last;
+	cval.mv_size = DIR_ID_LEN;
+	rkey[0] = 0;
+	put_dir_id(rkey + 1, *id);
+	MDB_val rk = { sizeof(rkey), rkey };
+	rval.mv_data = (void *)dir;
+	rval.mv_size = len;
+
+	if ((rc = mdb_put(txn, dirs_dbi, &ckey, &cval, 0)) ||
+	    (rc = mdb_put(txn, dirs_dbi, dkey, &cval, 0)) ||
+	    (rc = mdb_put(txn, dirs_dbi, &rk, &rval, 0)))
+		return rc;
+	return 0;
+}
+
+/*
+ * lookup_dir_id - Find the id of a directory.
+ * @txn: Transaction to use.
+ * @dir: Directory with its trailing slash, not NUL terminated.
+ * @len: Length of @dir.
+ * @mode: KEY_CREATE hands out an id to a new directory.
+ * @id: Receives the id.
+ * Returns 0 on success, -1 when the directory has no id and 1 on error.
+ */
+static int lookup_dir_id(MDB_txn *txn, const char *dir, size_t len,
+			 int mode, uint32_t *id)
+{
+	unsigned int generation = atomic_load(&dirs_generation);
+	MDB_val dkey, val;
+	char *hash = NULL;
+	int rc;
+
+	if (mode == KEY_READ && last_dir.id &&
+	    last_dir.generation == generation && last_dir.len == len &&
+	    memcmp(last_dir.dir, dir, len) == 0) {
+		*id = last_dir.id;
+		return 0;
+	}
+
+	if (len > key_max) {
+		hash = path_to_hash(dir, len);
+		if (hash == NULL)
+			return 1;
+		dkey.mv_data = hash;
+		dkey.mv_size = SHA512_LEN * 2;
+	} else {
+		dkey.mv_data = (void *)dir;
+		dkey.mv_size = len;
+	}
+
+	rc = mdb_get(txn, dirs_dbi, &dkey, &val);
+	if (rc == 0 && val.mv_size == DIR_ID_LEN)
+		*id = get_dir_id(val.mv_data);
+	else if (rc == 0)
+		rc = MDB_CORRUPTED;
+	else if (rc == MDB_NOTFOUND && mode == KEY_CREATE)
+		rc = new_dir_id(txn, &dkey, dir, len, id);
+	free(hash);
+
+	if (rc == MDB_NOTFOUND)
+		return -1;
+	if (rc) {
+		msg(LOG_ERR, "directory dictionary: %s", mdb_strerror(rc));
+		return 1;
+	}
+
+	// Ids handed out in a write transaction may still be rolled back
+	if (mode == KEY_READ && len < sizeof(last_dir.dir)) {
+		memcpy(last_dir.dir, dir, len);
+		last_dir.len = len;
+		last_dir.id = *id;
+		last_dir.generation = generation;
+	}
+	return 0;
+}
+
+/*
+ * record_key - Build the LMDB key for a path.
+ * @txn: Transaction the key is used in.
+ * @idx: Path, not necessarily NUL terminated.
+ * @len: Length of @idx.
+ * @mode: KEY_READ, KEY_REMOVE or KEY_CREATE, see lookup_dir_id().
+ * @key: Output key, pointing into @buf.
+ * @buf: TRUST_KEY_MAX bytes for the key.
+ *
+ * The path is split once at its last slash into the directory, which
+ * is replaced by its id, and the file name.
+ * Returns 0 on success, -1 when the directory has no id, in which case
+ * no record of the path exists, and 1 on failure.
+ */
+static int record_key(MDB_txn *txn, const char *idx, size_t len, int mode,
+		      MDB_val *key, char *buf)
+{
+	size_t dir_len = len;
+	uint32_t id = 0;
+	int rc;
+
+	while (dir_len && idx[dir_len - 1] != '/')
+		dir_len--;
+
+	key->mv_data = buf;
+	if (dir_len == 0 || DIR_ID_LEN + len - dir_len > key_max) {
+		char *hash = path_to_hash(idx, len);
+
+		if (hash == NULL)
+			return 1;
+		put_dir_id((unsigned char *)buf, 0);
+		memcpy(buf + DIR_ID_LEN, hash, SHA512_LEN * 2);
+		key->mv_size = DIR_ID_LEN + SHA512_LEN * 2;
+		free(hash);
+		return 0;
+	}
+
+	if ((rc = lookup_dir_id(txn, idx, dir_len, mode, &id)))
+		return rc;
+	put_dir_id((unsigned char *)buf, id);
+	memcpy(buf + DIR_ID_LEN, idx + dir_len, len - dir_len);
+	key->mv_size = DIR_ID_LEN + len - dir_len;
+	return 0;
+}
+
+/*
+ * trust_db_key_path - Turn a key of the path index back into its path.
+ * @txn: Transaction the key was read in.
+ * @dirs: Directory dictionary opened in @txn.
+ * @key: Key to decode.
+ * @buf: Receives the path, NUL terminated.
+ * @len: Size of @buf.
+ *
+ * Paths stored under their digest give the digest.
+ * Returns 0 on success and 1 when the key cannot be decoded or is too
+ * long for @buf.
+ */
+int trust_db_key_path(MDB_txn *txn, MDB_dbi dirs, const MDB_val *key,
+		      char *buf, size_t len)
+{
+	const char *name = (const char *)key->mv_data + DIR_ID_LEN;
+	size_t name_len;
+	unsigned char rkey[1 + DIR_ID_LEN];
+	MDB_val rk = { sizeof(rkey), rkey }, dir = { 0, NULL };
+	uint32_t id;
+
+	if (key->mv_size < DIR_ID_LEN)
+		return 1;
+	name_len = key->mv_size - DIR_ID_LEN;
+	id = get_dir_id(key->mv_data);
+
+	if (id) {
+		rkey[0] = 0;
+		put_dir_id(rkey + 1, id);
+		if (mdb_get(txn, dirs, &rk, &dir))
+			return 1;
+	}
+	if (dir.mv_size + name_len >= len)
+		return 1;
+
+	memcpy(buf, dir.mv_data, dir.mv_size);
+	memcpy(buf + dir.mv_size, name, name_len);
+	buf[dir.mv_size + name_len] = 0;
+	return 0;
+}
+
+/*
+ * The digest index maps "<size> <digest>" to "<tsource> <path key>" for
+ * every record of the path index, so that a file can be found by its
+ * content wherever it lives. Several paths with the same content are
+ * duplicates of one key. The path key is part of the value so that each
+ * path record owns exactly one entry, and removing it leaves the entries
+ * of the other copies alone. It is only maintained when digest_index is
+ * set, and is dropped otherwise so a stale index is never used.
+ */
+#define DIGEST_KEY_MAX (24 + FILE_DIGEST_STRING_MAX)
+
+/*
+ * digest_entry - Build the digest index entry of a trust record.
+ * @key: Key of the record in the path index.
+ * @data: Record data, "<tsource> <size> <digest>", not NUL terminated.
+ * @data_len: Length of @data.
+ * @kbuf: Receives the key, DIGEST_KEY_MAX bytes.
+ * @vbuf: Receives the value, BUFFER_SIZE bytes.
+ * @dkey: Set to the key in @kbuf.
+ * @dval: Set to the value in @vbuf.
+ *
+ * A path key that would make the value too long for a duplicate is
+ * replaced by its digest, the same way for adding and removing.
+ * Returns 0 on success and 1 for records that cannot be indexed.
+ */
+static int digest_entry(const MDB_val *key, const char *data, size_t data_len,
+			char *kbuf, char *vbuf, MDB_val *dkey, MDB_val *dval)
+{
+	char digest[FILE_DIGEST_STRING_MAX];
+	unsigned int tsource;
+	off_t size;
+	int len;
+
+	if (data_len >= BUFFER_SIZE)
+		return 1;
+	memcpy(vbuf, data, data_len);
+	vbuf[data_len] = 0;
+	if (lmdb_scan_record(vbuf, &tsource, &size, digest))
+		return 1;
+
+	dkey->mv_size = snprintf(kbuf, DIGEST_KEY_MAX, "%llu %s",
+				 (unsigned long long)size, digest);
+	dkey->mv_data = kbuf;
+
+	len = snprintf(vbuf, BUFFER_SIZE, "%u ", tsource);
+	if (len + key->mv_size <= MDB_maxkeysize) {
+		memcpy(vbuf + len, key->mv_data, key->mv_size);
+		dval->mv_size = len + key->mv_size;
+	} else {
+		char *hash = path_to_hash(key->mv_data, key->mv_size);
+
+		if (hash == NULL)
+			return 1;
+		dval->mv_size = len + snprintf(vbuf + len, BUFFER_SIZE - len,
+					       "%s", hash);
+		free(hash);
+	}
+	dval->mv_data = vbuf;
+
+	return 0;
+}
+
+/*
+ * put_digest - Add or remove the digest index entry of a trust record.
+ * @txn: Open write transaction.
+ * @key: Key of the record in the path index.
+ * @data: Record data.
+ * @data_len: Length of @data.
+ * @remove: Non-zero removes the entry instead of adding it.
+ *
+ * Records without a usable digest are simply not indexed.
+ * Returns 0 on success and 3 if LMDB reports an error.
+ */
+static int put_digest(MDB_txn *txn, const MDB_val *key, const char *data,
+		      size_t data_len, int remove)
+{
+	char kbuf[DIGEST_KEY_MAX], vbuf[BUFFER_SIZE];
+	MDB_val dkey, dval;
+	int rc;
+
+	if (!digest_index ||
+	    digest_entry(key, data, data_len, kbuf, vbuf, &dkey, &dval))
+		return 0;
+
+	if (remove)
+		rc = mdb_del(txn, digest_dbi, &dkey, &dval);
+	else
+		rc = mdb_put(txn, digest_dbi, &dkey, &dval, 0);
+	if (rc && !(remove && rc == MDB_NOTFOUND)) {
+		msg(LOG_ERR, "digest index: %s", mdb_strerror(rc));
+		return 3;
+	}
+	return 0;
+}
+
+/*
+ * put_record - Store or remove one trust record inside a write transaction.
+ * @txn: Open write transaction with the dbi already associated.
+ * @idx: Path of the record.
+ * @idx_len: Length of @idx, which does not need to be NUL terminated.
+ * @data: Serialized metadata for the path.
+ * @data_len: Length of @data.
+ * @remove: Non-zero deletes the exact key/data pair instead of adding it.
+ *
+ * Returns 0 on success (removing a missing record is not an error), 3 if
+ * LMDB reports an error, and 5 when key hashing fails.
+ */
+static int put_record(MDB_txn *txn, const char *idx, size_t idx_len,
+		      const char *data, size_t data_len, int remove)
+{
+	MDB_val key, value;
+	int rc, ret_val = 0;
+	char kbuf[TRUST_KEY_MAX];
+
+	rc = record_key(txn, idx, idx_len, remove ? KEY_REMOVE : KEY_CREATE,
+			&key, kbuf);
+	// A directory without an id holds no record to remove
+	if (rc < 0)
+		return 0;
+	if (rc)
+		return 5;
+	value.mv_data = (void *)data;
+	value.mv_size = data_len;
+
+	if (remove)
+		rc = mdb_del(txn, dbi, &key, &value);
+	else
+		rc = mdb_put(txn, dbi, &key, &value, 0);
+	if (rc && !(remove && rc == MDB_NOTFOUND)) {
+		msg(LOG_ERR, "%s", mdb_strerror(rc));
+		ret_val = 3;
+	} else
+		ret_val = put_digest(txn, &key, data, data_len, remove);
+
+	return ret_val;
+}
+
 /*
  * write_db - Persist a single trust record into the LMDB database.
  * @idx: Path string used as the key for the record. When the path exceeds
  *       the LMDB key size limit the function hashes the path before storage.
+ * @idx_len: Length of @idx, which does not need to be NUL terminated.
  * @data: Serialized metadata for the path. The buffer contains the integrity
  *        status, file size, and SHA256 hash sourced from the backend loaders.
+ * @data_len: Length of @data.
  *
  * Returns 0 on success, or an error code describing the stage that failed:
  * 1 when the transaction cannot start, 2 on dbi open failure, 3 if mdb_put
  * reports an error, 4 if mdb_txn_commit fails, and 5 when key hashing fails.
  */
-static int write_db(const char *idx, const char *data)
+static int write_db(const char *idx, size_t idx_len, const char *data,
+		    size_t data_len)
 {
-	MDB_val key, value;
 	MDB_txn *txn;
-	int rc, ret_val = 0;
-	size_t len;
-	char *hash = NULL;
+	int rc;
 
 	if (mdb_txn_begin(env, NULL, 0, &txn))
 		return 1;
@@ -500,41 +944,17 @@ static int write_db(const char *idx, const char *data)
 		return 2;
 	}
 
-	// Only scan enough to make a decision
-	len = strnlen(idx, MDB_maxkeysize+1);
-	if (len > MDB_maxkeysize) {
-		hash = path_to_hash(idx, len);
-		if (hash == NULL) {
-			abort_transaction(txn);
-			return 5;
-		}
-		key.mv_data = (void *)hash;
-		key.mv_size = (SHA512_LEN * 2) + 1;
-	} else {
-		key.mv_data = (void *)idx;
-		key.mv_size = len;
-	}
-	value.mv_data = (void *)data;
-	value.mv_size = strlen(data);
-
-	if ((rc = mdb_put(txn, dbi, &key, &value, 0))) {
-		msg(LOG_ERR, "%s", mdb_strerror(rc));
+	if ((rc = put_record(txn, idx, idx_len, data, data_len, 0))) {
 		abort_transaction(txn);
-		ret_val = 3;
-		goto out;
+		return rc;
 	}
 
 	if ((rc = mdb_txn_commit(txn))) {
 		msg(LOG_ERR, "%s", mdb_strerror(rc));
-		ret_val = 4;
-		goto out;
+		return 4;
 	}
 
-out:
-	if (len > MDB_maxkeysize)
-		free(hash);
-
-	return ret_val;
+	return 0;
 }
 
 
@@ -614,39 +1034,44 @@ static long get_number_of_entries(void)
 /*
  * This is the long term read operation. It takes a path as input and
  * search for the data. It returns NULL on error or if no data found.
- * The returned string must be freed by the caller.
+ * The returned string must be freed by the caller. The cursor is
+ * positioned with seek, MDB_SET or, for keys visited in sorted order,
+ * MDB_SET_RANGE.
  */
-static char *lt_read_db(const char *index, int operation, int *error) __attr_dealloc_free;
-static char *lt_read_db(const char *index, int operation, int *error)
+static char *lt_read_db(MDB_cursor *cursor, const char *index,
+			size_t index_len, int operation, MDB_cursor_op seek,
+			int *error) __attr_dealloc_free;
+static char *lt_read_db(MDB_cursor *cursor, const char *index,
+			size_t index_len, int operation, MDB_cursor_op seek,
+			int *error)
 {
 	int rc;
-	char *data, *hash = NULL;
+	char *data, kbuf[TRUST_KEY_MAX];
 	MDB_val key, value;
-	size_t len;
 	*error = 1; // Assume an error
 
-	// If the path is too long, convert to a hash
-	// Only scan enough to make a decision
-	len = strnlen(index, MDB_maxkeysize+1);
-	if (len > MDB_maxkeysize) {
-		hash = path_to_hash(index, len);
-		if (hash == NULL)
-			return NULL;
-		key.mv_data = (void *)hash;
-		key.mv_size = (SHA512_LEN * 2) + 1;
-	} else {
-		key.mv_data = (void *)index;
-		key.mv_size = len;
-	}
 	value.mv_data = NULL;
 	value.mv_size = 0;
 
 	// set cursor and read first data
 	if (operation == READ_DATA || operation == READ_TEST_KEY) {
+		rc = record_key(mdb_cursor_txn(cursor), index, index_len,
+				KEY_READ, &key, kbuf);
+		if (rc < 0)
+			*error = 0; // Nothing was ever stored in the directory
+		if (rc)
+			return NULL;
+
+		MDB_val want = key;
 
 		// Read the value pointed to by key
-		if ((rc = mdb_cursor_get(lt_cursor, &key, &value, MDB_SET))) {
-			free(hash);
+		rc = mdb_cursor_get(cursor, &key, &value, seek);
+		// A range seek stops at the first key not below the wanted one
+		if (rc == 0 && seek == MDB_SET_RANGE &&
+		    (key.mv_size != want.mv_size ||
+		     memcmp(key.mv_data, want.mv_data, want.mv_size)))
+			rc = MDB_NOTFOUND;
+		if (rc) {
 			if (rc == MDB_NOTFOUND) {
 				*error = 0;
 			} else {
@@ -662,17 +1087,15 @@ static char *lt_read_db(const char *index, int operation, int *error)
 	// as subsequent call just after READ_DATA
 	if (operation == READ_DATA_DUP) {
 		size_t nleaves;
-		mdb_cursor_count(lt_cursor, &nleaves);
+		mdb_cursor_count(cursor, &nleaves);
 		if (nleaves <= 1) {
-			free(hash);
 			*error = 0;
 			return NULL;
 		}
 
 		// is there a next duplicate?
-		if ((rc = mdb_cursor_get(lt_cursor, &key, &value,
+		if ((rc = mdb_cursor_get(cursor, &key, &value,
 					 MDB_NEXT_DUP))) {
-			free(hash);
 			if (rc == MDB_NOTFOUND) {
 				*error = 0;
 			} else {
@@ -682,9 +1105,6 @@ static char *lt_read_db(const char *index, int operation, int *error)
 		}
 	}
 
-	if (len > MDB_maxkeysize)
-		free(hash);
-
 	// Failure was already returned. Need to return a pointer of
 	// some kind. Using the db name since its non-NULL.
 	// A next step might be to check the status field to see that its
@@ -741,12 +1161,26 @@ static char *lt_read_db(const char *index, int operation, int *error)
 
 
 // This function checks the database to see if its empty. It returns
-// a 0 if it has entries, 1 on empty, and -1 if an error
+// a 0 if it has entries, 1 on empty, and -1 if an error. The environment
+// also lists the directory dictionary, so the path index is counted.
 static int database_empty(void)
 {
 	MDB_stat status;
-	if (mdb_env_stat(env, &status))
+	MDB_txn *txn;
+	MDB_dbi path_dbi;
+	int rc;
+
+	if (mdb_txn_begin(env, NULL, MDB_RDONLY, &txn))
 		return -1;
+	rc = mdb_dbi_open(txn, db, MDB_DUPSORT, &path_dbi);
+	if (rc == MDB_NOTFOUND)
+		status.ms_entries = 0;
+	else if (rc || mdb_stat(txn, path_dbi, &status)) {
+		mdb_txn_abort(txn);
+		return -1;
+	}
+	mdb_txn_abort(txn);
+
 	if (status.ms_entries == 0)
 		return 1;
 	return 0;
@@ -767,7 +1201,9 @@ static int delete_all_entries_db()
 	}
 
 	// 0 -> delete , 1 -> delete and close
-	if ((rc = mdb_drop(txn, dbi, 0))) {
+	if ((rc = mdb_drop(txn, dbi, 0)) ||
+	    (digest_index && (rc = mdb_drop(txn, digest_dbi, 0))) ||
+	    (rc = reset_dirs(txn))) {
 		msg(LOG_DEBUG, "mdb_drop -> %s", mdb_strerror(rc));
 		abort_transaction(txn);
 		return 3;
@@ -781,27 +1217,27 @@ static int delete_all_entries_db()
 			    mdb_strerror(rc));
 		return 4;
 	}
+	// Directories cached by readers may no longer be in the dictionary
+	atomic_fetch_add(&dirs_generation, 1);
 
 	return 0;
 }
 
 /*
- * do_memfd_update - Populate the LMDB trust database from a backend memfd.
+ * open_memfd_reader - Prepare buffered line reads from a backend memfd.
+ * @memfd: Backend snapshot, rewound before use.
  *
- * Returns 0 when all records write successfully, 1 when the first non-zero
- * write_db error encountered during the traversal of backend items.
+ * The memfd is mapped when possible so lines are served straight from the
+ * mapping. Returns the reader state or NULL on allocation failure.
  */
-int do_memfd_update(int memfd, long *entries)
+static fd_fgets_state_t *open_memfd_reader(int memfd)
 {
-	int rc = 0;
-	*entries = 0;
 	struct stat sb;
-	char buff[BUFFER_SIZE];
 	fd_fgets_state_t *st = fd_fgets_init();
 
 	if (st == NULL) {
 		msg(LOG_ERR, "Failed to initialize buffered memfd reader");
-		return 1;
+		return NULL;
 	}
 
 	// On any failure, fall back to descriptor based reads
@@ -813,8 +1249,52 @@ int do_memfd_update(int memfd, long *entries)
 			fd_setvbuf_r(st,base,sb.st_size,MEM_MMAP_FILE);
 	}
 
+	return st;
+}
+
+/*
+ * split_trust_record - Separate a backend line into path and data.
+ * @line: "<path> <tsource> <size> <digest>" without the newline.
+ * @len: Length of @line, it does not need to be NUL terminated.
+ * @path_len: Set to the length of the path.
+ *
+ * Its better to parse it from the end because there can be space in the
+ * file name. The data part runs to the end of the line.
+ * Returns a pointer to the data part or NULL for a malformed line.
+ */
+static const char *split_trust_record(const char *line, size_t len,
+				      size_t *path_len)
+{
+	int delims = 0;
+
+	for (size_t i = len; i-- > 0; ) {
+		if (isspace((unsigned char)line[i]) && ++delims == MAX_DELIMS) {
+			*path_len = i;
+			return line + i + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * do_memfd_update - Populate the LMDB trust database from a backend memfd.
+ *
+ * Returns 0 when all records write successfully, 1 when the first non-zero
+ * write_db error encountered during the traversal of backend items.
+ */
+int do_memfd_update(int memfd, long *entries)
+{
+	int rc = 0;
+	*entries = 0;
+	fd_fgets_state_t *st = open_memfd_reader(memfd);
+
+	if (st == NULL)
+		return 1;
+
 	do {
-		int res = fd_fgets_r(st, buff, sizeof(buff), memfd);
+		const char *line;
+		int res = fd_fgets_view_r(st, &line, BUFFER_SIZE, memfd);
 		if (res == -1) {
 			msg(LOG_ERR, "fd_fgets_r on memfd (%s)",
 			    strerror(errno));
@@ -822,39 +1302,26 @@ int do_memfd_update(int memfd, long *entries)
 			break;
 		} else if (res > 0) {
 			(*entries)++;
-			char *end = fapolicyd_strnchr(buff, '\n', BUFFER_SIZE);
-			if (end == NULL) {
+			size_t len = res, path_len;
+			if (line[len - 1] != '\n') {
 				msg(LOG_ERR, "Too long line?");
 				continue;
 			}
-			int size = end - buff;
-			*end = '\0';
-
-			// its better to parse it from the end because
-			// there can be space in file name
-			int delims = 0;
-			char *delim = NULL;
-			for (int i = size-1 ; i >= 0 ; i--) {
-				if (isspace(buff[i])) {
-					delim = &buff[i];
-					delims++;
-				}
-				if (delims >= MAX_DELIMS) {
-					buff[i] = '\0';
-					break;
-				}
-			}
+			len--;
 
-			if (delim == NULL) //bad line ? should never happen
+			const char *data = split_trust_record(line, len,
+							      &path_len);
+			if (data == NULL) //bad line ? should never happen
 				continue;
 
 			//            index, data
-			res = write_db(buff, delim + 1);
+			size_t data_len = len - (data - line);
+			res = write_db(line, path_len, data, data_len);
 			if (res)
 				msg(LOG_ERR,
-				    "Error (%d) writing key=\"%s\" data=\"%s\"",
-				    res, (const char*)buff,
-				    (const char*)delim + 1);
+				    "Error (%d) writing key=\"%.*s\" data=\"%.*s\"",
+				    res, (int)path_len, line,
+				    (int)data_len, data);
 		}
 	} while (!fd_fgets_eof_r(st) && !stop);
 
@@ -912,18 +1379,239 @@ static int create_database(int with_sync)
 }
 
 
+// Returns 1 if any loaded backend delivered a change set
+static int have_backend_delta(void)
+{
+	for (backend_entry *be = backend_get_first(); be != NULL;
+						      be = be->next)
+		if (be->backend->memfd != -1 && be->backend->delta)
+			return 1;
+	return 0;
+}
+
+// Remember whether the trust db matches what the backends last delivered
+static void set_backends_synced(int synced)
+{
+	for (backend_entry *be = backend_get_first(); be != NULL;
+						      be = be->next)
+		be->backend->synced = synced;
+}
+
+// Returns 1 if the record belongs to a backend that sent a change set
+static int owned_by_delta_backend(const MDB_val *value)
+{
+	char buf[16];
+	size_t len = value->mv_size < sizeof(buf) - 1 ?
+				value->mv_size : sizeof(buf) - 1;
+
+	memcpy(buf, value->mv_data, len);
+	buf[len] = '\0';
+	const char *name = lookup_tsource(strtoul(buf, NULL, 10));
+
+	for (backend_entry *be = backend_get_first(); be != NULL;
+						      be = be->next)
+		if (be->backend->memfd != -1 && be->backend->delta &&
+				strcmp(be->backend->name, name) == 0)
+			return 1;
+	return 0;
+}
+
 /*
- * check_data_presence - Look up an LMDB record and compare its stored data.
- * @index: Key used for the LMDB lookup.
- * @data: Data string expected to be present for the key.
- * @matched: Updated with the number of duplicate records inspected.
+ * purge_snapshot_records - Drop records not covered by a change set.
+ * @txn: Open write transaction.
  *
- * Returns 1 when an exact match is discovered, or 0 if the supplied data
- * cannot be located. Errors encountered by lt_read_db are logged separately.
+ * Records of backends that sent a full snapshot are re-imported afterwards,
+ * and updates pushed through the fifo go away just like on a full rebuild.
+ * Returns 0 on success and 1 on failure.
  */
-static int check_data_presence(const char * index, const char * data, int * matched)
+static int purge_snapshot_records(MDB_txn *txn)
 {
-	int found = 0;
+	MDB_cursor *cursor;
+	MDB_val key, value;
+	int rc;
+
+	if ((rc = mdb_cursor_open(txn, dbi, &cursor))) {
+		msg(LOG_ERR, "mdb_cursor_open -> %s", mdb_strerror(rc));
+		return 1;
+	}
+
+	rc = mdb_cursor_get(cursor, &key, &value, MDB_FIRST);
+	while (rc == 0 && !stop) {
+		// The cursor moves to the next item on delete
+		if (!owned_by_delta_backend(&value)) {
+			// put_digest() has logged the failure
+			if (put_digest(txn, &key, value.mv_data,
+				       value.mv_size, 1)) {
+				mdb_cursor_close(cursor);
+				return 1;
+			}
+			if ((rc = mdb_cursor_del(cursor, 0)))
+				break;
+		}
+		rc = mdb_cursor_get(cursor, &key, &value, MDB_NEXT);
+	}
+	mdb_cursor_close(cursor);
+
+	if (rc && rc != MDB_NOTFOUND) {
+		msg(LOG_ERR, "Purging trust database failed (%s)",
+		    mdb_strerror(rc));
+		return 1;
+	}
+	return stop;
+}
+
+/*
+ * apply_memfd_update - Import one backend memfd into a write transaction.
+ * @txn: Open write transaction.
+ * @be: Backend providing the memfd. A change set has '+' or '-' in front
+ *      of every record, a full snapshot is added as is.
+ *
+ * Returns 0 on success and 1 on failure.
+ */
+static int apply_memfd_update(MDB_txn *txn, backend *be)
+{
+	int rc = 0;
+	fd_fgets_state_t *st = open_memfd_reader(be->memfd);
+
+	if (st == NULL)
+		return 1;
+
+	be->entries = 0;
+	do {
+		const char *line;
+		int res = fd_fgets_view_r(st, &line, BUFFER_SIZE, be->memfd);
+		if (res == -1) {
+			msg(LOG_ERR, "fd_fgets_r on memfd (%s)",
+			    strerror(errno));
+			rc = 1;
+			break;
+		} else if (res > 0) {
+			size_t len = res, path_len;
+			int remove = 0;
+
+			if (line[len - 1] != '\n') {
+				msg(LOG_ERR, "Too long line?");
+				continue;
+			}
+			len--;
+
+			if (be->delta) {
+				if (len == 0 || (*line != '+' && *line != '-')) {
+					msg(LOG_ERR, "Malformed change: %.*s",
+					    (int)len, line);
+					continue;
+				}
+				remove = (*line == '-');
+				line++;
+				len--;
+			}
+
+			const char *data = split_trust_record(line, len,
+							      &path_len);
+			if (data == NULL) {
+				msg(LOG_ERR, "Malformed backend record: %.*s",
+				    (int)len, line);
+				continue;
+			}
+
+			size_t data_len = len - (data - line);
+			if ((res = put_record(txn, line, path_len, data,
+					      data_len, remove))) {
+				msg(LOG_ERR,
+				    "Error (%d) %s key=\"%.*s\" data=\"%.*s\"",
+				    res, remove ? "deleting" : "writing",
+				    (int)path_len, line, (int)data_len, data);
+				rc = 1;
+				break;
+			}
+			be->entries++;
+		}
+	} while (!fd_fgets_eof_r(st) && !stop);
+
+	fd_fgets_destroy(st); // calls munmap, memfd is closed by backend_close
+
+	return rc || stop;
+}
+
+/*
+ * update_database_delta - Apply backend change sets in one transaction.
+ *
+ * Used when at least one backend sent only what changed since its last
+ * load. Records of that backend stay in place and only its additions and
+ * removals are applied, everything else is rebuilt from the snapshots.
+ * Nothing is visible to readers until the transaction commits.
+ *
+ * Returns 0 on success and non-zero on failure.
+ */
+static int update_database_delta(void)
+{
+	MDB_txn *txn;
+	int rc;
+
+	msg(LOG_INFO, "Applying trust database changes");
+	if (mdb_txn_begin(env, NULL, 0, &txn))
+		return 1;
+
+	if (open_dbi(txn)) {
+		abort_transaction(txn);
+		return 2;
+	}
+
+	if (purge_snapshot_records(txn)) {
+		abort_transaction(txn);
+		return 3;
+	}
+
+	for (backend_entry *be = backend_get_first(); be != NULL;
+						      be = be->next) {
+		if (be->backend->memfd == -1)
+			continue;
+
+		if (apply_memfd_update(txn, be->backend)) {
+			msg(LOG_ERR,
+			    "Failed to import trust data from %s backend",
+			    be->backend->name);
+			abort_transaction(txn);
+			return 3;
+		}
+		msg(LOG_INFO, "Applied %ld %s from %s backend",
+		    be->backend->entries,
+		    be->backend->delta ? "changes" : "entries",
+		    be->backend->name);
+	}
+
+	if ((rc = mdb_txn_commit(txn))) {
+		if (rc == MDB_MAP_FULL)
+			msg(LOG_ERR, "db_max_size needs to be increased");
+		else
+			msg(LOG_ERR, "mdb_txn_commit -> %s",
+			    mdb_strerror(rc));
+		return 4;
+	}
+
+	// Check if database is getting full and warn
+	check_db_size();
+
+	return 0;
+}
+
+
+/*
+ * check_data_presence - Look up an LMDB record and compare its stored data.
+ * @index: Key used for the LMDB lookup.
+ * @index_len: Length of @index.
+ * @data: Data string expected to be present for the key.
+ * @data_len: Length of @data.
+ * @matched: Updated with the number of duplicate records inspected.
+ *
+ * Returns 1 when an exact match is discovered, or 0 if the supplied data
+ * cannot be located. Errors encountered by lt_read_db are logged separately.
+ */
+static int check_data_presence(const char *index, size_t index_len,
+			       const char *data, size_t data_len,
+			       int *matched)
+{
+	int found = 0;
 	int error;
 	char *read;
 	int operation = READ_DATA;
@@ -932,7 +1620,8 @@ static int check_data_presence(const char * index, const char * data, int * matc
 	while (1) {
 		error = 0;
 		read = NULL;
-		read = lt_read_db(index, operation, &error);
+		read = lt_read_db(lt_cursor, index, index_len, operation,
+				  MDB_SET, &error);
 
 		if (error)
 			msg(LOG_DEBUG, "Error when reading from DB!");
@@ -941,7 +1630,8 @@ static int check_data_presence(const char * index, const char * data, int * matc
 			break;
 
 		// check strings
-		if (strcmp(data, read) == 0) {
+		if (strncmp(read, data, data_len) == 0 &&
+		    read[data_len] == '\0') {
 			found = 1;
 		}
 
@@ -974,74 +1664,47 @@ long check_from_memfd(int memfd, long *entries)
 {
 	*entries = 0;
 	long problems = 0;
-	struct stat sb;
-	char buff[BUFFER_SIZE];
-	fd_fgets_state_t *st = fd_fgets_init();
+	fd_fgets_state_t *st = open_memfd_reader(memfd);
 
-	if (st == NULL) {
-		msg(LOG_ERR, "Failed to initialize buffered memfd reader");
+	if (st == NULL)
 		return 1;
-	}
-
-	// On any failure, fall back to descriptor based reads
-	lseek(memfd, 0, SEEK_SET); /* rewind in case */
-	if (fstat(memfd, &sb) == 0) {
-		void *base = mmap(NULL, sb.st_size, PROT_READ,
-				  MAP_PRIVATE, memfd, 0);
-		if (base != MAP_FAILED)
-			fd_setvbuf_r(st,base,sb.st_size,MEM_MMAP_FILE);
-	}
 
 	do {
-		int res = fd_fgets_r(st, buff, sizeof(buff), memfd);
+		const char *line;
+		int res = fd_fgets_view_r(st, &line, BUFFER_SIZE, memfd);
 		if (res == -1) {
 			msg(LOG_ERR, "fd_fgets_r on memfd (%s)",
 			    strerror(errno));
 			break;
 		} else if (res > 0) {
 			(*entries)++;
-			char *end = fapolicyd_strnchr(buff, '\n', BUFFER_SIZE);
-			if (end == NULL) {
+			size_t len = res, path_len;
+			if (line[len - 1] != '\n') {
 				msg(LOG_ERR, "Too long line?");
 				continue;
 			}
-			int size = end - buff;
-			*end = '\0';
-
-			// its better to parse it from the end because
-			// there can be space in file name
-			int delims = 0;
-			char *delim = NULL;
-			for (int i = size-1 ; i >= 0 ; i--) {
-				if (isspace(buff[i])) {
-					delim = &buff[i];
-					delims++;
-				}
-				if (delims >= MAX_DELIMS) {
-					buff[i] = '\0';
-					break;
-				}
-			}
+			len--;
 
-			if (delim == NULL) {
-				msg(LOG_ERR, "Malformed backend record: %s",
-				    buff);
+			const char *data = split_trust_record(line, len,
+							      &path_len);
+			if (data == NULL) {
+				msg(LOG_ERR, "Malformed backend record: %.*s",
+				    (int)len, line);
 				continue;
 			}
 
 			// We have everything, now do the check
-			char *index = buff;
-			char *data = delim + 1;
 			int matched = 0;
-			int found = check_data_presence(index, data, &matched);
+			int found = check_data_presence(line, path_len, data,
+						len - (data - line), &matched);
 			if (!found) {
 				problems++;
 				// missing in db
 				// recently added file
 				if (matched == 0) {
 					msg(LOG_DEBUG,
-					    "%s is not in the trust database",
-					    index);
+					    "%.*s is not in the trust database",
+					    (int)path_len, line);
 					backend_added_entries++;
 				}
 
@@ -1049,8 +1712,8 @@ long check_from_memfd(int memfd, long *entries)
 				// data miscompare
 				if (matched > 0) {
 					msg(LOG_DEBUG,
-					    "Trust data miscompare for %s",
-					    index);
+					    "Trust data miscompare for %.*s",
+					    (int)path_len, line);
 				}
 			}
 		}
@@ -1175,9 +1838,10 @@ int unlink_db(void)
 /*
  * DB version 1 = unique keys (0.8 - 0.9.2)
  * DB version 2 = allow duplicate keys (0.9.3 - )
+ * DB version 3 = directory id and file name keys
  *
- * This function is used to detect if we are using version1 of the database.
- * If so, we have to delete the database and rebuild it. We cannot mix
+ * This function is used to detect if we are using an older version of the
+ * database. If so, we have to delete the database and rebuild it. We cannot mix
  * database versions because lmdb doesn't do that.
  * Returns 0 success and 1 for failure.
  */
@@ -1188,32 +1852,138 @@ static int migrate_database(void)
 
 	snprintf(vpath, sizeof(vpath), "%s/db.ver", data_dir);
 	fd = open(vpath, O_RDONLY);
+	if (fd >= 0) {
+		// We have a version file, read it and check the version
+		int rc = read(fd, vpath, 2);
+		close(fd);
+		if ((rc > 0) && (vpath[0] == '3'))
+			return 0;
+		if ((rc <= 0) || (vpath[0] != '2'))
+			return 1;
+		// unlink_db() removes the version file as well
+		snprintf(vpath, sizeof(vpath), "%s/db.ver", data_dir);
+	}
+
+	msg(LOG_INFO, "Trust database migration will be performed.");
+
+	// A version1 db does not track versions, and the keys of a
+	// version2 db are full paths
+	if (unlink_db())
+		return 1;
+
+	// Create the new, db version tracker and write current version
+	fd = open(vpath, O_CREAT|O_EXCL|O_WRONLY, 0640);
 	if (fd < 0) {
-		msg(LOG_INFO, "Trust database migration will be performed.");
+		msg(LOG_ERR, "Failed writing db version %s",
+		    strerror(errno));
+		return 1;
+	}
+	write(fd, "3", 1);
+	close(fd);
 
-		// Then we have a version1 db since it does not track versions
-		if (unlink_db())
-			return 1;
+	return 0;
+}
 
-		// Create the new, db version tracker and write current version
-		fd = open(vpath, O_CREAT|O_EXCL|O_WRONLY, 0640);
-		if (fd < 0) {
-			msg(LOG_ERR, "Failed writing db version %s",
-			    strerror(errno));
+
+/*
+ * rebuild_digest_index - Index every record of the path index by digest.
+ * @txn: Open write transaction with the digest index opened in it.
+ * Returns 0 on success and 1 on failure.
+ */
+static int rebuild_digest_index(MDB_txn *txn)
+{
+	MDB_cursor *cursor;
+	MDB_val key, value;
+	long entries = 0;
+	int rc;
+
+	if (open_dbi(txn))
+		return 1;
+	if ((rc = mdb_cursor_open(txn, dbi, &cursor))) {
+		msg(LOG_ERR, "mdb_cursor_open -> %s", mdb_strerror(rc));
+		return 1;
+	}
+
+	rc = mdb_cursor_get(cursor, &key, &value, MDB_FIRST);
+	while (rc == 0 && !stop) {
+		if (put_digest(txn, &key, value.mv_data, value.mv_size, 0)) {
+			mdb_cursor_close(cursor);
 			return 1;
 		}
-		write(fd, "2", 1);
-		close(fd);
+		entries++;
+		rc = mdb_cursor_get(cursor, &key, &value, MDB_NEXT);
+	}
+	mdb_cursor_close(cursor);
 
-		return 0;
-	} else {
-		// We have a version file, read it and check the version
-		int rc = read(fd, vpath, 2);
-		close(fd);
-		if ((rc > 0) && (vpath[0] == '2'))
+	if (rc && rc != MDB_NOTFOUND) {
+		msg(LOG_ERR, "Indexing the trust database failed (%s)",
+		    mdb_strerror(rc));
+		return 1;
+	}
+	if (entries)
+		msg(LOG_INFO, "Indexed %ld trust database entries by digest",
+		    entries);
+	return stop;
+}
+
+/*
+ * init_digest_index - Open or drop the digest index as configured.
+ * @config: Daemon configuration.
+ *
+ * The index is opened in a committed transaction so that its handle
+ * stays valid for every later transaction, readers included. An empty
+ * index next to a populated path index, left by a run with the option
+ * off, is rebuilt. Must run before any record is written.
+ * Returns 0 on success and 1 on failure.
+ */
+static int init_digest_index(const conf_t *config)
+{
+	MDB_txn *txn;
+	MDB_stat st;
+	int rc;
+
+	if ((rc = mdb_txn_begin(env, NULL, 0, &txn)))
+		goto err;
+
+	if (!config->digest_index) {
+		rc = mdb_dbi_open(txn, digest_db, MDB_DUPSORT, &digest_dbi);
+		if (rc == MDB_NOTFOUND) {
+			mdb_txn_abort(txn);
 			return 0;
+		}
+		// Updates made while it is off would not be in it
+		if (rc == 0 && (rc = mdb_drop(txn, digest_dbi, 1)) == 0) {
+			if ((rc = mdb_txn_commit(txn)))
+				goto err;
+			msg(LOG_INFO, "Dropped the trust digest index");
+			return 0;
+		}
+		mdb_txn_abort(txn);
+		goto err;
 	}
 
+	if ((rc = mdb_dbi_open(txn, digest_db, MDB_CREATE|MDB_DUPSORT,
+			       &digest_dbi)) ||
+	    (rc = mdb_stat(txn, digest_dbi, &st))) {
+		abort_transaction(txn);
+		goto err;
+	}
+
+	digest_index = 1;
+	if (st.ms_entries == 0 && rebuild_digest_index(txn)) {
+		abort_transaction(txn);
+		digest_index = 0;
+		return 1;
+	}
+
+	if ((rc = mdb_txn_commit(txn))) {
+		digest_index = 0;
+		goto err;
+	}
+	return 0;
+err:
+	msg(LOG_ERR, "Cannot set up the trust digest index (%s)",
+	    mdb_strerror(rc));
 	return 1;
 }
 
@@ -1257,6 +2027,12 @@ int init_database(conf_t *config)
 	}
 
 	rc = database_empty();
+
+	if (init_digest_index(config)) {
+		close_db(0);
+		return 1;
+	}
+
 	if (rc > 0) {
 		if ((rc = create_database(/*with_sync*/1))) {
 			msg(LOG_ERR,
@@ -1265,6 +2041,7 @@ int init_database(conf_t *config)
 			close_db(0);
 			return rc;
 		}
+		set_backends_synced(1);
 	} else {
 		// check if our internal database is synced
 		rc = check_database_copy();
@@ -1273,7 +2050,8 @@ int init_database(conf_t *config)
 			if (rc)
 				msg(LOG_ERR,
 				    "Failed updating the trust database");
-		}
+		} else if (rc == 0)
+			set_backends_synced(1);
 	}
 
 	// Conserve memory by dumping unneeded resources
@@ -1294,8 +2072,8 @@ int init_database(conf_t *config)
  * It returns a 1 if the file is found and trustworthy. Callers have to
  * check the error variable before trusting it's results.
  */
-static int read_trust_db(const char *path, int *error, struct file_info *info,
-	int fd)
+static int read_trust_db(MDB_cursor *cursor, MDB_cursor_op seek,
+	const char *path, int *error, struct file_info *info, int fd)
 {
 	int do_integrity = 0, mode = READ_TEST_KEY;
 	char *res;
@@ -1320,7 +2098,7 @@ retry_res:
 		return 0;
 	}
 
-	res = lt_read_db(path, mode, error);
+	res = lt_read_db(cursor, path, strlen(path), mode, seek, error);
 
 	// For subjects we do a limited check because the process had to
 	// pass some kind of trust check to even be started and we do not
@@ -1456,22 +2234,75 @@ retry_res:
 	return 0;
 }
 
-// Returns a 1 if trusted and 0 if not and -1 on error
-int check_trust_database(const char *path, struct file_info *info, int fd)
+/*
+ * check_trust_digest - look a file up by content in the digest index.
+ * @txn: Read transaction to use.
+ * @path: Path of the file, for logging.
+ * @info: File information, the digest is used when already known.
+ * @fd: Open file, its IMA digest is read when that is the integrity mode.
+ *
+ * Nothing is hashed here: without a cached digest or an IMA measurement
+ * the file is simply not found.
+ * Returns 1 if trusted, 0 if not and -1 on error.
+ */
+static int check_trust_digest(MDB_txn *txn, const char *path,
+			      struct file_info *info, int fd)
 {
-	int retval = 0, error;
-	int res;
+	char kbuf[DIGEST_KEY_MAX];
+	file_hash_alg_t alg;
+	MDB_val key, value;
+	int rc;
 
-	// this function is going to be used from decision_thread that means
-	// we need to be sure database won't change under our hands.
-	lock_update_thread();
+	if (info->digest[0] == 0) {
+		if (integrity != IN_IMA ||
+		    get_ima_hash(fd, &alg, info->digest) == 0) {
+			info->digest[0] = 0;
+			return 0;
+		}
+		file_info_cache_digest(info, alg);
+	}
 
-	if (start_long_term_read_ops()) {
-		unlock_update_thread();
+	key.mv_size = snprintf(kbuf, sizeof(kbuf), "%llu %s",
+			       (unsigned long long)info->size, info->digest);
+	key.mv_data = kbuf;
+	if ((rc = mdb_get(txn, digest_dbi, &key, &value))) {
+		if (rc == MDB_NOTFOUND)
+			return 0;
+		msg(LOG_ERR, "digest index get:%s", mdb_strerror(rc));
 		return -1;
 	}
 
-	res = read_trust_db(path, &error, info, fd);
+	// The entry holds the trust source and key of the matching record
+	const char *sep = memchr(value.mv_data, ' ', value.mv_size);
+	char stored[PATH_MAX];
+
+	if (sep) {
+		MDB_val skey;
+
+		skey.mv_data = (void *)(sep + 1);
+		skey.mv_size = value.mv_size -
+			       (sep + 1 - (const char *)value.mv_data);
+		if (trust_db_key_path(txn, dirs_dbi, &skey, stored,
+				      sizeof(stored)) == 0)
+			msg(LOG_DEBUG, "%s trusted by content of %s", path,
+			    stored);
+	}
+	return 1;
+}
+
+/*
+ * check_trust_cursor - look a file up with the given cursor, retrying
+ * without the /usr prefix on systems where the top level directories are
+ * symlinks into /usr.
+ * Returns 1 if trusted, 0 if not and -1 on error.
+ */
+static int check_trust_cursor(MDB_cursor *cursor, MDB_cursor_op seek,
+			      const char *path, struct file_info *info, int fd)
+{
+	int retval = 0, error;
+	int res;
+
+	res = read_trust_db(cursor, seek, path, &error, info, fd);
 	if (error)
 		retval = -1;
 	else if (res)
@@ -1491,7 +2322,8 @@ int check_trust_database(const char *path, struct file_info *info, int fd)
 			    (sbin_symlink &&
 			     strncmp(&path[5], "sbin/", 5) == 0)) {
 				// We have a symlink, retry
-				res = read_trust_db(&path[4], &error, info, fd);
+				res = read_trust_db(cursor, seek, &path[4],
+						    &error, info, fd);
 				if (error)
 					retval = -1;
 				else if (res)
@@ -1500,6 +2332,30 @@ int check_trust_database(const char *path, struct file_info *info, int fd)
 		}
 	}
 
+	// Copies, bind mounts and overlays of trusted files by content
+	if (retval == 0 && digest_index && info)
+		retval = check_trust_digest(mdb_cursor_txn(cursor), path,
+					    info, fd);
+
+	return retval;
+}
+
+// Returns a 1 if trusted and 0 if not and -1 on error
+int check_trust_database(const char *path, struct file_info *info, int fd)
+{
+	int retval;
+
+	// this function is going to be used from decision_thread that means
+	// we need to be sure database won't change under our hands.
+	lock_update_thread();
+
+	if (start_long_term_read_ops()) {
+		unlock_update_thread();
+		return -1;
+	}
+
+	retval = check_trust_cursor(lt_cursor, MDB_SET, path, info, fd);
+
 	end_long_term_read_ops();
 	unlock_update_thread();
 
@@ -1507,6 +2363,196 @@ int check_trust_database(const char *path, struct file_info *info, int fd)
 }
 
 
+static int compare_lookup(const void *a, const void *b)
+{
+	const struct trust_lookup *la = *(struct trust_lookup * const *)a;
+	const struct trust_lookup *lb = *(struct trust_lookup * const *)b;
+
+	return strcmp(la->path, lb->path);
+}
+
+/*
+ * check_trust_batch - look every file of a batch up with one cursor.
+ * @cursor: cursor of an open read transaction.
+ * @files: lookups, their trusted field is filled in.
+ * @count: number of lookups.
+ *
+ * The paths are visited in name order, which keeps the files of a
+ * directory together, and the cursor is moved with MDB_SET_RANGE, so
+ * consecutive files of a directory reuse the directory id just looked
+ * up and are found on the leaf page the cursor is already on. Directory
+ * ids do not follow name order, so moving to the next directory or to
+ * a path stored under its digest costs a full seek but gives the same
+ * answer.
+ * Returns the number of trusted files.
+ */
+static unsigned int check_trust_batch(MDB_cursor *cursor,
+				      struct trust_lookup *files,
+				      unsigned int count)
+{
+	struct trust_lookup **order = malloc(count * sizeof(*order));
+	unsigned int trusted = 0;
+
+	// Without memory to sort, look them up as they come
+	if (order == NULL) {
+		for (unsigned int i = 0; i < count; i++) {
+			files[i].trusted = check_trust_cursor(cursor, MDB_SET,
+					files[i].path, files[i].info,
+					files[i].fd);
+			trusted += files[i].trusted == 1;
+		}
+		return trusted;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+		order[i] = &files[i];
+	qsort(order, count, sizeof(*order), compare_lookup);
+
+	for (unsigned int i = 0; i < count; i++) {
+		struct trust_lookup *f = order[i];
+
+		f->trusted = check_trust_cursor(cursor, MDB_SET_RANGE,
+						f->path, f->info, f->fd);
+		trusted += f->trusted == 1;
+	}
+	free(order);
+
+	return trusted;
+}
+
+/*
+ * check_trust_database_batch - check many files in one read transaction.
+ * @files: lookups, their trusted field is set as check_trust_database()
+ * would return it.
+ * @count: number of lookups.
+ * Returns the number of trusted files, or -1 if the database could not
+ * be read, in which case every lookup is marked as an error.
+ */
+int check_trust_database_batch(struct trust_lookup *files, unsigned int count)
+{
+	int trusted;
+
+	lock_update_thread();
+
+	if (start_long_term_read_ops()) {
+		unlock_update_thread();
+		for (unsigned int i = 0; i < count; i++)
+			files[i].trusted = -1;
+		return -1;
+	}
+
+	trusted = check_trust_batch(lt_cursor, files, count);
+
+	end_long_term_read_ops();
+	unlock_update_thread();
+
+	return trusted;
+}
+
+/*
+ * A trust reader holds a read transaction of its own. LMDB readers do not
+ * block each other or the writer, so threads that each open one can check
+ * files at the same time without the update lock. The transaction is a
+ * snapshot: updates committed after it was opened are not seen. It must be
+ * used and closed by the thread that opened it.
+ */
+struct trust_reader {
+	MDB_txn *txn;
+	MDB_cursor *cursor;
+};
+
+/*
+ * Aborting the transaction that opened a database handle closes it, which
+ * is what every other transaction here does. Trust readers would close it
+ * under each other that way, so they share reader_dbi, opened once in a
+ * committed transaction and valid until the environment is closed.
+ */
+// Must be called with the update lock held
+static int open_reader_dbi(void)
+{
+	MDB_txn *txn;
+	int rc;
+
+	if (reader_dbi_open)
+		return 0;
+	// Events that carry their trust are evaluated without a database
+	if (env == NULL)
+		return 1;
+
+	if ((rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn)))
+		goto err;
+	if ((rc = mdb_dbi_open(txn, db, MDB_DUPSORT, &reader_dbi))) {
+		mdb_txn_abort(txn);
+		goto err;
+	}
+	if ((rc = mdb_txn_commit(txn)))
+		goto err;
+
+	reader_dbi_open = 1;
+	return 0;
+err:
+	msg(LOG_ERR, "trust reader dbi_open:%s", mdb_strerror(rc));
+	return 1;
+}
+
+/*
+ * trust_reader_open - start a read transaction for the calling thread.
+ * Returns the reader, or NULL when the database is not open or no reader
+ * slot or memory is left.
+ */
+trust_reader_t *trust_reader_open(void)
+{
+	trust_reader_t *r = malloc(sizeof(*r));
+	int rc;
+
+	if (r == NULL)
+		return NULL;
+
+	lock_update_thread();
+	if (open_reader_dbi())
+		goto err;
+	if ((rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &r->txn))) {
+		msg(LOG_DEBUG, "trust reader txn_begin:%s", mdb_strerror(rc));
+		goto err;
+	}
+	if ((rc = mdb_cursor_open(r->txn, reader_dbi, &r->cursor))) {
+		msg(LOG_ERR, "trust reader cursor_open:%s", mdb_strerror(rc));
+		mdb_txn_abort(r->txn);
+		goto err;
+	}
+	unlock_update_thread();
+
+	return r;
+err:
+	unlock_update_thread();
+	free(r);
+	return NULL;
+}
+
+// Same as check_trust_database() but within the reader's transaction
+int trust_reader_check(trust_reader_t *r, const char *path,
+		       struct file_info *info, int fd)
+{
+	return check_trust_cursor(r->cursor, MDB_SET, path, info, fd);
+}
+
+// Same as check_trust_database_batch() but within the reader's transaction
+int trust_reader_check_batch(trust_reader_t *r, struct trust_lookup *files,
+			     unsigned int count)
+{
+	return check_trust_batch(r->cursor, files, count);
+}
+
+void trust_reader_close(trust_reader_t *r)
+{
+	if (r == NULL)
+		return;
+	mdb_cursor_close(r->cursor);
+	mdb_txn_abort(r->txn);
+	free(r);
+}
+
+
 void close_database(void)
 {
 	pthread_join(update_thread, NULL);
@@ -1591,25 +2637,31 @@ static int update_database(conf_t *config)
 
 	lock_update_thread();
 
-	if ((rc = delete_all_entries_db())) {
-		msg(LOG_ERR, "Cannot delete database (%d)", rc);
-		unlock_update_thread();
-		return rc;
-	}
+	// Until this succeeds the db no longer matches any backend load
+	set_backends_synced(0);
 
-	if (stop) {
-		unlock_update_thread();
-		return 1;
-	}
+	if (have_backend_delta()) {
+		rc = update_database_delta();
+	} else {
+		if ((rc = delete_all_entries_db())) {
+			msg(LOG_ERR, "Cannot delete database (%d)", rc);
+			unlock_update_thread();
+			return rc;
+		}
+
+		if (stop) {
+			unlock_update_thread();
+			return 1;
+		}
 
-	if (!stop)
 		rc = create_database(/*with_sync*/0);
-	else
-		rc = 1;
+	}
 
 	// signal that cache need to be flushed
-	if (!stop)
+	if (!stop) {
 		needs_flush = true;
+		reply_cache_invalidate();
+	}
 
 	unlock_update_thread();
 	mdb_env_sync(env, 1);
@@ -1620,48 +2672,142 @@ static int update_database(conf_t *config)
 		return rc;
 	}
 
+	set_backends_synced(1);
 	return 0;
 }
 
 /*
- * handle_record - Process a single update command received from the FIFO.
- * @buffer: Raw line of text read from the update pipe. For file updates the
- *          buffer contains a path, file size, and SHA256 hash separated by
- *          whitespace.
+ * parse_record - Turn a FIFO file update line into a trust record.
+ * @line: Raw line of text read from the update pipe. It contains a path,
+ *        file size, and SHA256 hash separated by whitespace and is not
+ *        NUL terminated.
+ * @len: Length of @line without the newline.
+ * @path: Receives the path, at least 2049 bytes.
+ * @data: Receives the record data, at least BUFFER_SIZE bytes.
  *
- * Returns 0 after successfully storing the record, 1 when processing should
- * stop due to malformed data or a shutdown request.
+ * Returns 0 on success and 1 for malformed input.
  */
-static int handle_record(const char * buffer)
+static int parse_record(const char *line, int len, char *path, char *data)
 {
-	char path[2048+1];
+	char buffer[BUFFER_SIZE];
 	char hash[64+1];
 	off_t size;
 
-	if (stop)
-		return 1;
+	// sscanf needs a string, the view is valid up to the newline
+	if (len >= BUFFER_SIZE)
+		len = BUFFER_SIZE - 1;
+	memcpy(buffer, line, len);
+	buffer[len] = '\0';
 
 	// validating input
 	int res = sscanf(buffer, "%2048s %lu %64s", path, &size, hash);
-	msg(LOG_DEBUG, "update_thread: Parsing input buffer: %s", buffer);
-	msg(LOG_DEBUG,
-	    "update_thread: Parsing input words(expected 3): %d",
-	    res);
-
 	if (res != 3) {
+		msg(LOG_DEBUG, "update_thread: Cannot parse %s", buffer);
 		msg(LOG_INFO, "Corrupted data read, ignoring...");
 		return 1;
 	}
 
-	char data[BUFFER_SIZE];
 	snprintf(data, BUFFER_SIZE, DATA_FORMAT, (unsigned int)SRC_UNKNOWN,
 		 size, hash);
+	return 0;
+}
 
-	msg(LOG_DEBUG, "update_thread: Saving %s %s", path, data);
+/*
+ * write_batch - Apply the queued FIFO records in one write transaction.
+ *
+ * The update lock is taken once for the whole batch and the decision
+ * cache is flushed once afterwards. The queue is emptied either way.
+ * Returns 0 on success and non-zero if the transaction failed.
+ */
+static int write_batch(void)
+{
+	struct timespec start, end;
+	MDB_txn *txn;
+	unsigned int i;
+	int rc = 0;
+
+	if (batch.count == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	lock_update_thread();
-	write_db(path, data);
+	if (mdb_txn_begin(env, NULL, 0, &txn)) {
+		rc = 1;
+		goto unlock;
+	}
+
+	if (open_dbi(txn)) {
+		abort_transaction(txn);
+		rc = 2;
+		goto unlock;
+	}
+
+	for (i = 0; i < batch.count && !stop; i++) {
+		const char *path = batch_path(&batch, i);
+		size_t path_len = strlen(path);
+		const char *data = batch_data(&batch, i);
+
+		if ((rc = put_record(txn, path, path_len, data, strlen(data),
+				     0))) {
+			msg(LOG_ERR, "Error writing %s to the trust database",
+			    path);
+			break;
+		}
+	}
+
+	if (rc || stop) {
+		abort_transaction(txn);
+		rc = rc ? rc : 1;
+	} else if ((rc = mdb_txn_commit(txn))) {
+		msg(LOG_ERR, "%s", mdb_strerror(rc));
+		rc = 4;
+	} else {
+		needs_flush = true;
+		reply_cache_invalidate();
+	}
+unlock:
 	unlock_update_thread();
 
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (rc)
+		msg(LOG_ERR, "Failed to apply update batch of %u records (%d)",
+		    batch.count, rc);
+	else
+		msg(LOG_DEBUG,
+		    "update_thread: Applied batch of %u records in %.3fs",
+		    batch.count, (end.tv_sec - start.tv_sec) +
+		    (end.tv_nsec - start.tv_nsec) / 1e9);
+
+	batch_clear(&batch);
+
+	return rc;
+}
+
+/*
+ * queue_record - Add a FIFO file update line to the batch.
+ * @line: Raw line of text read from the update pipe, see parse_record.
+ * @len: Length of @line without the newline.
+ *
+ * The batch is written when the pipe has been drained. Very large ones
+ * are written out every BATCH_MAX records so the queue stays bounded.
+ * Returns 0 on success and 1 on error.
+ */
+static int queue_record(const char *line, int len)
+{
+	char path[2048+1];
+	char data[BUFFER_SIZE];
+
+	if (parse_record(line, len, path, data))
+		return 1;
+
+	if (batch_add(&batch, path, data)) {
+		msg(LOG_ERR, "Out of memory queueing update batch");
+		return 1;
+	}
+
+	if (batch_full(&batch))
+		write_batch();
+
 	return 0;
 }
 
@@ -1703,7 +2849,6 @@ static void *update_thread_main(void *arg)
 {
 	int rc;
 	sigset_t sigs;
-	char buff[BUFFER_SIZE];
 	char err_buff[BUFFER_SIZE];
 	conf_t *config = (conf_t *)arg;
 
@@ -1793,23 +2938,20 @@ static void *update_thread_main(void *arg)
 				do {
 					if (stop)
 						break;
-					int res = fd_fgets_r(st, buff,
-						sizeof(buff), ffd[0].fd);
+					const char *line;
+					int res = fd_fgets_view_r(st, &line,
+						BUFFER_SIZE, ffd[0].fd);
 
 					// nothing to read
 					if (res == -1)
 						break;
 					else if (res > 0) {
-						char* end  = strchr(buff, '\n');
-
-						if (end == NULL) {
+						if (line[res - 1] != '\n') {
 							msg(LOG_ERR, "Too long line?");
 							continue;
 						}
 
-						int count = end - buff;
-
-						*end = '\0';
+						int count = res - 1;
 
 						for (int i = 0 ; i < count ; i++) {
 							/*
@@ -1822,38 +2964,55 @@ static void *update_thread_main(void *arg)
 								break;
 							// assume file name
 							// operation = 0
-							if (buff[i] == '/') {
+							if (line[i] == '/') {
 								do_operation = ONE_FILE;
 								break;
 							}
 
-							if (buff[i] == RELOAD_TRUSTDB_COMMAND) {
+							if (line[i] == RELOAD_TRUSTDB_COMMAND) {
 								do_operation = RELOAD_DB;
 								break;
 							}
 
-							if (buff[i] == FLUSH_CACHE_COMMAND) {
+							if (line[i] == FLUSH_CACHE_COMMAND) {
 								do_operation = FLUSH_CACHE;
 								break;
 							}
 
-							if (buff[i] == RELOAD_RULES_COMMAND) {
+							if (line[i] == RELOAD_RULES_COMMAND) {
 								do_operation = RELOAD_RULES;
 								break;
 							}
 
-							if (isspace(buff[i]))
+							if (line[i] == BEGIN_BATCH_COMMAND) {
+								do_operation = BEGIN_BATCH;
+								break;
+							}
+
+							if (line[i] == COMMIT_BATCH_COMMAND) {
+								do_operation = COMMIT_BATCH;
+								break;
+							}
+
+							if (isspace((unsigned char)line[i]))
 								continue;
 
-							msg(LOG_ERR, "Cannot handle data \"%s\" from pipe", buff);
+							msg(LOG_ERR, "Cannot handle data \"%.*s\" from pipe",
+							    count, line);
 							break;
 						}
 
-						*end = '\n';
-
 						if (stop)
 							break;
 
+						/*
+						 * Records read so far go in before
+						 * any other command, which may depend
+						 * on them.
+						 */
+						if (do_operation != ONE_FILE)
+							write_batch();
+
 						// got "1" -> reload db
 						if (do_operation == RELOAD_DB) {
 							/*
@@ -1890,6 +3049,7 @@ static void *update_thread_main(void *arg)
 							 */
 							do_operation = DB_NO_OP;
 							needs_flush = true;
+							reply_cache_invalidate();
 						} else if (do_operation == ONE_FILE) {
 							/*
 							 * Backend helpers send path/size/hash
@@ -1897,18 +3057,30 @@ static void *update_thread_main(void *arg)
 							 * changed on disk.
 							 */
 							do_operation = DB_NO_OP;
-							if (handle_record(buff))
+							if (queue_record(line, count))
 								continue;
+						} else if (do_operation == BEGIN_BATCH ||
+							   do_operation == COMMIT_BATCH) {
+							/*
+							 * Batch markers only bound a group
+							 * of records, which was written out
+							 * above. Nothing waits for a commit.
+							 */
+							do_operation = DB_NO_OP;
 						}
 					}
 
 				} while(!fd_fgets_eof_r(st) && !stop);
 				fd_fgets_destroy(st);
+
+				// The pipe is drained, apply what came in
+				write_batch();
 			}
 		}
 	}
 
 finalize:
+	batch_free(&batch);
 	close(ffd[0].fd);
 	unlink_fifo();
 
@@ -1922,6 +3094,21 @@ finalize:
  * only operation.
  ***********************************************************************/
 static walkdb_entry_t wdb_entry;
+static MDB_val wdb_key;
+static char wdb_path[PATH_MAX];
+
+// Point the entry at the path the current key stands for
+static int walk_decode_path(void)
+{
+	if (trust_db_key_path(lt_txn, dirs_dbi, &wdb_key, wdb_path,
+			      sizeof(wdb_path))) {
+		printf("Cannot decode a trust database key\n");
+		return 1;
+	}
+	wdb_entry.path.mv_data = wdb_path;
+	wdb_entry.path.mv_size = strlen(wdb_path);
+	return 0;
+}
 
 // Returns 0 on success and 1 on failure
 int walk_database_start(conf_t *config)
@@ -1953,9 +3140,9 @@ int walk_database_start(conf_t *config)
 		return 1;
 	}
 
-	if ((rc = mdb_cursor_get(lt_cursor, &wdb_entry.path, &wdb_entry.data,
+	if ((rc = mdb_cursor_get(lt_cursor, &wdb_key, &wdb_entry.data,
 							MDB_FIRST)) == 0)
-		return 0;
+		return walk_decode_path();
 
 	if (rc != MDB_NOTFOUND)
 		puts(mdb_strerror(rc));
@@ -1973,9 +3160,9 @@ int walk_database_next(void)
 {
 	int rc;
 
-	if ((rc = mdb_cursor_get(lt_cursor, &wdb_entry.path, &wdb_entry.data,
+	if ((rc = mdb_cursor_get(lt_cursor, &wdb_key, &wdb_entry.data,
 							MDB_NEXT)) == 0)
-		return 1;
+		return !walk_decode_path();
 
 	if (rc != MDB_NOTFOUND)
 		puts(mdb_strerror(rc));
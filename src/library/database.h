@@ -45,7 +45,27 @@ int preconstruct_fifo(const conf_t *config) __nonnull ((1));
 int init_database(conf_t *config) __nonnull ((1));
 int check_trust_database(const char *path, struct file_info *info, int fd)
 	__nonnull ((1));
+
+// One file of a batch lookup
+struct trust_lookup {
+	const char *path;
+	struct file_info *info;	// NULL to only check the path is known
+	int fd;
+	int trusted;		// 1 if trusted, 0 if not and -1 on error
+};
+int check_trust_database_batch(struct trust_lookup *files,
+			       unsigned int count) __nonnull ((1));
 void set_reload_trust_database(void);
+
+// Read only checks that can run on several threads at once
+#define TRUST_READERS_MAX 8
+typedef struct trust_reader trust_reader_t;
+trust_reader_t *trust_reader_open(void);
+int trust_reader_check(trust_reader_t *r, const char *path,
+		       struct file_info *info, int fd) __nonnull ((1, 2));
+int trust_reader_check_batch(trust_reader_t *r, struct trust_lookup *files,
+			     unsigned int count) __nonnull ((1, 2));
+void trust_reader_close(trust_reader_t *r);
 void close_database(void);
 void database_report(FILE *f);
 int unlink_db(void) __wur;
@@ -56,12 +76,24 @@ void unlock_rule(void);
 
 // Database verification functions
 int walk_database_start(conf_t *config) __nonnull ((1));
+int trust_db_key_path(MDB_txn *txn, MDB_dbi dirs, const MDB_val *key,
+		      char *buf, size_t len);
 walkdb_entry_t *walk_database_get_entry(void);
 int walk_database_next(void);
 void walk_database_finish(void);
 
+/*
+ * Commands accepted on the update FIFO, one per line. A line starting
+ * with '/' is a "<path> <size> <sha256>" file update. File updates read
+ * together are applied in a single database transaction followed by one
+ * cache flush as soon as the pipe is drained. BEGIN_BATCH_COMMAND and
+ * COMMIT_BATCH_COMMAND only end such a group early, updates are never
+ * held back waiting for a commit.
+ */
 #define RELOAD_TRUSTDB_COMMAND '1'
 #define FLUSH_CACHE_COMMAND '2'
 #define RELOAD_RULES_COMMAND '3'
+#define BEGIN_BATCH_COMMAND '4'
+#define COMMIT_BATCH_COMMAND '5'
 
 #endif
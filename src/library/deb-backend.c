@@ -4,6 +4,12 @@
 #include <dpkg/program.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -17,6 +23,9 @@
 #include "file.h"
 #include "message.h"
 #include "md5-backend.h"
+#include "paths.h"
+
+extern atomic_bool stop;
 
 static const char kDebBackend[] = "debdb";
 
@@ -31,6 +40,8 @@ backend deb_backend = {
     deb_destroy_backend,
     -1,
     -1,
+    0,
+    0,
 };
 
 // ================================================================
@@ -119,28 +130,307 @@ void parse_filehash2(struct pkginfo *pkg, struct pkgbin *pkgbin)
 // End of functions copied from dpkg.
 // =======================================================================
 
+/*
+ * Records are deduplicated in a table split into shards, each with its
+ * own lock, so the loader threads rarely contend on it.
+ */
+#define RECORD_SHARDS 64
+
+struct record_table {
+  struct _hash_record *shard[RECORD_SHARDS];
+  pthread_mutex_t lock[RECORD_SHARDS];
+};
+
+static void record_table_init(struct record_table *table)
+{
+  for (int i = 0; i < RECORD_SHARDS; i++) {
+    table->shard[i] = NULL;
+    pthread_mutex_init(&table->lock[i], NULL);
+  }
+}
+
+static void record_table_destroy(struct record_table *table)
+{
+  struct _hash_record *item, *tmp;
+
+  for (int i = 0; i < RECORD_SHARDS; i++) {
+    HASH_ITER(hh, table->shard[i], item, tmp) {
+      HASH_DEL(table->shard[i], item);
+      free((void *)item->key);
+      free(item);
+    }
+    pthread_mutex_destroy(&table->lock[i]);
+  }
+}
+
+// FNV-1a, only used to pick the shard
+static unsigned int record_shard(const char *line, size_t len)
+{
+  unsigned int hash = 2166136261u;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)line[i];
+    hash *= 16777619u;
+  }
+  return hash % RECORD_SHARDS;
+}
+
+/*
+ * Remember a record, returns 1 if it was already present, 0 if it was
+ * added, and -1 on allocation failure.
+ */
+static int record_table_seen(struct record_table *table, const char *line,
+                             size_t len)
+{
+  unsigned int i = record_shard(line, len);
+  struct _hash_record *rcd = NULL;
+  int rc = 0;
+
+  pthread_mutex_lock(&table->lock[i]);
+  HASH_FIND(hh, table->shard[i], line, len, rcd);
+  if (rcd) {
+    rc = 1;
+  } else {
+    rcd = malloc(sizeof(struct _hash_record));
+    if (rcd) rcd->key = strndup(line, len);
+    if (rcd && rcd->key) {
+      HASH_ADD_KEYPTR(hh, table->shard[i], rcd->key, len, rcd);
+    } else {
+      free(rcd);
+      rc = -1;
+    }
+  }
+  pthread_mutex_unlock(&table->lock[i]);
+  return rc;
+}
+
+/*
+ * Package iteration has to stay on one thread since libdpkg is not
+ * thread safe, but verifying and hashing the files of a package is
+ * handed to a pool of workers. Packages are queued in a ring with
+ * copies of their file names and MD5 sums, and their records are
+ * written in package order. A file listed by several packages is sent
+ * once, with the record of whichever worker got to it first.
+ */
+#define MAX_LOADER_THREADS 8
+#define ITEMS_PER_THREAD 16
+
+struct deb_file {
+  char *path;
+  char *md5;
+};
+
+struct load_item {
+  struct deb_file *files;
+  size_t count;
+  size_t size;
+  char *out;         // records to send after dedup
+  size_t out_len;
+  size_t out_size;
+  int done;
+  int failed;
+};
+
+struct deb_loader {
+  struct md5_cache cache;
+  struct record_table seen;
+  struct load_item *items;
+  unsigned int depth;
+  unsigned int head;  // next item to write out
+  unsigned int next;  // next item for a worker
+  unsigned int tail;  // next free item
+  int finished;
+  atomic_bool failed;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+};
+
+static int item_add_file(struct load_item *item, const char *path,
+                         const char *md5)
+{
+  if (item->count == item->size) {
+    size_t size = item->size ? item->size * 2 : 64;
+    struct deb_file *tmp = realloc(item->files, size * sizeof(*tmp));
+    if (tmp == NULL) return 1;
+    item->files = tmp;
+    item->size = size;
+  }
+  struct deb_file *f = &item->files[item->count];
+  f->path = strdup(path);
+  f->md5 = strdup(md5);
+  if (f->path == NULL || f->md5 == NULL) {
+    free(f->path);
+    free(f->md5);
+    return 1;
+  }
+  item->count++;
+  return 0;
+}
+
+static int item_add_record(struct load_item *item, const char *line,
+                           size_t len)
+{
+  size_t need = item->out_len + len + 1;
+
+  if (need > item->out_size) {
+    size_t size = item->out_size ? item->out_size : 4096;
+    while (size < need) size *= 2;
+    char *tmp = realloc(item->out, size);
+    if (tmp == NULL) return 1;
+    item->out = tmp;
+    item->out_size = size;
+  }
+  memcpy(item->out + item->out_len, line, len);
+  item->out_len += len;
+  item->out[item->out_len++] = '\n';
+  return 0;
+}
+
+static void reset_item(struct load_item *item)
+{
+  for (size_t i = 0; i < item->count; i++) {
+    free(item->files[i].path);
+    free(item->files[i].md5);
+  }
+  item->count = 0;
+  item->out_len = 0;
+  item->done = 0;
+  item->failed = 0;
+}
+
+/*
+ * Verify the files of one package and turn them into trust records.
+ * Runs on a worker thread. Returns 0 on success and 1 if a file could
+ * not be trusted, which fails the whole load.
+ */
+static int expand_item(struct deb_loader *ld, struct load_item *item)
+{
+  char line[PATH_MAX + FILE_DIGEST_STRING_MAX + 64];
+
+  for (size_t i = 0; i < item->count; i++) {
+    if (stop || ld->failed) return 1;
+
+    int len = get_file_record_by_md5(item->files[i].path,
+                                     item->files[i].md5, &ld->cache,
+                                     SRC_DEB, line, sizeof(line));
+    if (len < 0) return 1;
+
+    // Getting rid of the duplicates.
+    int seen = record_table_seen(&ld->seen, line, len);
+    if (seen < 0 || (seen == 0 && item_add_record(item, line, len)))
+      return 1;
+  }
+  return 0;
+}
+
+static void *loader_worker(void *arg)
+{
+  struct deb_loader *ld = arg;
+
+  pthread_mutex_lock(&ld->lock);
+  while (1) {
+    while (ld->next == ld->tail && !ld->finished)
+      pthread_cond_wait(&ld->work, &ld->lock);
+    if (ld->next == ld->tail) break;
+
+    struct load_item *item = &ld->items[ld->next++ % ld->depth];
+    pthread_mutex_unlock(&ld->lock);
+
+    int failed = expand_item(ld, item);
+    if (failed) ld->failed = true;
+
+    pthread_mutex_lock(&ld->lock);
+    item->failed = failed;
+    item->done = 1;
+    pthread_cond_broadcast(&ld->done);
+  }
+  pthread_mutex_unlock(&ld->lock);
+
+  return NULL;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+  while (len) {
+    ssize_t rc = write(fd, buf, len);
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      msg(LOG_ERR, "Failed writing debian snapshot (%s)", strerror(errno));
+      return 1;
+    }
+    buf += rc;
+    len -= rc;
+  }
+  return 0;
+}
+
+// Write out the oldest queued package once it is verified
+static int flush_item(struct deb_loader *ld, long *files)
+{
+  struct load_item *item = &ld->items[ld->head % ld->depth];
+  int rc = 1;
+
+  pthread_mutex_lock(&ld->lock);
+  while (!item->done) pthread_cond_wait(&ld->done, &ld->lock);
+  pthread_mutex_unlock(&ld->lock);
+
+  if (!item->failed) {
+    *files += item->count;
+    rc = write_all(deb_backend.memfd, item->out, item->out_len);
+  }
+  reset_item(item);
+  ld->head++;
+  return rc;
+}
+
 static int do_deb_load_list(const conf_t *conf)
 {
   const char *control_file = "md5sums";
-
-  struct _hash_record *hashtable = NULL;
-  struct _hash_record **hashtable_ptr = &hashtable;
+  struct deb_loader ld;
+  pthread_t workers[MAX_LOADER_THREADS];
+  unsigned int threads = 0;
+  long files = 0, packages = 0;
+  struct timespec start, end;
 
   struct pkg_array array;
   pkg_array_init_from_hash(&array);
 
   msg(LOG_INFO, "Computing hashes for %d packages.", array.n_pkgs);
+  clock_gettime(CLOCK_MONOTONIC, &start);
   fsys_hash_reset();
 
-  int rc = 0;
+  memset(&ld, 0, sizeof(ld));
+  md5_cache_open(&ld.cache, DEB_CACHE_FILE);
+  record_table_init(&ld.seen);
+  pthread_mutex_init(&ld.lock, NULL);
+  pthread_cond_init(&ld.work, NULL);
+  pthread_cond_init(&ld.done, NULL);
+
+  int rc = 1;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int want = cpus < 1 ? 1 : cpus > MAX_LOADER_THREADS ?
+                      MAX_LOADER_THREADS : (unsigned int)cpus;
+  ld.depth = want * ITEMS_PER_THREAD;
+  ld.items = calloc(ld.depth, sizeof(struct load_item));
+  if (ld.items == NULL) {
+    msg(LOG_ERR, "Out of memory starting the debian loader");
+    goto out;
+  }
+  for (; threads < want; threads++)
+    if (pthread_create(&workers[threads], NULL, loader_worker, &ld)) break;
+  if (threads == 0) {
+    msg(LOG_ERR, "Cannot start debian loader threads");
+    goto out;
+  }
 
-  for (int i = 0; i < array.n_pkgs; i++) {
+  rc = 0;
+  for (int i = 0; i < array.n_pkgs && rc == 0 && !stop && !ld.failed; i++) {
     struct pkginfo *package = array.pkgs[i];
     if (package->status != PKG_STAT_INSTALLED) {
       continue;
     }
-    printf("\x1b[2K\rPackage %d / %d : %s", i + 1, array.n_pkgs,
-           package->set->name);
     if (pkg_infodb_has_file(package, &package->installed, control_file))
       pkg_infodb_get_file(package, &package->installed, control_file);
     ensure_packagefiles_available(package);
@@ -157,7 +447,16 @@ static int do_deb_load_list(const conf_t *conf)
       // Package does not have any files.
       continue;
     }
-    // Loop over all files in the package, adding them to debdb.
+    packages++;
+
+    // Make room by writing out the oldest package
+    if (ld.tail - ld.head == ld.depth && flush_item(&ld, &files)) {
+      rc = 1;
+      break;
+    }
+
+    // Queue all files of the package for the workers
+    struct load_item *item = &ld.items[ld.tail % ld.depth];
     while (file) {
       struct fsys_namenode *namenode = file->namenode;
       // Get the hash and path of the file.
@@ -166,24 +465,59 @@ static int do_deb_load_list(const conf_t *conf)
       const char *path = (namenode->divert && !namenode->divert->camefrom)
                              ? namenode->divert->useinstead->name
                              : namenode->name;
-      if (hash != NULL) {
-        if (add_file_to_backend_by_md5(path, hash, hashtable_ptr, SRC_DEB,
-				   &deb_backend) != 0) {
-	  rc = 1;
-	  goto out;
-	}
+      if (hash != NULL && item_add_file(item, path, hash)) {
+        msg(LOG_ERR, "Out of memory queueing package %s", package->set->name);
+        rc = 1;
+        break;
       }
       file = file->next;
     }
+    if (rc || item->count == 0) {
+      reset_item(item);
+      continue;
+    }
+
+    pthread_mutex_lock(&ld.lock);
+    ld.tail++;
+    pthread_cond_signal(&ld.work);
+    pthread_mutex_unlock(&ld.lock);
   }
 
+  // Write out the rest in order, even on error, so workers go idle
+  while (ld.head != ld.tail)
+    if (flush_item(&ld, &files)) rc = 1;
+
+  if (stop) rc = 1;
+
 out:
-  struct _hash_record *item, *tmp;
-  HASH_ITER(hh, hashtable, item, tmp) {
-    HASH_DEL(hashtable, item);
-    free((void *)item->key);
-    free((void *)item);
+  pthread_mutex_lock(&ld.lock);
+  ld.finished = 1;
+  pthread_cond_broadcast(&ld.work);
+  pthread_mutex_unlock(&ld.lock);
+  for (unsigned int i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double secs = (end.tv_sec - start.tv_sec) +
+                (end.tv_nsec - start.tv_nsec) / 1e9;
+  msg(LOG_DEBUG,
+      "deb loader: %ld packages, %ld files in %.3fs (%ld cached, %ld hashed, %u threads)",
+      packages, files, secs, ld.cache.hits, ld.cache.misses, threads);
+
+  // Only a complete load may replace the digest cache
+  md5_cache_close(&ld.cache, rc == 0);
+
+  if (ld.items) {
+    for (unsigned int i = 0; i < ld.depth; i++) {
+      reset_item(&ld.items[i]);
+      free(ld.items[i].files);
+      free(ld.items[i].out);
+    }
+    free(ld.items);
   }
+  record_table_destroy(&ld.seen);
+  pthread_cond_destroy(&ld.work);
+  pthread_cond_destroy(&ld.done);
+  pthread_mutex_destroy(&ld.lock);
 
   pkg_array_destroy(&array);
   return rc;
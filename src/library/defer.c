@@ -0,0 +1,157 @@
+/*
+ * defer.c - subject snapshots of deferred events
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <errno.h>
+#include "defer.h"
+
+/*
+ * With permissive_defer, the reader answers an event before the decision
+ * thread evaluates it. Once answered, the process runs on and /proc no
+ * longer describes it as it was, so the reader snapshots the subject
+ * into a free slot first and the slot number travels with the queued
+ * event. Only the reader takes slots and only the decision thread
+ * releases them. The busy flag is set by the reader, which publishes the
+ * snapshot through the queue, and cleared with release by the decision
+ * thread once the snapshot is gone, so the reader's acquire load sees an
+ * empty slot.
+ */
+
+/*
+ * defer_open - Allocate a pool.
+ * @size: Most events that can be between the reader and their
+ *	evaluation, queued or being decided.
+ * Returns the pool or NULL with errno set.
+ */
+struct defer_pool *defer_open(unsigned int size)
+{
+	struct defer_pool *p;
+
+	if (size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return NULL;
+	p->slots = calloc(size, sizeof(struct defer_slot));
+	if (p->slots == NULL) {
+		free(p);
+		return NULL;
+	}
+	p->size = size;
+	return p;
+}
+
+/*
+ * defer_close - Free a pool and any snapshot still in it.
+ * @p: Pool, nobody may use it anymore.
+ */
+void defer_close(struct defer_pool *p)
+{
+	if (p == NULL)
+		return;
+	for (unsigned int i = 0; i < p->size; i++)
+		if (atomic_load(&p->slots[i].busy))
+			clear_subject_snapshot(&p->slots[i].snap);
+	free(p->slots);
+	free(p);
+}
+
+/*
+ * defer_capture - Snapshot the subject of an event about to be answered.
+ * @p: Pool.
+ * @pid: Process of the event.
+ * Returns the slot holding the snapshot, or -1 if every slot is in use
+ * or the process could not be read, in which case the event is counted
+ * as dropped.
+ */
+int defer_capture(struct defer_pool *p, pid_t pid)
+{
+	for (unsigned int i = 0; i < p->size; i++) {
+		unsigned int slot = (p->next + i) % p->size;
+		struct defer_slot *s = &p->slots[slot];
+
+		if (atomic_load_explicit(&s->busy, memory_order_acquire))
+			continue;
+		if (snapshot_subject(pid, &s->snap))
+			break;
+		atomic_store_explicit(&s->busy, true, memory_order_relaxed);
+		p->next = (slot + 1) % p->size;
+		return slot;
+	}
+	atomic_fetch_add_explicit(&p->dropped, 1, memory_order_relaxed);
+	return -1;
+}
+
+// Empty a slot and hand it back to the reader
+static void defer_release(struct defer_pool *p, int slot)
+{
+	clear_subject_snapshot(&p->slots[slot].snap);
+	atomic_store_explicit(&p->slots[slot].busy, false,
+			      memory_order_release);
+}
+
+/*
+ * defer_cancel - Give back a slot whose event could not be queued.
+ * @p: Pool.
+ * @slot: Slot from defer_capture().
+ * The event is counted as dropped.
+ */
+void defer_cancel(struct defer_pool *p, int slot)
+{
+	defer_release(p, slot);
+	atomic_fetch_add_explicit(&p->dropped, 1, memory_order_relaxed);
+}
+
+/*
+ * defer_snapshot - Find the snapshot of a dequeued event.
+ * @p: Pool.
+ * @slot: Slot the event carried.
+ * Returns the snapshot or NULL if the slot is not in use.
+ */
+struct subject_snapshot *defer_snapshot(struct defer_pool *p, int slot)
+{
+	if (slot < 0 || (unsigned int)slot >= p->size ||
+	    !atomic_load_explicit(&p->slots[slot].busy, memory_order_acquire))
+		return NULL;
+	return &p->slots[slot].snap;
+}
+
+/*
+ * defer_done - Release a slot once its event was evaluated.
+ * @p: Pool.
+ * @slot: Slot the event carried.
+ */
+void defer_done(struct defer_pool *p, int slot)
+{
+	defer_release(p, slot);
+	atomic_fetch_add_explicit(&p->evaluated, 1, memory_order_relaxed);
+}
+
+void defer_report(const struct defer_pool *p, FILE *f)
+{
+	fprintf(f, "Deferred evaluations: %lu\n", atomic_load(&p->evaluated));
+	fprintf(f, "Deferred evaluations dropped: %lu\n",
+		atomic_load(&p->dropped));
+}
@@ -0,0 +1,63 @@
+/*
+ * defer.h - Header for subject snapshots of deferred events
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef DEFER_H
+#define DEFER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "event.h"
+#include "gcc-attributes.h"
+
+struct defer_slot {
+	struct subject_snapshot snap;
+	atomic_bool busy;
+};
+
+/*
+ * defer_pool - snapshots of events answered before they are evaluated.
+ * @slots: One snapshot per event between the reader and its evaluation.
+ * @size: Number of slots.
+ * @next: Slot the reader looks at first.
+ * @evaluated: Deferred events that were evaluated.
+ * @dropped: Deferred events that were answered but not evaluated.
+ */
+struct defer_pool {
+	struct defer_slot *slots;
+	unsigned int size;
+	unsigned int next;
+	atomic_ulong evaluated;
+	atomic_ulong dropped;
+};
+
+void defer_close(struct defer_pool *p);
+struct defer_pool *defer_open(unsigned int size)
+		__attribute_malloc__
+		__attr_dealloc (defer_close, 1);
+int defer_capture(struct defer_pool *p, pid_t pid);
+void defer_cancel(struct defer_pool *p, int slot);
+struct subject_snapshot *defer_snapshot(struct defer_pool *p, int slot);
+void defer_done(struct defer_pool *p, int slot);
+void defer_report(const struct defer_pool *p, FILE *f);
+
+#endif
@@ -32,7 +32,18 @@
 
 #include "message.h"
 
-static const char sh_set[] = "\"'`$\\!()| ";
+/*
+ * Every byte that escape_shell rewrites: the control characters followed
+ * by the shell metacharacters. The scanners below hand this set to
+ * strcspn and look for '\\' and '%' with strchrnul. glibc implements
+ * those with SIMD, so runs of clean characters, which is nearly all of a
+ * path, are skipped and copied in bulk rather than byte by byte.
+ */
+static const char sh_reject[] =
+	"\001\002\003\004\005\006\007\010\011\012\013\014\015\016\017"
+	"\020\021\022\023\024\025\026\027\030\031\032\033\034\035\036\037"
+	"\"'`$\\!()| ";
+
 /*
  * this function checks whether escaping is needed and if yes
  * it returns positive value and this value represents the size
@@ -41,23 +52,25 @@ static const char sh_set[] = "\"'`$\\!()| ";
 size_t check_escape_shell(const char *input)
 {
 	const char *p = input;
-	size_t size = 0, cnt = 0;
-
-	while (*p) {
-		// \000
-		if (*p < 32)
-			cnt += 4;
-		// \\ \/
-		else if (strchr(sh_set, *p))
-			cnt += 2;
-		// non escaped char
-		else
-			cnt++;
+	size_t cnt = 0;
+	int escaped = 0;
+
+	while (1) {
+		size_t run = strcspn(p, sh_reject);
+
+		// non escaped chars
+		cnt += run;
+		p += run;
+		if (*p == '\0')
+			break;
+
+		// \000 or \\ \/
+		cnt += ((unsigned char)*p < 32) ? 4 : 2;
+		escaped = 1;
 		p++;
-		size++;
 	}
 	// if no escaped char
-	if (cnt == size)
+	if (!escaped)
 		return 0;
 
 	return cnt;
@@ -81,17 +94,24 @@ char *escape_shell(const char *input, const size_t expected_size)
 		return NULL;
 
 	p = input;
-	while (*p) {
+	while (1) {
+		size_t run = strcspn(p, sh_reject);
+
+		memcpy(escape_buffer + j, p, run);
+		j += run;
+		p += run;
+		if (*p == '\0')
+			break;
+
 		if ((unsigned char)*p < 32) {
 			escape_buffer[j++] = ('\\');
 			escape_buffer[j++] = ('0' + ((*p & 0300) >> 6));
 			escape_buffer[j++] = ('0' + ((*p & 0070) >> 3));
 			escape_buffer[j++] = ('0' + (*p & 0007));
-		} else if (strchr(sh_set, *p)) {
+		} else {
 			escape_buffer[j++] = ('\\');
 			escape_buffer[j++] = *p;
-		} else
-			escape_buffer[j++] = *p;
+		}
 		p++;
 	}
 	escape_buffer[j] = '\0';	/* terminate string */
@@ -102,23 +122,32 @@ char *escape_shell(const char *input, const size_t expected_size)
 #define isoctal(a) (((a) & ~7) == '0')
 void unescape_shell(char *s, const size_t len)
 {
-	size_t sz = 0;
+	const char *start = s;
 	char *buf = s;
 
-	while (*s) {
-		if (*s == '\\' && sz + 3 < len && isoctal(s[1]) &&
+	while (1) {
+		char *bs = strchrnul(s, '\\');
+		size_t run = bs - s;
+
+		// slide the clean run down over what was consumed
+		if (buf != s)
+			memmove(buf, s, run);
+		buf += run;
+		s = bs;
+		if (*s == '\0')
+			break;
+
+		size_t sz = s - start;
+		if (sz + 3 < len && isoctal(s[1]) &&
 		    isoctal(s[2]) && isoctal(s[3])) {
 
 			*buf++ = 64*(s[1] & 7) + 8*(s[2] & 7) + (s[3] & 7);
 			s += 4;
-			sz += 4;
-		} else if (*s == '\\' && sz + 2 < len) {
+		} else if (sz + 2 < len) {
 			*buf++ = s[1];
 			s += 2;
-			sz += 2;
 		} else {
 			*buf++ = *s++;
-			sz++;
 		}
 	}
 	*buf = '\0';
@@ -137,20 +166,25 @@ static char asciiHex2Bits(char X)
 	return (X - base) & 0X00FF;
 }
 
+static int is_hex_escape(const char *p, const char *end)
+{
+	return end - p > 2 && IS_HEX(p[1]) && IS_HEX(p[2]);
+}
+
 // unescape old format of a trust file
 // it makes code backwards compatible
 char *unescape(const char *input)
 {
 	size_t input_len = strlen(input);
-	size_t out_len = 0;
+	const char *end = input + input_len;
+	size_t out_len = input_len;
+	const char *p;
 
-	for (size_t i = 0; i < input_len; i++) {
-		if (input[i] == '%' && i + 2 < input_len &&
-		    IS_HEX(input[i + 1]) && IS_HEX(input[i + 2])) {
-			out_len++;
-			i += 2;
-		} else {
-			out_len++;
+	// every valid %XX sequence shrinks by 2
+	for (p = strchrnul(input, '%'); *p; p = strchrnul(p + 1, '%')) {
+		if (is_hex_escape(p, end)) {
+			out_len -= 2;
+			p += 2;
 		}
 	}
 
@@ -163,20 +197,27 @@ char *unescape(const char *input)
 
 	size_t pos = 0;
 
-	for (size_t i = 0; i < input_len; i++) {
-		if (input[i] == '%' && i + 2 < input_len &&
-		    IS_HEX(input[i + 1]) && IS_HEX(input[i + 2])) {
-			char c = asciiHex2Bits(input[i + 1]);
-			char d = asciiHex2Bits(input[i + 2]);
+	p = input;
+	while (1) {
+		const char *pct = strchrnul(p, '%');
+
+		memcpy(buffer + pos, p, pct - p);
+		pos += pct - p;
+		p = pct;
+		if (*p == '\0')
+			break;
+
+		if (is_hex_escape(p, end)) {
+			char c = asciiHex2Bits(p[1]);
+			char d = asciiHex2Bits(p[2]);
 			buffer[pos++] = (c << 4) + d;
-			i += 2;
+			p += 3;
 		} else {
-			if (input[i] == '%')
-				msg(LOG_WARNING,
-				    "Input %s does not have a valid escape sequence, "
-				    "unable to unescape, copying char by char",
-				    input);
-			buffer[pos++] = input[i];
+			msg(LOG_WARNING,
+			    "Input %s does not have a valid escape sequence, "
+			    "unable to unescape, copying char by char",
+			    input);
+			buffer[pos++] = *p++;
 		}
 	}
 
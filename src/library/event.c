@@ -237,17 +237,26 @@ static inline void reset_subject_attributes(s_array *s)
 	subject_reset(s, SUBJ_TRUST);
 }
 
-// Return 0 on success and 1 on error
-int new_event(const struct fanotify_event_metadata *m, event_t *e)
+/*
+ * setup_event - fill in an event from fanotify metadata.
+ * @m: event as read from fanotify.
+ * @pinfo: proc fingerprint of the subject, owned by this function.
+ * @e: event to fill in.
+ * Returns 0 on success and 1 on error.
+ */
+static int setup_event(const struct fanotify_event_metadata *m,
+		       struct proc_info *pinfo, event_t *e)
 {
 	subject_attr_t subj;
 	QNode *q_node;
 	unsigned int key, rc, evict = 1, skip_path = 0;
 	s_array *s;
 	o_array *o;
-	struct proc_info *pinfo;
 	struct file_info *finfo;
 
+	if (pinfo == NULL)
+		return 1;
+
 	if (needs_flush) {
 		flush_cache();
 		needs_flush = false;
@@ -263,11 +272,6 @@ int new_event(const struct fanotify_event_metadata *m, event_t *e)
 	q_node = check_lru_cache(subj_cache, key);
 	s = (s_array *)q_node->item;
 
-	// get proc fingerprint
-	pinfo = stat_proc_entry(m->pid);
-	if (pinfo == NULL)
-		return 1;
-
 	// Check the subject to see if its what its supposed to be
 	if (s) {
 		rc = compare_proc_infos(pinfo, s->info);
@@ -442,6 +446,143 @@ int new_event(const struct fanotify_event_metadata *m, event_t *e)
 	return 0;
 }
 
+// Return 0 on success and 1 on error
+int new_event(const struct fanotify_event_metadata *m, event_t *e)
+{
+	// get proc fingerprint
+	return setup_event(m, stat_proc_entry(m->pid), e);
+}
+
+/*
+ * snapshot_subject - read what rules need to know about a process.
+ * @pid: process whose event is about to be answered.
+ * @snap: snapshot to fill in, released with clear_subject_snapshot().
+ *
+ * The process is blocked on its permission event while this runs, so
+ * the attributes match the access being requested. Returns 0 on success
+ * and 1 if the process could not be read.
+ */
+int snapshot_subject(pid_t pid, struct subject_snapshot *snap)
+{
+	unsigned int fields = rules_get_proc_status_mask() |
+			      policy_get_syslog_proc_status_mask() |
+			      PROC_STAT_UID | PROC_STAT_COMM;
+	char buf[PATH_MAX+1], *ptr;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->status.ppid = -1;
+
+	snap->info = stat_proc_entry(pid);
+	if (snap->info == NULL)
+		return 1;
+	if (read_proc_status(pid, fields, &snap->status)) {
+		clear_subject_snapshot(snap);
+		return 1;
+	}
+
+	errno = 0;
+	ptr = get_program_from_pid(pid, sizeof(buf), buf);
+	if (errno == ENOENT)
+		/* kworkers have no exe entry, use comm like get_subj_attr */
+		snap->exe = strdup(snap->status.comm ? snap->status.comm : "?");
+	else
+		snap->exe = strdup(ptr ? buf : "?");
+	return 0;
+}
+
+void clear_subject_snapshot(struct subject_snapshot *snap)
+{
+	clear_proc_info(snap->info);
+	free(snap->info);
+	snap->info = NULL;
+	free(snap->exe);
+	snap->exe = NULL;
+	if (snap->status.uid) {
+		destroy_attr_set(snap->status.uid);
+		free(snap->status.uid);
+		snap->status.uid = NULL;
+	}
+	if (snap->status.groups) {
+		destroy_attr_set(snap->status.groups);
+		free(snap->status.groups);
+		snap->status.groups = NULL;
+	}
+	free(snap->status.comm);
+	snap->status.comm = NULL;
+}
+
+// Replace attribute T of S with SUBJ, whose memory S adopts on success
+static void adopt_subject_attr(s_array *s, subject_attr_t *subj)
+{
+	subject_reset(s, subj->type);
+	if (subject_add(s, subj))
+		return;
+	if (subj->type == UID || subj->type == GID)
+		subj->set = NULL;
+	else if (subj->type >= COMM)
+		subj->str = NULL;
+}
+
+/*
+ * new_deferred_event - set up an event that was answered before now.
+ * @m: event as read from fanotify.
+ * @snap: subject snapshot taken before the answer, its contents are
+ *	consumed and it is left empty.
+ * @e: event to fill in.
+ *
+ * Once answered, the process may have run something else or exited and
+ * its pid may belong to another process, so the subject is identified by
+ * the snapshot and its exe, comm, uid and the other status fields are
+ * taken from it rather than from /proc. Returns 0 on success and 1 on
+ * error.
+ */
+int new_deferred_event(const struct fanotify_event_metadata *m,
+		       struct subject_snapshot *snap, event_t *e)
+{
+	subject_attr_t subj;
+	struct proc_info *pinfo = snap->info;
+
+	snap->info = NULL;
+	if (setup_event(m, pinfo, e)) {
+		clear_subject_snapshot(snap);
+		return 1;
+	}
+
+	if (snap->exe) {
+		// Trust was derived from the old exe
+		subject_reset(e->s, SUBJ_TRUST);
+		subj.type = EXE;
+		subj.str = snap->exe;
+		adopt_subject_attr(e->s, &subj);
+		snap->exe = subj.str;
+	}
+	if (snap->status.comm) {
+		subj.type = COMM;
+		subj.str = snap->status.comm;
+		adopt_subject_attr(e->s, &subj);
+		snap->status.comm = subj.str;
+	}
+	if (snap->status.uid) {
+		subj.type = UID;
+		subj.set = snap->status.uid;
+		adopt_subject_attr(e->s, &subj);
+		snap->status.uid = subj.set;
+	}
+	if (snap->status.groups) {
+		subj.type = GID;
+		subj.set = snap->status.groups;
+		adopt_subject_attr(e->s, &subj);
+		snap->status.groups = subj.set;
+	}
+	if (snap->status.ppid != -1) {
+		subj.type = PPID;
+		subj.pid = snap->status.ppid;
+		adopt_subject_attr(e->s, &subj);
+	}
+	clear_subject_snapshot(snap);
+	return 0;
+}
+
 /*
  * fetch_proc_status - populate subject cache entries using /proc status
  * @e: event whose subject cache should be filled
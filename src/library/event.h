@@ -33,6 +33,7 @@
 #include "subject.h"
 #include "object.h"
 #include "conf.h"
+#include "process.h"
 
 typedef struct ev {
 	pid_t pid;
@@ -46,6 +47,19 @@ typedef struct ev {
 int init_event_system(const conf_t *config);
 void destroy_event_system(void);
 int new_event(const struct fanotify_event_metadata *m, event_t *e);
+
+/* Subject of an event as seen before it was answered, see
+ * permissive_defer */
+struct subject_snapshot {
+	struct proc_info *info;		// identity and start time
+	char *exe;
+	struct proc_status_info status;	// uid, comm and what rules need
+};
+
+int snapshot_subject(pid_t pid, struct subject_snapshot *snap);
+void clear_subject_snapshot(struct subject_snapshot *snap);
+int new_deferred_event(const struct fanotify_event_metadata *m,
+		       struct subject_snapshot *snap, event_t *e);
 subject_attr_t *get_subj_attr(event_t *e, subject_type_t t);
 object_attr_t *get_obj_attr(event_t *e, object_type_t t);
 void run_usage_report(const conf_t *config, FILE *f);
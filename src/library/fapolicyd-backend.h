@@ -49,6 +49,8 @@ typedef struct _backend
 	int (*close)(void);
 	int memfd;
 	long entries;
+	int delta;	// memfd holds '+'/'-' changes, not a full snapshot
+	int synced;	// trust db holds exactly what the last load delivered
 } backend;
 
 #endif
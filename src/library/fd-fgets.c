@@ -33,8 +33,9 @@
  * The theory of operation for this family of functions is that it
  * operates like the glibc fgets function except with a descriptor.
  * It reads from the descriptor into a buffer and then looks through
- * the buffer to find a string terminated with a '\n'. It terminates
- * the string with a 0 and returns it. It updates current to point
+ * the buffer to find a string terminated with a '\n'. fd_fgets_r copies
+ * it out and terminates it with a 0, fd_fgets_view_r just returns a
+ * pointer and length into the buffer. It updates current to point
  * to where it left off. On the next read it starts there and tries to
  * find a '\n'. If it can't find one, it advances the buffer pointer
  * and only compacts the unread data when there is no room left for
@@ -140,11 +141,14 @@ int fd_fgets_more_r(struct fd_fgets_state *st, size_t blen)
 }
 
 /* Function to read the next chunk of data from the given fd. If we have
- * data to return, we Read up to blen-1 chars (or through the next newline),
- * copy into buf, NUL-terminate, and return the number of chars.
+ * data to return, we locate up to blen-1 chars (or through the next newline),
+ * point start at them, consume them and return the number of chars.
  * It also returns 0 for no data. And -1 if there was an error reading
- * the fd. */
-int fd_fgets_r(struct fd_fgets_state *st, char *buf, size_t blen, int fd)
+ * the fd. The returned text stays in place until the next call, the
+ * buffer is only compacted when a read needs room. The newline search
+ * is memchr, which glibc vectorizes. */
+static int next_line(struct fd_fgets_state *st, size_t blen, int fd,
+		     char **start)
 {
 	size_t avail = st->current - st->buffer, line_len;
 	char  *line_end;
@@ -212,9 +216,8 @@ int fd_fgets_r(struct fd_fgets_state *st, char *buf, size_t blen, int fd)
 		 * at EOF/full */
 		line_len = (avail < blen - 1) ? avail : (blen - 1);
 
-	/* 5) Copy out, slide the remainder down, reset pointers */
-	memcpy(buf, st->buffer, line_len);
-	buf[line_len] = '\0';
+	/* 5) Hand out the line, reset pointers */
+	*start = st->buffer;
 
 	size_t remainder = avail - line_len;
 	/* For MEM_MMAP_FILE we advance over the returned data permanently.
@@ -235,6 +238,34 @@ int fd_fgets_r(struct fd_fgets_state *st, char *buf, size_t blen, int fd)
 	return (int)line_len;
 }
 
+/* Copy the next line into buf and NUL-terminate it. Return values are
+ * the same as fd_fgets_view_r. */
+int fd_fgets_r(struct fd_fgets_state *st, char *buf, size_t blen, int fd)
+{
+	char *start = NULL;
+	int line_len = next_line(st, blen, fd, &start);
+
+	if (start) {
+		memcpy(buf, start, line_len);
+		buf[line_len] = '\0';
+	}
+	return line_len;
+}
+
+/* Zero copy variant of fd_fgets_r. The line is not NUL-terminated, it
+ * is described by *line and the returned length, which includes the
+ * newline if one was found. The view points into the read buffer or the
+ * mapped file and is only valid until the next call on st. */
+int fd_fgets_view_r(struct fd_fgets_state *st, const char **line,
+		    size_t blen, int fd)
+{
+	char *start = NULL;
+	int line_len = next_line(st, blen, fd, &start);
+
+	*line = start;
+	return line_len;
+}
+
 static inline void fd_fgets_ensure_global(void)
 {
 	if (!global_init_done) {
@@ -51,6 +51,8 @@ int fd_fgets_eof_r(fd_fgets_state_t *st);
 int fd_fgets_more_r(fd_fgets_state_t *st, size_t blen);
 int fd_fgets_r(fd_fgets_state_t *st, char *buf, size_t blen, int fd)
 	__attr_access ((__write_only__, 2, 3)) __wur;
+int fd_fgets_view_r(fd_fgets_state_t *st, const char **line, size_t blen,
+		int fd) __wur;
 int fd_setvbuf_r(fd_fgets_state_t *st, void *buf, size_t buff_size,
 		enum fd_mem how)
 		__attr_access ((__read_only__, 2, 3));
@@ -51,6 +51,8 @@ backend file_backend =
 	file_destroy_backend,
 	-1,
 	-1,
+	0,
+	0,
 };
 
 
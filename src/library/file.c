@@ -32,7 +32,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <openssl/sha.h>
-#include <openssl/md5.h>
+#include <openssl/evp.h>
 #include <magic.h>
 #include <libudev.h>
 #include <elf.h>
@@ -40,6 +40,8 @@
 #include <linux/hash_info.h>
 #include <sys/mman.h>
 #include <mntent.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include "file.h"
 #include "message.h"
@@ -52,8 +54,12 @@
 // Local variables
 static struct udev *udev;
 magic_t magic_cookie;
+// libmagic cookies cannot be shared, threads classifying files open their own
+static __thread magic_t thread_cookie;
 struct cache { dev_t device; const char *devname; };
 static struct cache c = { 0, NULL };
+// Files may be classified on several threads, see file_thread_init()
+static pthread_mutex_t c_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Local declarations
 static ssize_t safe_read(int fd, char *buf, size_t size)
@@ -85,6 +91,25 @@ static inline void rewind_fd(int fd)
 }
 
 
+// Open a libmagic cookie with our flags and magic definitions
+static magic_t open_magic(void)
+{
+	magic_t cookie = magic_open(MAGIC_MIME|MAGIC_ERROR|MAGIC_NO_CHECK_CDF|
+			MAGIC_NO_CHECK_ELF);
+	if (cookie == NULL) {
+		msg(LOG_ERR, "Unable to init libmagic");
+		return NULL;
+	}
+	// Load our overrides and the default magic definitions
+	if (magic_load(cookie, MAGIC_PATHS) != 0) {
+		msg(LOG_ERR, "Unable to load magic database");
+		magic_close(cookie);
+		return NULL;
+	}
+	return cookie;
+}
+
+
 // Initialize what we can now so that its not done each call
 void file_init(void)
 {
@@ -93,17 +118,32 @@ void file_init(void)
 
 	// Setup libmagic
 	unsetenv("MAGIC");
-	magic_cookie = magic_open(MAGIC_MIME|MAGIC_ERROR|MAGIC_NO_CHECK_CDF|
-			MAGIC_NO_CHECK_ELF);
-	if (magic_cookie == NULL) {
-		msg(LOG_ERR, "Unable to init libmagic");
-		exit(1);
-	}
-	// Load our overrides and the default magic definitions
-	if (magic_load(magic_cookie, MAGIC_PATHS)
-									!= 0) {
-		msg(LOG_ERR, "Unable to load magic database");
+	magic_cookie = open_magic();
+	if (magic_cookie == NULL)
 		exit(1);
+}
+
+
+/*
+ * file_thread_init - give the calling thread its own libmagic cookie so
+ * it can call get_file_type_from_fd() alongside other threads. file_init()
+ * must have been called first.
+ * Returns 0 on success and 1 on failure.
+ */
+int file_thread_init(void)
+{
+	if (thread_cookie == NULL)
+		thread_cookie = open_magic();
+	return thread_cookie == NULL;
+}
+
+
+// Release the calling thread's libmagic cookie
+void file_thread_close(void)
+{
+	if (thread_cookie) {
+		magic_close(thread_cookie);
+		thread_cookie = NULL;
 	}
 }
 
@@ -554,10 +594,12 @@ char *get_device_from_stat(unsigned int device, size_t blen, char *buf)
 	struct udev_device *dev;
 	const char *node;
 
+	pthread_mutex_lock(&c_lock);
 	if (c.device) {
 		if (c.device == device) {
 			strncpy(buf, c.devname, blen-1);
 			buf[blen-1] = 0;
+			pthread_mutex_unlock(&c_lock);
 			return buf;
 		}
 	}
@@ -567,6 +609,7 @@ char *get_device_from_stat(unsigned int device, size_t blen, char *buf)
 	node = udev_device_get_devnode(dev);
 	if (node == NULL) {
 		udev_device_unref(dev);
+		pthread_mutex_unlock(&c_lock);
 		return NULL;
 	}
 	strncpy(buf, node, blen-1);
@@ -577,6 +620,7 @@ char *get_device_from_stat(unsigned int device, size_t blen, char *buf)
 	free((void *)c.devname);
 	c.device = device;
 	c.devname = strdup(buf);
+	pthread_mutex_unlock(&c_lock);
 
 	return buf;
 }
@@ -685,7 +729,7 @@ char *get_file_type_from_fd(int fd, const struct file_info *i, const char *path,
 	}
 
 	// Do the normal classification
-	ptr = magic_descriptor(magic_cookie, fd);
+	ptr = magic_descriptor(thread_cookie ? thread_cookie : magic_cookie, fd);
 	if (ptr) {
 		char *str;
 		strncpy(buf, ptr, blen-1);
@@ -731,13 +775,10 @@ static ssize_t safe_read(int fd, char *buf, size_t size)
 	return len;
 }
 
-/*
- * get_hash_from_fd2 - calculate the requested file digest.
- * @fd: open descriptor whose contents should be measured.
- * @size: number of bytes to include in the digest calculation.
- * @alg: digest algorithm to use for the measurement.
- * Returns a heap-allocated hex string on success or NULL when hashing fails.
- */
+#define HASH_CHUNK (4 * 1024 * 1024)
+#define HASH_STRIDE (64 * 1024)
+static atomic_ulong hash_progress;
+
 static const char *degenerate_hash_sha1 =
 	"da39a3ee5e6b4b0d3255bfef95601890afd80709";
 static const char *degenerate_hash_sha256 =
@@ -747,67 +788,164 @@ static const char *degenerate_hash_sha512 =
 	"47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e";
 static const char *degenerate_hash_md5 =
 	"d41d8cd98f00b204e9800998ecf8427e";
-char *get_hash_from_fd2(int fd, size_t size, file_hash_alg_t alg)
+
+static const EVP_MD *file_hash_md(file_hash_alg_t alg)
 {
+	switch (alg) {
+	case FILE_HASH_ALG_SHA1:
+		return EVP_sha1();
+	case FILE_HASH_ALG_SHA256:
+		return EVP_sha256();
+	case FILE_HASH_ALG_SHA512:
+		return EVP_sha512();
+	case FILE_HASH_ALG_MD5:
+#ifdef USE_DEB
+		return EVP_md5();
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * degenerate_hash - digest of an empty file, which cannot be mapped.
+ */
+static const char *degenerate_hash(file_hash_alg_t alg)
+{
+	switch (alg) {
+	case FILE_HASH_ALG_SHA1:
+		return degenerate_hash_sha1;
+	case FILE_HASH_ALG_SHA256:
+		return degenerate_hash_sha256;
+	case FILE_HASH_ALG_SHA512:
+		return degenerate_hash_sha512;
+	case FILE_HASH_ALG_MD5:
+		return degenerate_hash_md5;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * hash_mapped - digest a mapped file with every context in CTX at once.
+ * The data is fed to all of them HASH_STRIDE bytes at a time so that
+ * the second and later digests read it from the cache rather than from
+ * memory. Each HASH_CHUNK bytes bump hash_progress so the watchdog can
+ * tell a long hash of a huge file from a stuck one.
+ * Returns 0 on success and 1 on failure.
+ */
+static int hash_mapped(EVP_MD_CTX **ctx, unsigned int count,
+		       const unsigned char *buf, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		size_t len = size - done > HASH_STRIDE ? HASH_STRIDE :
+			     size - done;
+
+		for (unsigned int i = 0; i < count; i++)
+			if (EVP_DigestUpdate(ctx[i], buf + done, len) != 1)
+				return 1;
+		done += len;
+		if (done % HASH_CHUNK == 0 || done == size)
+			atomic_fetch_add_explicit(&hash_progress, 1,
+						  memory_order_relaxed);
+	}
+	return 0;
+}
+
+/*
+ * file_hash_progress - number of chunks hashed so far.
+ */
+unsigned long file_hash_progress(void)
+{
+	return atomic_load_explicit(&hash_progress, memory_order_relaxed);
+}
+
+/*
+ * get_hashes_from_fd - calculate several file digests in one pass.
+ * @fd: open descriptor whose contents should be measured.
+ * @size: number of bytes to include in the digest calculation.
+ * @d: digests to calculate, the alg of each one says which.
+ * @count: number of entries in @d, at most FILE_HASH_MULTI_MAX.
+ * The file is mapped and read once however many digests are asked for.
+ * Returns 0 on success, filling in each digest as a hex string, or 1
+ * when hashing fails.
+ */
+int get_hashes_from_fd(int fd, size_t size, struct file_digest *d,
+		       unsigned int count)
+{
+	EVP_MD_CTX *ctx[FILE_HASH_MULTI_MAX] = { NULL };
 	unsigned char *mapped;
-	char *digest = NULL;
-	size_t digest_length;
+	unsigned int i;
+	int rc = 1;
+
+	if (count == 0 || count > FILE_HASH_MULTI_MAX)
+		return 1;
 
 	if (size == 0) {
-		switch (alg) {
-		case FILE_HASH_ALG_SHA1:
-			return strdup(degenerate_hash_sha1);
-		case FILE_HASH_ALG_SHA256:
-			return strdup(degenerate_hash_sha256);
-		case FILE_HASH_ALG_SHA512:
-			return strdup(degenerate_hash_sha512);
-		case FILE_HASH_ALG_MD5:
-			return strdup(degenerate_hash_md5);
-		default:
-			return NULL;
+		for (i = 0; i < count; i++) {
+			const char *h = degenerate_hash(d[i].alg);
+
+			if (h == NULL)
+				return 1;
+			strcpy(d[i].digest, h);
 		}
+		return 0;
 	}
 
-	digest_length = file_hash_length(alg);
-	if (digest_length == 0)
-		return NULL;
+	for (i = 0; i < count; i++) {
+		const EVP_MD *md = file_hash_md(d[i].alg);
 
-	mapped = mmap(0, size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
-	if (mapped != MAP_FAILED) {
-		unsigned char hptr[SHA512_DIGEST_LENGTH];
-		int computed = 0;
-
-		switch (alg) {
-		case FILE_HASH_ALG_SHA1:
-			SHA1(mapped, size, hptr);
-			computed = 1;
-			break;
-		case FILE_HASH_ALG_SHA256:
-			SHA256(mapped, size, hptr);
-			computed = 1;
-			break;
-		case FILE_HASH_ALG_SHA512:
-			SHA512(mapped, size, hptr);
-			computed = 1;
-			break;
-		case FILE_HASH_ALG_MD5:
-#ifdef USE_DEB
-			MD5(mapped, size, hptr);
-			computed = 1;
-#endif
-			break;
-		default:
-			break;
-		}
-		munmap(mapped, size);
+		if (md == NULL || file_hash_length(d[i].alg) == 0)
+			goto out;
+		ctx[i] = EVP_MD_CTX_new();
+		if (ctx[i] == NULL ||
+		    EVP_DigestInit_ex(ctx[i], md, NULL) != 1)
+			goto out;
+	}
 
-		if (computed) {
-			digest = malloc((digest_length * 2) + 1);
-			if (digest)
-				bytes2hex(digest, hptr, digest_length);
+	// Large files are faulted in as they are hashed so that progress
+	// shows up chunk by chunk instead of after one long populate.
+	mapped = mmap(0, size, PROT_READ, size > HASH_CHUNK ? MAP_PRIVATE :
+		      MAP_PRIVATE|MAP_POPULATE, fd, 0);
+	if (mapped == MAP_FAILED)
+		goto out;
+	if (size > HASH_CHUNK)
+		madvise(mapped, size, MADV_SEQUENTIAL);
+	if (hash_mapped(ctx, count, mapped, size) == 0) {
+		for (i = 0; i < count; i++) {
+			unsigned char hptr[EVP_MAX_MD_SIZE];
+
+			if (EVP_DigestFinal_ex(ctx[i], hptr, NULL) != 1)
+				break;
+			bytes2hex(d[i].digest, hptr,
+				  file_hash_length(d[i].alg));
 		}
+		if (i == count)
+			rc = 0;
 	}
-	return digest;
+	munmap(mapped, size);
+out:
+	for (i = 0; i < count; i++)
+		EVP_MD_CTX_free(ctx[i]);
+	return rc;
+}
+
+/*
+ * get_hash_from_fd2 - calculate the requested file digest.
+ * @fd: open descriptor whose contents should be measured.
+ * @size: number of bytes to include in the digest calculation.
+ * @alg: digest algorithm to use for the measurement.
+ * Returns a heap-allocated hex string on success or NULL when hashing fails.
+ */
+char *get_hash_from_fd2(int fd, size_t size, file_hash_alg_t alg)
+{
+	struct file_digest d = { .alg = alg };
+
+	if (get_hashes_from_fd(fd, size, &d, 1))
+		return NULL;
+	return strdup(d.digest);
 }
 
 // This function returns 0 on error and 1 if successful
@@ -862,7 +1000,7 @@ int get_ima_hash(int fd, file_hash_alg_t *alg, char *sha)
 }
 
 
-static unsigned char e_ident[EI_NIDENT];
+static __thread unsigned char e_ident[EI_NIDENT];
 static int read_preliminary_header(int fd)
 {
 	ssize_t rc = safe_read(fd, (char *)e_ident, EI_NIDENT);
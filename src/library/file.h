@@ -50,6 +50,16 @@ typedef enum {
 #define FILE_DIGEST_STRING_WIDTH 135
 #define TRUSTDB_DATA_BUFSZ (FILE_DIGEST_STRING_MAX + 64)
 
+// Most digests get_hashes_from_fd calculates in one pass
+#define FILE_HASH_MULTI_MAX 4
+
+// One digest requested from get_hashes_from_fd
+struct file_digest
+{
+	file_hash_alg_t alg;
+	char digest[FILE_DIGEST_STRING_MAX];
+};
+
 // Information we will cache to identify the same executable
 struct file_info
 {
@@ -64,6 +74,8 @@ struct file_info
 
 void file_init(void);
 void file_close(void);
+int file_thread_init(void);
+void file_thread_close(void);
 struct file_info *stat_file_entry(int fd) __attr_dealloc_free;
 void file_info_reset_digest(struct file_info *info);
 file_hash_alg_t file_hash_alg(unsigned len);
@@ -91,6 +103,10 @@ char *bytes2hex(char *final, const unsigned char *buf, unsigned int size)
 	 __attr_access ((__read_only__, 2, 3));
 char *get_hash_from_fd2(int fd, size_t size, file_hash_alg_t alg)
 	__attr_dealloc_free;
+int get_hashes_from_fd(int fd, size_t size, struct file_digest *d,
+		       unsigned int count)
+	__attr_access ((__read_write__, 3, 4));
+unsigned long file_hash_progress(void);
 int get_ima_hash(int fd, file_hash_alg_t *alg, char *sha);
 uint32_t gather_elf(int fd, off_t size);
 
@@ -175,6 +175,8 @@ static int stack_push_vars(stack_t *_stack, stack_item_t *buf, int *sp,
 	stack_item_t *item = &buf[(*sp)++];
 	item->level = _level;
 	item->offset = _offset;
+	item->processed = 0;
+	item->matched = 0;
 	item->filter = _filter;
 
 	stack_push(_stack, item);
@@ -205,35 +207,6 @@ static void stack_pop_all_vars(stack_t *_stack, int *sp)
 		stack_pop_vars(_stack, sp);
 }
 
-/*
- * stack_pop_reset - reset flags and pop top item
- */
-static void stack_pop_reset(stack_t *_stack, int *sp)
-{
-	if (_stack == NULL || sp == NULL || *sp <= 0)
-		return;
-
-	stack_item_t *item = (stack_item_t *)stack_top(_stack);
-	if (item && item->filter) {
-		item->filter->processed = 0;
-		item->filter->matched = 0;
-	}
-
-	stack_pop(_stack);
-	(*sp)--;
-}
-
-/*
- * stack_pop_all_reset - reset and pop all stack items
- */
-static void stack_pop_all_reset(stack_t *_stack, int *sp)
-{
-	if (_stack == NULL || sp == NULL)
-		return;
-
-	while (!stack_is_empty(_stack))
-		stack_pop_reset(_stack, sp);
-}
 
 /*
  * filter_check - compare path against loaded filters
@@ -280,7 +253,8 @@ filter_rc_t filter_check(const char *_path)
 
 	while(!stack_is_empty(&stack)) {
 		int matched = 0;
-		filter->processed = 1;
+		stack_item_t *current = (stack_item_t *)stack_top(&stack);
+		current->processed = 1;
 
 		// this is starting branch of the algo
 		// assuming that in root filter filter->path is NULL
@@ -359,7 +333,7 @@ filter_rc_t filter_check(const char *_path)
 
 			if (matched) {
 				level++;
-				filter->matched = 1;
+				current->matched = 1;
 
 				// if matched we need ot push descendants
 				// to the stack
@@ -417,19 +391,18 @@ filter_rc_t filter_check(const char *_path)
 
 				// assuimg that nothing has matched on the
 				// upper level so it's a directory match
-				if (filter->matched &&
+				if (stack_item->matched &&
 				    filter->path[filter->len-1] == '/') {
 					res = filter->type == ADD ?
 						FILTER_ALLOW : FILTER_DENY;
 					goto end;
 				}
 
-				// reset processed flag
-				stack_pop_reset(&stack, &sp);
+				stack_pop_vars(&stack, &sp);
 			}
 
 			stack_item = (stack_item_t*)stack_top(&stack);
-		} while(stack_item && stack_item->filter->processed);
+		} while(stack_item && stack_item->processed);
 
 		if (!stack_item)
 			break;
@@ -443,7 +416,7 @@ end:
 	FILTER_TRACE("decision %s\n",
 		res == FILTER_ALLOW ? "include" : "exclude");
 	// Clean up the stack
-	stack_pop_all_reset(&stack, &sp);
+	stack_pop_all_vars(&stack, &sp);
 	stack_destroy(&stack);
 	return res;
 }
@@ -52,10 +52,13 @@ typedef struct _filter
 } filter_t;
 
 
+// Traversal state lives in the stack item so filter_check is reentrant
 typedef struct _stack_item
 {
 	int level;
 	int offset;
+	int processed;
+	int matched;
 	filter_t *filter;
 } stack_item_t;
 
@@ -27,6 +27,7 @@
 #include <string.h>
 #include "lru.h"
 #include "message.h"
+#include "realtime.h"
 #include "gcc-attributes.h"
 
 //#define DEBUG
@@ -52,29 +53,26 @@ static QNode *new_QNode(void)
 
 static Hash *create_hash(unsigned int hsize)
 {
-	unsigned int i;
-
 	Hash *hash = malloc(sizeof(Hash));
 	if (hash == NULL)
 		return hash;
 
-	hash->array = malloc(hsize * sizeof(QNode*));
+	// Mapped on its own and left untouched, so that the decision thread
+	// which fills it gets its pages on its own NUMA node. The mapping is
+	// zeroed, so all hash entries start empty.
+	hash->array = rt_alloc_array(hsize * sizeof(QNode*));
 	if (hash->array == NULL) {
 		free(hash);
 		return NULL;
 	}
 
-	// Initialize all hash entries as empty
-	for (i = 0; i < hsize; i++)
-		hash->array[i] = NULL;
-
 	hash->size = hsize;
 	return hash;
 }
 
 static void destroy_hash(Hash *hash)
 {
-	free(hash->array);
+	rt_free_array(hash->array, hash->size * sizeof(QNode*));
 	free(hash);
 }
 
@@ -1,6 +1,6 @@
 /*
  * md5-backend.c - functions for adding files to the trust database
- * based on MD5 hashes.
+ * based on MD5 hashes, and a cache of the digests they verified.
  *
  * This software may be freely redistributed and/or modified under the
  * terms of the GNU General Public License as published by the Free
@@ -24,10 +24,14 @@
 #include "config.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syslog.h>
 #include <sys/types.h>
@@ -38,53 +42,291 @@
 #include "md5-backend.h"
 
 /*
- * Given a path to a file with an expected MD5 digest, add
- * the file to the trust database if it matches.
+ * Digest cache
+ *
+ * Hashing every installed file makes loading the deb backend slow, so
+ * the SHA256 of each file that passed MD5 verification is remembered
+ * between loads, together with what identifies the file's contents:
+ *
+ *   fapolicyd-md5-cache 1
+ *   <dev> <inode> <mtime> <ctime> <size> <md5> <sha256> <path>
+ *   ...
+ *
+ * A file whose identity and expected MD5 still match is not read again.
+ * ctime is part of the identity because, unlike mtime, it cannot be set
+ * back by whoever changes the file. A damaged cache is ignored and every
+ * file is hashed.
+ */
+#define CACHE_MAGIC "fapolicyd-md5-cache 1\n"
+#define CACHE_LINE_MAX (PATH_MAX + 256)
+
+static void free_cache_entries(struct md5_cache *cache)
+{
+	struct md5_cache_entry *item, *tmp;
+
+	HASH_ITER(hh, cache->entries, item, tmp) {
+		HASH_DEL(cache->entries, item);
+		free(item);
+	}
+	if (cache->base)
+		munmap(cache->base, cache->size);
+	cache->base = NULL;
+	cache->size = 0;
+}
+
+// Parse one cache line, the path is left pointing into the map
+static struct md5_cache_entry *parse_cache_line(const char *ptr, size_t len)
+{
+	char line[CACHE_LINE_MAX];
+	unsigned long long dev, ino;
+	long long msec, csec, size;
+	long mnsec, cnsec;
+	int n = 0;
+	struct md5_cache_entry *e;
+
+	if (len >= sizeof(line))
+		return NULL;
+	memcpy(line, ptr, len);
+	line[len] = 0;
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
+		return NULL;
+	if (sscanf(line, "%llu %llu %lld.%ld %lld.%ld %lld %32s %64s %n",
+		   &dev, &ino, &msec, &mnsec, &csec, &cnsec, &size, e->md5,
+		   e->sha256, &n) != 9 || n == 0 || line[n] != '/' ||
+	    strlen(e->md5) != MD5_LEN * 2 ||
+	    strlen(e->sha256) != SHA256_LEN * 2) {
+		free(e);
+		return NULL;
+	}
+	e->device = dev;
+	e->inode = ino;
+	e->mtime.tv_sec = msec;
+	e->mtime.tv_nsec = mnsec;
+	e->ctime.tv_sec = csec;
+	e->ctime.tv_nsec = cnsec;
+	e->size = size;
+	e->path = ptr + n;
+	e->path_len = len - n;
+	return e;
+}
+
+// Map the previous cache and index it by path
+static int load_cache(struct md5_cache *cache)
+{
+	struct stat sb;
+	size_t mlen = strlen(CACHE_MAGIC);
+	int fd = open(cache->file, O_RDONLY|O_CLOEXEC);
+
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &sb) || (size_t)sb.st_size <= mlen) {
+		close(fd);
+		return 1;
+	}
+	cache->base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache->base == MAP_FAILED) {
+		cache->base = NULL;
+		return 1;
+	}
+	cache->size = sb.st_size;
+
+	if (memcmp(cache->base, CACHE_MAGIC, mlen) ||
+	    cache->base[cache->size - 1] != '\n')
+		goto corrupt;
+
+	const char *ptr = cache->base + mlen;
+	const char *end = cache->base + cache->size;
+	while (ptr < end) {
+		const char *eol = memchr(ptr, '\n', end - ptr);
+		struct md5_cache_entry *e = parse_cache_line(ptr, eol - ptr);
+		struct md5_cache_entry *dup = NULL;
+
+		if (e == NULL)
+			goto corrupt;
+		// A file listed by several packages is stored once per listing
+		HASH_FIND(hh, cache->entries, e->path, e->path_len, dup);
+		if (dup)
+			free(e);
+		else
+			HASH_ADD_KEYPTR(hh, cache->entries, e->path,
+					e->path_len, e);
+		ptr = eol + 1;
+	}
+	return 0;
+corrupt:
+	msg(LOG_WARNING, "Ignoring damaged digest cache %s", cache->file);
+	free_cache_entries(cache);
+	return 1;
+}
+
+/*
+ * md5_cache_open - Load the digest cache and start the next one.
+ * @cache: Cache to set up.
+ * @file: Location of the cache, NULL disables it.
+ * Returns 0 on success and 1 when the cache cannot be used, in which
+ * case @cache is still safe to pass to the other functions.
+ */
+int md5_cache_open(struct md5_cache *cache, const char *file)
+{
+	memset(cache, 0, sizeof(*cache));
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->file = file;
+	if (file == NULL)
+		return 1;
+
+	load_cache(cache);
+
+	if (asprintf(&cache->tmp_file, "%s.tmp", file) < 0) {
+		cache->tmp_file = NULL;
+		return 1;
+	}
+	cache->out = fopen(cache->tmp_file, "we");
+	if (cache->out == NULL) {
+		msg(LOG_WARNING, "Cannot write digest cache %s (%s)",
+		    cache->tmp_file, strerror(errno));
+		return 1;
+	}
+	fputs(CACHE_MAGIC, cache->out);
+	return 0;
+}
+
+/*
+ * md5_cache_close - Release the cache of the previous load.
+ * @cache: Cache from md5_cache_open().
+ * @commit: Non-zero when the load succeeded and the new cache should
+ *          replace the old one.
+ */
+void md5_cache_close(struct md5_cache *cache, int commit)
+{
+	if (cache->out) {
+		int failed = ferror(cache->out);
+
+		if (fclose(cache->out) || failed || !commit ||
+		    rename(cache->tmp_file, cache->file))
+			unlink(cache->tmp_file);
+		cache->out = NULL;
+	}
+	free(cache->tmp_file);
+	cache->tmp_file = NULL;
+	free_cache_entries(cache);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Look up a verified digest of the file described by SB
+static const struct md5_cache_entry *cache_find(const struct md5_cache *cache,
+		const char *path, const struct stat *sb, const char *md5)
+{
+	struct md5_cache_entry *e = NULL;
+
+	if (cache == NULL || cache->entries == NULL)
+		return NULL;
+	HASH_FIND(hh, cache->entries, path, strlen(path), e);
+	if (e && e->device == sb->st_dev && e->inode == sb->st_ino &&
+	    e->size == sb->st_size && same_time(&e->mtime, &sb->st_mtim) &&
+	    same_time(&e->ctime, &sb->st_ctim) && strcmp(e->md5, md5) == 0)
+		return e;
+	return NULL;
+}
+
+// Remember a verified digest for the next load
+static void cache_store(struct md5_cache *cache, const char *path,
+			const struct stat *sb, const char *md5,
+			const char *sha256, int hit)
+{
+	if (cache == NULL)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	if (hit)
+		cache->hits++;
+	else
+		cache->misses++;
+	if (cache->out && strchr(path, '\n') == NULL)
+		fprintf(cache->out, "%llu %llu %lld.%09ld %lld.%09ld %lld "
+			"%s %s %s\n",
+			(unsigned long long)sb->st_dev,
+			(unsigned long long)sb->st_ino,
+			(long long)sb->st_mtim.tv_sec, sb->st_mtim.tv_nsec,
+			(long long)sb->st_ctim.tv_sec, sb->st_ctim.tv_nsec,
+			(long long)sb->st_size, md5, sha256, path);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Given a path to a file with an expected MD5 digest, produce its
+ * trust record if it matches.
  *
  * Dpkg does not provide sha256 sums or file sizes to verify against.
  * The only source for verification is MD5. The logic implemented is:
- * 1) Calculate the MD5 sum and compare to the expected hash. If it does
- *    not match, abort.
- * 2) Calculate the SHA256 and file size on the local files.
- * 3) Add to database.
+ * 1) If the digest cache knows the file unchanged since it verified
+ *    the same MD5, use the SHA256 it stored and skip to 4.
+ * 2) Calculate the MD5 and SHA256 sums of the local file in one pass.
+ * 3) Compare the MD5 sum to the expected hash. If it does not match,
+ *    abort.
+ * 4) Format the SHA256 and file size as a trust record.
  *
  * Security considerations:
  * An attacker would need to craft a file with a MD5 hash collision.
  * While MD5 is considered broken, this is still some effort.
  * This function would compute a sha256 and file size on the attackers
  * crafted file so they do not secure this backend.
+ *
+ * This is called from several loader threads at once; it only shares
+ * @cache, whose entries are read only and whose output is locked.
+ * Returns the length of the record written to @line, or -1 if the file
+ * cannot be trusted.
  */
-int add_file_to_backend_by_md5(const char *path, const char *expected_md5,
-			       struct _hash_record **hashtable,
-			       trust_src_t trust_src, backend *dstbackend)
+int get_file_record_by_md5(const char *path, const char *expected_md5,
+			   struct md5_cache *cache, trust_src_t trust_src,
+			   char *line, size_t len)
 {
+	const struct md5_cache_entry *hit;
+	struct stat path_stat;
+	int fd, rc;
 
 	#ifdef DEBUG
 	msg(LOG_DEBUG, "Adding %s", path);
 	msg(LOG_DEBUG, "\tExpected MD5: %s", expected_md5);
 	#endif
 
-	int fd = open(path, O_RDONLY|O_NOFOLLOW);
-	struct stat path_stat;
+	// An unchanged file does not even have to be opened
+	if (cache && cache->entries && lstat(path, &path_stat) == 0 &&
+	    S_ISREG(path_stat.st_mode) &&
+	    (hit = cache_find(cache, path, &path_stat, expected_md5))) {
+		cache_store(cache, path, &path_stat, hit->md5, hit->sha256, 1);
+		rc = snprintf(line, len, "%s " DATA_FORMAT, path, trust_src,
+			      (size_t)path_stat.st_size, hit->sha256);
+		return rc < 0 || (size_t)rc >= len ? -1 : rc;
+	}
+
+	fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
 	if (fd < 0) {
 		if (errno != ELOOP) // Don't report symlinks as a warning
 			msg(LOG_WARNING, "Could not open %si, %s", path,
 			    strerror(errno));
-		return 1;
+		return -1;
 	}
 
 	if (fstat(fd, &path_stat)) {
 		close(fd);
 		msg(LOG_WARNING, "fstat file %s failed %s", path,
 		    strerror(errno));
-		return 1;
+		return -1;
 	}
 
 	// If its not a regular file, skip.
 	if (!S_ISREG(path_stat.st_mode)) {
 		close(fd);
 		msg(LOG_DEBUG, "Not regular file %s", path);
-		return 1;
+		return -1;
 	}
 
 	size_t file_size = path_stat.st_size;
@@ -93,64 +335,25 @@ int add_file_to_backend_by_md5(const char *path, const char *expected_md5,
 	msg(LOG_DEBUG, "\tFile size: %zu", file_size);
 	#endif
 
-	char *md5_digest = get_hash_from_fd2(fd, file_size,
-		FILE_HASH_ALG_MD5);
-	if (md5_digest == NULL) {
-		close(fd);
-		msg(LOG_ERR, "MD5 digest returned NULL");
-		return 1;
+	// Both digests come from a single read of the file
+	struct file_digest d[2] = {
+		{ .alg = FILE_HASH_ALG_MD5 },
+		{ .alg = FILE_HASH_ALG_SHA256 }
+	};
+	rc = get_hashes_from_fd(fd, file_size, d, 2);
+	close(fd);
+	if (rc) {
+		msg(LOG_ERR, "Digests of %s could not be calculated", path);
+		return -1;
 	}
-	if (strcmp(md5_digest, expected_md5) != 0) {
+	if (strcmp(d[0].digest, expected_md5) != 0) {
 		msg(LOG_WARNING, "Skipping %s: hash mismatch. Got %s, expected %s",
-				path, md5_digest, expected_md5);
-		close(fd);
-		free(md5_digest);
-		return 1;
-	}
-	free(md5_digest);
-
-	// It's OK so create a sha256 of the file
-	char *sha_digest = get_hash_from_fd2(fd, file_size,
-		FILE_HASH_ALG_SHA256);
-	close(fd);
-
-	if (sha_digest == NULL) {
-		msg(LOG_ERR, "Sha digest returned NULL");
-		return 1;
+				path, d[0].digest, expected_md5);
+		return -1;
 	}
 
-	char *data;
-	if (asprintf(&data, DATA_FORMAT, trust_src, file_size, sha_digest) == -1) {
-		data = NULL;
-	}
-	free(sha_digest);
-
-	if (data) {
-		// Getting rid of the duplicates.
-		struct _hash_record *rcd = NULL;
-		char key[kMaxKeyLength];
-		snprintf(key, kMaxKeyLength - 1, "%s %s", path, data);
-
-		HASH_FIND_STR(*hashtable, key, rcd);
-
-		if (!rcd) {
-			rcd = (struct _hash_record *)malloc(
-						sizeof(struct _hash_record));
-			rcd->key = strdup(key);
-			HASH_ADD_KEYPTR(hh, *hashtable, rcd->key,
-					strlen(rcd->key), rcd);
-			if (dprintf(dstbackend->memfd, "%s %s\n",
-				    path, data) < 0) {
-				msg(LOG_ERR,
-				    "dprintf failed writing %s to memfd (%s)",
-				    path, strerror(errno));
-				free((void *)data);
-				return 1;
-			}
-		}
-		free((void *)data);
-		return 0;
-	}
-	return 1;
+	cache_store(cache, path, &path_stat, d[0].digest, d[1].digest, 0);
+	rc = snprintf(line, len, "%s " DATA_FORMAT, path, trust_src, file_size,
+		      d[1].digest);
+	return rc < 0 || (size_t)rc >= len ? -1 : rc;
 }
-
@@ -23,6 +23,10 @@
 #ifndef MD5_BACKEND_HEADER
 #define MD5_BACKEND_HEADER
 
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
 #include <uthash.h>
 
 #include "fapolicyd-backend.h"
@@ -35,7 +39,36 @@ struct _hash_record {
 static const int kMaxKeyLength = 4096;
 static const int kMd5HexSize = 32;
 
-int add_file_to_backend_by_md5(const char *path, const char *expected_md5,
-			       struct _hash_record **hashtable,
-			       trust_src_t trust_src, backend *dstbackend);
+// A file whose MD5 was verified by an earlier load
+struct md5_cache_entry {
+	const char *path;	// points into the mapped cache
+	size_t path_len;
+	dev_t device;
+	ino_t inode;
+	struct timespec mtime;
+	struct timespec ctime;
+	off_t size;
+	char md5[MD5_LEN * 2 + 1];
+	char sha256[SHA256_LEN * 2 + 1];
+	UT_hash_handle hh;
+};
+
+// Verified digests carried from one load to the next
+struct md5_cache {
+	char *base;
+	size_t size;
+	struct md5_cache_entry *entries;	// read only while loading
+	const char *file;
+	char *tmp_file;
+	FILE *out;				// entries for the next load
+	pthread_mutex_t lock;			// serializes out and counters
+	long hits;
+	long misses;
+};
+
+int md5_cache_open(struct md5_cache *cache, const char *file);
+void md5_cache_close(struct md5_cache *cache, int commit);
+int get_file_record_by_md5(const char *path, const char *expected_md5,
+			   struct md5_cache *cache, trust_src_t trust_src,
+			   char *line, size_t len);
 #endif
@@ -29,10 +29,16 @@
 #define RULES_FILE      "/etc/fapolicyd/compiled.rules"
 #define LANGUAGE_RULES_FILE  "/etc/fapolicyd/rules.d/10-languages.rules"
 #define MOUNTS_FILE     "/proc/mounts"
+#define MOUNTINFO_FILE  "/proc/self/mountinfo"
 #define TRUST_DIR_PATH  "/etc/fapolicyd/trust.d/"
 #define TRUST_FILE_PATH "/etc/fapolicyd/fapolicyd.trust"
 #define DB_DIR          "/var/lib/fapolicyd"
 #define DB_NAME         "trust.db"
+#define DIGEST_DB_NAME  "trust.digest"
+#define DIRS_DB_NAME    "trust.dirs"
+#define RPM_CACHE_FILE  "/var/lib/fapolicyd/rpm-header.cache"
+#define DEB_CACHE_FILE  "/var/lib/fapolicyd/deb-digest.cache"
+#define SCAN_CURSOR_FILE "/var/lib/fapolicyd/ignore-mounts.cursor"
 #define REPORT          "/var/log/fapolicyd-access.log"
 #define RUN_DIR         "/run/fapolicyd/"
 #define STAT_REPORT     "/run/fapolicyd/fapolicyd.state"
@@ -49,12 +49,15 @@
 #include "paths.h"
 #include "conf.h"
 #include "process.h"
+#include "reply-cache.h"
 
 #define MAX_SYSLOG_FIELDS	21
 #define NGID_LIMIT		32
 
 static llist rules;
 static atomic_ulong allowed = 0, denied = 0;
+static atomic_uint decision_stage = STAGE_IDLE;
+static atomic_ulong decision_steps;
 static nvlist_t fields[MAX_SYSLOG_FIELDS];
 static unsigned int num_fields;
 static unsigned int syslog_proc_status_mask;
@@ -217,7 +220,7 @@ int dec_name_to_val(const char *name)
 	return -1;
 }
 
-static const char *dec_val_to_name(unsigned int v)
+const char *dec_val_to_name(unsigned int v)
 {
 	unsigned int i = 0;
 	while (i < MAX_DECISIONS) {
@@ -386,6 +389,9 @@ int do_reload_rules(const conf_t *_config)
 
 	fclose(ff);
 	ff = NULL;
+
+	// Replies given under the old rules no longer hold
+	reply_cache_invalidate();
 	return 0;
 }
 
@@ -652,26 +658,55 @@ void reply_event(int fd, const struct fanotify_event_metadata *metadata,
 }
 
 
-void make_policy_decision(const struct fanotify_event_metadata *metadata,
-						int fd, uint64_t mask)
+static void set_stage(decision_stage_t stage)
+{
+	atomic_store_explicit(&decision_stage, stage, memory_order_relaxed);
+	atomic_fetch_add_explicit(&decision_steps, 1, memory_order_relaxed);
+}
+
+/*
+ * make_policy_decision - evaluate an event and answer the kernel.
+ * @metadata: event to decide.
+ * @snap: subject snapshot of an event the reader already answered, or
+ *	NULL to look at the subject as it is now.
+ * @fd: fanotify descriptor to reply on.
+ * @mask: permission events we asked for.
+ * Returns the response sent when it can be reused for an identical
+ * event, or -1 when nothing was sent or when the decision was audited or
+ * logged, which has to happen for every event on its own.
+ */
+int make_policy_decision(const struct fanotify_event_metadata *metadata,
+			 struct subject_snapshot *snap, int fd, uint64_t mask)
 {
 	event_t e;
-	int decision;
+	int decision, evaluated = 0, reply = -1;
 
-	if (new_event(metadata, &e))
+	set_stage(STAGE_EVENT);
+	if (snap ? new_deferred_event(metadata, snap, &e) :
+		   new_event(metadata, &e))
 		decision = FAN_DENY;
 	else {
+		evaluated = 1;
+		set_stage(STAGE_RULES);
 		lock_rule();
 		decision = process_event(&e);
 		unlock_rule();
 	}
+	set_stage(STAGE_REPLY);
 
 	if ((decision & DENY) == DENY)
 		atomic_fetch_add_explicit(&denied, 1, memory_order_relaxed);
 	else
 		atomic_fetch_add_explicit(&allowed, 1, memory_order_relaxed);
 
-	if (metadata->mask & mask) {
+	if (metadata->reserved & EVENT_REPLIED) {
+		// The reader already allowed it and the kernel audit record
+		// can no longer be requested, so say it in syslog instead.
+		if (evaluated && (decision & AUDIT) && !(decision & SYSLOG))
+			log_it2(e.num ? e.num - 1 : 0xFFFFFFFF,
+				decision | SYSLOG, &e);
+		close(metadata->fd);
+	} else if (metadata->mask & mask) {
 		// if in debug mode, do not allow audit events
 		if (debug_mode)
 			decision &= ~AUDIT;
@@ -679,12 +714,33 @@ void make_policy_decision(const struct fanotify_event_metadata *metadata,
 		// If permissive, always allow and honor the audit bit
 		// if not in debug mode
 		if (config.permissive)
-			reply_event(fd, metadata,FAN_ALLOW | (decision & AUDIT),
-					&e);
+			reply = FAN_ALLOW | (decision & AUDIT);
 		else
-			reply_event(fd, metadata, decision & FAN_RESPONSE_MASK,
-					&e);
+			reply = decision & FAN_RESPONSE_MASK;
+		reply_event(fd, metadata, reply, &e);
+
+		// A reused reply is counted from the reply alone, so a
+		// permissive one must not hide a deny
+		if (!evaluated || debug_mode || (decision & (AUDIT|SYSLOG)) ||
+		    (config.permissive && (decision & DENY) == DENY))
+			reply = -1;
 	}
+	set_stage(STAGE_IDLE);
+	return reply;
+}
+
+
+/*
+ * policy_count_reply - count an event answered with a reused reply.
+ * @reply: Response make_policy_decision() returned for an identical event.
+ * It was not evaluated again, but counts in the totals as if it had been.
+ */
+void policy_count_reply(int reply)
+{
+	if ((reply & FAN_DENY) == FAN_DENY)
+		atomic_fetch_add_explicit(&denied, 1, memory_order_relaxed);
+	else
+		atomic_fetch_add_explicit(&allowed, 1, memory_order_relaxed);
 }
 
 
@@ -704,3 +760,38 @@ void policy_no_audit(void)
 {
 	rules_unsupport_audit(&rules);
 }
+
+
+decision_stage_t policy_stage(void)
+{
+	return atomic_load_explicit(&decision_stage, memory_order_relaxed);
+}
+
+
+const char *policy_stage_name(decision_stage_t stage)
+{
+	switch (stage) {
+	case STAGE_IDLE:
+		return "idle";
+	case STAGE_EVENT:
+		return "event";
+	case STAGE_RULES:
+		return "rules";
+	case STAGE_REPLY:
+		return "reply";
+	}
+	return "unknown";
+}
+
+
+/*
+ * policy_progress - a counter that moves whenever the decision thread
+ * changes stage or hashes another chunk of a file. A watchdog that sees
+ * it stand still while work is pending knows the thread is stuck rather
+ * than busy.
+ */
+unsigned long policy_progress(void)
+{
+	return atomic_load_explicit(&decision_steps, memory_order_relaxed) +
+		file_hash_progress();
+}
@@ -40,6 +40,10 @@
 #endif
 
 #define SYSLOG 0x0020
+
+/* Set in fanotify_event_metadata.reserved for events the reader answered
+ * before queueing them, see permissive_defer */
+#define EVENT_REPLIED 0x01
 #define FAN_RESPONSE_MASK (FAN_ALLOW|FAN_DENY|FAN_AUDIT)
 
 typedef enum {
@@ -56,7 +60,16 @@ typedef enum {
 	DENY_LOG = FAN_DENY | AUDIT | SYSLOG
 } decision_t;
 
+/* Where the decision thread is, published for the watchdog */
+typedef enum {
+	STAGE_IDLE = 0,
+	STAGE_EVENT,	// building the event, may hash the file
+	STAGE_RULES,	// waiting for and evaluating the rules
+	STAGE_REPLY,
+} decision_stage_t;
+
 int dec_name_to_val(const char *name);
+const char *dec_val_to_name(unsigned int v);
 int load_rules(const conf_t *config);
 int load_rule_file(void);
 int do_reload_rules(const conf_t *config);
@@ -64,11 +77,15 @@ void set_reload_rules(void);
 decision_t process_event(event_t *e);
 void reply_event(int fd, const struct fanotify_event_metadata *metadata,
 		unsigned reply, event_t *e);
-void make_policy_decision(const struct fanotify_event_metadata *metadata,
-						int fd, uint64_t mask);
+int make_policy_decision(const struct fanotify_event_metadata *metadata,
+			 struct subject_snapshot *snap, int fd, uint64_t mask);
+void policy_count_reply(int reply);
 unsigned long getAllowed(void);
 unsigned long getDenied(void);
 void policy_no_audit(void);
+decision_stage_t policy_stage(void);
+const char *policy_stage_name(decision_stage_t stage);
+unsigned long policy_progress(void);
 void destroy_rules(void);
 unsigned int policy_get_syslog_proc_status_mask(void);
 
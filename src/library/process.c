@@ -91,6 +91,7 @@ struct proc_info *stat_proc_entry(pid_t pid)
 		info->path2 = NULL;
 		info->state = STATE_COLLECTING;
 		info->elf_info = 0;
+		info->env_state = ENVIRON_UNCHECKED;
 
 		return info;
 	}
@@ -459,32 +460,89 @@ int read_proc_status(pid_t pid, unsigned int fields,
 }
 
 
+/*
+ * /proc/<pid>/environ is the block of NUL terminated variables the
+ * program was started with. It is read ENVIRON_CHUNK bytes at a time
+ * into a fixed buffer, however large the environment. memchr jumps from
+ * one NUL to the next so that only the start of each variable is
+ * compared with the keys; a value that merely contains LD_PRELOAD is
+ * not a match. A variable start too close to the end of a chunk to
+ * hold a key is carried over to the front of the next one.
+ */
+#define ENVIRON_CHUNK 4096
+#define ENVIRON_KEY_MAX (sizeof("LD_PRELOAD=") - 1)
+
+static int is_loader_var(const char *var, size_t len)
+{
+	if (len >= sizeof("LD_PRELOAD=") - 1 &&
+	    memcmp(var, "LD_PRELOAD=", sizeof("LD_PRELOAD=") - 1) == 0)
+		return 1;
+	if (len >= sizeof("LD_AUDIT=") - 1 &&
+	    memcmp(var, "LD_AUDIT=", sizeof("LD_AUDIT=") - 1) == 0)
+		return 1;
+	return 0;
+}
+
 // Returns 0 if environ is clean, 1 if problems, -1 on error
 int check_environ_from_pid(pid_t pid)
 {
-	int rc = -1;
-	char *line = NULL;
-	size_t len = 0;
-	FILE *f;
+	char buf[ENVIRON_CHUNK + ENVIRON_KEY_MAX];
+	size_t carry = 0;
+	off_t off = 0;
+	int in_var = 0, rc = 0;
 
 	const char *path = proc_path(pid, "/environ");
-	f = fopen(path, "rt");
-	if (f) {
-		__fsetlocking(f, FSETLOCKING_BYCALLER);
-		while (getline(&line, &len, f) != -1) {
-			char *match = strstr(line, "LD_PRELOAD");
-			if (!match)
-				match = strstr(line, "LD_AUDIT");
-			if (match) {
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	while (rc == 0) {
+		ssize_t n = pread(fd, buf + carry, ENVIRON_CHUNK, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			rc = -1;
+			break;
+		}
+		off += n;
+
+		const char *p = buf, *end = buf + carry + n;
+		carry = 0;
+
+		// Finish the variable left over from the last chunk
+		if (in_var) {
+			const char *nul = memchr(p, 0, end - p);
+			if (nul == NULL)
+				goto next;
+			p = nul + 1;
+			in_var = 0;
+		}
+
+		while (p < end) {
+			size_t left = end - p;
+
+			if (left < ENVIRON_KEY_MAX && n) {
+				memmove(buf, p, left);
+				carry = left;
+				break;
+			}
+			if (is_loader_var(p, left)) {
 				rc = 1;
 				break;
 			}
+			const char *nul = memchr(p, 0, left);
+			if (nul == NULL) {
+				in_var = 1;
+				break;
+			}
+			p = nul + 1;
 		}
-		fclose(f);
-		if (rc == -1)
-			rc = 0;
-		free(line);
+next:
+		if (n == 0)
+			break;
 	}
+	close(fd);
+
 	return rc;
 }
 
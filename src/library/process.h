@@ -84,6 +84,12 @@ struct proc_status_info {
        char *comm;
 };
 
+// Result of check_environ_from_pid, kept for the life of the exec image
+typedef enum {	ENVIRON_UNCHECKED=0,
+		ENVIRON_CLEAN,		// no loader variables
+		ENVIRON_LD_VARS		// LD_PRELOAD or LD_AUDIT set
+} env_state_t;
+
 // Information we will cache to identify the same executable
 struct proc_info
 {
@@ -95,6 +101,7 @@ struct proc_info
 	char *path1;
 	char *path2;
 	uint32_t elf_info;
+	env_state_t env_state;
 };
 
 struct proc_info *stat_proc_entry(pid_t pid) __attr_dealloc_free;
@@ -36,31 +36,154 @@
 #include <unistd.h>
 #include "queue.h"
 #include "message.h"
+#include "realtime.h"
 
 /*
  * Ring buffer queue
  *
- * The queue is a fixed-size ring of struct fanotify_event_metadata.  A
- * semaphore tracks how many events are queued while atomic indices maintain
- * the next slot to use for enqueueing and dequeueing.  This avoids blocking
- * producers and consumers on a mutex which improves latency under load.
+ * The queue is a fixed array of struct fanotify_event_metadata slots
+ * shared by its lanes. Each lane is a ring of the slot numbers it holds
+ * in arrival order, and a free ring holds the slot numbers not in use.
+ * A semaphore tracks how many events are queued in all lanes while atomic
+ * indices maintain the next position to use for enqueueing and dequeueing
+ * in each ring. This avoids blocking producers and consumers on a mutex
+ * which improves latency under load. There is a single producer, the
+ * thread reading fanotify, and a single consumer, the decision thread.
+ * The producer takes slots from the free ring and the consumer gives
+ * them back, so each ring also has one producer and one consumer.
  *
- * q_open() allocates the array and initializes the semaphore and indices.
- * q_enqueue() copies a new event into the producer slot, advances it and posts
- * to the semaphore.  q_dequeue() waits on the semaphore, reads from the
- * consumer slot and advances it.
+ * q_open() allocates the slots and rings and initializes the semaphore
+ * and indices. q_place() fills the free ring and must run before the
+ * first event is queued. q_enqueue() takes a free slot, copies a new event into
+ * it, appends the slot to its lane and posts to the semaphore.
+ * q_dequeue() waits on the semaphore, picks a lane, copies the event out
+ * of the slot at its head and returns the slot to the free ring.
  *
- * queue_length is read without locking by the deadman thread and is
- * therefore atomic. Using a ring buffer avoids per-event malloc/free and
- * keeps memory usage predictable. max_depth records the highest
- * queue_length observed for diagnostics.
+ * Exec permission events block process startup, so they get their own
+ * lane which is served first. When open events are waiting too, one of
+ * them is served after every exec_weight exec events so that a storm of
+ * execs cannot starve them. new_event() tracks per process state that
+ * depends on seeing a process' events in order, so an event goes to the
+ * lane that already holds events from its pid, whatever its class. The
+ * pending counters are kept per pid hash bucket; a collision only makes
+ * an unrelated pid follow the same lane, which is harmless. A counter is
+ * decremented only after its event left the lane, and the decision
+ * thread finishes an event before taking the next, so an event placed by
+ * class once the counter reads zero cannot overtake an earlier one.
+ *
+ * queue_length is read without locking by other threads and is
+ * therefore atomic. Using fixed slots avoids per-event malloc/free and
+ * keeps memory usage predictable. There are num_entries slots whatever
+ * the number of lanes, only the rings of slot numbers are per lane. When
+ * exec_weight is 0 everything goes through the open lane and the exec
+ * lane is not allocated. max_depth records the highest queue_length
+ * observed for diagnostics.
+ *
+ * The slots and rings are mapped with rt_alloc_array() so that they can
+ * use huge pages, and q_open() leaves them untouched. The decision
+ * thread calls q_place() once it is pinned, which faults every page in
+ * from there and so places them on its NUMA node rather than on the one
+ * of the thread that opened the queue. Filling the free ring there also
+ * keeps it with the thread that pushes slots back to it afterwards.
+ *
+ * Each slot also carries the time it was enqueued. The consumer turns
+ * that into the time the event waited and counts it in its lane's
+ * wait_hist, a power of two histogram in microseconds. Only the decision
+ * thread dequeues, so the histograms are written by a single thread.
  */
 
 /* Queue implementation */
 static atomic_uint max_depth;
+static unsigned long wait_hist[Q_LANES][Q_WAIT_BUCKETS];
+static unsigned long lane_events[Q_LANES];
+static uint64_t max_wait[Q_LANES];
+static const char *lane_name[Q_LANES] = { "exec", "open" };
+
+static inline uint64_t q_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Bucket i counts waits below 2^i microseconds, the last one the rest
+static void q_record_wait(unsigned int lane, uint64_t stamp)
+{
+	uint64_t now = q_now();
+	uint64_t wait = now > stamp ? now - stamp : 0;
+	uint64_t usec = wait / 1000;
+	unsigned int b = 0;
+
+	if (wait > max_wait[lane])
+		max_wait[lane] = wait;
+	while (b < Q_WAIT_BUCKETS - 1 && usec >= (1ULL << b))
+		b++;
+	wait_hist[lane][b]++;
+	lane_events[lane]++;
+}
+
+static inline unsigned int q_pid_bucket(int pid)
+{
+	return (unsigned int)pid % Q_PID_BUCKETS;
+}
+
+static int q_ring_alloc(struct q_ring *r, size_t num_entries)
+{
+	r->slots = rt_alloc_array(num_entries * sizeof(uint32_t));
+	if (r->slots == NULL)
+		return -1;
+	atomic_store_explicit(&r->q_next, 0, memory_order_relaxed);
+	atomic_store_explicit(&r->q_last, 0, memory_order_relaxed);
+	atomic_store_explicit(&r->length, 0, memory_order_relaxed);
+	return 0;
+}
+
+/*
+ * Only one thread appends to a ring, so a relaxed load of q_next is
+ * enough. The entry is published by the release increment of the ring
+ * length, which the other side reads with acquire before using it.
+ */
+static void q_ring_push(const struct queue *q, struct q_ring *r,
+			uint32_t slot)
+{
+	unsigned int n = atomic_load_explicit(&r->q_next, memory_order_relaxed);
+
+	r->slots[n] = slot;
+	n++;
+	if (n == q->num_entries)
+		n = 0;
+	atomic_store_explicit(&r->q_next, n, memory_order_relaxed);
+	atomic_fetch_add_explicit(&r->length, 1, memory_order_release);
+}
+
+// The caller has seen a non zero length with acquire
+static uint32_t q_ring_pop(const struct queue *q, struct q_ring *r)
+{
+	unsigned int n = atomic_load_explicit(&r->q_last, memory_order_relaxed);
+	uint32_t slot = r->slots[n];
+
+	n++;
+	if (n == q->num_entries)
+		n = 0;
+	atomic_store_explicit(&r->q_last, n, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&r->length, 1, memory_order_release);
+	return slot;
+}
+
+static void q_free_slots(struct queue *q)
+{
+	for (unsigned int i = 0; i < Q_LANES; i++)
+		rt_free_array(q->lanes[i].slots,
+			      q->num_entries * sizeof(uint32_t));
+	rt_free_array(q->free.slots, q->num_entries * sizeof(uint32_t));
+	rt_free_array(q->stamps, q->num_entries * sizeof(uint64_t));
+	rt_free_array(q->events, q->num_entries *
+		      sizeof(struct fanotify_event_metadata));
+}
 
 /* Initialize a queue   */
-struct queue *q_open(size_t num_entries)
+struct queue *q_open(size_t num_entries, unsigned int exec_weight)
 {
 	struct queue *q;
 	int saved_errno;
@@ -71,29 +194,38 @@ struct queue *q_open(size_t num_entries)
 		return NULL;
 	}
 
-	q = malloc(sizeof(*q));
+	q = calloc(1, sizeof(*q));
 	if (q == NULL)
 		return NULL;
+	q->num_entries = num_entries;
 
-	q->events = calloc(num_entries, sizeof(struct fanotify_event_metadata));
-	if (q->events == NULL)
+	q->events = rt_alloc_array(num_entries *
+				   sizeof(struct fanotify_event_metadata));
+	q->stamps = rt_alloc_array(num_entries * sizeof(uint64_t));
+	if (q->events == NULL || q->stamps == NULL)
+		goto err;
+	if (q_ring_alloc(&q->free, num_entries) ||
+	    q_ring_alloc(&q->lanes[Q_OPEN], num_entries))
+		goto err;
+	if (exec_weight && q_ring_alloc(&q->lanes[Q_EXEC], num_entries))
 		goto err;
 
-	q->num_entries = num_entries;
-	atomic_store_explicit(&q->q_next, 0, memory_order_relaxed);
-	atomic_store_explicit(&q->q_last, 0, memory_order_relaxed);
+	q->exec_weight = exec_weight;
+	q->exec_run = 0;
 	atomic_store_explicit(&q->queue_length, 0, memory_order_relaxed);
 	max_depth = 0;
+	memset(wait_hist, 0, sizeof(wait_hist));
+	memset(lane_events, 0, sizeof(lane_events));
+	memset(max_wait, 0, sizeof(max_wait));
 
-	if (sem_init(&q->sem, 0, 0) == -1) {
-		free(q->events);
+	if (sem_init(&q->sem, 0, 0) == -1)
 		goto err;
-	}
 
 	return q;
 
 err:
 	saved_errno = errno;
+	q_free_slots(q);
 	free(q);
 	errno = saved_errno;
 	return NULL;
@@ -102,48 +234,90 @@ err:
 void q_close(struct queue *q)
 {
 	sem_destroy(&q->sem);
-	free(q->events);
+	q_free_slots(q);
 	msg(LOG_DEBUG, "Inter-thread max queue depth %u", max_depth);
+	for (unsigned int i = 0; i < Q_LANES; i++)
+		msg(LOG_DEBUG, "Inter-thread %s max queue wait %llu us",
+		    lane_name[i], (unsigned long long)max_wait[i] / 1000);
 	free(q);
 }
 
+void q_place(struct queue *q)
+{
+	rt_touch_array(q->events, q->num_entries *
+		       sizeof(struct fanotify_event_metadata));
+	rt_touch_array(q->stamps, q->num_entries * sizeof(uint64_t));
+	for (unsigned int i = 0; i < Q_LANES; i++)
+		rt_touch_array(q->lanes[i].slots,
+			       q->num_entries * sizeof(uint32_t));
+
+	// Every slot is free, the reader can queue from now on
+	for (uint32_t i = 0; i < q->num_entries; i++)
+		q_ring_push(q, &q->free, i);
+}
+
 void q_report(FILE *f)
 {
 	fprintf(f, "Inter-thread max queue depth: %u\n", max_depth);
+	for (unsigned int i = 0; i < Q_LANES; i++) {
+		fprintf(f, "Inter-thread %s events: %lu\n", lane_name[i],
+			lane_events[i]);
+		fprintf(f, "Inter-thread %s max queue wait: %llu us\n",
+			lane_name[i], (unsigned long long)max_wait[i] / 1000);
+		if (lane_events[i] == 0)
+			continue;
+		fprintf(f, "Inter-thread %s queue wait histogram:\n",
+			lane_name[i]);
+		for (unsigned int b = 0; b < Q_WAIT_BUCKETS; b++) {
+			if (wait_hist[i][b] == 0)
+				continue;
+			if (b == Q_WAIT_BUCKETS - 1)
+				fprintf(f, "  >=%lluus: %lu\n",
+					1ULL << (b - 1), wait_hist[i][b]);
+			else
+				fprintf(f, "  <%lluus: %lu\n", 1ULL << b,
+					wait_hist[i][b]);
+		}
+	}
+}
+
+// Follow earlier events from the same pid, otherwise go by class
+static unsigned int q_pick_lane(const struct queue *q,
+				const struct fanotify_event_metadata *data,
+				unsigned int bucket)
+{
+	if (q->exec_weight == 0)
+		return Q_OPEN;
+	if (atomic_load_explicit(&q->pending[bucket][Q_OPEN],
+				 memory_order_acquire))
+		return Q_OPEN;
+	if (atomic_load_explicit(&q->pending[bucket][Q_EXEC],
+				 memory_order_acquire))
+		return Q_EXEC;
+	return (data->mask & FAN_OPEN_EXEC_PERM) ? Q_EXEC : Q_OPEN;
 }
 
 /* add DATA to Q */
 int q_enqueue(struct queue *q, const struct fanotify_event_metadata *data)
 {
-	unsigned int n;
+	unsigned int bucket = q_pid_bucket(data->pid);
+	unsigned int lane, n;
+	uint32_t slot;
 
-	if (atomic_load_explicit(&q->queue_length, memory_order_relaxed) ==
-		q->num_entries) {
+	// Acquire pairs with the consumer returning a slot after reading it
+	if (atomic_load_explicit(&q->free.length, memory_order_acquire) == 0) {
 		errno = ENOSPC;
 		return -1;
 	}
 
-	/*
-	 * Load the producer index with relaxed ordering.  sem_post() acts as a
-	 * release barrier and sem_wait() in q_dequeue() provides the matching
-	 * acquire barrier.  Because the threads synchronize on the semaphore,
-	 * a relaxed load of q_next is sufficient here.
-	 */
-	n = atomic_load_explicit(&q->q_next, memory_order_relaxed);
-	q->events[n] = *data;
+	lane = q_pick_lane(q, data, bucket);
+	slot = q_ring_pop(q, &q->free);
+	q->events[slot] = *data;
+	q->stamps[slot] = q_now();
 
-	n++;
-	if (n == q->num_entries)
-		n = 0;
-
-	/*
-	 * Store the updated producer index with release semantics.  The event
-	 * was written to q->events above and sem_post() will be issued next.
-	 * sem_post() itself is a release barrier and sem_wait() in
-	 * q_dequeue() will acquire it, so the combination guarantees the
-	 * consumer sees the event before noticing that q_next advanced.
-	 */
-	atomic_store_explicit(&q->q_next, n, memory_order_release);
+	atomic_fetch_add_explicit(&q->pending[bucket][lane], 1,
+				  memory_order_relaxed);
+	q_ring_push(q, &q->lanes[lane], slot);
 
 	n = atomic_fetch_add_explicit(&q->queue_length, 1, memory_order_relaxed) + 1;
 	if (n > atomic_load_explicit(&max_depth, memory_order_relaxed))
@@ -153,6 +327,48 @@ int q_enqueue(struct queue *q, const struct fanotify_event_metadata *data)
 	return 0;
 }
 
+/*
+ * q_pop - take the next event after the semaphore was acquired.
+ * Returns 1 with DATA filled in or 0 if every lane is empty, which
+ * happens when q_shutdown() posts the semaphore.
+ */
+static int q_pop(struct queue *q, struct fanotify_event_metadata *data)
+{
+	unsigned int exec_len = atomic_load_explicit(&q->lanes[Q_EXEC].length,
+						     memory_order_acquire);
+	unsigned int open_len = atomic_load_explicit(&q->lanes[Q_OPEN].length,
+						     memory_order_acquire);
+	unsigned int lane;
+	uint32_t slot;
+
+	if (exec_len == 0 && open_len == 0)
+		return 0;
+
+	if (open_len == 0)
+		q->exec_run = 0;
+	if (exec_len && (open_len == 0 || q->exec_run < q->exec_weight)) {
+		lane = Q_EXEC;
+		q->exec_run++;
+	} else {
+		lane = Q_OPEN;
+		q->exec_run = 0;
+	}
+
+	slot = q_ring_pop(q, &q->lanes[lane]);
+	*data = q->events[slot];
+	q_record_wait(lane, q->stamps[slot]);
+
+	/*
+	 * The release in q_ring_push() ensures the slot was read before the
+	 * producer can take it from the free ring again.
+	 */
+	atomic_fetch_sub_explicit(&q->pending[q_pid_bucket(data->pid)][lane],
+				  1, memory_order_release);
+	q_ring_push(q, &q->free, slot);
+	atomic_fetch_sub_explicit(&q->queue_length, 1, memory_order_relaxed);
+	return 1;
+}
+
 /* remove one event from Q */
 int q_dequeue(struct queue *q, struct fanotify_event_metadata *data)
 {
@@ -162,33 +378,19 @@ int q_dequeue(struct queue *q, struct fanotify_event_metadata *data)
 				continue;
 			return -1;
 		}
-		if (atomic_load_explicit(&q->queue_length,
-					 memory_order_relaxed) == 0)
-			return 0;
+		return q_pop(q, data);
+	}
+}
 
-		/*
-		 * The consumer waits on sem_wait() above which provides an
-		 * acquire barrier for the producer's sem_post().  Because of
-		 * that synchronization a relaxed load of the consumer index is
-		 * safe here.
-		 */
-		unsigned int n = atomic_load_explicit(&q->q_last,
-						      memory_order_relaxed);
-		*data = q->events[n];
-		n++;
-		if (n == q->num_entries)
-			n = 0;
-
-		/*
-		 * Release ensures the slot is cleared before we advance the
-		 * consumer index.  The following sem_post() pairs with the
-		 * producer's sem_wait(), so the semaphore again provides the
-		 * cross-thread ordering needed for the queue operations.
-		 */
-		atomic_store_explicit(&q->q_last, n, memory_order_release);
-		atomic_fetch_sub_explicit(&q->queue_length, 1,
-					  memory_order_relaxed);
-		return 1;
+int q_try_dequeue(struct queue *q, struct fanotify_event_metadata *data)
+{
+	for (;;) {
+		if (sem_trywait(&q->sem)) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		return q_pop(q, data);
 	}
 }
 
@@ -206,34 +408,28 @@ int q_timed_dequeue(struct queue *q, struct fanotify_event_metadata *data,
 		break;
 	}
 
-	if (atomic_load_explicit(&q->queue_length,
-				 memory_order_relaxed) == 0)
-		return 0;
+	return q_pop(q, data);
+}
 
-	/*
-	 * The consumer waits on sem_timedwait() above which provides an
-	 * acquire barrier for the producer's sem_post().  Because of that
-	 * synchronization a relaxed load of the consumer index is safe here.
-	 */
-	unsigned int n = atomic_load_explicit(&q->q_last,
-			                      memory_order_relaxed);
-	*data = q->events[n];
-	n++;
-	if (n == q->num_entries)
-		n = 0;
+uint64_t q_oldest_stamp(struct queue *q)
+{
+	uint64_t oldest = 0;
 
-	/*
-	 * Release ensures the slot is cleared before we advance the consumer
-	 * index.  The semaphore again provides the cross-thread ordering needed
-	 * for the queue operations.
-	 */
-	atomic_store_explicit(&q->q_last, n, memory_order_release);
-	atomic_fetch_sub_explicit(&q->queue_length, 1, memory_order_relaxed);
-	return 1;
+	for (unsigned int i = 0; i < Q_LANES; i++) {
+		struct q_ring *r = &q->lanes[i];
+		uint64_t stamp;
+
+		if (atomic_load_explicit(&r->length, memory_order_acquire) == 0)
+			continue;
+		stamp = q->stamps[r->slots[atomic_load_explicit(&r->q_last,
+						memory_order_relaxed)]];
+		if (oldest == 0 || stamp < oldest)
+			oldest = stamp;
+	}
+	return oldest;
 }
 
 void q_shutdown(struct queue *q)
 {
 	sem_post(&q->sem);
 }
-
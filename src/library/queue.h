@@ -26,6 +26,7 @@
 #define QUEUE_HEADER
 
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/fanotify.h>
 #include <stdatomic.h>
@@ -33,24 +34,56 @@
 #include <time.h>
 #include "gcc-attributes.h"
 
+#define Q_WAIT_BUCKETS 18
+#define Q_PID_BUCKETS 1024
+
+/* Event classes, each with its own lane */
+enum q_lane_id { Q_EXEC, Q_OPEN, Q_LANES };
+
+/* Single producer, single consumer ring of slot numbers */
+struct q_ring
+{
+	uint32_t *slots;
+	atomic_uint q_next;
+	atomic_uint q_last;
+	atomic_uint length;
+};
+
 struct queue
 {
-	/* Ring buffer of fanotify events */
+	/* Slots of fanotify events shared by all lanes */
 	struct fanotify_event_metadata *events;
+	/* CLOCK_MONOTONIC nanoseconds at which each slot was enqueued */
+	uint64_t *stamps;
+	/* Slots not holding an event, returned by the consumer */
+	struct q_ring free;
+	/* Slots holding events, in the order they are served */
+	struct q_ring lanes[Q_LANES];
 	size_t num_entries;
-	atomic_uint q_next;
-	atomic_uint q_last;
 	atomic_uint queue_length;
+	/* Exec events served in a row while open events wait */
+	unsigned int exec_weight;
+	unsigned int exec_run;
+	/* Queued events per lane for each pid hash bucket */
+	atomic_uint pending[Q_PID_BUCKETS][Q_LANES];
         sem_t sem;
 };
 
 /* Close Q. */
 void q_close(struct queue *q);
 
-/* Open a queue for use */
-struct queue *q_open(size_t num_entries) __attribute_malloc__
+/* Open a queue holding NUM_ENTRIES events in total. Exec permission events
+ * go ahead of open events, EXEC_WEIGHT of them for each open event when
+ * both are waiting. An EXEC_WEIGHT of 0 keeps a single FIFO. */
+struct queue *q_open(size_t num_entries, unsigned int exec_weight)
+		     __attribute_malloc__
 		     __attr_dealloc (q_close, 1);
 
+/* Fault every page of Q in from the calling thread, so they are resident
+ * and local to its NUMA node, and make its slots free. Must be called
+ * once, by the consumer, before the first event is enqueued. */
+void q_place(struct queue *q);
+
 /* Write out q_depth */
 void q_report(FILE *f);
 
@@ -61,11 +94,20 @@ int q_enqueue(struct queue *q, const struct fanotify_event_metadata *data);
  * the queue is empty. */
 int q_dequeue(struct queue *q, struct fanotify_event_metadata *data);
 
+/* Remove one event from Q without blocking. Return 1 on success or 0 if
+ * the queue is empty. */
+int q_try_dequeue(struct queue *q, struct fanotify_event_metadata *data);
+
 /* Remove one event from Q, blocking until timeout. On success return 1. On
  * timeout return 0 and set errno to ETIMEDOUT. */
  int q_timed_dequeue(struct queue *q, struct fanotify_event_metadata *data,
 		     const struct timespec *ts);
 
+/* Return the CLOCK_MONOTONIC nanoseconds at which the oldest queued event
+ * was enqueued, or 0 if Q is empty. Meant for monitoring from other
+ * threads, so the answer may be slightly stale. */
+uint64_t q_oldest_stamp(struct queue *q);
+
 /* Wake up anyone waiting on the queue. */
 void q_shutdown(struct queue *q);
 
@@ -0,0 +1,327 @@
+/*
+ * realtime.c - scheduling and memory setup for latency sensitive threads
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#include "config.h"
+#include <assert.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "message.h"
+#include "realtime.h"
+
+/*
+ * The decision path allocates small objects for every event: subject
+ * and object attributes, cache nodes, stdio buffers for /proc. Rather
+ * than rewriting all of them to use pools, the calling thread's malloc
+ * arena is made to behave like one. rt_reserve_heap() grows the arena
+ * by the reserve, touches every page and frees it again. With trimming
+ * and mmap'ed chunks disabled, that memory stays in the arena and later
+ * allocations are carved from pages that are already resident. Once
+ * rt_lock_memory() locks them they cannot be paged out either, so the
+ * steady state decision path does not fault.
+ */
+
+/*
+ * rt_set_scheduling - apply real time scheduling to the calling thread.
+ * @priority: SCHED_FIFO priority, 0 leaves the policy alone.
+ * @cpu: CPU to pin the thread to, -1 for no pinning.
+ * Returns 0 on success and 1 if any part failed, which is logged.
+ */
+int rt_set_scheduling(unsigned int priority, int cpu)
+{
+	int rc, ret = 0;
+
+	if (priority) {
+		struct sched_param sp = { .sched_priority = priority };
+
+		rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (rc) {
+			msg(LOG_WARNING,
+			    "Cannot set SCHED_FIFO priority %u (%s)",
+			    priority, strerror(rc));
+			ret = 1;
+		}
+	}
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (rc) {
+			msg(LOG_WARNING, "Cannot pin thread to cpu %d (%s)",
+			    cpu, strerror(rc));
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * rt_reserve_heap - prefault SIZE bytes of heap in the calling thread's
+ * malloc arena and keep them there.
+ * Returns 0 on success and 1 on failure.
+ */
+int rt_reserve_heap(size_t size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	volatile char *p;
+
+	// Never give memory back and never mmap single chunks
+	if (mallopt(M_TRIM_THRESHOLD, -1) == 0 ||
+	    mallopt(M_MMAP_MAX, 0) == 0) {
+		msg(LOG_WARNING, "Cannot tune malloc for a locked heap");
+		return 1;
+	}
+
+	p = malloc(size);
+	if (p == NULL) {
+		msg(LOG_WARNING, "Cannot reserve %zu bytes of heap", size);
+		return 1;
+	}
+	for (size_t off = 0; off < size; off += page)
+		p[off] = 0;
+	free((void *)p);
+
+	return 0;
+}
+
+/*
+ * rt_lock_memory - lock every page that is in use now, and any page of
+ * the current mappings faulted in later, into memory. Large file backed
+ * mappings such as the trust database are only locked as far as they
+ * have been read. Without MCL_ONFAULT, mlockall() would fault in and
+ * lock the whole of those mappings, so nothing is locked.
+ * Returns 0 on success and 1 on failure.
+ */
+int rt_lock_memory(void)
+{
+#if RT_CAN_LOCK_MEMORY
+	if (mlockall(MCL_CURRENT | MCL_ONFAULT)) {
+		msg(LOG_WARNING, "Cannot lock memory (%s)", strerror(errno));
+		return 1;
+	}
+	return 0;
+#else
+	msg(LOG_WARNING, "Cannot lock memory without MCL_ONFAULT");
+	return 1;
+#endif
+}
+
+/*
+ * The event queue and the cache hash arrays are indexed all over on
+ * every event, so they are mapped on their own with rt_alloc_array()
+ * rather than taken from the heap. That lets them be backed by huge
+ * pages, which cover them with a handful of TLB entries, and leaves
+ * their pages untouched until the decision thread writes them. With
+ * the kernel's default local allocation that places them on the NUMA
+ * node the decision thread runs on, rather than on the one of the
+ * thread that created them. rt_touch_array() faults them in from the
+ * calling thread when they must be resident before the first event.
+ */
+static huge_pages_t huge_mode = HP_NONE;
+static size_t huge_size = 2 * 1024 * 1024;
+static int hugetlb_usable;	// the pool has pages of huge_size
+// Arrays mapped and not yet freed. The decision thread maps some too,
+// when it flushes the object cache.
+static atomic_uint arrays;
+
+/*
+ * rt_set_huge_pages - choose the backing of later rt_alloc_array() calls.
+ * @mode: HP_NONE, HP_TRANSPARENT or HP_EXPLICIT.
+ *
+ * Must be called while no array is mapped, arrays are freed with the
+ * same mode and huge page size they were allocated with.
+ */
+void rt_set_huge_pages(huge_pages_t mode)
+{
+	FILE *f;
+	unsigned long size;
+
+	// Freeing recomputes the length from the mode, it must not change
+	assert(atomic_load(&arrays) == 0);
+	huge_mode = mode;
+	hugetlb_usable = 0;
+	if (mode == HP_NONE)
+		return;
+
+	// The PMD size is the huge page that both kinds can use
+	f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "re");
+	if (f) {
+		if (fscanf(f, "%lu", &size) == 1 && size &&
+		    (size & (size - 1)) == 0)
+			huge_size = size;
+		fclose(f);
+	}
+
+	if (mode != HP_EXPLICIT)
+		return;
+#ifdef MAP_HUGE_SHIFT
+	hugetlb_usable = 1;
+#else
+	/*
+	 * Without MAP_HUGE_SHIFT the pool size cannot be asked for, and
+	 * MAP_HUGETLB takes the default one. Arrays are rounded to the
+	 * PMD size, so only use the pool when the two agree.
+	 */
+	f = fopen("/proc/meminfo", "re");
+	if (f) {
+		char line[80];
+
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "Hugepagesize: %lu kB", &size) == 1) {
+				hugetlb_usable = size * 1024 == huge_size;
+				break;
+			}
+		}
+		fclose(f);
+	}
+	if (!hugetlb_usable)
+		msg(LOG_DEBUG, "Default hugetlb size is not %zu bytes",
+		    huge_size);
+#endif
+}
+
+// Mapping length of an array, huge pages only pay off for large ones
+static size_t array_length(size_t size, int *huge)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	*huge = huge_mode != HP_NONE && size >= huge_size / 2;
+	if (*huge)
+		page = huge_size;
+	return (size + page - 1) & ~(page - 1);
+}
+
+/*
+ * rt_alloc_array - map zeroed memory for a large, hot array.
+ * @size: Bytes needed.
+ *
+ * HP_EXPLICIT takes pages of the PMD size from the reserved hugetlb pool
+ * and falls back to transparent huge pages when it has none. HP_TRANSPARENT maps
+ * a huge page aligned region and asks for it to be backed by huge pages.
+ * Arrays smaller than half a huge page always use normal pages.
+ * Returns the array or NULL on failure.
+ */
+void *rt_alloc_array(size_t size)
+{
+	int huge;
+	size_t len = array_length(size, &huge);
+	char *p;
+
+	if (size == 0)
+		return NULL;
+	if (!huge) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+		atomic_fetch_add(&arrays, 1);
+		return p;
+	}
+
+#ifdef MAP_HUGETLB
+	if (huge_mode == HP_EXPLICIT && hugetlb_usable) {
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+
+#ifdef MAP_HUGE_SHIFT
+		// Ask for pages of the size the length was rounded to
+		flags |= __builtin_ctzl(huge_size) << MAP_HUGE_SHIFT;
+#endif
+		// munmap() of a hugetlb mapping needs whole pages
+		assert((len & (huge_size - 1)) == 0);
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (p != MAP_FAILED) {
+			atomic_fetch_add(&arrays, 1);
+			return p;
+		}
+		msg(LOG_DEBUG, "No hugetlb pages for %zu bytes (%s)", len,
+		    strerror(errno));
+	}
+#endif
+
+	// Map a huge page more than needed and trim it to an aligned region
+	p = mmap(NULL, len + huge_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	atomic_fetch_add(&arrays, 1);
+
+	size_t head = (huge_size - ((uintptr_t)p & (huge_size - 1))) &
+		      (huge_size - 1);
+	if (head)
+		munmap(p, head);
+	if (huge_size - head)
+		munmap(p + head + len, huge_size - head);
+	p += head;
+
+#ifdef MADV_HUGEPAGE
+	if (madvise(p, len, MADV_HUGEPAGE))
+		msg(LOG_DEBUG, "Cannot use transparent huge pages (%s)",
+		    strerror(errno));
+#endif
+	return p;
+}
+
+/*
+ * rt_free_array - unmap an array from rt_alloc_array().
+ * @p: Array, may be NULL.
+ * @size: Size it was allocated with.
+ */
+void rt_free_array(void *p, size_t size)
+{
+	int huge;
+
+	if (p) {
+		assert(atomic_load(&arrays) > 0);
+		atomic_fetch_sub(&arrays, 1);
+		munmap(p, array_length(size, &huge));
+	}
+}
+
+/*
+ * rt_touch_array - fault an array in from the calling thread.
+ * @p: Array from rt_alloc_array().
+ * @size: Size it was allocated with.
+ *
+ * Every page is written with an atomic no-op, so the contents are kept
+ * even when other threads already use the array.
+ */
+void rt_touch_array(void *p, size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	unsigned char *c = p;
+
+	if (p == NULL)
+		return;
+	for (size_t off = 0; off < size; off += page)
+		__atomic_fetch_or(c + off, 0, __ATOMIC_RELAXED);
+}
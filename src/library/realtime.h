@@ -0,0 +1,47 @@
+/*
+ * realtime.h - Header for latency sensitive thread setup
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include "conf.h"
+
+// Heap reserved by the decision thread when memory is locked
+#define RT_HEAP_RESERVE (16 * 1024 * 1024)
+
+// Memory can only be locked as it faults in with MCL_ONFAULT
+#ifdef MCL_ONFAULT
+#define RT_CAN_LOCK_MEMORY 1
+#else
+#define RT_CAN_LOCK_MEMORY 0
+#endif
+
+int rt_set_scheduling(unsigned int priority, int cpu);
+int rt_reserve_heap(size_t size);
+int rt_lock_memory(void);
+void rt_set_huge_pages(huge_pages_t mode);
+void *rt_alloc_array(size_t size);
+void rt_free_array(void *p, size_t size);
+void rt_touch_array(void *p, size_t size);
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * reply-cache.c - replies reused during decision stalls
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include "reply-cache.h"
+
+/*
+ * When the watchdog finds the decision thread stalled, the reader answers
+ * new events itself. Those it has seen decided recently get the same
+ * reply, the others the watchdog_fallback decision or a place in the
+ * queue. An event matches a recent reply when it has the same pid, mask
+ * and file, which is what coalescing looks at too, and nothing that
+ * decision depended on changed since:
+ *
+ *  - the process did not exec. The reader counts the exec events of each
+ *    pid bucket and the count at the time an event is read travels with
+ *    it to the decision thread, which keeps it with the reply.
+ *  - the rules and the trust database were not reloaded. Each reload
+ *    moves the process wide epoch, which is read before deciding.
+ *
+ * Only the decision thread writes entries and only the reader looks them
+ * up, each entry is guarded by a sequence count so that a torn entry is
+ * a miss. Decisions that are audited or logged are never stored.
+ */
+
+static atomic_uint cache_epoch;
+
+/*
+ * reply_cache_open - Allocate an empty cache.
+ * Returns the cache or NULL when out of memory.
+ */
+struct reply_cache *reply_cache_open(void)
+{
+	struct reply_cache *c = calloc(1, sizeof(*c));
+
+	if (c == NULL)
+		return NULL;
+	c->entries = calloc(REPLY_CACHE_SIZE, sizeof(struct reply_entry));
+	if (c->entries == NULL) {
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+void reply_cache_close(struct reply_cache *c)
+{
+	if (c == NULL)
+		return;
+	free(c->entries);
+	free(c);
+}
+
+/*
+ * reply_cache_invalidate - Drop every stored reply.
+ * Called after the rules are reloaded or needs_flush is set, so that a
+ * decision that read the new epoch also sees the flush.
+ */
+void reply_cache_invalidate(void)
+{
+	atomic_fetch_add(&cache_epoch, 1);
+}
+
+// Epoch to store with a reply, read before the decision is made
+unsigned int reply_cache_epoch(void)
+{
+	return atomic_load(&cache_epoch);
+}
+
+static inline atomic_uint *exec_bucket(struct reply_cache *c, pid_t pid)
+{
+	return &c->exec_gen[(unsigned int)pid % REPLY_EXEC_BUCKETS];
+}
+
+// Exec count of the pid's bucket as the reader reads an event
+unsigned int reply_cache_stamp(struct reply_cache *c, pid_t pid)
+{
+	return atomic_load_explicit(exec_bucket(c, pid),
+				    memory_order_relaxed);
+}
+
+/*
+ * reply_cache_exec - Note that a process is about to exec.
+ * @c: Cache.
+ * @pid: Process of an exec permission event, once that event was
+ *	answered or queued with the stamp from before.
+ */
+void reply_cache_exec(struct reply_cache *c, pid_t pid)
+{
+	atomic_fetch_add_explicit(exec_bucket(c, pid), 1,
+				  memory_order_relaxed);
+}
+
+static inline struct reply_entry *entry_of(struct reply_cache *c,
+		pid_t pid, unsigned long long mask, dev_t dev, ino_t ino)
+{
+	unsigned long long h = ino * 0x9E3779B97F4A7C15ULL;
+
+	h ^= ((unsigned long long)dev << 32) ^ (unsigned int)pid ^ mask;
+	h *= 0x9E3779B97F4A7C15ULL;
+	return &c->entries[(h >> 32) & (REPLY_CACHE_SIZE - 1)];
+}
+
+/*
+ * reply_cache_store - Remember the reply given to an event.
+ * @c: Cache.
+ * @m: Event as dequeued.
+ * @stamp: reply_cache_stamp() when the event was read.
+ * @epoch: reply_cache_epoch() before the event was decided.
+ * @dev: Device of the event's file.
+ * @ino: Inode of the event's file.
+ * @reply: Response from make_policy_decision(), which may be reused.
+ */
+void reply_cache_store(struct reply_cache *c,
+		       const struct fanotify_event_metadata *m,
+		       unsigned int stamp, unsigned int epoch,
+		       dev_t dev, ino_t ino, int reply)
+{
+	struct reply_entry *e = entry_of(c, m->pid, m->mask, dev, ino);
+	unsigned int seq = atomic_load_explicit(&e->seq,
+						memory_order_relaxed);
+
+	atomic_store_explicit(&e->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&e->pid, m->pid, memory_order_relaxed);
+	atomic_store_explicit(&e->mask, m->mask, memory_order_relaxed);
+	atomic_store_explicit(&e->dev, dev, memory_order_relaxed);
+	atomic_store_explicit(&e->ino, ino, memory_order_relaxed);
+	atomic_store_explicit(&e->exec_gen, stamp, memory_order_relaxed);
+	atomic_store_explicit(&e->epoch, epoch, memory_order_relaxed);
+	atomic_store_explicit(&e->reply, reply, memory_order_relaxed);
+	atomic_store_explicit(&e->seq, seq + 2, memory_order_release);
+}
+
+/*
+ * reply_cache_lookup - Find the reply of an identical recent event.
+ * @c: Cache.
+ * @m: Event just read, not answered yet.
+ * @dev: Device of the event's file.
+ * @ino: Inode of the event's file.
+ * Returns the reply to give, or -1 when there is none.
+ */
+int reply_cache_lookup(struct reply_cache *c,
+		       const struct fanotify_event_metadata *m,
+		       dev_t dev, ino_t ino)
+{
+	struct reply_entry *e = entry_of(c, m->pid, m->mask, dev, ino);
+	unsigned int seq, stamp = reply_cache_stamp(c, m->pid);
+	int match, reply;
+
+	seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+	if (seq & 1)
+		return -1;
+	match = atomic_load_explicit(&e->pid, memory_order_relaxed) ==
+			m->pid &&
+		atomic_load_explicit(&e->mask, memory_order_relaxed) ==
+			m->mask &&
+		atomic_load_explicit(&e->dev, memory_order_relaxed) == dev &&
+		atomic_load_explicit(&e->ino, memory_order_relaxed) == ino &&
+		atomic_load_explicit(&e->exec_gen, memory_order_relaxed) ==
+			stamp &&
+		atomic_load_explicit(&e->epoch, memory_order_relaxed) ==
+			reply_cache_epoch();
+	reply = atomic_load_explicit(&e->reply, memory_order_relaxed);
+	atomic_thread_fence(memory_order_acquire);
+	if (!match || seq == 0 ||
+	    atomic_load_explicit(&e->seq, memory_order_relaxed) != seq)
+		return -1;
+
+	atomic_fetch_add_explicit(&c->hits, 1, memory_order_relaxed);
+	return reply;
+}
+
+void reply_cache_report(const struct reply_cache *c, FILE *f)
+{
+	fprintf(f, "Watchdog cached replies: %lu\n", atomic_load(&c->hits));
+}
@@ -0,0 +1,77 @@
+/*
+ * reply-cache.h - Header for replies reused during decision stalls
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef REPLY_CACHE_H
+#define REPLY_CACHE_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/fanotify.h>
+#include "gcc-attributes.h"
+
+// Recent replies kept, a power of two
+#define REPLY_CACHE_SIZE 4096
+// Hash buckets of pids whose exec is tracked
+#define REPLY_EXEC_BUCKETS 1024
+
+struct reply_entry {
+	atomic_uint seq;
+	atomic_int pid;
+	atomic_int reply;
+	atomic_uint exec_gen;
+	atomic_uint epoch;
+	atomic_ullong mask;
+	atomic_ullong dev;
+	atomic_ullong ino;
+};
+
+/*
+ * reply_cache - replies the reader may give while decisions are stalled.
+ * @entries: REPLY_CACHE_SIZE recent replies, written by the decision
+ *	thread only.
+ * @exec_gen: Execs seen by the reader for each pid hash bucket.
+ * @hits: Events the reader answered from the cache.
+ */
+struct reply_cache {
+	struct reply_entry *entries;
+	atomic_uint exec_gen[REPLY_EXEC_BUCKETS];
+	atomic_ulong hits;
+};
+
+void reply_cache_close(struct reply_cache *c);
+struct reply_cache *reply_cache_open(void)
+		__attribute_malloc__
+		__attr_dealloc (reply_cache_close, 1);
+void reply_cache_invalidate(void);
+unsigned int reply_cache_epoch(void);
+unsigned int reply_cache_stamp(struct reply_cache *c, pid_t pid);
+void reply_cache_exec(struct reply_cache *c, pid_t pid);
+void reply_cache_store(struct reply_cache *c,
+		       const struct fanotify_event_metadata *m,
+		       unsigned int stamp, unsigned int epoch,
+		       dev_t dev, ino_t ino, int reply);
+int reply_cache_lookup(struct reply_cache *c,
+		       const struct fanotify_event_metadata *m,
+		       dev_t dev, ino_t ino);
+void reply_cache_report(const struct reply_cache *c, FILE *f);
+
+#endif
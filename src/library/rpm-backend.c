@@ -46,6 +46,11 @@
 #include <rpm/rpmpgp.h>
 #include <fnmatch.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <uthash.h>
 
@@ -56,6 +61,7 @@
 
 #include "filter.h"
 #include "file.h"
+#include "paths.h"
 
 
 extern atomic_bool stop;
@@ -63,6 +69,7 @@ extern atomic_bool stop;
 int do_rpm_init_backend(void);
 int do_rpm_load_list(const conf_t *, int memfd);
 int do_rpm_destroy_backend(void);
+void do_rpm_set_options(const char *root, const char *cache, int incremental);
 
 static int rpm_init_backend(void);
 static int rpm_load_list(const conf_t *);
@@ -76,8 +83,15 @@ backend rpm_backend =
 	rpm_destroy_backend,
 	-1,
 	-1,
+	0,
+	0,
 };
 
+// Loader options, see do_rpm_set_options()
+static const char *rpm_root = NULL;
+static const char *header_cache_file = RPM_CACHE_FILE;
+static int incremental_load = 0;
+
 static rpmts ts = NULL;
 static rpmdbMatchIterator mi = NULL;
 
@@ -92,6 +106,8 @@ static int get_next_package_rpm(void)
 	// If this is the first time, create a package iterator
 	if (mi == NULL) {
 		ts = rpmtsCreate();
+		if (rpm_root)
+			rpmtsSetRootDir(ts, rpm_root);
 		mi = rpmtsInitIterator(ts, RPMDBI_PACKAGES, NULL, 0);
 		if (mi == NULL)
 			return 0;
@@ -110,39 +126,49 @@ static int get_next_package_rpm(void)
 	return 1;
 }
 
-static rpmfi fi = NULL;
-static int get_next_file_rpm(void)
+/*
+ * get_header_key_rpm - Identify the current package header.
+ * @buf: Scratch buffer used when the header carries no digest.
+ * @blen: Size of @buf.
+ *
+ * Installed headers carry a digest of their immutable region, which
+ * changes whenever the package is upgraded, reinstalled from a different
+ * build, or removed and added back. Very old packages lack it, so fall
+ * back to the NEVRA plus the install transaction id.
+ * Returns a string valid until the next header is loaded.
+ */
+static const char *get_header_key_rpm(char *buf, size_t blen)
 {
-	// If its the first time, make file iterator
-	if (fi == NULL)
-		fi = rpmfiNew(NULL, h, RPMTAG_BASENAMES, RPMFI_KEEPHEADER);
-
-	if (fi) {
-		if (rpmfiNext(fi) == -1) {
-			// No more files, cleanup iterator
-			rpmfiFree(fi);
-			fi = NULL;
-			return 0;
-		}
-	}
-	return 1;
+	const char *key = headerGetString(h, RPMTAG_SHA256HEADER);
+	if (key == NULL)
+		key = headerGetString(h, RPMTAG_SHA1HEADER);
+	if (key)
+		return key;
+
+	char *nevra = headerGetAsString(h, RPMTAG_NEVRA);
+	snprintf(buf, blen, "%s@%llu", nevra ? nevra : "(none)",
+		 (unsigned long long)headerGetNumber(h, RPMTAG_INSTALLTID));
+	free(nevra);
+	return buf;
 }
 
-static inline const char *get_file_name_rpm(void)
+static inline const char *get_file_name_rpm(rpmfi fi)
 {
 	return rpmfiFN(fi);
 }
 
-static inline rpm_loff_t get_file_size_rpm(void)
+static inline rpm_loff_t get_file_size_rpm(rpmfi fi)
 {
 	return rpmfiFSize(fi);
 }
 
-static char *get_sha256_rpm(int *len)
+/*
+ * The rpm database has SHA512, SHA26, and SHA1 hashes. The caller passes
+ * a buffer of at least SHA512_LEN * 2 + 1 bytes to avoid a short lived
+ * malloc/free cycle.
+ */
+static char *get_sha256_rpm(rpmfi fi, char *sha, int *len)
 {
-	// The rpm database has SHA512, SHA26, and SHA1 hashes. This uses
-	// a static buffer to avoid a short lived malloc/free cycle.
-	static char sha[SHA512_LEN * 2 + 1];
 	const unsigned char *digest;
 	size_t tlen = 0;
 
@@ -158,7 +184,7 @@ static char *get_sha256_rpm(int *len)
 	return sha;
 }
 
-static int is_dir_link_rpm(void)
+static int is_dir_link_rpm(rpmfi fi)
 {
 	mode_t mode = rpmfiFMode(fi);
 	if (S_ISDIR(mode) || S_ISLNK(mode))
@@ -167,7 +193,7 @@ static int is_dir_link_rpm(void)
 }
 
 /* We don't want doc files in the database */
-static int is_doc_rpm(void)
+static int is_doc_rpm(rpmfi fi)
 {
 	if (rpmfiFFlags(fi) & (RPMFILE_DOC|RPMFILE_README|
 				RPMFILE_GHOST|RPMFILE_LICENSE|RPMFILE_PUBKEY))
@@ -177,7 +203,7 @@ static int is_doc_rpm(void)
 
 /* Config files can have a changed hash. We want them in the db since
  * they are trusted. */
-static int is_config_rpm(void)
+static int is_config_rpm(rpmfi fi)
 {
 	if (rpmfiFFlags(fi) &
 		(RPMFILE_CONFIG|RPMFILE_MISSINGOK|RPMFILE_NOREPLACE))
@@ -187,8 +213,6 @@ static int is_config_rpm(void)
 
 static void close_rpm(void)
 {
-	rpmfiFree(fi);
-	fi = NULL;
 	headerFree(h);
 	h = NULL;
 	rpmdbFreeIterator(mi);
@@ -225,7 +249,10 @@ static int rpm_load_list(const conf_t *conf)
 	posix_spawn_file_actions_addclose(&actions, sv[0]);
 	posix_spawn_file_actions_addclose(&actions, sv[1]);
 
-	char *argv[] = { "fapolicyd-rpm-loader", NULL };
+	// A change set is only useful if the trust database holds exactly
+	// what the previous load delivered.
+	char *argv[] = { "fapolicyd-rpm-loader",
+			 rpm_backend.synced ? "--incremental" : NULL, NULL };
 	char *custom_env[] = { "FAPO_SOCK_FD=3", NULL };
 
 	pid_t pid = -1;
@@ -236,8 +263,9 @@ static int rpm_load_list(const conf_t *conf)
 	if (status == 0) {
 		msg(LOG_DEBUG, "fapolicyd-rpm-loader spawned with pid: %d",pid);
 
+		char kind = 0;
 		struct msghdr  _msg  = {0};
-		struct iovec   iov = { .iov_base = (char[1]){0}, .iov_len = 1 };
+		struct iovec   iov = { .iov_base = &kind, .iov_len = 1 };
 		union {
 			struct cmsghdr align;
 			char buf[CMSG_SPACE(sizeof(int))];
@@ -275,6 +303,9 @@ static int rpm_load_list(const conf_t *conf)
 
 		// Pass the memfd to the backend representation
 		rpm_backend.memfd = memfd;
+		rpm_backend.delta = (kind != 0);
+		if (rpm_backend.delta)
+			msg(LOG_DEBUG, "rpm loader sent a change set");
 
 		waitpid(pid, NULL, 0);
 	} else
@@ -285,17 +316,677 @@ static int rpm_load_list(const conf_t *conf)
 	return 0;
 }
 
-// this function is used in fapolicyd-rpm-loader
+/*
+ * Header cache
+ *
+ * The loader remembers which package headers produced the previous
+ * snapshot, together with the trust records each one contributed:
+ *
+ *   fapolicyd-rpm-cache 1 <rpmdb dev>:<rpmdb ino> <config fingerprint>
+ *   H <header key>
+ *   <path> <tsource> <size> <digest>
+ *   ...
+ *
+ * Headers that are still installed are not expanded again; their records
+ * are copied from the cache. When the daemon asks for an incremental load,
+ * only the records of added and removed packages are sent, prefixed with
+ * '+' or '-'. A rebuilt rpmdb, a changed filter or rpm_sha256_only setting,
+ * or an unreadable cache all fall back to a full scan.
+ */
+#define CACHE_MAGIC "fapolicyd-rpm-cache 1"
+
+struct _header_record {
+	const char *key;	// points into the mapped cache
+	const char *recs;	// first trust record of this header
+	size_t len;		// length of all its trust records
+	long count;		// number of trust records
+	int seen;
+	UT_hash_handle hh;
+};
+
+struct header_cache {
+	char *base;
+	size_t size;
+	struct _header_record *headers;
+};
+
+// Append file identity to the fingerprint so rewrites are noticed
+static void stat_fingerprint(char *buf, size_t blen, const char *path)
+{
+	struct stat sb;
+	size_t len = strlen(buf);
+
+	if (stat(path, &sb) == 0)
+		snprintf(buf + len, blen - len, "%lx.%lx.%llx.%lx,",
+			 (unsigned long)sb.st_ino,
+			 (unsigned long)sb.st_dev,
+			 (unsigned long long)sb.st_size,
+			 (unsigned long)sb.st_mtim.tv_sec ^
+			 (unsigned long)sb.st_mtim.tv_nsec);
+	else
+		snprintf(buf + len, blen - len, "-,");
+}
+
+/*
+ * cache_identity - Describe what the header cache is only valid for.
+ * @conf: Daemon configuration, may be NULL.
+ * @buf: Output buffer for the first line of the cache.
+ * @blen: Size of @buf.
+ *
+ * Returns 0 on success and 1 when the rpmdb files cannot be located, in
+ * which case no cache should be used.
+ */
+static int cache_identity(const conf_t *conf, char *buf, size_t blen)
+{
+	static const char *db_files[] = {
+		"rpmdb.sqlite", "Packages.db", "Packages", NULL };
+	char path[PATH_MAX];
+	struct stat sb;
+	int found = 0;
+
+	char *dbpath = rpmExpand("%{_dbpath}", NULL);
+	if (dbpath == NULL)
+		return 1;
+
+	for (int i = 0; db_files[i]; i++) {
+		snprintf(path, sizeof(path), "%s%s/%s",
+			 rpm_root ? rpm_root : "", dbpath, db_files[i]);
+		if (stat(path, &sb) == 0) {
+			found = 1;
+			break;
+		}
+	}
+	free(dbpath);
+	if (!found)
+		return 1;
+
+	char fingerprint[256] = "";
+	stat_fingerprint(fingerprint, sizeof(fingerprint), OLD_FILTER_FILE);
+	stat_fingerprint(fingerprint, sizeof(fingerprint), FILTER_FILE);
+
+	snprintf(buf, blen, "%s %lu:%lu %s%u\n", CACHE_MAGIC,
+		 (unsigned long)sb.st_dev, (unsigned long)sb.st_ino,
+		 fingerprint, conf ? conf->rpm_sha256_only : 0);
+	return 0;
+}
+
+static void close_header_cache(struct header_cache *cache)
+{
+	struct _header_record *item, *tmp;
+
+	HASH_ITER(hh, cache->headers, item, tmp) {
+		HASH_DEL(cache->headers, item);
+		free(item);
+	}
+	if (cache->base)
+		munmap(cache->base, cache->size);
+	cache->base = NULL;
+	cache->size = 0;
+}
+
+/*
+ * open_header_cache - Map the previous header cache and index it.
+ * @identity: Expected first line of the cache.
+ * @cache: Output, left empty on failure.
+ *
+ * Returns 0 when the cache matches @identity and parsed cleanly,
+ * and 1 when it has to be ignored.
+ */
+static int open_header_cache(const char *identity, struct header_cache *cache)
+{
+	struct stat sb;
+	struct _header_record *cur = NULL;
+	size_t ilen = strlen(identity);
+
+	memset(cache, 0, sizeof(*cache));
+	int fd = open(header_cache_file, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+
+	if (fstat(fd, &sb) || (size_t)sb.st_size <= ilen) {
+		close(fd);
+		return 1;
+	}
+
+	cache->base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache->base == MAP_FAILED) {
+		cache->base = NULL;
+		return 1;
+	}
+	cache->size = sb.st_size;
+
+	if (memcmp(cache->base, identity, ilen) ||
+			cache->base[cache->size - 1] != '\n')
+		goto corrupt;
+
+	const char *ptr = cache->base + ilen;
+	const char *end = cache->base + cache->size;
+	while (ptr < end) {
+		const char *eol = memchr(ptr, '\n', end - ptr);
+		size_t len = eol - ptr;
+
+		if (len > 2 && ptr[0] == 'H' && ptr[1] == ' ') {
+			struct _header_record *dup = NULL;
+
+			HASH_FIND(hh, cache->headers, ptr + 2, len - 2, dup);
+			if (dup)
+				goto corrupt;
+
+			cur = calloc(1, sizeof(*cur));
+			if (cur == NULL)
+				goto corrupt;
+			cur->key = ptr + 2;
+			cur->recs = eol + 1;
+			HASH_ADD_KEYPTR(hh, cache->headers, cur->key,
+					len - 2, cur);
+		} else if (cur && ptr[0] == '/') {
+			cur->len += len + 1;
+			cur->count++;
+		} else
+			goto corrupt;
+		ptr = eol + 1;
+	}
+
+	return 0;
+corrupt:
+	msg(LOG_WARNING, "Ignoring damaged rpm header cache %s",
+	    header_cache_file);
+	close_header_cache(cache);
+	return 1;
+}
+
+/*
+ * record_seen - Remember a trust record in a dedup table.
+ * @table: Hash table of records.
+ * @line: Record text, not necessarily NUL terminated.
+ * @len: Length of @line.
+ *
+ * Returns 1 if the record was already present, 0 if it was added, and
+ * -1 on allocation failure.
+ */
+static int record_seen(struct _hash_record **table, const char *line,
+		       size_t len)
+{
+	struct _hash_record *rcd = NULL;
+
+	HASH_FIND(hh, *table, line, len, rcd);
+	if (rcd)
+		return 1;
+
+	rcd = malloc(sizeof(struct _hash_record));
+	if (rcd == NULL)
+		return -1;
+	rcd->key = strndup(line, len);
+	if (rcd->key == NULL) {
+		free(rcd);
+		return -1;
+	}
+	HASH_ADD_KEYPTR(hh, *table, rcd->key, len, rcd);
+	return 0;
+}
+
+// Drop a record from a dedup table if it is present
+static void record_forget(struct _hash_record **table, const char *line,
+			  size_t len)
+{
+	struct _hash_record *rcd = NULL;
+
+	HASH_FIND(hh, *table, line, len, rcd);
+	if (rcd) {
+		HASH_DEL(*table, rcd);
+		free((void *)rcd->key);
+		free(rcd);
+	}
+}
+
+static void free_records(struct _hash_record **table)
+{
+	struct _hash_record *item, *tmp;
+
+	HASH_ITER(hh, *table, item, tmp) {
+		HASH_DEL(*table, item);
+		free((void *)item->key);
+		free(item);
+	}
+}
+
+/*
+ * Records are deduplicated in a table split into shards, each with its
+ * own lock, so the loader threads rarely contend on it.
+ */
+#define RECORD_SHARDS 64
+
+struct record_table {
+	struct _hash_record *shard[RECORD_SHARDS];
+	pthread_mutex_t lock[RECORD_SHARDS];
+};
+
+static void record_table_init(struct record_table *table)
+{
+	for (int i = 0; i < RECORD_SHARDS; i++) {
+		table->shard[i] = NULL;
+		pthread_mutex_init(&table->lock[i], NULL);
+	}
+}
+
+static void record_table_destroy(struct record_table *table)
+{
+	for (int i = 0; i < RECORD_SHARDS; i++) {
+		free_records(&table->shard[i]);
+		pthread_mutex_destroy(&table->lock[i]);
+	}
+}
+
+// FNV-1a, only used to pick the shard
+static unsigned int record_shard(const char *line, size_t len)
+{
+	unsigned int hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)line[i];
+		hash *= 16777619u;
+	}
+	return hash % RECORD_SHARDS;
+}
+
+// Thread safe record_seen() on the sharded table
+static int record_table_seen(struct record_table *table, const char *line,
+			     size_t len)
+{
+	unsigned int i = record_shard(line, len);
+
+	pthread_mutex_lock(&table->lock[i]);
+	int rc = record_seen(&table->shard[i], line, len);
+	pthread_mutex_unlock(&table->lock[i]);
+	return rc;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t rc = write(fd, buf, len);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			msg(LOG_ERR, "Failed writing rpm snapshot (%s)",
+			    strerror(errno));
+			return 1;
+		}
+		buf += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/*
+ * emit_cached_header - Replay the records of an unchanged header.
+ * Only needed for a full snapshot; a change set omits them.
+ * Returns 0 on success, 1 on failure.
+ */
+static int emit_cached_header(const struct _header_record *hr,
+			      struct record_table *table, int memfd,
+			      long *entries)
+{
+	const char *ptr = hr->recs, *end = hr->recs + hr->len;
+	const char *run = ptr;
+
+	// Consecutive new records are written with a single call
+	while (ptr < end) {
+		const char *eol = memchr(ptr, '\n', end - ptr);
+		int rc = record_table_seen(table, ptr, eol - ptr);
+
+		if (rc < 0)
+			return 1;
+		if (rc) {
+			if (write_all(memfd, run, ptr - run))
+				return 1;
+			run = eol + 1;
+		} else
+			(*entries)++;
+		ptr = eol + 1;
+	}
+	return write_all(memfd, run, end - run);
+}
+
+/*
+ * emit_removed_records - Send the records of uninstalled packages.
+ * @cache: Previous header cache, unseen headers were removed.
+ * @added: Records delivered by new headers in this run.
+ * @memfd: Output.
+ * @entries: Incremented for each record written.
+ *
+ * A record only goes away if no surviving or new header provides it.
+ * Returns 0 on success, 1 on failure.
+ */
+static int emit_removed_records(struct header_cache *cache,
+				struct record_table *added, int memfd,
+				long *entries)
+{
+	struct _hash_record *removed = NULL, *rcd, *tmp;
+	struct _header_record *hr, *htmp;
+	int rc = 1;
+
+	HASH_ITER(hh, cache->headers, hr, htmp) {
+		if (hr->seen)
+			continue;
+		const char *ptr = hr->recs, *end = hr->recs + hr->len;
+		while (ptr < end) {
+			const char *eol = memchr(ptr, '\n', end - ptr);
+			if (record_seen(&removed, ptr, eol - ptr) < 0)
+				goto out;
+			ptr = eol + 1;
+		}
+	}
+
+	if (removed == NULL)
+		return 0;
+
+	HASH_ITER(hh, cache->headers, hr, htmp) {
+		if (!hr->seen)
+			continue;
+		const char *ptr = hr->recs, *end = hr->recs + hr->len;
+		while (ptr < end && removed) {
+			const char *eol = memchr(ptr, '\n', end - ptr);
+			record_forget(&removed, ptr, eol - ptr);
+			ptr = eol + 1;
+		}
+	}
+	for (int i = 0; i < RECORD_SHARDS; i++)
+		HASH_ITER(hh, added->shard[i], rcd, tmp)
+			record_forget(&removed, rcd->key, strlen(rcd->key));
+
+	HASH_ITER(hh, removed, rcd, tmp) {
+		if (dprintf(memfd, "-%s\n", rcd->key) < 0) {
+			msg(LOG_ERR, "dprintf failed writing %s to memfd (%s)",
+			    rcd->key, strerror(errno));
+			goto out;
+		}
+		(*entries)++;
+	}
+	rc = 0;
+out:
+	free_records(&removed);
+	return rc;
+}
+
+/*
+ * Header iteration has to stay on one thread, but expanding a header into
+ * trust records (filtering, digest conversion, formatting and dedup) is
+ * handed to a pool of workers. Headers are queued in a ring and their
+ * output is written strictly in rpmdb order, so the header cache keeps
+ * its layout and every record still appears once in the snapshot.
+ */
+#define MAX_LOADER_THREADS 8
+#define ITEMS_PER_THREAD 16
+
+struct line_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+struct load_item {
+	char *key;
+	struct _header_record *cached;	// unchanged header, nothing to do
+	rpmfi fi;			// files to expand otherwise
+	struct line_buf recs;		// all records, for the header cache
+	struct line_buf out;		// records to send after dedup
+	long files;
+	long emitted;
+	int done;
+	int failed;
+};
+
+struct rpm_loader {
+	const conf_t *conf;
+	int delta;
+	struct record_table seen;
+	struct load_item *items;
+	unsigned int depth;
+	unsigned int head;	// next item to write out
+	unsigned int next;	// next item for a worker
+	unsigned int tail;	// next free item
+	int finished;
+	atomic_uint digest_warnings;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+};
+
+static int line_buf_add(struct line_buf *lb, const char *prefix,
+			const char *line, size_t len)
+{
+	size_t plen = strlen(prefix);
+	size_t need = lb->len + plen + len + 1;
+
+	if (need > lb->size) {
+		size_t size = lb->size ? lb->size : BUFFER_SIZE;
+		while (size < need)
+			size *= 2;
+		char *tmp = realloc(lb->buf, size);
+		if (tmp == NULL)
+			return 1;
+		lb->buf = tmp;
+		lb->size = size;
+	}
+	memcpy(lb->buf + lb->len, prefix, plen);
+	memcpy(lb->buf + lb->len + plen, line, len);
+	lb->len += plen + len;
+	lb->buf[lb->len++] = '\n';
+	return 0;
+}
+
+static void reset_item(struct load_item *item)
+{
+	free(item->key);
+	item->key = NULL;
+	item->cached = NULL;
+	if (item->fi) {
+		rpmfiFree(item->fi);
+		item->fi = NULL;
+	}
+	item->recs.len = 0;
+	item->out.len = 0;
+	item->files = 0;
+	item->emitted = 0;
+	item->done = 0;
+	item->failed = 0;
+}
+
 extern unsigned int debug_mode;
+
+/*
+ * expand_item - Turn the files of one header into trust records.
+ * Runs on a worker thread; only touches the item and the shared
+ * dedup table. Returns 0 on success, 1 on allocation failure.
+ */
+static int expand_item(struct rpm_loader *ld, struct load_item *item)
+{
+	unsigned int tsource = SRC_RPM;
+	char sha_buf[SHA512_LEN * 2 + 1];
+	char line[PATH_MAX + FILE_DIGEST_STRING_MAX + 64];
+
+	// Loop across the files of the package
+	while (!stop && rpmfiNext(item->fi) >= 0) {
+		rpmfi fi = item->fi;
+
+		// We do not want directories or symlinks in the
+		// database. Multiple packages can own the same
+		// directory and that causes problems in the size info.
+		if (is_dir_link_rpm(fi))
+			continue;
+
+		// We do not want any documentation in the database
+		if (is_doc_rpm(fi))
+			continue;
+
+		// We do not want any configuration files in database
+		if (is_config_rpm(fi))
+			continue;
+
+		// Get specific file information
+		const char *file_name = get_file_name_rpm(fi);
+
+		// should we drop a path?
+		filter_rc_t f_res = filter_check(file_name);
+		if (f_res != FILTER_ALLOW) {
+			if (f_res == FILTER_ERR_DEPTH)
+				msg(LOG_WARNING,
+				    "filter nesting exceeds MAX_FILTER_DEPTH for %s; excluding",
+				    file_name);
+			continue;
+		}
+
+		rpm_loff_t sz = get_file_size_rpm(fi);
+		int len;
+		const char *sha = get_sha256_rpm(fi, sha_buf, &len);
+
+		// Filter out short digests when rpm_sha256_only is
+		// set. SHA256 and larger are unconditionally accepted.
+		if (len < (SHA256_LEN*2)) {
+			if (ld->conf && ld->conf->rpm_sha256_only) {
+				// Limit this to 5 if production
+				if (debug_mode ||
+				    atomic_fetch_add(&ld->digest_warnings, 1) < 5)
+					msg(LOG_WARNING,
+					    "No acceptable digest for %s",
+					    file_name);
+				continue;
+			}
+		}
+
+		int line_len = snprintf(line, sizeof(line), "%s " DATA_FORMAT,
+					file_name, tsource, (size_t)sz, sha);
+		if (line_len < 0 || line_len >= (int)sizeof(line)) {
+			msg(LOG_WARNING, "Skipping overlong path %s",
+			    file_name);
+			continue;
+		}
+		item->files++;
+
+		if (line_buf_add(&item->recs, "", line, line_len))
+			return 1;
+
+		// getting rid of the duplicates
+		int seen = record_table_seen(&ld->seen, line, line_len);
+		if (seen < 0)
+			return 1;
+		if (seen)
+			continue;
+
+		if (line_buf_add(&item->out, ld->delta ? "+" : "", line,
+				 line_len))
+			return 1;
+		item->emitted++;
+	}
+	return 0;
+}
+
+static void *loader_worker(void *arg)
+{
+	struct rpm_loader *ld = arg;
+
+	pthread_mutex_lock(&ld->lock);
+	while (1) {
+		while (ld->next == ld->tail && !ld->finished)
+			pthread_cond_wait(&ld->work, &ld->lock);
+		if (ld->next == ld->tail)
+			break;
+
+		struct load_item *item = &ld->items[ld->next++ % ld->depth];
+		pthread_mutex_unlock(&ld->lock);
+
+		int failed = item->fi ? expand_item(ld, item) : 0;
+
+		pthread_mutex_lock(&ld->lock);
+		item->failed = failed;
+		item->done = 1;
+		pthread_cond_broadcast(&ld->done);
+	}
+	pthread_mutex_unlock(&ld->lock);
+
+	return NULL;
+}
+
+/*
+ * flush_item - Write out the oldest queued header once it is expanded.
+ * Returns 0 on success, 1 on failure.
+ */
+static int flush_item(struct rpm_loader *ld, int memfd, FILE *new_cache,
+		      long *entries, long *files)
+{
+	struct load_item *item = &ld->items[ld->head % ld->depth];
+	int rc = 0;
+
+	pthread_mutex_lock(&ld->lock);
+	while (!item->done)
+		pthread_cond_wait(&ld->done, &ld->lock);
+	pthread_mutex_unlock(&ld->lock);
+
+	if (item->failed) {
+		msg(LOG_ERR, "Out of memory expanding rpm header %s",
+		    item->key);
+		rc = 1;
+		goto out;
+	}
+
+	if (item->cached) {
+		if (new_cache) {
+			fprintf(new_cache, "H %s\n", item->key);
+			fwrite(item->cached->recs, 1, item->cached->len,
+			       new_cache);
+		}
+		*files += item->cached->count;
+		if (!ld->delta)
+			rc = emit_cached_header(item->cached, &ld->seen,
+						memfd, entries);
+		goto out;
+	}
+
+	if (new_cache) {
+		fprintf(new_cache, "H %s\n", item->key);
+		fwrite(item->recs.buf, 1, item->recs.len, new_cache);
+	}
+	*files += item->files;
+	rc = write_all(memfd, item->out.buf, item->out.len);
+	*entries += item->emitted;
+out:
+	reset_item(item);
+	ld->head++;
+	return rc;
+}
+
+/*
+ * do_rpm_set_options - Adjust how the loader reads the rpm database.
+ * @root: Alternate root of the rpm database or NULL for the system one.
+ * @cache: Location of the header cache, NULL disables it.
+ * @incremental: Non-zero to send a change set against the header cache
+ *               rather than a full snapshot whenever possible.
+ */
+void do_rpm_set_options(const char *root, const char *cache, int incremental)
+{
+	rpm_root = root;
+	header_cache_file = cache;
+	incremental_load = incremental;
+}
+
+// this function is used in fapolicyd-rpm-loader
 int do_rpm_load_list(const conf_t *conf, int memfd)
 {
 	int rc;
-	unsigned int msg_count = 0;
-	unsigned int tsource = SRC_RPM;
+	long entries = 0, files = 0, packages = 0;
+	struct timespec start, end;
+
+	struct rpm_loader ld;
+	pthread_t workers[MAX_LOADER_THREADS];
+	unsigned int threads = 0;
 
-	// hash table
-	struct _hash_record *hashtable = NULL;
-	long entries = 0;
+	struct header_cache cache = { NULL, 0, NULL };
+	char identity[512];
+	char tmp_cache[PATH_MAX] = "";
+	FILE *new_cache = NULL;
+	int have_cache = 0;
 
 	if (memfd < 0) {
 		msg(LOG_ERR, "Invalid memfd supplied to rpm loader");
@@ -303,129 +994,164 @@ int do_rpm_load_list(const conf_t *conf, int memfd)
 	}
 
 	msg(LOG_INFO, "Loading rpmdb backend");
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if ((rc = init_rpm())) {
 		msg(LOG_ERR, "init_rpm() failed (%d)", rc);
 		return rc;
 	}
 
-	// Loop across the rpm database
-	while (!stop && get_next_package_rpm()) {
-		// Loop across the packages
-		while (!stop && get_next_file_rpm()) {
-			// We do not want directories or symlinks in the
-			// database. Multiple packages can own the same
-			// directory and that causes problems in the size info.
-			if (is_dir_link_rpm())
-				continue;
-
-			// We do not want any documentation in the database
-			if (is_doc_rpm())
-				continue;
+	memset(&ld, 0, sizeof(ld));
+	ld.conf = conf;
+	record_table_init(&ld.seen);
+	pthread_mutex_init(&ld.lock, NULL);
+	pthread_cond_init(&ld.work, NULL);
+	pthread_cond_init(&ld.done, NULL);
+
+	if (header_cache_file && cache_identity(conf, identity,
+						sizeof(identity)) == 0) {
+		have_cache = !open_header_cache(identity, &cache);
+		ld.delta = have_cache && incremental_load;
+
+		snprintf(tmp_cache, sizeof(tmp_cache), "%s.tmp",
+			 header_cache_file);
+		new_cache = fopen(tmp_cache, "we");
+		if (new_cache)
+			fputs(identity, new_cache);
+		else
+			msg(LOG_WARNING, "Cannot write rpm header cache %s (%s)",
+			    tmp_cache, strerror(errno));
+	}
+	if (incremental_load && !ld.delta)
+		msg(LOG_INFO, "rpm header cache unusable, doing a full load");
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int want = cpus < 1 ? 1 : cpus > MAX_LOADER_THREADS ?
+				MAX_LOADER_THREADS : (unsigned int)cpus;
+	ld.depth = want * ITEMS_PER_THREAD;
+	ld.items = calloc(ld.depth, sizeof(struct load_item));
+	if (ld.items == NULL) {
+		msg(LOG_ERR, "Out of memory starting the rpm loader");
+		rc = 1;
+		goto out;
+	}
+	for (; threads < want; threads++)
+		if (pthread_create(&workers[threads], NULL, loader_worker, &ld))
+			break;
+	if (threads == 0) {
+		msg(LOG_ERR, "Cannot start rpm loader threads");
+		rc = 1;
+		goto out;
+	}
 
-			// We do not want any configuration files in database
-			if (is_config_rpm())
-				continue;
+	// Loop across the rpm database
+	rc = 0;
+	while (!stop && rc == 0 && get_next_package_rpm()) {
+		char key_buf[256];
+		const char *key = get_header_key_rpm(key_buf, sizeof(key_buf));
+		struct _header_record *hr = NULL;
+
+		// Make room by writing out the oldest header
+		if (ld.tail - ld.head == ld.depth &&
+		    flush_item(&ld, memfd, new_cache, &entries, &files)) {
+			rc = 1;
+			break;
+		}
 
-			// Get specific file information
-			const char *tmp = get_file_name_rpm();
+		struct load_item *item = &ld.items[ld.tail % ld.depth];
+		item->key = strdup(key);
+		if (item->key == NULL) {
+			rc = 1;
+			break;
+		}
+		packages++;
+
+		// Unchanged package, reuse what it contributed last time
+		if (have_cache) {
+			HASH_FIND(hh, cache.headers, key, strlen(key), hr);
+			if (hr && !hr->seen) {
+				hr->seen = 1;
+				item->cached = hr;
+			}
+		}
 
-			// should we drop a path?
-			filter_rc_t f_res = filter_check(tmp);
-			if (f_res != FILTER_ALLOW) {
-				if (f_res == FILTER_ERR_DEPTH)
-					msg(LOG_WARNING,
-					    "filter nesting exceeds MAX_FILTER_DEPTH for %s; excluding",
-					    tmp);
+		// The file info is copied out of the header so workers
+		// never touch the header reference count.
+		if (item->cached == NULL) {
+			item->fi = rpmfiNew(NULL, h, RPMTAG_BASENAMES, 0);
+			if (item->fi == NULL) {
+				free(item->key);
+				item->key = NULL;
 				continue;
 			}
+		}
 
-			const char *file_name = strdup(tmp);
-			if (file_name == NULL)
-				continue;
+		pthread_mutex_lock(&ld.lock);
+		ld.tail++;
+		pthread_cond_signal(&ld.work);
+		pthread_mutex_unlock(&ld.lock);
+	}
 
-			rpm_loff_t sz = get_file_size_rpm();
-			int len;
-			const char *sha = get_sha256_rpm(&len);
-			char *data;
-
-			// Filter out short digests when rpm_sha256_only is
-			// set. SHA256 and larger are unconditionally accepted.
-			if (len < (SHA256_LEN*2)) {
-				if (conf && conf->rpm_sha256_only) {
-					// Limit this to 5 if production
-					if (debug_mode || msg_count++ < 5)
-						msg(LOG_WARNING,
-						  "No acceptable digest for %s",
-						  file_name);
-					free((void *)file_name);
-					continue;
-				}
-			}
+	// Write out the rest in order, even on error, so workers go idle
+	while (ld.head != ld.tail)
+		if (flush_item(&ld, memfd, new_cache, &entries, &files))
+			rc = 1;
 
-			// We use asprintf here so that we can reuse existing
-			// cleanup paths and avoid manual buffer management.
-			if (asprintf(	&data,
-					DATA_FORMAT,
-					tsource,
-					sz,
-					sha) == -1) {
-				data = NULL;
-			}
+	if (stop)
+		rc = 1;
 
-			if (data) {
-				// getting rid of the duplicates
-				struct _hash_record *rcd = NULL;
-				char key[4096];
-				snprintf(key, 4095, "%s %s", file_name, data);
-
-				HASH_FIND_STR( hashtable, key, rcd );
-
-				if (!rcd) {
-					rcd = (struct _hash_record*)
-					     malloc(sizeof(struct _hash_record));
-					rcd->key = strdup(key);
-					HASH_ADD_KEYPTR( hh, hashtable,
-							 rcd->key,
-							 strlen(rcd->key),
-							  rcd );
-					if (dprintf(memfd, "%s %s\n",
-						    file_name, data) < 0) {
-						msg(LOG_ERR,
-						    "dprintf failed writing %s to memfd (%s)",
-						    file_name,
-						    strerror(errno));
-						free((void*)file_name);
-						free((void*)data);
-						rc = 1;
-						goto out;
-					}
-					entries++;
-					free((void*)file_name);
-					free((void*)data);
-				} else {
-					free((void*)file_name);
-					free((void*)data);
-				}
-			} else {
-				free((void*)file_name);
-			}
-		}
-	}
+	if (rc == 0 && ld.delta &&
+	    emit_removed_records(&cache, &ld.seen, memfd, &entries))
+		rc = 1;
 
-	rc = 0;
 out:
+	pthread_mutex_lock(&ld.lock);
+	ld.finished = 1;
+	pthread_cond_broadcast(&ld.work);
+	pthread_mutex_unlock(&ld.lock);
+	for (unsigned int i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+
 	close_rpm();
 
-	// cleaning up
-	struct _hash_record *item, *tmp;
-	HASH_ITER( hh, hashtable, item, tmp) {
-		   HASH_DEL( hashtable, item );
-		free((void*)item->key);
-		free((void*)item);
+	// The cache must always describe the last snapshot handed to the
+	// daemon, so drop it when that cannot be guaranteed.
+	if (new_cache) {
+		int failed = ferror(new_cache);
+		if (fclose(new_cache) || failed || rc ||
+				rename(tmp_cache, header_cache_file)) {
+			unlink(tmp_cache);
+			new_cache = NULL;
+		}
 	}
+	if (new_cache == NULL && header_cache_file)
+		unlink(header_cache_file);
+	close_header_cache(&cache);
 
-	if (rc == 0)
+	// cleaning up
+	if (ld.items) {
+		for (unsigned int i = 0; i < ld.depth; i++) {
+			reset_item(&ld.items[i]);
+			free(ld.items[i].recs.buf);
+			free(ld.items[i].out.buf);
+		}
+		free(ld.items);
+	}
+	record_table_destroy(&ld.seen);
+	pthread_cond_destroy(&ld.work);
+	pthread_cond_destroy(&ld.done);
+	pthread_mutex_destroy(&ld.lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+	msg(LOG_DEBUG,
+	    "rpm loader: %ld packages, %ld files in %.3fs (%.0f files/sec, %u threads)",
+	    packages, files, secs, secs > 0 ? files / secs : 0.0, threads);
+
+	if (rc == 0) {
 		rpm_backend.entries = entries;
+		rpm_backend.delta = ld.delta;
+	}
 
 	return rc;
 }
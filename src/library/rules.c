@@ -1241,12 +1241,21 @@ make_decision:
 				(pinfo->state == STATE_STATIC))
 				rc = 1;
 			break;
-		case PATTERN_LD_PRELOAD_VAL: {
-			int env = check_environ_from_pid(pinfo->pid);
-			if (env == 1) {
+		case PATTERN_LD_PRELOAD_VAL:
+			// The loader only reads the environment at exec, so
+			// one look per exec image is enough. Errors are
+			// retried the next time.
+			if (pinfo->env_state == ENVIRON_UNCHECKED) {
+				int env = check_environ_from_pid(pinfo->pid);
+				if (env == 1)
+					pinfo->env_state = ENVIRON_LD_VARS;
+				else if (env == 0)
+					pinfo->env_state = ENVIRON_CLEAN;
+			}
+			if (pinfo->env_state == ENVIRON_LD_VARS) {
 				pinfo->state = STATE_LD_PRELOAD;
 				rc = 1;
-			} }
+			}
 			break;
 	}
 
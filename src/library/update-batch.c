@@ -0,0 +1,97 @@
+/*
+ * update-batch.c - queue of framed trust database updates
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "update-batch.h"
+
+/*
+ * The update thread queues the file records it reads from the FIFO here
+ * and writes them in one database transaction once the pipe has nothing
+ * more to read, or earlier at a batch marker or another command. Records
+ * that arrive together are grouped, but none waits for more to come, so
+ * a writer never holds back its own records or those of anyone else.
+ * Only the update thread uses a batch, so it needs no locking.
+ */
+
+/*
+ * batch_add - Queue a parsed file record.
+ * @b: Batch.
+ * @path: Path of the file.
+ * @data: Record data for the trust database.
+ * Returns 0 on success and 1 when out of memory.
+ */
+int batch_add(struct update_batch *b, const char *path, const char *data)
+{
+	size_t path_len = strlen(path), data_len = strlen(data);
+	char *rec;
+
+	if (b->count == b->size) {
+		unsigned int size = b->size ? b->size * 2 : 256;
+		char **tmp = realloc(b->records, size * sizeof(char *));
+
+		if (tmp == NULL)
+			return 1;
+		b->records = tmp;
+		b->size = size;
+	}
+
+	rec = malloc(path_len + data_len + 2);
+	if (rec == NULL)
+		return 1;
+	memcpy(rec, path, path_len + 1);
+	memcpy(rec + path_len + 1, data, data_len + 1);
+	b->records[b->count++] = rec;
+
+	return 0;
+}
+
+// Very large batches are written out every BATCH_MAX records
+int batch_full(const struct update_batch *b)
+{
+	return b->count >= BATCH_MAX;
+}
+
+const char *batch_path(const struct update_batch *b, unsigned int i)
+{
+	return b->records[i];
+}
+
+const char *batch_data(const struct update_batch *b, unsigned int i)
+{
+	return b->records[i] + strlen(b->records[i]) + 1;
+}
+
+// Drop the queued records once they are written
+void batch_clear(struct update_batch *b)
+{
+	for (unsigned int i = 0; i < b->count; i++)
+		free(b->records[i]);
+	b->count = 0;
+}
+
+void batch_free(struct update_batch *b)
+{
+	batch_clear(b);
+	free(b->records);
+	memset(b, 0, sizeof(*b));
+}
@@ -0,0 +1,47 @@
+/*
+ * update-batch.h - Header for grouped trust database updates
+ * Copyright (c) 2026 Red Hat Inc.
+ * All Rights Reserved.
+ *
+ * This software may be freely redistributed and/or modified under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING. If not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef UPDATE_BATCH_H
+#define UPDATE_BATCH_H
+
+// Records queued before the batch is written out regardless
+#define BATCH_MAX 16384
+
+/*
+ * update_batch - FIFO records read but not yet written.
+ * @records: Each entry holds the path, a NUL, then the record data.
+ * @count: Number of queued records.
+ * @size: Allocated length of @records.
+ */
+struct update_batch {
+	char **records;
+	unsigned int count;
+	unsigned int size;
+};
+
+int batch_add(struct update_batch *b, const char *path, const char *data);
+int batch_full(const struct update_batch *b);
+const char *batch_path(const struct update_batch *b, unsigned int i);
+const char *batch_data(const struct update_batch *b, unsigned int i);
+void batch_clear(struct update_batch *b);
+void batch_free(struct update_batch *b);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * coalesce_test.c - tests for answering identical events with one decision
+ *
+ * Builds a batch of events on descriptors of real files and checks that
+ * only events with the same pid, mask and file as one just decided get
+ * its reply, that every other event is decided on its own in queue order,
+ * that each event is answered exactly once with the reply for its own
+ * file, and that replies which must not be reused, events already
+ * answered by the reader and files that cannot be looked at are never
+ * shared. Then checks that a reply is not shared past another event of
+ * the same process, or past its exec, and that no event is answered
+ * before an earlier one of its process.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+
+#include "coalesce.h"
+#include "policy.h"
+
+#define E FAN_OPEN_EXEC_PERM
+#define O FAN_OPEN_PERM
+
+// Files of the batch and the reply the decision gives for each
+enum { FILE_A, FILE_B, FILE_C, FILE_NONE };
+static const int file_reply[] = { FAN_ALLOW, FAN_DENY, -1, FAN_ALLOW };
+
+struct test_event {
+	int pid;
+	unsigned long long mask;
+	int file;
+	int replied;
+	int shared;	// expected to get the reply of an earlier event
+};
+
+static const struct test_event events[] = {
+	{ 10, O, FILE_A, 0, 0 },
+	{ 10, O, FILE_A, 0, 1 },	// same as 0
+	{ 11, O, FILE_A, 0, 0 },	// other pid
+	{ 12, O, FILE_B, 0, 0 },
+	{ 12, O, FILE_A, 0, 0 },	// other file
+	{ 12, O, FILE_B, 0, 0 },	// same as 3, but 4 came between
+	{ 11, O, FILE_A, 0, 1 },	// same as 2 past other processes
+	{ 10, E, FILE_A, 0, 0 },	// other mask, an exec
+	{ 10, E, FILE_A, 0, 0 },	// execs are never shared
+	{ 10, O, FILE_A, 0, 0 },	// same as 0, but after the exec
+	{ 13, O, FILE_B, 0, 0 },
+	{ 13, O, FILE_B, 0, 1 },	// same as 10, gets its deny
+	{ 10, O, FILE_A, 1, 0 },	// answered by the reader
+	{ 10, O, FILE_C, 0, 0 },	// decision may not be reused
+	{ 10, O, FILE_C, 0, 0 },
+	{ 10, O, FILE_NONE, 0, 0 },	// cannot be looked at
+	{ 10, O, FILE_NONE, 0, 0 },
+};
+#define NEVENTS (sizeof(events) / sizeof(events[0]))
+
+static struct batch_slot batch[COALESCE_BATCH];
+static int decided[NEVENTS], answered[NEVENTS];
+static int order[NEVENTS], norder;
+// When each event was decided or answered
+static int done_at[NEVENTS], steps;
+
+// The descriptors are all different, so they tell the events apart
+static unsigned int find_event(const struct fanotify_event_metadata *m)
+{
+	for (unsigned int i = 0; i < NEVENTS; i++)
+		if (batch[i].m.fd == m->fd)
+			return i;
+	fprintf(stderr, "[ERROR:9] unknown event\n");
+	exit(9);
+}
+
+static int decide(const struct fanotify_event_metadata *m)
+{
+	unsigned int i = find_event(m);
+
+	decided[i]++;
+	order[norder++] = i;
+	done_at[i] = steps++;
+	return file_reply[events[i].file];
+}
+
+static void answer(const struct fanotify_event_metadata *m, int reply)
+{
+	unsigned int i = find_event(m);
+
+	answered[i]++;
+	done_at[i] = steps++;
+	if (reply != file_reply[events[i].file]) {
+		fprintf(stderr, "[ERROR:4] event %u got reply %d\n", i, reply);
+		exit(4);
+	}
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/coalesce_test.XXXXXX";
+	char path[3][64];
+	unsigned int i, shared = 0, n = 0;
+
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "[ERROR:1] mkdtemp failed\n");
+		return 1;
+	}
+	for (i = 0; i < 3; i++) {
+		int fd;
+
+		snprintf(path[i], sizeof(path[i]), "%s/%c", dir, 'a' + i);
+		fd = open(path[i], O_CREAT | O_WRONLY, 0600);
+		if (fd < 0) {
+			fprintf(stderr, "[ERROR:1] cannot create %s\n",
+				path[i]);
+			return 1;
+		}
+		close(fd);
+	}
+
+	// Every event gets its own descriptor, like fanotify gives
+	for (i = 0; i < NEVENTS; i++) {
+		memset(&batch[i], 0, sizeof(batch[i]));
+		batch[i].m.vers = FANOTIFY_METADATA_VERSION;
+		batch[i].m.pid = events[i].pid;
+		batch[i].m.mask = events[i].mask;
+		if (events[i].replied)
+			batch[i].m.reserved |= EVENT_REPLIED;
+		if (events[i].file == FILE_NONE)
+			batch[i].m.fd = -100 - i;
+		else
+			batch[i].m.fd = open(path[events[i].file], O_RDONLY);
+		if (batch[i].m.fd == -1) {
+			fprintf(stderr, "[ERROR:1] cannot open event file\n");
+			return 1;
+		}
+		batch[i].state = SLOT_NEW;
+		shared += events[i].shared;
+	}
+
+	if (coalesce_decide(batch, NEVENTS, decide, answer) != shared) {
+		fprintf(stderr, "[ERROR:2] wrong number of shared replies\n");
+		return 2;
+	}
+
+	for (i = 0; i < NEVENTS; i++) {
+		if (decided[i] + answered[i] != 1 ||
+		    answered[i] != events[i].shared) {
+			fprintf(stderr, "[ERROR:3] event %u decided %d times "
+				"and answered %d times\n", i, decided[i],
+				answered[i]);
+			return 3;
+		}
+		if (batch[i].state != SLOT_DONE) {
+			fprintf(stderr, "[ERROR:5] event %u not done\n", i);
+			return 5;
+		}
+	}
+
+	// Decisions are made in queue order
+	for (i = 0; i < NEVENTS; i++) {
+		if (events[i].shared)
+			continue;
+		if (order[n++] != (int)i) {
+			fprintf(stderr, "[ERROR:6] event %u decided out of "
+				"order\n", i);
+			return 6;
+		}
+	}
+
+	// A process gets its replies in the order it asked
+	for (i = 0; i < NEVENTS; i++)
+		for (unsigned int j = 0; j < i; j++)
+			if (events[j].pid == events[i].pid &&
+			    done_at[j] > done_at[i]) {
+				fprintf(stderr, "[ERROR:8] event %u answered "
+					"before event %u\n", i, j);
+				return 8;
+			}
+
+	// A batch of one, as when coalescing is off, is just decided
+	memset(decided, 0, sizeof(decided));
+	memset(answered, 0, sizeof(answered));
+	batch[1].state = SLOT_NEW;
+	if (coalesce_decide(&batch[1], 1, decide, answer) != 0 ||
+	    decided[1] != 1 || answered[1] != 0) {
+		fprintf(stderr, "[ERROR:7] single event not decided\n");
+		return 7;
+	}
+
+	for (i = 0; i < NEVENTS; i++)
+		if (batch[i].m.fd >= 0)
+			close(batch[i].m.fd);
+	for (i = 0; i < 3; i++)
+		unlink(path[i]);
+	rmdir(dir);
+
+	return 0;
+}
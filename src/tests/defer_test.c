@@ -0,0 +1,117 @@
+/*
+ * defer_test.c - tests for subject snapshots of deferred events
+ *
+ * Takes snapshots of this process the way the reader does before it
+ * answers a permissive event and checks they describe it. Then checks
+ * that a full pool and a process that is gone drop the evaluation, that
+ * cancelled and evaluated slots are reused, that the counters follow
+ * and that closing the pool frees snapshots still in it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "defer.h"
+
+int main(void)
+{
+	struct defer_pool *p;
+	struct subject_snapshot *snap;
+	char exe[PATH_MAX];
+	char buf[256];
+	ssize_t len;
+	int s0, s1;
+	pid_t pid;
+	FILE *f;
+
+	if (defer_open(0) != NULL || errno != EINVAL) {
+		fprintf(stderr, "[ERROR:1] empty pool accepted\n");
+		return 1;
+	}
+
+	p = defer_open(2);
+	if (p == NULL) {
+		fprintf(stderr, "[ERROR:2] defer_open failed\n");
+		return 2;
+	}
+
+	// A snapshot describes the process
+	len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (len <= 0) {
+		fprintf(stderr, "[ERROR:3] cannot read /proc/self/exe\n");
+		return 3;
+	}
+	exe[len] = 0;
+	s0 = defer_capture(p, getpid());
+	snap = defer_snapshot(p, s0);
+	if (s0 < 0 || snap == NULL || snap->info == NULL ||
+	    snap->info->pid != getpid() || snap->exe == NULL ||
+	    strcmp(snap->exe, exe) || snap->status.comm == NULL ||
+	    snap->status.uid == NULL ||
+	    !check_int_attr_set(snap->status.uid, getuid())) {
+		fprintf(stderr, "[ERROR:4] snapshot does not match\n");
+		return 4;
+	}
+
+	// Only as many events as slots can wait
+	s1 = defer_capture(p, getpid());
+	if (s1 < 0 || s1 == s0 || defer_capture(p, getpid()) != -1 ||
+	    atomic_load(&p->dropped) != 1) {
+		fprintf(stderr, "[ERROR:5] full pool not handled\n");
+		return 5;
+	}
+
+	// A slot whose event could not be queued comes back
+	defer_cancel(p, s1);
+	if (defer_snapshot(p, s1) != NULL || atomic_load(&p->dropped) != 2 ||
+	    defer_capture(p, getpid()) != s1) {
+		fprintf(stderr, "[ERROR:6] cancelled slot not reused\n");
+		return 6;
+	}
+
+	// So does one whose event was evaluated
+	defer_done(p, s0);
+	if (defer_snapshot(p, s0) != NULL ||
+	    atomic_load(&p->evaluated) != 1 ||
+	    atomic_load(&p->dropped) != 2) {
+		fprintf(stderr, "[ERROR:7] evaluated slot not released\n");
+		return 7;
+	}
+
+	// A process that is gone cannot be evaluated
+	pid = fork();
+	if (pid == 0)
+		_exit(0);
+	if (pid < 0 || waitpid(pid, NULL, 0) != pid) {
+		fprintf(stderr, "[ERROR:8] cannot run a child\n");
+		return 8;
+	}
+	if (defer_capture(p, pid) != -1 || atomic_load(&p->dropped) != 3 ||
+	    defer_capture(p, getpid()) != s0) {
+		fprintf(stderr, "[ERROR:9] exited process not dropped\n");
+		return 9;
+	}
+
+	f = fmemopen(buf, sizeof(buf), "w");
+	if (f == NULL) {
+		fprintf(stderr, "[ERROR:10] fmemopen failed\n");
+		return 10;
+	}
+	defer_report(p, f);
+	fclose(f);
+	if (strcmp(buf, "Deferred evaluations: 1\n"
+			"Deferred evaluations dropped: 3\n")) {
+		fprintf(stderr, "[ERROR:10] report is %s\n", buf);
+		return 10;
+	}
+
+	// Both slots are busy, closing frees their snapshots
+	defer_close(p);
+
+	return 0;
+}
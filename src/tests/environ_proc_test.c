@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+#include <string.h>
+#include <sys/wait.h>
+#include "process.h"
+
+/*
+ * check_child - run this program again with @envp and have it scan its
+ * own environment
+ * @envp: environment given to the child
+ *
+ * Return: what check_environ_from_pid() reported in the child.
+ */
+static int check_child(char *const envp[])
+{
+	char *const argv[] = { "environ_proc_test", "child", NULL };
+	int status;
+	pid_t pid = fork();
+
+	if (pid < 0)
+		error(1, errno, "fork");
+	if (pid == 0) {
+		execve("/proc/self/exe", argv, envp);
+		_exit(100);
+	}
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		error(1, 0, "child did not exit");
+	if (WEXITSTATUS(status) == 100)
+		error(1, 0, "cannot re-execute test");
+	return WEXITSTATUS(status) == 255 ? -1 : WEXITSTATUS(status);
+}
+
+/*
+ * padding - build a variable of exactly @len bytes, NUL excluded
+ * @len: length of the variable, at least 3
+ */
+static char *padding(size_t len)
+{
+	char *var = malloc(len + 1);
+
+	if (var == NULL)
+		error(1, errno, "malloc");
+	memcpy(var, "P=", 2);
+	memset(var + 2, 'x', len - 2);
+	var[len] = 0;
+	return var;
+}
+
+/*
+ * main - validate detection of loader variables in /proc/<pid>/environ
+ *
+ * Return: 0 when only variables named LD_PRELOAD or LD_AUDIT are found,
+ * wherever they fall relative to the read chunks, or terminate via
+ * error() on the first wrong answer.
+ */
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "child") == 0)
+		return check_environ_from_pid(getpid()) & 0xFF;
+
+	char *clean[] = { "PATH=/usr/bin", "HOME=/", NULL };
+	if (check_child(clean) != 0)
+		error(1, 0, "clean environment flagged");
+
+	char *in_value[] = { "X=LD_PRELOAD=/tmp/evil.so", "LD_AUDIT", NULL };
+	if (check_child(in_value) != 0)
+		error(1, 0, "key inside a value flagged");
+
+	char *suffix[] = { "MY_LD_PRELOAD=1", "OLD_LD_AUDIT=1", NULL };
+	if (check_child(suffix) != 0)
+		error(1, 0, "key as a name suffix flagged");
+
+	char *preload[] = { "PATH=/usr/bin", "LD_PRELOAD=", NULL };
+	if (check_child(preload) != 1)
+		error(1, 0, "LD_PRELOAD missed");
+
+	char *audit[] = { "LD_AUDIT=", "PATH=/usr/bin", NULL };
+	if (check_child(audit) != 1)
+		error(1, 0, "LD_AUDIT missed");
+
+	/* a variable far beyond the first chunk */
+	char *big[] = { padding(100000), "LD_AUDIT=", NULL };
+	if (check_child(big) != 1)
+		error(1, 0, "LD_AUDIT after a large variable missed");
+
+	/* the key straddling every offset around the first chunk end */
+	for (size_t at = 4080; at <= 4100; at++) {
+		char *edge[] = { padding(at - 1), "LD_PRELOAD=", NULL };
+		char *edge_clean[] = { padding(at - 1), "LD_PRELOAX=", NULL };
+
+		if (check_child(edge) != 1)
+			error(1, 0, "LD_PRELOAD at offset %zu missed", at);
+		if (check_child(edge_clean) != 0)
+			error(1, 0, "LD_PRELOAX at offset %zu flagged", at);
+		free(edge[0]);
+		free(edge_clean[0]);
+	}
+	free(big[0]);
+
+	return 0;
+}
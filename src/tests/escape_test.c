@@ -1,5 +1,9 @@
 /*
  * escape_test.c - tests for shell escaping helpers
+ *
+ * Besides the edge cases, a set of generated paths is run through the
+ * escaping helpers and compared with simple byte at a time versions of
+ * them. The time taken by each is printed as a throughput benchmark.
  */
 
 #include "escape.h"
@@ -8,6 +12,196 @@
 #include <stdlib.h>
 #include <string.h>
 #include <error.h>
+#include <time.h>
+
+#define BENCH_PATHS 20000
+#define BENCH_ROUNDS 20
+
+static const char sh_set[] = "\"'`$\\!()| ";
+
+// Byte at a time reference for check_escape_shell
+static size_t ref_check_escape(const char *p)
+{
+	size_t size = 0, cnt = 0;
+
+	for (; *p; p++, size++) {
+		if ((unsigned char)*p < 32)
+			cnt += 4;
+		else if (strchr(sh_set, *p))
+			cnt += 2;
+		else
+			cnt++;
+	}
+	return cnt == size ? 0 : cnt;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// Byte at a time reference for unescape
+static size_t ref_unescape(const char *in, char *out)
+{
+	size_t len = strlen(in), pos = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (in[i] == '%' && i + 2 < len &&
+		    hexval(in[i + 1]) >= 0 && hexval(in[i + 2]) >= 0) {
+			out[pos++] = (char)(hexval(in[i + 1]) * 16 +
+					    hexval(in[i + 2]));
+			i += 2;
+		} else
+			out[pos++] = in[i];
+	}
+	out[pos] = '\0';
+	return pos;
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Build trust file style paths. Most are clean, some have a space or a
+ * control char near the end and some are in the old %XX format.
+ */
+static char **make_paths(size_t *total)
+{
+	char **paths = malloc(BENCH_PATHS * sizeof(char *));
+	char buf[512];
+
+	if (paths == NULL)
+		return NULL;
+
+	*total = 0;
+	for (unsigned int i = 0; i < BENCH_PATHS; i++) {
+		switch (i % 8) {
+		case 0:
+			snprintf(buf, sizeof(buf), "/usr/share/doc/pkg-%u/"
+				 "release notes %u.txt", i, i);
+			break;
+		case 1:
+			snprintf(buf, sizeof(buf), "/opt/vendor/app%%20%u/"
+				 "bin/tool%%24%u", i, i);
+			break;
+		case 2:
+			snprintf(buf, sizeof(buf), "/home/user/caf\xc3\xa9/"
+				 "file\t%u", i);
+			break;
+		default:
+			snprintf(buf, sizeof(buf), "/usr/lib64/python3.12/"
+				 "site-packages/module_%u/__init__.cpython-312."
+				 "opt-1.pyc", i);
+			break;
+		}
+		paths[i] = strdup(buf);
+		if (paths[i] == NULL)
+			exit(5);
+		*total += strlen(buf);
+	}
+	return paths;
+}
+
+/*
+ * Compare the helpers with the references on generated paths and report
+ * the throughput of both. Returns 0 when the outputs agree.
+ */
+static int bench(void)
+{
+	struct timespec start;
+	double fast, slow;
+	size_t total, sum = 0, ref_sum = 0;
+	char out[512], sh[512];
+	char **paths = make_paths(&total);
+
+	if (paths == NULL)
+		return 1;
+
+	for (unsigned int i = 0; i < BENCH_PATHS; i++) {
+		size_t sz = check_escape_shell(paths[i]);
+		char *tmp;
+
+		if (sz != ref_check_escape(paths[i])) {
+			fprintf(stderr, "[ERROR:5] check %s %zu\n", paths[i], sz);
+			return 1;
+		}
+
+		// escape_shell then unescape_shell must round trip
+		if (sz) {
+			tmp = escape_shell(paths[i], sz);
+			if (tmp == NULL || strlen(tmp) != sz) {
+				fprintf(stderr, "[ERROR:5] escape %s\n",
+					paths[i]);
+				free(tmp);
+				return 1;
+			}
+			strcpy(sh, tmp);
+			free(tmp);
+			unescape_shell(sh, strlen(sh));
+			if (strcmp(sh, paths[i])) {
+				fprintf(stderr, "[ERROR:5] round trip %s\n",
+					sh);
+				return 1;
+			}
+		}
+
+		tmp = unescape(paths[i]);
+		ref_unescape(paths[i], out);
+		if (tmp == NULL || strcmp(tmp, out)) {
+			fprintf(stderr, "[ERROR:5] unescape %s\n", paths[i]);
+			free(tmp);
+			return 1;
+		}
+		free(tmp);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		for (unsigned int i = 0; i < BENCH_PATHS; i++) {
+			char *tmp = unescape(paths[i]);
+			size_t sz = check_escape_shell(tmp);
+
+			sum += sz;
+			if (sz)
+				free(escape_shell(tmp, sz));
+			free(tmp);
+		}
+	}
+	fast = elapsed(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		for (unsigned int i = 0; i < BENCH_PATHS; i++) {
+			ref_unescape(paths[i], out);
+			ref_sum += ref_check_escape(out);
+		}
+	}
+	slow = elapsed(&start);
+
+	if (sum != ref_sum) {
+		fprintf(stderr, "[ERROR:5] benchmark mismatch\n");
+		return 1;
+	}
+
+	total *= BENCH_ROUNDS;
+	printf("escape: %zu bytes, helpers %.1f MB/s, byte loop %.1f MB/s\n",
+	       total, total / fast / 1e6, total / slow / 1e6);
+
+	for (unsigned int i = 0; i < BENCH_PATHS; i++)
+		free(paths[i]);
+	free(paths);
+	return 0;
+}
 
 int main(void)
 {
@@ -36,6 +230,17 @@ int main(void)
 		return 1;
 	}
 
+	sz = check_escape_shell("caf\xc3\xa9");
+	if (sz != 0) {
+		fprintf(stderr, "[ERROR:1] utf-8 %zu\n", sz);
+		return 1;
+	}
+	sz = check_escape_shell("/a/long/clean/prefix/before/the/end()");
+	if (sz != 39) {
+		fprintf(stderr, "[ERROR:1] trailing metachars %zu\n", sz);
+		return 1;
+	}
+
 	/* escape_shell */
 	tmp = escape_shell(NULL, 0);
 	if (tmp) {
@@ -64,6 +269,15 @@ int main(void)
 	}
 	free(tmp);
 
+	sz = check_escape_shell("x\x01y|z");
+	tmp = escape_shell("x\x01y|z", sz);
+	if (!tmp || strcmp(tmp, "x\\001y\\|z")) {
+		fprintf(stderr, "[ERROR:2] mixed '%s'\n", tmp);
+		free(tmp);
+		return 2;
+	}
+	free(tmp);
+
 	/* unescape_shell */
 	char buf1[] = "\\040\\$";
 	unescape_shell(buf1, sizeof(buf1));
@@ -84,6 +298,13 @@ int main(void)
 		return 3;
 	}
 
+	char buf4[] = "/clean/run\\ one/\\011tab/end";
+	unescape_shell(buf4, strlen(buf4));
+	if (strcmp(buf4, "/clean/run one/\ttab/end")) {
+		fprintf(stderr, "[ERROR:3] runs '%s'\n", buf4);
+		return 3;
+	}
+
 	/* unescape */
 	tmp = unescape("%41%42");
 	if (!tmp || strcmp(tmp, "AB")) {
@@ -106,6 +327,20 @@ int main(void)
 		return 4;
 	}
 	free(tmp);
+	tmp = unescape("/no/escapes/here");
+	if (!tmp || strcmp(tmp, "/no/escapes/here")) {
+		fprintf(stderr, "[ERROR:4] unescape clean\n");
+		free(tmp);
+		return 4;
+	}
+	free(tmp);
+	tmp = unescape("/a%20b/c%%41%");
+	if (!tmp || strcmp(tmp, "/a b/c%A%")) {
+		fprintf(stderr, "[ERROR:4] unescape mixed '%s'\n", tmp);
+		free(tmp);
+		return 4;
+	}
+	free(tmp);
 	char big[4097 + 1];
 	memset(big, 'A', sizeof(big));
 	big[sizeof(big) - 1] = '\0';
@@ -116,5 +351,9 @@ int main(void)
 		return 4;
 	}
 
+	/* throughput */
+	if (bench())
+		return 5;
+
 	return 0;
 }
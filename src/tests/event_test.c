@@ -216,6 +216,7 @@ struct proc_info *stat_proc_entry(pid_t pid)
 	info->path1 = NULL;
 	info->path2 = NULL;
 	info->elf_info = 0;
+	info->env_state = ENVIRON_UNCHECKED;
 	return info;
 }
 
@@ -659,6 +660,91 @@ static int test_needs_flush_resets_object_cache(void)
 	return 0;
 }
 
+/*
+ * Verify that a deferred event takes exe, comm and uid from the snapshot
+ * the reader made rather than from what the stubs report by now, and
+ * that a snapshot from an earlier process with the same pid does not
+ * reuse the cached subject of the current one.
+ */
+static int test_deferred_event_uses_snapshot(void)
+{
+	struct fanotify_event_metadata meta = { 0 };
+	struct subject_snapshot snap;
+	event_t live = { 0 };
+	event_t deferred = { 0 };
+	event_t older = { 0 };
+	subject_attr_t *sn;
+
+	CHECK(init_caches(4, 4) == 0, 70,
+	      "[ERROR:70] init_event_system failed");
+
+	CHECK(snapshot_subject(999, &snap) == 1, 71,
+	      "[ERROR:71] snapshot of a missing process succeeded");
+	CHECK(snapshot_subject(201, &snap) == 0, 72,
+	      "[ERROR:72] snapshot_subject failed");
+	CHECK(snap.info && snap.info->time.tv_nsec == 300 && snap.exe &&
+	      strcmp(snap.exe, "/proc/201/exe") == 0, 73,
+	      "[ERROR:73] snapshot does not describe the process");
+	clear_subject_snapshot(&snap);
+	CHECK(snap.info == NULL && snap.exe == NULL, 74,
+	      "[ERROR:74] snapshot not cleared");
+
+	meta.mask = FAN_OPEN_PERM;
+	meta.fd = 20;
+	meta.pid = 200;
+	CHECK(new_event(&meta, &live) == 0, 75,
+	      "[ERROR:75] live new_event failed");
+	sn = get_subj_attr(&live, EXE);
+	CHECK(sn && strcmp(sn->str, "/proc/200/exe") == 0, 76,
+	      "[ERROR:76] live exe not from the stubs");
+
+	/* Same process as the cached subject, before it ran something else */
+	CHECK(snapshot_subject(200, &snap) == 0, 77,
+	      "[ERROR:77] snapshot_subject failed");
+	free(snap.exe);
+	snap.exe = strdup("/usr/bin/before");
+	snap.status.comm = strdup("before");
+	snap.status.uid = init_standalone_set(UNSIGNED);
+	CHECK(snap.exe && snap.status.comm && snap.status.uid &&
+	      append_int_attr_set(snap.status.uid, 42) == 0, 78,
+	      "[ERROR:78] cannot build snapshot");
+
+	CHECK(new_deferred_event(&meta, &snap, &deferred) == 0, 79,
+	      "[ERROR:79] new_deferred_event failed");
+	CHECK(snap.info == NULL && snap.exe == NULL &&
+	      snap.status.comm == NULL && snap.status.uid == NULL, 80,
+	      "[ERROR:80] snapshot not consumed");
+	CHECK(deferred.s == live.s, 81,
+	      "[ERROR:81] same process did not reuse its subject");
+	sn = get_subj_attr(&deferred, EXE);
+	CHECK(sn && strcmp(sn->str, "/usr/bin/before") == 0, 82,
+	      "[ERROR:82] exe not taken from the snapshot");
+	sn = get_subj_attr(&deferred, COMM);
+	CHECK(sn && strcmp(sn->str, "before") == 0, 83,
+	      "[ERROR:83] comm not taken from the snapshot");
+	sn = get_subj_attr(&deferred, UID);
+	CHECK(sn && check_int_attr_set(sn->set, 42), 84,
+	      "[ERROR:84] uid not taken from the snapshot");
+
+	/* The pid now belongs to another process than the snapshot's */
+	CHECK(snapshot_subject(200, &snap) == 0, 85,
+	      "[ERROR:85] snapshot_subject failed");
+	snap.info->time.tv_nsec = 999;
+	free(snap.exe);
+	snap.exe = strdup("/usr/bin/gone");
+	CHECK(new_deferred_event(&meta, &snap, &older) == 0, 86,
+	      "[ERROR:86] new_deferred_event failed");
+	CHECK(older.s && older.s->info &&
+	      older.s->info->time.tv_nsec == 999, 87,
+	      "[ERROR:87] earlier process used the current subject");
+	sn = get_subj_attr(&older, EXE);
+	CHECK(sn && strcmp(sn->str, "/usr/bin/gone") == 0, 88,
+	      "[ERROR:88] exe of the earlier process not kept");
+
+	destroy_event_system();
+	return 0;
+}
+
 /* Run each scenario in sequence, propagating the first non-zero error code. */
 int main(void)
 {
@@ -688,6 +774,10 @@ int main(void)
 	if (rc)
 		return rc;
 
+	rc = test_deferred_event_uses_snapshot();
+	if (rc)
+		return rc;
+
 	return 0;
 }
 
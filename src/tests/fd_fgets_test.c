@@ -7,6 +7,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fd-fgets.h>
@@ -15,7 +16,9 @@
  * Exercises the fd_fgets_r family of APIs with multiple backing buffers and
  * input patterns.  The goal is to cover the behaviours that fapolicyd relies
  * on: incremental reads from pipes, truncated lines, anonymous mmap buffers
- * and pre-populated mmap()'d files.
+ * and pre-populated mmap()'d files.  The zero copy view API gets the same
+ * checks, and a small benchmark compares it with the copying reader on the
+ * kind of mapped trust list that the daemon loads from a backend memfd.
  */
 
 #ifndef MAP_ANONYMOUS
@@ -302,6 +305,177 @@ static void test_mmap_file_readme(void)
 	close(fd);
 }
 
+/*
+ * The view API must return the same lines as fd_fgets_r without a NUL
+ * terminator, and a pending partial line must survive until it completes.
+ */
+static void test_view_pipe(void)
+{
+	int fds[2];
+	const char *line;
+	fd_fgets_state_t *st;
+
+	assert(pipe(fds) == 0);
+	st = fd_fgets_init();
+	assert(st);
+
+	write_all(fds[1], "hello\n");
+
+	int len = fd_fgets_view_r(st, &line, 64, fds[0]);
+	assert(len == 6);
+	assert(memcmp(line, "hello\n", 6) == 0);
+
+	write_all(fds[1], "wor");
+	len = fd_fgets_view_r(st, &line, 64, fds[0]);
+	assert(len == 0);
+	assert(fd_fgets_eof_r(st) == 0);
+
+	write_all(fds[1], "ld\n");
+	close(fds[1]);
+
+	len = fd_fgets_view_r(st, &line, 64, fds[0]);
+	assert(len == 6);
+	assert(memcmp(line, "world\n", 6) == 0);
+
+	len = fd_fgets_view_r(st, &line, 64, fds[0]);
+	assert(len == 0);
+	assert(fd_fgets_eof_r(st) == 1);
+
+	close(fds[0]);
+	fd_fgets_destroy(st);
+}
+
+/*
+ * A view is limited to blen-1 chars just like the copying reader, the rest
+ * of the line is returned by the next call.
+ */
+static void test_view_truncation(void)
+{
+	int fds[2];
+	const char *line;
+	fd_fgets_state_t *st;
+
+	assert(pipe(fds) == 0);
+	st = fd_fgets_init();
+	assert(st);
+
+	write_all(fds[1], "123456789\n");
+	close(fds[1]);
+
+	int len = fd_fgets_view_r(st, &line, 6, fds[0]);
+	assert(len == 5);
+	assert(memcmp(line, "12345", 5) == 0);
+
+	len = fd_fgets_view_r(st, &line, 6, fds[0]);
+	assert(len == 5);
+	assert(memcmp(line, "6789\n", 5) == 0);
+
+	len = fd_fgets_view_r(st, &line, 6, fds[0]);
+	assert(len == 0);
+	assert(fd_fgets_eof_r(st) == 1);
+
+	close(fds[0]);
+	fd_fgets_destroy(st);
+}
+
+/*
+ * Build a trust list shaped file, map it and return the mapping. The
+ * mapping is released by fd_fgets_destroy, the caller closes the fd.
+ */
+static char *make_trust_list(int *fd, size_t *size, unsigned int entries)
+{
+	char tmpl[] = "/tmp/fd-fgets-XXXXXX";
+	char line[256];
+	FILE *f;
+	int tfd = mkstemp(tmpl);
+	struct stat sb;
+
+	assert(tfd >= 0);
+	unlink(tmpl);
+	f = fdopen(dup(tfd), "w");
+	assert(f);
+	for (unsigned int i = 0; i < entries; i++) {
+		snprintf(line, sizeof(line), "/usr/lib64/fapolicyd/dir%u/"
+			 "libexample-%u.so.1 1 %u "
+			 "%064x\n", i % 97, i, 4096 + i, i);
+		fputs(line, f);
+	}
+	fclose(f);
+
+	assert(fstat(tfd, &sb) == 0);
+	char *base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, tfd, 0);
+	assert(base != MAP_FAILED);
+
+	*fd = tfd;
+	*size = sb.st_size;
+	return base;
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Walk a mapped trust list with both readers, check that they agree and
+ * report the time each one takes. The numbers are informational only.
+ */
+static void test_view_throughput(void)
+{
+	const unsigned int entries = 200000;
+	char buf[4096];
+	struct timespec start;
+	unsigned long copy_bytes = 0, view_bytes = 0;
+	unsigned int copy_lines = 0, view_lines = 0;
+	double copy_time, view_time;
+	size_t size;
+	int fd, len;
+	char *base = make_trust_list(&fd, &size, entries);
+	fd_fgets_state_t *st = fd_fgets_init();
+
+	assert(st);
+	assert(fd_setvbuf_r(st, base, size, MEM_MMAP_FILE) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		len = fd_fgets_r(st, buf, sizeof(buf), fd);
+		if (len > 0) {
+			copy_lines++;
+			copy_bytes += len;
+		}
+	} while (!fd_fgets_eof_r(st));
+	copy_time = elapsed(&start);
+	fd_fgets_destroy(st);
+
+	base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	assert(base != MAP_FAILED);
+	st = fd_fgets_init();
+	assert(st);
+	assert(fd_setvbuf_r(st, base, size, MEM_MMAP_FILE) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		const char *line;
+
+		len = fd_fgets_view_r(st, &line, sizeof(buf), fd);
+		if (len > 0) {
+			assert(line[len - 1] == '\n');
+			view_lines++;
+			view_bytes += len;
+		}
+	} while (!fd_fgets_eof_r(st));
+	view_time = elapsed(&start);
+	fd_fgets_destroy(st);
+	close(fd);
+
+	assert(copy_lines == entries && view_lines == entries);
+	assert(copy_bytes == size && view_bytes == size);
+	printf("fd-fgets_r: %u lines, copy %.3fms, view %.3fms\n", entries,
+	       copy_time * 1000, view_time * 1000);
+}
+
 int main(void)
 {
 	test_pipe_self_managed();
@@ -310,6 +484,9 @@ int main(void)
 	test_mmap_buffer();
 	test_deferred_compaction();
 	test_mmap_file_readme();
+	test_view_pipe();
+	test_view_truncation();
+	test_view_throughput();
 	printf("fd-fgets_r tests: all passed\n");
 	return 0;
 }
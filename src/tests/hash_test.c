@@ -0,0 +1,313 @@
+/*
+ * hash_test.c - tests for calculating several file digests in one pass
+ *
+ * Checks get_hashes_from_fd() against known digests of a fixed buffer
+ * and against EVP_Digest() run over the file contents in memory, which
+ * shares none of its mapping and striding. Every algorithm is asked for
+ * in one call, as well as subsets in other orders, for empty files,
+ * files smaller than a page, sizes around HASH_STRIDE and files spanning
+ * several hash chunks. It must also refuse a bad count or algorithm.
+ *
+ * Given a directory, such as /usr, it instead benchmarks the package
+ * backend case: two digests of every regular file below it, read once
+ * per digest and read once for both. Each is run from the page cache
+ * and cold, with every file dropped from the cache before it is hashed
+ * as it is when the backend loads at boot.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#include "file.h"
+#include "message.h"
+
+#ifdef USE_DEB
+#define BENCH_FIRST FILE_HASH_ALG_MD5
+#else
+#define BENCH_FIRST FILE_HASH_ALG_SHA1
+#endif
+
+// Bytes hashed at a time by get_hashes_from_fd(), as in file.c
+#define HASH_STRIDE (64 * 1024)
+
+static const file_hash_alg_t algs[] = {
+	FILE_HASH_ALG_SHA1, FILE_HASH_ALG_SHA256, FILE_HASH_ALG_SHA512,
+#ifdef USE_DEB
+	FILE_HASH_ALG_MD5
+#endif
+};
+#define NALGS (sizeof(algs) / sizeof(algs[0]))
+
+// Subsets of algs asked for in one call, by index, in other orders
+static const unsigned int subsets[][2] = { { 2, 0 }, { 1, 1 }, { 2, 1 } };
+#define NSUBSETS (sizeof(subsets) / sizeof(subsets[0]))
+
+static const EVP_MD *alg_md(file_hash_alg_t alg)
+{
+	switch (alg) {
+	case FILE_HASH_ALG_SHA1:
+		return EVP_sha1();
+	case FILE_HASH_ALG_SHA256:
+		return EVP_sha256();
+	case FILE_HASH_ALG_SHA512:
+		return EVP_sha512();
+	default:
+		return EVP_md5();
+	}
+}
+
+// Hash BUF in one call into a hex string
+static int reference(const unsigned char *buf, size_t size,
+		     file_hash_alg_t alg, char *hex)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len;
+
+	if (EVP_Digest(buf, size, md, &len, alg_md(alg), NULL) != 1)
+		return 1;
+	for (unsigned int i = 0; i < len; i++)
+		sprintf(hex + 2 * i, "%02x", md[i]);
+	return 0;
+}
+
+// Write SIZE bytes of a pattern to a temporary file, return its fd and
+// the contents in BUF
+static int make_file(size_t size, unsigned char **buf)
+{
+	char path[] = "/tmp/hash_test.XXXXXX";
+	int fd = mkstemp(path);
+
+	*buf = malloc(size ? size : 1);
+	if (fd < 0 || *buf == NULL) {
+		if (fd >= 0)
+			close(fd);
+		free(*buf);
+		return -1;
+	}
+	unlink(path);
+	for (size_t i = 0; i < size; i++)
+		(*buf)[i] = (unsigned char)(i * 7 + 3 + i / 4096);
+	if (write(fd, *buf, size) != (ssize_t)size) {
+		close(fd);
+		free(*buf);
+		return -1;
+	}
+	return fd;
+}
+
+static int check_size(int num, size_t size)
+{
+	char ref[NALGS][FILE_DIGEST_STRING_MAX];
+	struct file_digest d[NALGS];
+	unsigned char *buf;
+	int fd = make_file(size, &buf);
+	int rc = 0;
+
+	if (fd < 0) {
+		fprintf(stderr, "[ERROR:%d] cannot create file\n", num);
+		return num;
+	}
+	for (unsigned int i = 0; i < NALGS; i++)
+		if (reference(buf, size, algs[i], ref[i])) {
+			fprintf(stderr, "[ERROR:%d] EVP_Digest failed\n", num);
+			rc = num;
+			goto out;
+		}
+
+	// Every algorithm at once
+	for (unsigned int i = 0; i < NALGS; i++)
+		d[i].alg = algs[i];
+	if (get_hashes_from_fd(fd, size, d, NALGS)) {
+		fprintf(stderr, "[ERROR:%d] get_hashes_from_fd failed\n", num);
+		rc = num;
+		goto out;
+	}
+	for (unsigned int i = 0; i < NALGS; i++)
+		if (strcmp(ref[i], d[i].digest)) {
+			fprintf(stderr, "[ERROR:%d] %s of %zu bytes is %s, "
+				"expected %s\n", num,
+				file_hash_alg_name(algs[i]), size,
+				d[i].digest, ref[i]);
+			rc = num;
+		}
+
+	// Subsets, repeats and single digests
+	for (unsigned int s = 0; s < NSUBSETS; s++) {
+		for (unsigned int i = 0; i < 2; i++)
+			d[i].alg = algs[subsets[s][i]];
+		if (get_hashes_from_fd(fd, size, d, 2) ||
+		    strcmp(d[0].digest, ref[subsets[s][0]]) ||
+		    strcmp(d[1].digest, ref[subsets[s][1]])) {
+			fprintf(stderr, "[ERROR:%d] subset %u of %zu bytes "
+				"is wrong\n", num, s, size);
+			rc = num;
+		}
+	}
+	for (unsigned int i = 0; i < NALGS; i++) {
+		char *one = get_hash_from_fd2(fd, size, algs[i]);
+
+		if (one == NULL || strcmp(one, ref[i])) {
+			fprintf(stderr, "[ERROR:%d] single %s of %zu bytes is "
+				"%s, expected %s\n", num,
+				file_hash_alg_name(algs[i]), size,
+				one ? one : "(null)", ref[i]);
+			rc = num;
+		}
+		free(one);
+	}
+out:
+	free(buf);
+	close(fd);
+	return rc;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int single_pass, cold;
+static unsigned long bench_files;
+static unsigned long long bench_bytes;
+
+static int bench_one(const char *path, const struct stat *sb, int type,
+		     struct FTW *ftw)
+{
+	int fd;
+
+	(void)ftw;
+	if (type != FTW_F || !S_ISREG(sb->st_mode))
+		return 0;
+	fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	if (cold)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	if (single_pass) {
+		struct file_digest d[2] = {
+			{ .alg = BENCH_FIRST }, { .alg = FILE_HASH_ALG_SHA256 }
+		};
+
+		if (get_hashes_from_fd(fd, sb->st_size, d, 2) == 0) {
+			bench_files++;
+			bench_bytes += sb->st_size;
+		}
+	} else {
+		char *a = get_hash_from_fd2(fd, sb->st_size, BENCH_FIRST);
+		char *b = get_hash_from_fd2(fd, sb->st_size,
+					    FILE_HASH_ALG_SHA256);
+
+		if (a && b) {
+			bench_files++;
+			bench_bytes += sb->st_size;
+		}
+		free(a);
+		free(b);
+	}
+	close(fd);
+	return 0;
+}
+
+static void bench_run(const char *dir, int pass, int evict,
+		      const char *name)
+{
+	double start;
+
+	single_pass = pass;
+	cold = evict;
+	bench_files = 0;
+	bench_bytes = 0;
+	start = now();
+	nftw(dir, bench_one, 64, FTW_PHYS);
+	double secs = now() - start;
+	printf("%-17s %lu files, %.1f MB in %.2f s, %.1f MB/s\n", name,
+	       bench_files, bench_bytes / 1e6, secs,
+	       secs > 0 ? bench_bytes / 1e6 / secs : 0);
+}
+
+static int bench(const char *dir)
+{
+	printf("%s and %s of every file below %s\n",
+	       file_hash_alg_name(BENCH_FIRST),
+	       file_hash_alg_name(FILE_HASH_ALG_SHA256), dir);
+
+	// The first walk warms the page cache so both runs read from it
+	bench_run(dir, 1, 0, "warm up:");
+	bench_run(dir, 0, 0, "two passes:");
+	bench_run(dir, 1, 0, "one pass:");
+	bench_run(dir, 0, 1, "two passes, cold:");
+	bench_run(dir, 1, 1, "one pass, cold:");
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t sizes[] = {
+		0, 1, 3, 4095, HASH_STRIDE - 1, HASH_STRIDE, HASH_STRIDE + 1,
+		3 * HASH_STRIDE + 17, 4 * 1024 * 1024 + 1,
+		5 * 1024 * 1024 + 123, 9 * 1024 * 1024
+	};
+	struct file_digest d[FILE_HASH_MULTI_MAX + 1];
+	int rc;
+
+	set_message_mode(MSG_STDERR, DBG_NO);
+
+	if (argc > 1)
+		return bench(argv[1]);
+
+	for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		rc = check_size(i + 1, sizes[i]);
+		if (rc)
+			return rc;
+	}
+
+	/* known digests of a fixed buffer */
+	unsigned char *buf;
+	int fd = make_file(0, &buf);
+	free(buf);
+	if (fd < 0 || write(fd, "abc", 3) != 3) {
+		fprintf(stderr, "[ERROR:20] cannot create file\n");
+		return 20;
+	}
+	d[0].alg = FILE_HASH_ALG_SHA256;
+	d[1].alg = FILE_HASH_ALG_SHA1;
+	d[2].alg = FILE_HASH_ALG_SHA512;
+	if (get_hashes_from_fd(fd, 3, d, 3) || strcmp(d[0].digest,
+	    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") ||
+	    strcmp(d[1].digest, "a9993e364706816aba3e25717850c26c9cd0d89d") ||
+	    strcmp(d[2].digest,
+	    "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+	    "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f")) {
+		fprintf(stderr, "[ERROR:21] wrong digest of abc\n");
+		return 21;
+	}
+
+	/* bad counts and algorithms are refused */
+	for (unsigned int i = 0; i <= FILE_HASH_MULTI_MAX; i++)
+		d[i].alg = FILE_HASH_ALG_SHA256;
+	if (get_hashes_from_fd(fd, 3, d, 0) == 0 ||
+	    get_hashes_from_fd(fd, 3, d, FILE_HASH_MULTI_MAX + 1) == 0) {
+		fprintf(stderr, "[ERROR:22] bad count accepted\n");
+		return 22;
+	}
+	d[1].alg = FILE_HASH_ALG_NONE;
+	if (get_hashes_from_fd(fd, 3, d, 2) == 0) {
+		fprintf(stderr, "[ERROR:23] bad algorithm accepted\n");
+		return 23;
+	}
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * md5_cache_test.c - tests for the digest cache of the md5 backend
+ *
+ * Checks that a file is hashed on the first load and taken from the
+ * cache on the next one, that rewriting a file is noticed even when its
+ * size and mtime are put back, that a wrong MD5 is never trusted, that
+ * an aborted load does not replace the cache, and that a damaged cache
+ * is ignored.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "file.h"
+#include "message.h"
+#include "md5-backend.h"
+
+static char dir[] = "/tmp/md5_cache_test.XXXXXX";
+static char file_a[64], file_b[64], cache_file[64];
+static char md5_a[FILE_DIGEST_STRING_MAX], md5_b[FILE_DIGEST_STRING_MAX];
+
+static int write_file(const char *path, const char *data)
+{
+	int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+
+	if (fd < 0)
+		return 1;
+	if (write(fd, data, strlen(data)) != (ssize_t)strlen(data)) {
+		close(fd);
+		return 1;
+	}
+	return close(fd);
+}
+
+static int md5_of(const char *path, char *md5)
+{
+	struct file_digest d = { .alg = FILE_HASH_ALG_MD5 };
+	struct stat sb;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return 1;
+	fstat(fd, &sb);
+	int rc = get_hashes_from_fd(fd, sb.st_size, &d, 1);
+	close(fd);
+	strcpy(md5, d.digest);
+	return rc;
+}
+
+// One load of both files, returns the number of records produced
+static int load(long *hits, long *misses, int commit)
+{
+	struct md5_cache cache;
+	char line[PATH_MAX + 256];
+	int records = 0;
+
+	md5_cache_open(&cache, cache_file);
+	if (get_file_record_by_md5(file_a, md5_a, &cache, SRC_DEB, line,
+				   sizeof(line)) > 0)
+		records++;
+	if (get_file_record_by_md5(file_b, md5_b, &cache, SRC_DEB, line,
+				   sizeof(line)) > 0)
+		records++;
+	*hits = cache.hits;
+	*misses = cache.misses;
+	md5_cache_close(&cache, commit);
+	return records;
+}
+
+static void cleanup(void)
+{
+	char tmp[80];
+
+	unlink(file_a);
+	unlink(file_b);
+	unlink(cache_file);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache_file);
+	unlink(tmp);
+	rmdir(dir);
+}
+
+int main(void)
+{
+	long hits, misses;
+	struct stat sb;
+
+	set_message_mode(MSG_STDERR, DBG_NO);
+
+	if (mkdtemp(dir) == NULL)
+		return 1;
+	atexit(cleanup);
+	snprintf(file_a, sizeof(file_a), "%s/a", dir);
+	snprintf(file_b, sizeof(file_b), "%s/b", dir);
+	snprintf(cache_file, sizeof(cache_file), "%s/cache", dir);
+	if (write_file(file_a, "first file\n") ||
+	    write_file(file_b, "second file\n") ||
+	    md5_of(file_a, md5_a) || md5_of(file_b, md5_b)) {
+		fprintf(stderr, "[ERROR:1] cannot set up files\n");
+		return 1;
+	}
+
+	/* the first load hashes everything */
+	if (load(&hits, &misses, 1) != 2 || hits != 0 || misses != 2) {
+		fprintf(stderr, "[ERROR:2] first load %ld hits %ld misses\n",
+			hits, misses);
+		return 2;
+	}
+
+	/* the second one reads nothing */
+	if (load(&hits, &misses, 1) != 2 || hits != 2 || misses != 0) {
+		fprintf(stderr, "[ERROR:3] second load %ld hits %ld misses\n",
+			hits, misses);
+		return 3;
+	}
+
+	/* same size and mtime, different contents */
+	stat(file_a, &sb);
+	struct timespec times[2] = { sb.st_atim, sb.st_mtim };
+	sleep(1);
+	if (write_file(file_a, "FIRST FILE\n") ||
+	    utimensat(AT_FDCWD, file_a, times, 0)) {
+		fprintf(stderr, "[ERROR:4] cannot rewrite file\n");
+		return 4;
+	}
+	if (load(&hits, &misses, 0) != 1 || hits != 1 || misses != 0) {
+		fprintf(stderr, "[ERROR:5] rewritten file trusted, %ld hits "
+			"%ld misses\n", hits, misses);
+		return 5;
+	}
+
+	/* the aborted load above left the cache alone */
+	write_file(file_a, "first file\n");
+	md5_of(file_a, md5_a);
+	if (load(&hits, &misses, 1) != 2 || hits != 1 || misses != 1) {
+		fprintf(stderr, "[ERROR:6] cache changed by aborted load, "
+			"%ld hits %ld misses\n", hits, misses);
+		return 6;
+	}
+
+	/* a cache that does not parse is ignored */
+	if (write_file(cache_file, "fapolicyd-md5-cache 1\ngarbage\n")) {
+		fprintf(stderr, "[ERROR:7] cannot damage cache\n");
+		return 7;
+	}
+	if (load(&hits, &misses, 1) != 2 || hits != 0 || misses != 2) {
+		fprintf(stderr, "[ERROR:8] damaged cache used, %ld hits "
+			"%ld misses\n", hits, misses);
+		return 8;
+	}
+
+	return 0;
+}
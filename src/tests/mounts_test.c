@@ -0,0 +1,195 @@
+/*
+ * mounts_test.c - tests for the watched mount list
+ *
+ * Checks both mount table formats, that the path index keeps working
+ * while the list grows and shrinks, and that a mount point which was
+ * unmounted and mounted again between scans is flagged to be marked.
+ * Mount events are checked through mlist_attach and mlist_detach,
+ * including mounts stacked on one point, which must keep the point
+ * watched until the last of them is detached.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "mounts.h"
+
+#define MANY 5000
+
+static mnode *node(mlist *m, const char *p)
+{
+	return mlist_find(m, p) ? m->cur : NULL;
+}
+
+// Remove the deleted nodes like fanotify_update does
+static void drop_deleted(mlist *m)
+{
+	mnode *cur = m->head, *prev = NULL;
+
+	while (cur) {
+		if (cur->status == MNT_DELETE)
+			cur = mlist_remove(m, prev, cur);
+		else {
+			prev = cur;
+			cur = cur->next;
+		}
+	}
+}
+
+int main(void)
+{
+	char point[4097], type[32], path[64];
+	unsigned int added = 0, deleted = 0;
+	struct timespec start, end;
+	mlist m;
+	int id;
+
+	/* parse_mount_line */
+	if (!parse_mount_line("36 35 98:0 /mnt1 /mnt/my\\040dir rw,noatime "
+			      "master:1 - ext3 /dev/root rw\n", point,
+			      sizeof(point), type, sizeof(type), &id) ||
+	    id != 36 || strcmp(point, "/mnt/my dir") || strcmp(type, "ext3")) {
+		fprintf(stderr, "[ERROR:1] mountinfo %d %s %s\n", id, point,
+			type);
+		return 1;
+	}
+	if (!parse_mount_line("/dev/sda1 /boot xfs rw,relatime 0 0\n", point,
+			      sizeof(point), type, sizeof(type), &id) ||
+	    id != -1 || strcmp(point, "/boot") || strcmp(type, "xfs")) {
+		fprintf(stderr, "[ERROR:1] mounts %d %s %s\n", id, point, type);
+		return 1;
+	}
+	if (parse_mount_line("garbage\n", point, sizeof(point), type,
+			     sizeof(type), &id)) {
+		fprintf(stderr, "[ERROR:1] garbage parsed\n");
+		return 1;
+	}
+
+	/* first scan adds everything */
+	mlist_create(&m);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mlist_mark_all_deleted(&m);
+	for (int i = 0; i < MANY; i++) {
+		snprintf(path, sizeof(path), "/var/lib/containers/%d", i);
+		if (mlist_seen(&m, path, 100 + i)) {
+			fprintf(stderr, "[ERROR:2] cannot add %s\n", path);
+			return 2;
+		}
+	}
+	mlist_resolve(&m, &added, &deleted);
+	if (m.count != MANY || added != MANY || deleted) {
+		fprintf(stderr, "[ERROR:2] %u nodes %u added %u deleted\n",
+			m.count, added, deleted);
+		return 2;
+	}
+
+	/* rescan: one remounted, one gone, one stacked, one new */
+	added = deleted = 0;
+	mlist_mark_all_deleted(&m);
+	for (int i = 0; i < MANY; i++) {
+		snprintf(path, sizeof(path), "/var/lib/containers/%d", i);
+		if (i == 7)
+			continue;
+		mlist_seen(&m, path, i == 3 ? 9000 : 100 + i);
+		if (i == 5)
+			mlist_seen(&m, path, 9001);
+	}
+	mlist_seen(&m, "/new", 9002);
+	mlist_resolve(&m, &added, &deleted);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (added != 3 || deleted != 1 ||
+	    node(&m, "/var/lib/containers/3")->status != MNT_ADD ||
+	    node(&m, "/var/lib/containers/5")->status != MNT_ADD ||
+	    node(&m, "/var/lib/containers/7")->status != MNT_DELETE ||
+	    node(&m, "/var/lib/containers/8")->status != MNT_NO_CHANGE) {
+		fprintf(stderr, "[ERROR:3] %u added %u deleted\n", added,
+			deleted);
+		return 3;
+	}
+
+	/* the index follows removals */
+	drop_deleted(&m);
+	if (m.count != MANY || node(&m, "/var/lib/containers/7") ||
+	    !node(&m, "/new") || m.tail != node(&m, "/new")) {
+		fprintf(stderr, "[ERROR:4] %u nodes after removal\n", m.count);
+		return 4;
+	}
+
+	/* the stacked mount keeps its top ID */
+	added = deleted = 0;
+	mlist_mark_all_deleted(&m);
+	for (int i = 0; i < MANY; i++) {
+		snprintf(path, sizeof(path), "/var/lib/containers/%d", i);
+		if (i == 7)
+			continue;
+		mlist_seen(&m, path, i == 3 ? 9000 : 100 + i);
+		if (i == 5)
+			mlist_seen(&m, path, 9001);
+	}
+	mlist_seen(&m, "/new", 9002);
+	mlist_resolve(&m, &added, &deleted);
+	if (added || deleted) {
+		fprintf(stderr, "[ERROR:5] %u added %u deleted\n", added,
+			deleted);
+		return 5;
+	}
+
+	/* mount events: stacking on a watched point marks it again */
+	if (mlist_attach(&m, "/var/lib/containers/1", 77777) ||
+	    node(&m, "/var/lib/containers/1")->status != MNT_ADD ||
+	    mlist_attach(&m, "/event", 77778) || m.count != MANY + 1) {
+		fprintf(stderr, "[ERROR:6] attach %u nodes\n", m.count);
+		return 6;
+	}
+	if (mlist_detach(&m, 77778) != 1 || mlist_detach(&m, 12345) != 0 ||
+	    node(&m, "/event")->status != MNT_DELETE) {
+		fprintf(stderr, "[ERROR:6] detach\n");
+		return 6;
+	}
+	drop_deleted(&m);
+	if (node(&m, "/event") || m.count != MANY) {
+		fprintf(stderr, "[ERROR:6] %u nodes after detach\n", m.count);
+		return 6;
+	}
+
+	/* stacked mounts: the point stays until its last mount goes */
+	mlist_resolve(&m, &added, &deleted);
+	if (mlist_detach(&m, 77777) != 1 ||
+	    node(&m, "/var/lib/containers/1")->status == MNT_DELETE ||
+	    node(&m, "/var/lib/containers/1")->mnt_id != 101) {
+		fprintf(stderr, "[ERROR:7] top of stack detached\n");
+		return 7;
+	}
+	if (mlist_detach(&m, 101) != 1 ||
+	    node(&m, "/var/lib/containers/1")->status != MNT_DELETE) {
+		fprintf(stderr, "[ERROR:7] bottom of stack detached\n");
+		return 7;
+	}
+	// the scan found 105 with 9001 on top, the lower one goes first
+	if (mlist_detach(&m, 105) != 1 ||
+	    node(&m, "/var/lib/containers/5")->status == MNT_DELETE ||
+	    node(&m, "/var/lib/containers/5")->mnt_id != 9001 ||
+	    mlist_detach(&m, 105) != 0) {
+		fprintf(stderr, "[ERROR:8] lower mount detached\n");
+		return 8;
+	}
+	if (mlist_attach(&m, "/var/lib/containers/5", 9100) ||
+	    mlist_detach(&m, 9001) != 1 || mlist_detach(&m, 9100) != 1 ||
+	    node(&m, "/var/lib/containers/5")->status != MNT_DELETE) {
+		fprintf(stderr, "[ERROR:8] stack not emptied\n");
+		return 8;
+	}
+	drop_deleted(&m);
+	if (m.count != MANY - 2 || mlist_detach(&m, 9100) != 0 ||
+	    mlist_detach(&m, 110) != 1) {
+		fprintf(stderr, "[ERROR:9] %u nodes after stacks\n", m.count);
+		return 9;
+	}
+
+	printf("mounts: %d mounts, two scans in %.3fms\n", MANY,
+	       (end.tv_sec - start.tv_sec) * 1000.0 +
+	       (end.tv_nsec - start.tv_nsec) / 1e6);
+	mlist_clear(&m);
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * queue_test.c - tests for the inter-thread event queue
+ *
+ * Checks that exec events are served ahead of open events with the
+ * configured weight, that a process' events never overtake each other
+ * when they land in different lanes, that a weight of 0 keeps a plain
+ * FIFO, that the oldest queued event can be seen from outside, that a
+ * queue takes no event before it is placed, that a full queue refuses
+ * new events, that it drains without blocking and
+ * that the lanes share the queue's slots when they are freed out of
+ * order.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <sys/fanotify.h>
+
+#include "queue.h"
+
+#define E FAN_OPEN_EXEC_PERM
+#define O FAN_OPEN_PERM
+
+struct ev {
+	int pid;
+	unsigned long long mask;
+};
+
+static int push(struct queue *q, int pid, unsigned long long mask)
+{
+	struct fanotify_event_metadata m = { 0 };
+
+	m.vers = FANOTIFY_METADATA_VERSION;
+	m.pid = pid;
+	m.mask = mask;
+	m.fd = -1;
+	return q_enqueue(q, &m);
+}
+
+// Enqueue IN, then check the events come back as OUT
+static int run(int num, unsigned int weight, const struct ev *in,
+	       const struct ev *out, unsigned int count)
+{
+	struct fanotify_event_metadata m;
+	struct queue *q = q_open(count, weight);
+	unsigned int i;
+	int rc = 0;
+
+	if (q == NULL) {
+		fprintf(stderr, "[ERROR:%d] q_open failed\n", num);
+		return num;
+	}
+	q_place(q);
+
+	for (i = 0; i < count; i++) {
+		if (push(q, in[i].pid, in[i].mask)) {
+			fprintf(stderr, "[ERROR:%d] enqueue %u failed\n",
+				num, i);
+			rc = num;
+			goto out;
+		}
+	}
+	if (q_oldest_stamp(q) == 0) {
+		fprintf(stderr, "[ERROR:%d] no oldest event\n", num);
+		rc = num;
+		goto out;
+	}
+	if (q_queue_length(q) != count) {
+		fprintf(stderr, "[ERROR:%d] length %zu\n", num,
+			q_queue_length(q));
+		rc = num;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (q_dequeue(q, &m) != 1 || m.pid != out[i].pid ||
+		    m.mask != out[i].mask) {
+			fprintf(stderr,
+				"[ERROR:%d] event %u is pid %d mask %llx\n",
+				num, i, m.pid, (unsigned long long)m.mask);
+			rc = num;
+			goto out;
+		}
+	}
+
+	// Nothing left, a shutdown wakeup returns empty
+	q_shutdown(q);
+	if (q_dequeue(q, &m) != 0 || q_queue_length(q) != 0 ||
+	    q_oldest_stamp(q) != 0) {
+		fprintf(stderr, "[ERROR:%d] queue not empty\n", num);
+		rc = num;
+	}
+out:
+	q_close(q);
+	return rc;
+}
+
+int main(void)
+{
+	int rc;
+
+	/* exec events jump ahead unless their pid is already queued */
+	static const struct ev in1[] = {
+		{ 10, O }, { 11, O }, { 12, E }, { 10, E }, { 13, E }
+	};
+	static const struct ev out1[] = {
+		{ 12, E }, { 13, E }, { 10, O }, { 11, O }, { 10, E }
+	};
+	rc = run(1, 2, in1, out1, 5);
+	if (rc)
+		return rc;
+
+	/* opens following a queued exec of the same pid stay behind it */
+	static const struct ev in2[] = {
+		{ 20, O }, { 21, E }, { 21, O }, { 21, O }, { 22, O }
+	};
+	static const struct ev out2[] = {
+		{ 21, E }, { 21, O }, { 21, O }, { 20, O }, { 22, O }
+	};
+	rc = run(2, 8, in2, out2, 5);
+	if (rc)
+		return rc;
+
+	/* one open is served after every two execs while both wait */
+	static const struct ev in3[] = {
+		{ 200, O }, { 201, O }, { 100, E }, { 101, E }, { 102, E },
+		{ 103, E }, { 104, E }
+	};
+	static const struct ev out3[] = {
+		{ 100, E }, { 101, E }, { 200, O }, { 102, E }, { 103, E },
+		{ 201, O }, { 104, E }
+	};
+	rc = run(3, 2, in3, out3, 7);
+	if (rc)
+		return rc;
+
+	/* weight 0 is first come, first served */
+	rc = run(4, 0, in3, in3, 7);
+	if (rc)
+		return rc;
+
+	/* a queue takes no event before it is placed */
+	struct queue *q = q_open(2, 4);
+	if (q == NULL || push(q, 1, E) != -1 || errno != ENOSPC ||
+	    q_queue_length(q) != 0) {
+		fprintf(stderr, "[ERROR:5] unplaced queue accepted an event\n");
+		return 5;
+	}
+	q_place(q);
+
+	/* a full queue refuses events */
+	if (push(q, 1, E) || push(q, 2, O) ||
+	    push(q, 3, E) != -1 || errno != ENOSPC) {
+		fprintf(stderr, "[ERROR:5] full queue accepted an event\n");
+		return 5;
+	}
+
+	/* draining without blocking */
+	struct fanotify_event_metadata m;
+	if (q_try_dequeue(q, &m) != 1 || m.pid != 1 ||
+	    q_try_dequeue(q, &m) != 1 || m.pid != 2 ||
+	    q_try_dequeue(q, &m) != 0) {
+		fprintf(stderr, "[ERROR:6] q_try_dequeue failed\n");
+		return 6;
+	}
+	q_close(q);
+
+	/* slots freed out of order are reused by either lane */
+	q = q_open(3, 2);
+	if (q == NULL) {
+		fprintf(stderr, "[ERROR:7] q_open failed\n");
+		return 7;
+	}
+	q_place(q);
+	for (int i = 0; i < 100; i++) {
+		int base = 3 * i + 1;
+
+		if (push(q, base, O) || push(q, base + 1, E) ||
+		    push(q, base + 2, E) || push(q, base + 3, O) != -1 ||
+		    q_try_dequeue(q, &m) != 1 || m.pid != base + 1 ||
+		    m.mask != E ||
+		    q_try_dequeue(q, &m) != 1 || m.pid != base + 2 ||
+		    m.mask != E ||
+		    q_try_dequeue(q, &m) != 1 || m.pid != base ||
+		    m.mask != O ||
+		    q_queue_length(q) != 0) {
+			fprintf(stderr, "[ERROR:7] round %d failed\n", i);
+			return 7;
+		}
+	}
+	q_close(q);
+
+	return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ * realtime_test.c - tests for the locked decision heap
+ *
+ * Runs an allocation pattern like the one of the decision path, small
+ * attribute objects and strings kept alive in a cache and evicted in
+ * turn, plus an occasional large scratch buffer, in a thread of its own
+ * and counts the minor page faults it takes per event. After
+ * rt_reserve_heap() and rt_lock_memory() the steady state must not
+ * fault. Locking needs CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK;
+ * without it only the reserve is checked.
+ *
+ * The arrays of rt_alloc_array() are then checked to come back zeroed,
+ * writable and intact after rt_touch_array() in every huge page mode.
+ * Given a size in megabytes, it instead benchmarks random lookups in an
+ * array of that size, like those of the cache hash arrays, with each
+ * mode and prints the time and the data TLB misses they took. Counting
+ * misses needs perf events to be allowed, see perf_event_paranoid.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "message.h"
+#include "realtime.h"
+
+#define EVENTS 50000
+#define LIVE 4096
+#define PER_EVENT 4
+#define BURST (512 * 1024)
+
+static void *cache[LIVE * PER_EVENT];
+
+// One event: a few attributes and a path, replacing the oldest entry
+static void fake_event(unsigned int n)
+{
+	static const size_t sizes[PER_EVENT - 1] = { 40, 96, 264 };
+	char path[128];
+	unsigned int slot = (n % LIVE) * PER_EVENT;
+
+	for (unsigned int i = 0; i < PER_EVENT; i++)
+		free(cache[slot + i]);
+	for (unsigned int i = 0; i < PER_EVENT - 1; i++) {
+		cache[slot + i] = malloc(sizes[i] + n % 24);
+		memset(cache[slot + i], n, sizes[i]);
+	}
+	snprintf(path, sizeof(path), "/usr/lib64/libtest-%u.so.%u", n, n % 7);
+	cache[slot + PER_EVENT - 1] = strdup(path);
+
+	// Now and then a large scratch buffer, like reading a big /proc file
+	if (n % 64 == 0) {
+		char *scratch = malloc(BURST);
+
+		memset(scratch, 0, BURST);
+		free(scratch);
+	}
+}
+
+static long minflt(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_minflt;
+}
+
+static void *worker(void *arg)
+{
+	long *faults = arg;
+	long before;
+
+	if (rt_reserve_heap(RT_HEAP_RESERVE)) {
+		*faults = -1;
+		return NULL;
+	}
+	if (rt_lock_memory())
+		fprintf(stderr, "memory not locked, checking the reserve only\n");
+
+	// Fill the cache first so its own pages are not counted
+	for (unsigned int n = 0; n < LIVE; n++)
+		fake_event(n);
+
+	before = minflt();
+	for (unsigned int n = LIVE; n < LIVE + EVENTS; n++)
+		fake_event(n);
+	*faults = minflt() - before;
+
+	for (unsigned int i = 0; i < LIVE * PER_EVENT; i++)
+		free(cache[i]);
+	return NULL;
+}
+
+static const char *mode_name[] = { "none", "transparent", "explicit" };
+
+// Each mode must give zeroed memory that keeps its contents when touched
+static int check_arrays(void)
+{
+	static const size_t sizes[] = { 24, 64 * 1024, 3 * 1024 * 1024 };
+
+	for (int mode = HP_NONE; mode <= HP_EXPLICIT; mode++) {
+		rt_set_huge_pages(mode);
+		for (unsigned int i = 0; i < sizeof(sizes)/sizeof(sizes[0]);
+		     i++) {
+			size_t size = sizes[i];
+			unsigned char *p = rt_alloc_array(size);
+
+			if (p == NULL) {
+				fprintf(stderr, "cannot map %zu bytes (%s)\n",
+					size, mode_name[mode]);
+				return 1;
+			}
+			for (size_t off = 0; off < size; off++)
+				if (p[off]) {
+					fprintf(stderr,
+						"%zu bytes not zeroed (%s)\n",
+						size, mode_name[mode]);
+					return 1;
+				}
+			p[0] = 1;
+			p[size - 1] = 2;
+			rt_touch_array(p, size);
+			if (p[0] != 1 || p[size - 1] != 2) {
+				fprintf(stderr, "%zu bytes changed (%s)\n",
+					size, mode_name[mode]);
+				return 1;
+			}
+			rt_free_array(p, size);
+		}
+	}
+	rt_set_huge_pages(HP_NONE);
+
+	return 0;
+}
+
+static int open_tlb_counter(void)
+{
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HW_CACHE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CACHE_DTLB |
+		    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static volatile uintptr_t sink;
+
+// Look up random slots of an array of pointers, as the caches do
+static int tlb_bench(size_t mb)
+{
+	size_t slots = mb * 1024 * 1024 / sizeof(void *);
+	int fd = open_tlb_counter();
+
+	if (fd < 0)
+		printf("perf events not available, timing only\n");
+	printf("%zu MB of slots, %u lookups\n", mb, EVENTS * 100);
+
+	for (int mode = HP_NONE; mode <= HP_EXPLICIT; mode++) {
+		struct timespec start, end;
+		unsigned long long misses = 0;
+		uint32_t x = 2463534242U;
+		uintptr_t sum = 0;
+		void **array;
+
+		rt_set_huge_pages(mode);
+		array = rt_alloc_array(slots * sizeof(void *));
+		if (array == NULL) {
+			fprintf(stderr, "[ERROR:5] cannot map %zu MB\n", mb);
+			return 5;
+		}
+		rt_touch_array(array, slots * sizeof(void *));
+
+		if (fd >= 0) {
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (unsigned int n = 0; n < EVENTS * 100; n++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			sum += (uintptr_t)array[x % slots];
+			array[x % slots] = (void *)(uintptr_t)n;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (fd >= 0) {
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+				misses = 0;
+		}
+
+		printf("%-12s %8.2f ms", mode_name[mode],
+		       (end.tv_sec - start.tv_sec) * 1000.0 +
+		       (end.tv_nsec - start.tv_nsec) / 1000000.0);
+		if (fd >= 0)
+			printf(" %12llu dTLB misses", misses);
+		printf("\n");
+		sink = sum;
+		rt_free_array(array, slots * sizeof(void *));
+	}
+	if (fd >= 0)
+		close(fd);
+	rt_set_huge_pages(HP_NONE);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t t;
+	long faults = 0;
+
+	set_message_mode(MSG_STDERR, DBG_NO);
+	if (argc > 1)
+		return tlb_bench(strtoul(argv[1], NULL, 10) ?: 256);
+	if (pthread_create(&t, NULL, worker, &faults)) {
+		fprintf(stderr, "[ERROR:1] cannot start worker\n");
+		return 1;
+	}
+	pthread_join(t, NULL);
+
+	if (faults < 0) {
+		fprintf(stderr, "[ERROR:2] cannot reserve heap\n");
+		return 2;
+	}
+	printf("%ld minor faults in %d events (%.4f per event)\n",
+	       faults, EVENTS, (double)faults / EVENTS);
+
+	// Leave room for the stack and getrusage itself
+	if (faults > 16) {
+		fprintf(stderr, "[ERROR:3] decision heap is faulting\n");
+		return 3;
+	}
+
+	if (check_arrays()) {
+		fprintf(stderr, "[ERROR:4] arrays are not usable\n");
+		return 4;
+	}
+
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * reply_cache_test.c - tests for replies reused during decision stalls
+ *
+ * Stores the reply of an event the way the decision thread does and
+ * checks that only an event with the same pid, mask and file gets it
+ * back, that an exec of the process or a reload drops it, that a reply
+ * stored from before an exec is never found again and that hits are
+ * counted.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/fanotify.h>
+
+#include "reply-cache.h"
+
+static struct fanotify_event_metadata event(pid_t pid,
+					    unsigned long long mask)
+{
+	struct fanotify_event_metadata m;
+
+	memset(&m, 0, sizeof(m));
+	m.vers = FANOTIFY_METADATA_VERSION;
+	m.pid = pid;
+	m.mask = mask;
+	m.fd = -1;
+	return m;
+}
+
+int main(void)
+{
+	struct reply_cache *c = reply_cache_open();
+	struct fanotify_event_metadata m = event(100, FAN_OPEN_PERM);
+	struct fanotify_event_metadata other;
+	unsigned int stamp;
+	char buf[64];
+	FILE *f;
+
+	if (c == NULL) {
+		fprintf(stderr, "[ERROR:1] reply_cache_open failed\n");
+		return 1;
+	}
+
+	// Nothing is found in an empty cache
+	if (reply_cache_lookup(c, &m, 8, 42) != -1) {
+		fprintf(stderr, "[ERROR:2] empty cache has a reply\n");
+		return 2;
+	}
+
+	// The same event gets the stored reply
+	stamp = reply_cache_stamp(c, m.pid);
+	reply_cache_store(c, &m, stamp, reply_cache_epoch(), 8, 42,
+			  FAN_DENY);
+	if (reply_cache_lookup(c, &m, 8, 42) != FAN_DENY) {
+		fprintf(stderr, "[ERROR:3] stored reply not found\n");
+		return 3;
+	}
+
+	// Another pid, mask or file does not
+	other = event(101, FAN_OPEN_PERM);
+	if (reply_cache_lookup(c, &other, 8, 42) != -1 ||
+	    reply_cache_lookup(c, &m, 8, 43) != -1 ||
+	    reply_cache_lookup(c, &m, 9, 42) != -1) {
+		fprintf(stderr, "[ERROR:4] reply given to another event\n");
+		return 4;
+	}
+	other = event(100, FAN_OPEN_EXEC_PERM);
+	if (reply_cache_lookup(c, &other, 8, 42) != -1) {
+		fprintf(stderr, "[ERROR:5] reply given to another mask\n");
+		return 5;
+	}
+
+	// An exec by the process drops its replies
+	reply_cache_exec(c, m.pid);
+	if (reply_cache_lookup(c, &m, 8, 42) != -1) {
+		fprintf(stderr, "[ERROR:6] reply survived an exec\n");
+		return 6;
+	}
+
+	// A reply decided for an event read before the exec stays stale
+	reply_cache_store(c, &m, stamp, reply_cache_epoch(), 8, 42,
+			  FAN_ALLOW);
+	if (reply_cache_lookup(c, &m, 8, 42) != -1) {
+		fprintf(stderr, "[ERROR:7] reply from before an exec found\n");
+		return 7;
+	}
+
+	// So does one decided before a reload
+	stamp = reply_cache_stamp(c, m.pid);
+	reply_cache_store(c, &m, stamp, reply_cache_epoch(), 8, 42,
+			  FAN_ALLOW);
+	if (reply_cache_lookup(c, &m, 8, 42) != FAN_ALLOW) {
+		fprintf(stderr, "[ERROR:8] reply after exec not found\n");
+		return 8;
+	}
+	reply_cache_invalidate();
+	if (reply_cache_lookup(c, &m, 8, 42) != -1) {
+		fprintf(stderr, "[ERROR:9] reply survived a reload\n");
+		return 9;
+	}
+
+	f = fmemopen(buf, sizeof(buf), "w");
+	if (f == NULL) {
+		fprintf(stderr, "[ERROR:10] fmemopen failed\n");
+		return 10;
+	}
+	reply_cache_report(c, f);
+	fclose(f);
+	if (strcmp(buf, "Watchdog cached replies: 2\n")) {
+		fprintf(stderr, "[ERROR:10] report is %s\n", buf);
+		return 10;
+	}
+
+	reply_cache_close(c);
+	return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * rpm_incremental_test.c - tests for incremental rpm backend loads
+ *
+ * A private rpm database is created under a temporary root and populated
+ * with tiny packages installed with --justdb. The loader is then run
+ * against it to check that:
+ *   1. the first load is a full snapshot and writes the header cache,
+ *   2. an incremental load with no package changes is an empty change set,
+ *   3. installing and erasing packages only sends their records, and a
+ *      file still provided by another package is never removed,
+ *   4. a full load reusing the cache still produces the whole snapshot,
+ *   5. a damaged cache falls back to a full snapshot.
+ * The test is skipped when rpm or rpmbuild are not installed.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "conf.h"
+#include "fapolicyd-backend.h"
+#include "filter.h"
+#include "message.h"
+
+atomic_bool stop;
+unsigned int debug_mode;
+
+extern backend rpm_backend;
+int do_rpm_load_list(const conf_t *conf, int memfd);
+void do_rpm_set_options(const char *root, const char *cache, int incremental);
+
+static char base[] = "/tmp/fapolicyd-rpm-XXXXXX";
+static char root[128], cache[128], snapshot[1 << 16];
+
+static int run(const char *fmt, ...)
+{
+	char cmd[1024];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(cmd, sizeof(cmd), fmt, ap);
+	va_end(ap);
+	return system(cmd);
+}
+
+// Build a noarch package owning /usr/bin/<name> and a file shared by all
+static int build_package(const char *name)
+{
+	char path[256];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s.spec", base, name);
+	f = fopen(path, "w");
+	if (f == NULL)
+		return 1;
+	fprintf(f, "Name: %s\nVersion: 1\nRelease: 1\nSummary: test\n"
+		"License: GPLv2+\nBuildArch: noarch\n"
+		"%%description\ntest\n"
+		"%%install\nmkdir -p %%{buildroot}/usr/bin "
+		"%%{buildroot}/usr/share/fapo\n"
+		"echo %s > %%{buildroot}/usr/bin/%s\n"
+		"echo shared > %%{buildroot}/usr/share/fapo/shared\n"
+		"%%files\n/usr/bin/%s\n/usr/share/fapo/shared\n",
+		name, name, name, name);
+	fclose(f);
+
+	return run("rpmbuild --quiet --define '_topdir %s/build' "
+		   "--define '_build_id_links none' -bb %s >/dev/null 2>&1",
+		   base, path);
+}
+
+static int install_package(const char *name)
+{
+	return run("rpm --root %s -i --justdb --nodeps --replacefiles "
+		   "%s/build/RPMS/noarch/%s-1-1.noarch.rpm >/dev/null 2>&1",
+		   root, base, name);
+}
+
+// Load the rpm backend into a memfd and keep its text in snapshot
+static int load(int incremental)
+{
+	int memfd = memfd_create("rpm_test", MFD_CLOEXEC);
+	ssize_t len;
+
+	if (memfd < 0)
+		return 1;
+
+	do_rpm_set_options(root, cache, incremental);
+	if (do_rpm_load_list(NULL, memfd)) {
+		close(memfd);
+		return 1;
+	}
+
+	lseek(memfd, 0, SEEK_SET);
+	len = read(memfd, snapshot, sizeof(snapshot) - 1);
+	close(memfd);
+	if (len < 0)
+		return 1;
+	snapshot[len] = '\0';
+	return 0;
+}
+
+int main(void)
+{
+	char path[256];
+	int rc = 0;
+
+	if (system("command -v rpm >/dev/null 2>&1 && "
+		   "command -v rpmbuild >/dev/null 2>&1")) {
+		fprintf(stderr, "rpm or rpmbuild not found, skipping\n");
+		return 77;
+	}
+
+	set_message_mode(MSG_STDERR, DBG_NO);
+	if (mkdtemp(base) == NULL) {
+		fprintf(stderr, "[ERROR:1] mkdtemp failed\n");
+		return 1;
+	}
+	snprintf(root, sizeof(root), "%s/root", base);
+	snprintf(cache, sizeof(cache), "%s/rpm-header.cache", base);
+
+	// Trust everything, the filter is tested elsewhere
+	snprintf(path, sizeof(path), "%s/filter.conf", base);
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "[ERROR:1] cannot write filter\n");
+		rc = 1;
+		goto out;
+	}
+	fputs("+ /\n", f);
+	fclose(f);
+	if (filter_init() || filter_load_file(path)) {
+		fprintf(stderr, "[ERROR:1] filter setup failed\n");
+		rc = 1;
+		goto out;
+	}
+
+	if (build_package("fapo-a") || build_package("fapo-b") ||
+	    build_package("fapo-c")) {
+		fprintf(stderr, "[ERROR:2] rpmbuild failed\n");
+		rc = 2;
+		goto out;
+	}
+	if (run("rpm --root %s --initdb", root) ||
+	    install_package("fapo-a") || install_package("fapo-b")) {
+		fprintf(stderr, "[ERROR:2] cannot populate rpmdb\n");
+		rc = 2;
+		goto out;
+	}
+
+	/* full load */
+	if (load(1) || rpm_backend.delta || rpm_backend.entries != 3 ||
+	    !strstr(snapshot, "/usr/bin/fapo-a 1 ") ||
+	    !strstr(snapshot, "/usr/share/fapo/shared 1 ") ||
+	    access(cache, R_OK)) {
+		fprintf(stderr, "[ERROR:3] first load %ld entries:\n%s",
+			rpm_backend.entries, snapshot);
+		rc = 3;
+		goto out;
+	}
+
+	/* no changes */
+	if (load(1) || !rpm_backend.delta || rpm_backend.entries != 0) {
+		fprintf(stderr, "[ERROR:4] unchanged load %ld entries:\n%s",
+			rpm_backend.entries, snapshot);
+		rc = 4;
+		goto out;
+	}
+
+	/* install c, erase a */
+	if (install_package("fapo-c") ||
+	    run("rpm --root %s -e --justdb --nodeps fapo-a >/dev/null 2>&1",
+		root)) {
+		fprintf(stderr, "[ERROR:5] cannot update rpmdb\n");
+		rc = 5;
+		goto out;
+	}
+	if (load(1) || !rpm_backend.delta || rpm_backend.entries != 3 ||
+	    !strstr(snapshot, "+/usr/bin/fapo-c 1 ") ||
+	    !strstr(snapshot, "-/usr/bin/fapo-a 1 ") ||
+	    strstr(snapshot, "-/usr/share/fapo/shared")) {
+		fprintf(stderr, "[ERROR:5] change set %ld entries:\n%s",
+			rpm_backend.entries, snapshot);
+		rc = 5;
+		goto out;
+	}
+
+	/* full load served from the cache */
+	if (load(0) || rpm_backend.delta || rpm_backend.entries != 3 ||
+	    strstr(snapshot, "fapo-a") || !strstr(snapshot, "fapo-b") ||
+	    !strstr(snapshot, "fapo-c")) {
+		fprintf(stderr, "[ERROR:6] cached load %ld entries:\n%s",
+			rpm_backend.entries, snapshot);
+		rc = 6;
+		goto out;
+	}
+
+	/* damaged cache */
+	f = fopen(cache, "a");
+	if (f) {
+		fputs("garbage\n", f);
+		fclose(f);
+	}
+	if (load(1) || rpm_backend.delta || rpm_backend.entries != 3) {
+		fprintf(stderr, "[ERROR:7] fallback load %ld entries:\n%s",
+			rpm_backend.entries, snapshot);
+		rc = 7;
+		goto out;
+	}
+
+out:
+	filter_destroy();
+	run("rm -rf %s", base);
+	return rc;
+}
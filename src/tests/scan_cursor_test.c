@@ -0,0 +1,118 @@
+/*
+ * scan_cursor_test.c - tests for resuming an interrupted mount scan
+ *
+ * Saves the cursor the way --check-ignore_mounts does when the first of
+ * two mounts is scanned to the end and the second is interrupted, then
+ * loads it as --resume does and checks that the first mount is skipped
+ * with its count, that the position applies to the second mount only and
+ * that finishing it drops the position. A missing, old or cut short
+ * cursor must leave nothing to resume.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scan-cursor.h"
+
+#define MOUNT_A	"/mnt/a"
+#define MOUNT_B	"/mnt/b c"	// mounts may hold spaces
+#define LAST_B	"/mnt/b c/d e"
+
+static char file[] = "/tmp/scan_cursor_test.XXXXXX";
+
+// Write TEXT as the saved cursor and check it cannot be resumed
+static int check_unusable(const char *text)
+{
+	struct scan_cursor c;
+	FILE *f = fopen(file, "w");
+
+	if (f == NULL || fputs(text, f) < 0 || fclose(f))
+		return 1;
+	scan_cursor_init(&c, file);
+	return scan_cursor_load(&c) != 1 || c.ndone || c.mount;
+}
+
+int main(void)
+{
+	const struct scan_cursor_mount *done;
+	struct scan_cursor c;
+	int fd = mkstemp(file);
+
+	if (fd < 0) {
+		fprintf(stderr, "[ERROR:1] cannot create cursor file\n");
+		return 1;
+	}
+	close(fd);
+
+	// First run, a checkpoint in A, A done, then interrupted in B
+	scan_cursor_init(&c, file);
+	if (scan_cursor_save(&c, MOUNT_A, 4096, 1, MOUNT_A "/x") ||
+	    scan_cursor_finish(&c, MOUNT_A, 2) ||
+	    scan_cursor_resumes(&c, MOUNT_A) ||
+	    scan_cursor_save(&c, MOUNT_B, 5000, 3, LAST_B)) {
+		fprintf(stderr, "[ERROR:2] cannot save cursor\n");
+		return 2;
+	}
+	scan_cursor_free(&c);
+
+	// Second run, with --resume
+	scan_cursor_init(&c, file);
+	if (scan_cursor_load(&c)) {
+		fprintf(stderr, "[ERROR:3] cannot load cursor\n");
+		return 3;
+	}
+	done = scan_cursor_finished(&c, MOUNT_A);
+	if (done == NULL || done->found != 2 || c.ndone != 1 ||
+	    scan_cursor_finished(&c, MOUNT_B)) {
+		fprintf(stderr, "[ERROR:4] wrong mounts scanned to the end\n");
+		return 4;
+	}
+	if (scan_cursor_resumes(&c, MOUNT_A) ||
+	    scan_cursor_resumes(&c, "/mnt/b") ||
+	    !scan_cursor_resumes(&c, MOUNT_B) || c.files != 5000 ||
+	    c.found != 3 || strcmp(c.last, LAST_B)) {
+		fprintf(stderr, "[ERROR:5] wrong position\n");
+		return 5;
+	}
+
+	// B is scanned to the end in turn
+	if (scan_cursor_finish(&c, MOUNT_B, 4) || c.mount ||
+	    scan_cursor_save(&c, NULL, 0, 0, NULL)) {
+		fprintf(stderr, "[ERROR:6] cannot finish mount\n");
+		return 6;
+	}
+	scan_cursor_free(&c);
+	scan_cursor_init(&c, file);
+	if (scan_cursor_load(&c) || c.ndone != 2 || c.mount ||
+	    (done = scan_cursor_finished(&c, MOUNT_B)) == NULL ||
+	    done->found != 4) {
+		fprintf(stderr, "[ERROR:7] finished mount not saved\n");
+		return 7;
+	}
+
+	// Once every mount was walked there is nothing left
+	scan_cursor_remove(&c);
+	if (access(file, F_OK) == 0 || c.ndone) {
+		fprintf(stderr, "[ERROR:8] cursor not removed\n");
+		return 8;
+	}
+	scan_cursor_init(&c, file);
+	if (scan_cursor_load(&c) != 1) {
+		fprintf(stderr, "[ERROR:9] missing cursor loaded\n");
+		return 9;
+	}
+
+	if (check_unusable("fapolicyd-scan-cursor 1\n" MOUNT_B "\n5000 3\n"
+			   LAST_B "\n") ||
+	    check_unusable("fapolicyd-scan-cursor 2\ndone 2 " MOUNT_A "\n"
+			   "at 5000 3 " MOUNT_B "\n") ||
+	    check_unusable("fapolicyd-scan-cursor 2\ndone 2\n")) {
+		fprintf(stderr, "[ERROR:10] unusable cursor loaded\n");
+		return 10;
+	}
+	unlink(file);
+
+	return 0;
+}
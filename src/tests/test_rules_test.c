@@ -0,0 +1,120 @@
+/*
+ * test_rules_test.c - tests for evaluating recorded events offline
+ *
+ * Runs the events of src/tests/fixtures/test-rules.events through
+ * rule_test(), the way fapolicyd-cli --test-rules does, and checks the
+ * allowed and denied counts it prints for each rule file and the status
+ * it returns: 0 for one rule file or two that agree, 1 when two rule
+ * files decide an event differently or when an event or rule file
+ * cannot be used. The events give the trust of both sides, so no trust
+ * database is needed.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "conf.h"
+#include "message.h"
+#include "rule-test.h"
+
+#ifndef TEST_BASE
+#define TEST_BASE "."
+#endif
+
+#define FIXTURES TEST_BASE "/src/tests/fixtures/"
+#define EVENTS FIXTURES "test-rules.events"
+#define BAD_EVENTS FIXTURES "test-rules-bad.events"
+#define RULES_A FIXTURES "test-rules-a.rules"
+#define RULES_B FIXTURES "test-rules-b.rules"
+
+/* globals expected by library code */
+conf_t config;
+int debug_mode;
+atomic_bool stop;
+
+static char out[8192];
+
+// Run rule_test() with its output in out, returns its status
+static int run(const char *events, const char *rules, const char *other)
+{
+	FILE *f = tmpfile();
+	int saved, rc;
+	size_t len;
+
+	if (f == NULL)
+		return -1;
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	dup2(fileno(f), STDOUT_FILENO);
+	rc = rule_test(events, rules, other, false);
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	rewind(f);
+	len = fread(out, 1, sizeof(out) - 1, f);
+	out[len] = 0;
+	fclose(f);
+	return rc;
+}
+
+// Check the counts printed for a rule file
+static int counts(const char *rules, unsigned long events,
+		  unsigned long allowed, unsigned long denied)
+{
+	char expect[PATH_MAX + 64];
+
+	snprintf(expect, sizeof(expect), "%s: %lu events, %lu allowed, "
+		 "%lu denied\n", rules, events, allowed, denied);
+	return strstr(out, expect) != NULL;
+}
+
+int main(void)
+{
+	set_message_mode(MSG_STDERR, DBG_NO);
+
+	if (run(EVENTS, RULES_A, NULL) != 0 || !counts(RULES_A, 6, 4, 2)) {
+		fprintf(stderr, "[ERROR:1] wrong result for %s:\n%s", RULES_A,
+			out);
+		return 1;
+	}
+
+	if (run(EVENTS, RULES_B, NULL) != 0 || !counts(RULES_B, 6, 3, 3)) {
+		fprintf(stderr, "[ERROR:2] wrong result for %s:\n%s", RULES_B,
+			out);
+		return 2;
+	}
+
+	// Only the plain text file opened by cat is decided differently
+	if (run(EVENTS, RULES_A, RULES_B) != 1 || !counts(RULES_A, 6, 4, 2) ||
+	    !counts(RULES_B, 6, 3, 3) ||
+	    strstr(out, "1 of 6 decisions differ\n") == NULL ||
+	    strstr(out, "/home/user/notes.txt: allow (rule 5) -> "
+			"deny (rule 2)\n") == NULL) {
+		fprintf(stderr, "[ERROR:3] wrong comparison:\n%s", out);
+		return 3;
+	}
+
+	if (run(EVENTS, RULES_A, RULES_A) != 0 ||
+	    strstr(out, "0 of 6 decisions differ\n") == NULL) {
+		fprintf(stderr, "[ERROR:4] rule file differs from itself:\n%s",
+			out);
+		return 4;
+	}
+
+	if (run(BAD_EVENTS, RULES_A, NULL) != 1) {
+		fprintf(stderr, "[ERROR:5] bad event accepted\n");
+		return 5;
+	}
+
+	if (run(EVENTS, FIXTURES "missing.rules", NULL) != 1) {
+		fprintf(stderr, "[ERROR:6] missing rule file accepted\n");
+		return 6;
+	}
+
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * trustdb_digest_test.c - tests for the digest index of the trust database
+ *
+ * Builds a trust database in a temporary directory and checks that a file
+ * is found by size and digest, that another size or digest is not, that
+ * removing one copy of a file through put_record() leaves the others
+ * indexed, that purge_snapshot_records() and delete_all_entries_db()
+ * empty the index along with the path index, and that the index is
+ * dropped when digest_index is turned off and rebuilt from the path index
+ * when it is turned back on.
+ *
+ * The record functions are private to database.c, so it is built into
+ * this test rather than taken from the library.
+ */
+
+#include "database.c"
+
+/* globals expected by library code */
+conf_t config;
+unsigned int debug_mode;
+atomic_bool stop;
+
+#define D1 "1111111111111111111111111111111111111111111111111111111111111111"
+#define D2 "2222222222222222222222222222222222222222222222222222222222222222"
+#define D3 "3333333333333333333333333333333333333333333333333333333333333333"
+
+static char dir[] = "/tmp/trustdb_digest_test.XXXXXX";
+
+static int open_test_db(unsigned int with_index)
+{
+	config.db_max_size = 16;
+	config.integrity = IN_NONE;
+	config.digest_index = with_index;
+	data_dir = dir;
+	if (init_db(&config))
+		return 1;
+	return init_digest_index(&config);
+}
+
+static int add(const char *path, off_t size, const char *digest)
+{
+	char data[TRUSTDB_DATA_BUFSZ];
+	int len = snprintf(data, sizeof(data), DATA_FORMAT, SRC_RPM,
+			   (size_t)size, digest);
+
+	return write_db(path, strlen(path), data, len);
+}
+
+static int del(const char *path, off_t size, const char *digest)
+{
+	char data[TRUSTDB_DATA_BUFSZ];
+	int len = snprintf(data, sizeof(data), DATA_FORMAT, SRC_RPM,
+			   (size_t)size, digest);
+	MDB_txn *txn;
+
+	if (mdb_txn_begin(env, NULL, 0, &txn))
+		return 1;
+	if (open_dbi(txn) ||
+	    put_record(txn, path, strlen(path), data, len, 1)) {
+		abort_transaction(txn);
+		return 1;
+	}
+	return mdb_txn_commit(txn) != 0;
+}
+
+// Returns 1 if a file of that size and digest is trusted, 0 if not
+static int lookup(off_t size, const char *digest)
+{
+	struct file_info info;
+	MDB_txn *txn;
+	int rc;
+
+	memset(&info, 0, sizeof(info));
+	info.size = size;
+	strcpy(info.digest, digest);
+	if (mdb_txn_begin(env, NULL, MDB_RDONLY, &txn))
+		return -1;
+	rc = check_trust_digest(txn, "/lookup", &info, -1);
+	mdb_txn_abort(txn);
+	return rc;
+}
+
+// Entries of the digest index, -1 when it does not exist
+static long index_entries(void)
+{
+	MDB_txn *txn;
+	MDB_dbi d;
+	MDB_stat st;
+	long n = -1;
+
+	if (mdb_txn_begin(env, NULL, MDB_RDONLY, &txn))
+		return -2;
+	if (mdb_dbi_open(txn, digest_db, MDB_DUPSORT, &d) == 0 &&
+	    mdb_stat(txn, d, &st) == 0)
+		n = st.ms_entries;
+	mdb_txn_abort(txn);
+	return n;
+}
+
+int main(void)
+{
+	MDB_txn *txn;
+
+	set_message_mode(MSG_QUIET, DBG_NO);
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "[ERROR:1] mkdtemp failed\n");
+		return 1;
+	}
+
+	if (open_test_db(1) || digest_index != 1) {
+		fprintf(stderr, "[ERROR:2] cannot open the database\n");
+		return 2;
+	}
+
+	// Two copies of one file and another file
+	if (add("/usr/bin/a", 10, D1) || add("/usr/bin/b", 20, D2) ||
+	    add("/opt/copy/a", 10, D1)) {
+		fprintf(stderr, "[ERROR:3] cannot add records\n");
+		return 3;
+	}
+	if (lookup(10, D1) != 1 || lookup(20, D2) != 1 ||
+	    index_entries() != 3) {
+		fprintf(stderr, "[ERROR:4] indexed file not found\n");
+		return 4;
+	}
+	if (lookup(20, D1) != 0 || lookup(10, D2) != 0 ||
+	    lookup(30, D3) != 0) {
+		fprintf(stderr, "[ERROR:5] unknown content trusted\n");
+		return 5;
+	}
+
+	// Removing one copy leaves the other
+	if (del("/usr/bin/a", 10, D1) || lookup(10, D1) != 1 ||
+	    index_entries() != 2) {
+		fprintf(stderr, "[ERROR:6] removing a copy lost the other\n");
+		return 6;
+	}
+	if (del("/opt/copy/a", 10, D1) || lookup(10, D1) != 0 ||
+	    index_entries() != 1) {
+		fprintf(stderr, "[ERROR:7] removed record still indexed\n");
+		return 7;
+	}
+
+	// Without a backend sending a change set, purging drops everything
+	if (mdb_txn_begin(env, NULL, 0, &txn) || open_dbi(txn) ||
+	    purge_snapshot_records(txn) || mdb_txn_commit(txn)) {
+		fprintf(stderr, "[ERROR:8] purge failed\n");
+		return 8;
+	}
+	if (lookup(20, D2) != 0 || index_entries() != 0 ||
+	    database_empty() != 1) {
+		fprintf(stderr, "[ERROR:9] purged record still indexed\n");
+		return 9;
+	}
+
+	if (add("/usr/bin/b", 20, D2) || delete_all_entries_db() ||
+	    lookup(20, D2) != 0 || index_entries() != 0) {
+		fprintf(stderr, "[ERROR:10] deleted record still indexed\n");
+		return 10;
+	}
+	close_db(0);
+
+	// Turned off, the index is dropped and no longer kept up
+	if (open_test_db(0) || digest_index != 0 || index_entries() != -1 ||
+	    add("/usr/bin/c", 30, D3) || index_entries() != -1) {
+		fprintf(stderr, "[ERROR:11] index kept while turned off\n");
+		return 11;
+	}
+	close_db(0);
+
+	// Turned back on, it is rebuilt from the path index
+	if (open_test_db(1) || index_entries() != 1 || lookup(30, D3) != 1) {
+		fprintf(stderr, "[ERROR:12] index not rebuilt\n");
+		return 12;
+	}
+	close_db(0);
+
+	if (open_test_db(0) || index_entries() != -1) {
+		fprintf(stderr, "[ERROR:13] index not dropped\n");
+		return 13;
+	}
+	close_db(0);
+
+	unlink_db();
+	rmdir(dir);
+
+	return 0;
+}
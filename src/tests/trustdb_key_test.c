@@ -0,0 +1,184 @@
+/*
+ * trustdb_key_test.c - tests for the keys of the trust database
+ *
+ * Builds a trust database in a temporary directory and checks that
+ * records are found again after they are written and not after they are
+ * removed, that a key is the id of its directory followed by the file
+ * name and decodes back to the path, that a name too long for a key is
+ * stored under id 0 and the digest of the path, and that a directory too
+ * long for a key is stored under its digest but still decodes to the
+ * full path. Then checks that deleting every record empties the
+ * directory dictionary without reusing ids, and that a directory this
+ * thread looked up before is looked up again afterwards.
+ *
+ * The key functions are private to database.c, so it is built into this
+ * test rather than taken from the library.
+ */
+
+#include "database.c"
+
+/* globals expected by library code */
+conf_t config;
+unsigned int debug_mode;
+atomic_bool stop;
+
+#define DIGEST "4444444444444444444444444444444444444444444444444444444444444444"
+
+static char dir[] = "/tmp/trustdb_key_test.XXXXXX";
+static char long_name[PATH_MAX], long_dir[PATH_MAX];
+
+static int record(const char *path, int remove)
+{
+	char data[TRUSTDB_DATA_BUFSZ];
+	int len = snprintf(data, sizeof(data), DATA_FORMAT, SRC_FILE_DB,
+			   (size_t)1, DIGEST);
+	MDB_txn *txn;
+
+	if (mdb_txn_begin(env, NULL, 0, &txn))
+		return 1;
+	if (open_dbi(txn) ||
+	    put_record(txn, path, strlen(path), data, len, remove)) {
+		abort_transaction(txn);
+		return 1;
+	}
+	return mdb_txn_commit(txn) != 0;
+}
+
+/*
+ * Look the key of a path up and decode it again. Returns 0 when the
+ * record exists, its key starts with the id given, or any id when it is
+ * -1, and decodes to expect.
+ */
+static int check_key(const char *path, long id, const char *expect)
+{
+	char kbuf[TRUST_KEY_MAX], decoded[PATH_MAX];
+	MDB_val key, val;
+	MDB_txn *txn;
+	int rc = 1;
+
+	if (mdb_txn_begin(env, NULL, MDB_RDONLY, &txn))
+		return 1;
+	if (open_dbi(txn) ||
+	    record_key(txn, path, strlen(path), KEY_READ, &key, kbuf) ||
+	    mdb_get(txn, dbi, &key, &val))
+		goto out;
+	if (id >= 0 && get_dir_id(key.mv_data) != id)
+		goto out;
+	if (id != 0 && (key.mv_size != DIR_ID_LEN +
+			strlen(strrchr(path, '/') + 1)))
+		goto out;
+	if (trust_db_key_path(txn, dirs_dbi, &key, decoded, sizeof(decoded)) ||
+	    strcmp(decoded, expect))
+		goto out;
+	rc = 0;
+out:
+	abort_transaction(txn);
+	return rc;
+}
+
+// Id of a directory, 0 when it has none
+static uint32_t dir_id(const char *d)
+{
+	MDB_txn *txn;
+	uint32_t id = 0;
+
+	if (mdb_txn_begin(env, NULL, MDB_RDONLY, &txn))
+		return 0;
+	if (lookup_dir_id(txn, d, strlen(d), KEY_REMOVE, &id))
+		id = 0;
+	mdb_txn_abort(txn);
+	return id;
+}
+
+int main(void)
+{
+	char *long_hash;
+	uint32_t old_id;
+
+	set_message_mode(MSG_QUIET, DBG_NO);
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "[ERROR:1] mkdtemp failed\n");
+		return 1;
+	}
+
+	config.db_max_size = 16;
+	config.integrity = IN_NONE;
+	data_dir = dir;
+	if (init_db(&config)) {
+		fprintf(stderr, "[ERROR:2] cannot open the database\n");
+		return 2;
+	}
+
+	// A name that does not fit in a key, and a directory that does not
+	snprintf(long_name, sizeof(long_name), "/usr/share/%0600d", 7);
+	snprintf(long_dir, sizeof(long_dir), "/opt/%0300d/%0300d/tool", 8, 9);
+	long_hash = path_to_hash(long_name, strlen(long_name));
+
+	if (record("/usr/bin/ls", 0) || record("/usr/bin/cat", 0) ||
+	    record(long_name, 0) || record(long_dir, 0)) {
+		fprintf(stderr, "[ERROR:3] cannot write records\n");
+		return 3;
+	}
+	if (check_trust_database("/usr/bin/ls", NULL, -1) != 1 ||
+	    check_trust_database("/usr/bin/cat", NULL, -1) != 1 ||
+	    check_trust_database(long_name, NULL, -1) != 1 ||
+	    check_trust_database(long_dir, NULL, -1) != 1 ||
+	    check_trust_database("/usr/bin/id", NULL, -1) != 0 ||
+	    check_trust_database("/usr/sbin/ls", NULL, -1) != 0) {
+		fprintf(stderr, "[ERROR:4] wrong records found\n");
+		return 4;
+	}
+
+	// Keys are a directory id and the name, and decode to the path
+	if (check_key("/usr/bin/ls", -1, "/usr/bin/ls") ||
+	    dir_id("/usr/bin/") == 0 ||
+	    check_key("/usr/bin/cat", dir_id("/usr/bin/"), "/usr/bin/cat")) {
+		fprintf(stderr, "[ERROR:5] wrong key for /usr/bin/ls\n");
+		return 5;
+	}
+	if (long_hash == NULL || check_key(long_name, 0, long_hash)) {
+		fprintf(stderr, "[ERROR:6] long name not stored by digest\n");
+		return 6;
+	}
+	if (strlen(long_dir) - 4 <= key_max ||
+	    dir_id("/opt/") != 0 || check_key(long_dir, -1, long_dir)) {
+		fprintf(stderr, "[ERROR:7] long directory not decoded\n");
+		return 7;
+	}
+
+	// Removing one record leaves the rest of its directory
+	if (record("/usr/bin/cat", 1) || record(long_name, 1) ||
+	    record("/nowhere/x", 1) ||
+	    check_trust_database("/usr/bin/cat", NULL, -1) != 0 ||
+	    check_trust_database(long_name, NULL, -1) != 0 ||
+	    check_trust_database("/usr/bin/ls", NULL, -1) != 1) {
+		fprintf(stderr, "[ERROR:8] removal failed\n");
+		return 8;
+	}
+
+	// Deleting everything resets the dictionary but not the ids
+	old_id = dir_id("/usr/bin/");
+	if (delete_all_entries_db() || dir_id("/usr/bin/") != 0 ||
+	    check_trust_database("/usr/bin/ls", NULL, -1) != 0) {
+		fprintf(stderr, "[ERROR:9] dictionary not reset\n");
+		return 9;
+	}
+	if (record("/usr/sbin/ip", 0) || record("/usr/bin/ls", 0) ||
+	    dir_id("/usr/sbin/") <= old_id || dir_id("/usr/bin/") <= old_id) {
+		fprintf(stderr, "[ERROR:10] directory id reused\n");
+		return 10;
+	}
+
+	// The id this thread cached for /usr/bin/ before is not used
+	if (check_trust_database("/usr/bin/ls", NULL, -1) != 1) {
+		fprintf(stderr, "[ERROR:11] stale directory id used\n");
+		return 11;
+	}
+
+	free(long_hash);
+	close_db(0);
+	unlink_db();
+	rmdir(dir);
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * update_batch_test.c - tests for grouped trust database updates
+ *
+ * Queues file records the way the update thread does while it drains
+ * the FIFO and checks they come back whole and in order. Then checks
+ * that a written batch is empty and can be filled again, and that a
+ * huge batch asks to be written out.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "update-batch.h"
+
+static const char *paths[] = { "/usr/bin/a", "/usr/lib64/libb.so.1",
+			       "/usr/share/c d" };
+static const char *datas[] = { "0 10 aa", "0 2048 bb", "0 1 cc" };
+
+int main(void)
+{
+	struct update_batch b;
+
+	memset(&b, 0, sizeof(b));
+
+	// records read in one go
+	for (unsigned int i = 0; i < 3; i++)
+		if (batch_add(&b, paths[i], datas[i])) {
+			fprintf(stderr, "[ERROR:1] cannot queue record\n");
+			return 1;
+		}
+	if (b.count != 3) {
+		fprintf(stderr, "[ERROR:2] batch has %u records\n", b.count);
+		return 2;
+	}
+	for (unsigned int i = 0; i < 3; i++)
+		if (strcmp(batch_path(&b, i), paths[i]) ||
+		    strcmp(batch_data(&b, i), datas[i])) {
+			fprintf(stderr, "[ERROR:3] record %u is %s %s\n", i,
+				batch_path(&b, i), batch_data(&b, i));
+			return 3;
+		}
+
+	// once written, the batch starts over
+	batch_clear(&b);
+	if (b.count || batch_full(&b)) {
+		fprintf(stderr, "[ERROR:4] written batch still pending\n");
+		return 4;
+	}
+	if (batch_add(&b, paths[2], datas[2]) || b.count != 1 ||
+	    strcmp(batch_path(&b, 0), paths[2]) ||
+	    strcmp(batch_data(&b, 0), datas[2])) {
+		fprintf(stderr, "[ERROR:5] batch not reused\n");
+		return 5;
+	}
+	batch_clear(&b);
+
+	// huge batches are written out as they go
+	for (unsigned int i = 0; i < BATCH_MAX; i++) {
+		if (batch_full(&b)) {
+			fprintf(stderr, "[ERROR:6] full after %u records\n", i);
+			return 6;
+		}
+		batch_add(&b, paths[i % 3], datas[i % 3]);
+	}
+	if (!batch_full(&b)) {
+		fprintf(stderr, "[ERROR:7] batch never full\n");
+		return 7;
+	}
+	batch_free(&b);
+
+	return 0;
+}